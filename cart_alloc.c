@@ -0,0 +1,399 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_alloc.c
+//  Description    : This is the implementation of the frame allocator, a free
+//                   bitmap per cartridge searched a word at a time, with a
+//                   count of the files sharing each frame.
+//
+//  Author         : [Jacob Hohenstein]
+//  Last Modified  : [10/16/2016]
+//
+
+// Includes
+#include <string.h>
+#include <stdlib.h>
+
+// Project includes
+#include <cart_alloc.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define ALLOC_WORD_BITS 64
+#define ALLOC_WORDS (CART_CARTRIDGE_SIZE / ALLOC_WORD_BITS)  // bitmap words per cartridge
+
+// A cartridge's free frames, a set bit is a free frame
+struct cart_free_map {
+	uint64_t bits[ALLOC_WORDS];
+	uint32_t free;    // set bits
+	uint32_t cursor;  // frame after the last one allocated, where new files start
+	uint16_t shares[CART_CARTRIDGE_SIZE];  // references to an allocated frame beyond the first
+};
+
+//
+// Global data
+
+struct cart_free_map Free_Maps[CART_MAX_CARTRIDGES];
+uint32_t Free_Frames;  // free frames on the device
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : alloc_find
+// Description  : Find the first free frame of a cartridge at or after a
+//                frame, wrapping round to the start
+//
+// Inputs       : fm - the cartridge's free map
+//                from - the frame to search from
+// Outputs      : the frame, or -1 if the cartridge is full
+
+static int alloc_find(struct cart_free_map *fm, uint32_t from) {
+	uint32_t w = from / ALLOC_WORD_BITS, n;
+	uint64_t word;
+
+	if (fm->free == 0)
+		return (-1);
+
+	// The first word ignores the frames before from, the last pass comes back
+	// round to pick them up
+	word = fm->bits[w] & (~(uint64_t)0 << (from % ALLOC_WORD_BITS));
+	for (n = 0; n <= ALLOC_WORDS; n++) {
+		if (word != 0)
+			return ((int)(w * ALLOC_WORD_BITS + __builtin_ctzll(word)));
+		w = (w + 1) % ALLOC_WORDS;
+		word = fm->bits[w];
+	}
+	return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : alloc_take
+// Description  : Mark a frame allocated
+//
+// Inputs       : cart - the cartridge
+//                frm - the frame, which must be free
+// Outputs      : the frame as a block
+
+static CartBlock alloc_take(CartridgeIndex cart, CartFrameIndex frm) {
+	struct cart_free_map *fm = &Free_Maps[cart];
+
+	fm->bits[frm / ALLOC_WORD_BITS] &= ~((uint64_t)1 << (frm % ALLOC_WORD_BITS));
+	fm->free--;
+	fm->cursor = (frm + 1u) % CART_CARTRIDGE_SIZE;
+	Free_Frames--;
+	return (CART_BLOCK(cart, frm));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_alloc_init
+// Description  : Mark every frame of every cartridge free
+//
+// Inputs       : none
+// Outputs      : none
+
+void cart_alloc_init(void) {
+	int i;
+
+	for (i = 0; i < CART_MAX_CARTRIDGES; i++) {
+		memset(Free_Maps[i].bits, 0xff, sizeof(Free_Maps[i].bits));
+		Free_Maps[i].free = CART_CARTRIDGE_SIZE;
+		Free_Maps[i].cursor = 0;
+		memset(Free_Maps[i].shares, 0, sizeof(Free_Maps[i].shares));
+	}
+	Free_Frames = CART_MAX_CARTRIDGES * CART_CARTRIDGE_SIZE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_alloc_frame
+// Description  : Allocate a frame, keeping files on as few cartridges as
+//                possible: right after the goal if that is free, else
+//                elsewhere on the goal's cartridge, else on the loaded
+//                cartridge, else on the cartridge with the most room
+//
+// Inputs       : goal - the file's last frame, CART_BLOCK_NONE for a new file
+//                loaded - the cartridge in the drive
+// Outputs      : the frame, CART_BLOCK_NONE if the device is full
+
+CartBlock cart_alloc_frame(CartBlock goal, CartridgeIndex loaded) {
+	CartridgeIndex cart, best;
+	int frm;
+
+	if (Free_Frames == 0)
+		return (CART_BLOCK_NONE);
+
+	// Carry on from the file's last frame, so its extent keeps growing
+	if (goal != CART_BLOCK_NONE) {
+		cart = CART_BLOCK_CART(goal);
+		frm = alloc_find(&Free_Maps[cart], (CART_BLOCK_FRAME(goal) + 1u) % CART_CARTRIDGE_SIZE);
+		if (frm != -1)
+			return (alloc_take(cart, (CartFrameIndex)frm));
+	}
+
+	// Otherwise stay on the cartridge already in the drive
+	if (loaded < CART_MAX_CARTRIDGES && Free_Maps[loaded].free > 0)
+		return (alloc_take(loaded, (CartFrameIndex)alloc_find(&Free_Maps[loaded], Free_Maps[loaded].cursor)));
+
+	// Failing that, the emptiest cartridge leaves the file the most room
+	for (best = 0, cart = 1; cart < CART_MAX_CARTRIDGES; cart++) {
+		if (Free_Maps[cart].free > Free_Maps[best].free)
+			best = cart;
+	}
+	return (alloc_take(best, (CartFrameIndex)alloc_find(&Free_Maps[best], Free_Maps[best].cursor)));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : alloc_find_run
+// Description  : Find the first run of free frames of a cartridge long
+//                enough
+//
+// Inputs       : fm - the cartridge's free map
+//                count - the frames wanted
+// Outputs      : the first frame of the run, or -1 if there is none
+
+static int alloc_find_run(struct cart_free_map *fm, uint32_t count) {
+	uint32_t frm, run = 0;
+
+	if (fm->free < count)
+		return (-1);
+	for (frm = 0; frm < CART_CARTRIDGE_SIZE; frm++) {
+		// A word with nothing free ends the run at once
+		if (frm % ALLOC_WORD_BITS == 0 && fm->bits[frm / ALLOC_WORD_BITS] == 0) {
+			run = 0;
+			frm += ALLOC_WORD_BITS - 1;
+			continue;
+		}
+		run = (fm->bits[frm / ALLOC_WORD_BITS] & ((uint64_t)1 << (frm % ALLOC_WORD_BITS))) ? run + 1 : 0;
+		if (run == count)
+			return ((int)(frm + 1 - count));
+	}
+	return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_alloc_run
+// Description  : Allocate consecutive frames of one cartridge, on the
+//                goal's cartridge if it has room, else on the first that
+//                does
+//
+// Inputs       : goal - a frame on the cartridge preferred, CART_BLOCK_NONE for any
+//                count - the frames, at most a cartridge
+// Outputs      : the first frame of the run, CART_BLOCK_NONE if no cartridge has one
+
+CartBlock cart_alloc_run(CartBlock goal, uint32_t count) {
+	CartridgeIndex cart, first = (goal != CART_BLOCK_NONE) ? CART_BLOCK_CART(goal) : 0;
+	uint32_t i, n;
+	int frm;
+
+	if (count == 0 || count > CART_CARTRIDGE_SIZE || first >= CART_MAX_CARTRIDGES)
+		return (CART_BLOCK_NONE);
+	for (n = 0; n < CART_MAX_CARTRIDGES; n++) {
+		cart = (first + n) % CART_MAX_CARTRIDGES;
+		if ((frm = alloc_find_run(&Free_Maps[cart], count)) == -1)
+			continue;
+		for (i = 0; i < count; i++)
+			alloc_take(cart, (CartFrameIndex)(frm + i));
+		return (CART_BLOCK(cart, frm));
+	}
+	return (CART_BLOCK_NONE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_alloc_free
+// Description  : Drop a reference to a frame, returning it to the
+//                allocator with the last
+//
+// Inputs       : block - the frame
+// Outputs      : 0 if freed, 1 if still shared, -1 if it was not allocated
+
+int cart_alloc_free(CartBlock block) {
+	CartridgeIndex cart = CART_BLOCK_CART(block);
+	CartFrameIndex frm = CART_BLOCK_FRAME(block);
+	uint64_t bit = (uint64_t)1 << (frm % ALLOC_WORD_BITS);
+
+	if (block == CART_BLOCK_NONE || cart >= CART_MAX_CARTRIDGES || frm >= CART_CARTRIDGE_SIZE
+			|| (Free_Maps[cart].bits[frm / ALLOC_WORD_BITS] & bit)) {
+		logMessage(LOG_ERROR_LEVEL, "Frame allocator: freeing unallocated frame [%u/%u]", cart, frm);
+		return (-1);
+	}
+	if (Free_Maps[cart].shares[frm] > 0) {
+		Free_Maps[cart].shares[frm]--;
+		return (1);
+	}
+	Free_Maps[cart].bits[frm / ALLOC_WORD_BITS] |= bit;
+	Free_Maps[cart].free++;
+	Free_Frames++;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_alloc_take
+// Description  : Allocate a given frame, as a remount does for the frames
+//                its files already hold
+//
+// Inputs       : block - the frame
+// Outputs      : 0 if successful, -1 if it was already allocated
+
+int cart_alloc_take(CartBlock block) {
+	CartridgeIndex cart = CART_BLOCK_CART(block);
+	CartFrameIndex frm = CART_BLOCK_FRAME(block);
+
+	if (block == CART_BLOCK_NONE || cart >= CART_MAX_CARTRIDGES || frm >= CART_CARTRIDGE_SIZE
+			|| !(Free_Maps[cart].bits[frm / ALLOC_WORD_BITS] & ((uint64_t)1 << (frm % ALLOC_WORD_BITS)))) {
+		logMessage(LOG_ERROR_LEVEL, "Frame allocator: taking allocated frame [%u/%u]", cart, frm);
+		return (-1);
+	}
+	alloc_take(cart, frm);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_alloc_share
+// Description  : Add a reference to an allocated frame, for another file
+//                frame holding the same contents
+//
+// Inputs       : block - the frame
+// Outputs      : 0 if successful, -1 if it is free or shared too often
+
+int cart_alloc_share(CartBlock block) {
+	CartridgeIndex cart = CART_BLOCK_CART(block);
+	CartFrameIndex frm = CART_BLOCK_FRAME(block);
+
+	if (cart_alloc_refs(block) == 0 || Free_Maps[cart].shares[frm] == UINT16_MAX)
+		return (-1);
+	Free_Maps[cart].shares[frm]++;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_alloc_refs
+// Description  : Count the references to a frame
+//
+// Inputs       : block - the frame
+// Outputs      : 0 for a free frame (or no frame), else the references
+
+uint32_t cart_alloc_refs(CartBlock block) {
+	CartridgeIndex cart = CART_BLOCK_CART(block);
+	CartFrameIndex frm = CART_BLOCK_FRAME(block);
+
+	if (block == CART_BLOCK_NONE || cart >= CART_MAX_CARTRIDGES || frm >= CART_CARTRIDGE_SIZE
+			|| (Free_Maps[cart].bits[frm / ALLOC_WORD_BITS] & ((uint64_t)1 << (frm % ALLOC_WORD_BITS))))
+		return (0);
+	return (1u + Free_Maps[cart].shares[frm]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_alloc_free_frames
+// Description  : Get the free frames of a cartridge or of the device
+//
+// Inputs       : cart - the cartridge, CART_NO_CARTRIDGE for the device
+// Outputs      : free frames
+
+uint32_t cart_alloc_free_frames(CartridgeIndex cart) {
+	if (cart >= CART_MAX_CARTRIDGES)
+		return (Free_Frames);
+	return (Free_Maps[cart].free);
+}
+
+//
+// Unit test
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cartAllocUnitTest
+// Description  : Check cartridge affinity, freeing and reuse, and filling
+//                the device
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int cartAllocUnitTest(void) {
+	CartBlock a, b, blk;
+	uint32_t i;
+
+	// Interleaved files each stay on one cartridge, the loaded one first
+	cart_alloc_init();
+	a = cart_alloc_frame(CART_BLOCK_NONE, 7);
+	b = cart_alloc_frame(CART_BLOCK_NONE, CART_NO_CARTRIDGE);
+	if (CART_BLOCK_CART(a) != 7 || CART_BLOCK_CART(b) == 7) {
+		logMessage(LOG_ERROR_LEVEL, "Allocator unit test failed: new files not placed.");
+		return (-1);
+	}
+	for (i = 0; i < 100; i++) {
+		a = cart_alloc_frame(a, CART_BLOCK_CART(b));
+		b = cart_alloc_frame(b, 7);
+		if (CART_BLOCK_CART(a) != 7 || CART_BLOCK_CART(b) == 7 || CART_BLOCK_FRAME(a) != i + 1) {
+			logMessage(LOG_ERROR_LEVEL, "Allocator unit test failed: file left its cartridge.");
+			return (-1);
+		}
+	}
+
+	// Freed frames are handed out again, double frees are refused
+	if (cart_alloc_free(CART_BLOCK(7, 50)) != 0 || cart_alloc_free(CART_BLOCK(7, 50)) != -1
+			|| cart_alloc_free_frames(7) != CART_CARTRIDGE_SIZE - 100) {
+		logMessage(LOG_ERROR_LEVEL, "Allocator unit test failed: free not counted.");
+		return (-1);
+	}
+	if (cart_alloc_take(CART_BLOCK(7, 50)) != 0 || cart_alloc_take(CART_BLOCK(7, 50)) != -1
+			|| cart_alloc_free(CART_BLOCK(7, 50)) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "Allocator unit test failed: frame taken twice.");
+		return (-1);
+	}
+	if (cart_alloc_frame(CART_BLOCK(7, 49), CART_NO_CARTRIDGE) != CART_BLOCK(7, 50)) {
+		logMessage(LOG_ERROR_LEVEL, "Allocator unit test failed: freed frame not reused.");
+		return (-1);
+	}
+
+	// A shared frame is freed with its last reference
+	if (cart_alloc_share(CART_BLOCK(7, 50)) != 0 || cart_alloc_share(CART_BLOCK(7, 50)) != 0
+			|| cart_alloc_refs(CART_BLOCK(7, 50)) != 3 || cart_alloc_free(CART_BLOCK(7, 50)) != 1
+			|| cart_alloc_free(CART_BLOCK(7, 50)) != 1 || cart_alloc_free(CART_BLOCK(7, 50)) != 0
+			|| cart_alloc_refs(CART_BLOCK(7, 50)) != 0 || cart_alloc_share(CART_BLOCK(7, 50)) != -1) {
+		logMessage(LOG_ERROR_LEVEL, "Allocator unit test failed: shared frame not counted.");
+		return (-1);
+	}
+	cart_alloc_take(CART_BLOCK(7, 50));
+
+	// Runs stay on one cartridge, the goal's while it has room
+	if (cart_alloc_run(CART_BLOCK(7, 0), CART_CARTRIDGE_SIZE - 200) != CART_BLOCK(7, 101)
+			|| cart_alloc_free_frames(7) != 99) {
+		logMessage(LOG_ERROR_LEVEL, "Allocator unit test failed: run not placed.");
+		return (-1);
+	}
+	blk = cart_alloc_run(CART_BLOCK(7, 0), 100);
+	if (blk == CART_BLOCK_NONE || CART_BLOCK_CART(blk) == 7 || cart_alloc_refs(blk + 99) != 1
+			|| cart_alloc_run(CART_BLOCK_NONE, CART_CARTRIDGE_SIZE + 1) != CART_BLOCK_NONE) {
+		logMessage(LOG_ERROR_LEVEL, "Allocator unit test failed: run not moved on.");
+		return (-1);
+	}
+
+	// A full cartridge spills over, a full device says so
+	for (blk = a; cart_alloc_free_frames(7) > 0; )
+		blk = cart_alloc_frame(blk, 7);
+	if (CART_BLOCK_CART(cart_alloc_frame(blk, 7)) == 7) {
+		logMessage(LOG_ERROR_LEVEL, "Allocator unit test failed: full cartridge reused.");
+		return (-1);
+	}
+	while (cart_alloc_free_frames(CART_NO_CARTRIDGE) > 0) {
+		if (cart_alloc_frame(CART_BLOCK_NONE, CART_NO_CARTRIDGE) == CART_BLOCK_NONE)
+			return (-1);
+	}
+	if (cart_alloc_frame(CART_BLOCK_NONE, 0) != CART_BLOCK_NONE) {
+		logMessage(LOG_ERROR_LEVEL, "Allocator unit test failed: full device not detected.");
+		return (-1);
+	}
+
+	logMessage(LOG_INFO_LEVEL, "Allocator unit test completed successfully.");
+	return (0);
+}
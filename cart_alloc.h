@@ -0,0 +1,50 @@
+#ifndef CART_ALLOC_INCLUDED
+#define CART_ALLOC_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_alloc.h
+//  Description    : This is the header file for the frame allocator, which
+//                   hands out cartridge frames from per-cartridge bitmaps
+//                   and counts the files sharing each.
+//
+//  Author         : [Jacob Hohenstein]
+//  Last Modified  : [10/16/2016]
+//
+
+// Includes
+#include <stdint.h>
+#include <cart_controller.h>
+#include <cart_blockmap.h>
+
+///
+// Allocator Interfaces (callers serialize, the driver holds driver_lock)
+
+void cart_alloc_init(void);
+	// Mark every frame of every cartridge free
+
+CartBlock cart_alloc_frame(CartBlock goal, CartridgeIndex loaded);
+	// Allocate a frame, near goal (the file's last frame) or on the loaded cartridge if possible
+
+CartBlock cart_alloc_run(CartBlock goal, uint32_t count);
+	// Allocate count consecutive frames of one cartridge, the goal's if it has room
+
+int cart_alloc_free(CartBlock block);
+	// Drop a reference to a frame, freed with the last (1 while still shared)
+
+int cart_alloc_take(CartBlock block);
+	// Allocate a given frame, -1 if it already is
+
+int cart_alloc_share(CartBlock block);
+	// Add a reference to an allocated frame
+
+uint32_t cart_alloc_refs(CartBlock block);
+	// Count the references to a frame, 0 if it is free
+
+uint32_t cart_alloc_free_frames(CartridgeIndex cart);
+	// Get the free frames of a cartridge, or of the device for CART_NO_CARTRIDGE
+
+int cartAllocUnitTest(void);
+	// Run a UNIT test checking the allocator implementation
+
+#endif
@@ -0,0 +1,562 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_blockmap.c
+//  Description    : This is the implementation of the file block maps, sorted
+//                   extent lists that fall back to a radix index.
+//
+//  Author         : [Jacob Hohenstein]
+//  Last Modified  : [10/16/2016]
+//
+
+// Includes
+#include <string.h>
+#include <stdlib.h>
+
+// Project includes
+#include <cart_blockmap.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define RADIX_BITS 8                      // index bits per radix level
+#define RADIX_FANOUT (1u << RADIX_BITS)   // entries per radix node
+#define RADIX_MASK (RADIX_FANOUT - 1)
+#define RADIX_MAX_HEIGHT 4                // 2^32 file frames
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : extent_array
+// Description  : Get the extents of a block map, inline or allocated
+//
+// Inputs       : map - the block map (extent form)
+// Outputs      : the extent array
+
+static CartExtent * extent_array(CartBlockMap *map) {
+	return ((map->capacity <= 1) ? &map->inline_extent : map->extents);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : extent_find
+// Description  : Binary search for the last extent starting at or before a
+//                file frame
+//
+// Inputs       : map - the block map (extent form)
+//                logical - the file frame
+// Outputs      : extent index, or -1 if every extent starts after it
+
+static int extent_find(CartBlockMap *map, uint32_t logical) {
+	int lo = 0, hi = (int)map->nextents - 1, mid, ret = -1;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (extent_array(map)[mid].logical <= logical) {
+			ret = mid;
+			lo = mid + 1;
+		}
+		else {
+			hi = mid - 1;
+		}
+	}
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : extent_follows
+// Description  : Check if one extent carries straight on from another, in
+//                the file and on the cartridge
+//
+// Inputs       : a - the earlier extent
+//                b - the later extent
+// Outputs      : 1 if they can be merged, 0 if not
+
+static int extent_follows(CartExtent *a, CartExtent *b) {
+	return (a->logical + a->length == b->logical && a->start + a->length == b->start);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : extent_reserve
+// Description  : Make room for more extents, moving off the inline extent
+//                when a second one is needed
+//
+// Inputs       : map - the block map (extent form)
+//                count - the number of extents needed
+// Outputs      : 0 if successful, -1 if failure
+
+static int extent_reserve(CartBlockMap *map, uint32_t count) {
+	uint32_t capacity = map->capacity;
+	CartExtent *extents;
+
+	if (count <= capacity)
+		return (0);
+	while (capacity < count)
+		capacity = (capacity < 4) ? 4 : capacity * 2;
+	if (map->capacity <= 1) {
+		if ((extents = malloc(capacity * sizeof(CartExtent))) == NULL)
+			return (-1);
+		memcpy(extents, &map->inline_extent, map->nextents * sizeof(CartExtent));
+	}
+	else if ((extents = realloc(map->extents, capacity * sizeof(CartExtent))) == NULL) {
+		return (-1);
+	}
+	map->extents = extents;
+	map->capacity = capacity;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : radix_slot
+// Description  : Find the leaf entry of a file frame, optionally creating
+//                the nodes (and levels) on the way
+//
+// Inputs       : map - the block map (radix form)
+//                logical - the file frame
+//                create - non-zero to add missing nodes
+// Outputs      : pointer to the entry, NULL if absent (or out of memory)
+
+static CartBlock * radix_slot(CartBlockMap *map, uint32_t logical, int create) {
+	void **node, *root;
+	uint32_t level, i;
+
+	// Grow the tree upwards until it covers the frame
+	while (map->height < RADIX_MAX_HEIGHT && (logical >> (RADIX_BITS * map->height)) != 0) {
+		if (!create)
+			return (NULL);
+		if ((root = calloc(RADIX_FANOUT, sizeof(void *))) == NULL)
+			return (NULL);
+		((void **)root)[0] = map->root;
+		map->root = root;
+		map->height++;
+	}
+
+	// Walk down, the last level holds blocks rather than pointers
+	node = &map->root;
+	for (level = map->height; level > 0; level--) {
+		if (*node == NULL) {
+			if (!create)
+				return (NULL);
+			if (level > 1)
+				*node = calloc(RADIX_FANOUT, sizeof(void *));
+			else if ((*node = malloc(RADIX_FANOUT * sizeof(CartBlock))) != NULL)
+				memset(*node, 0xff, RADIX_FANOUT * sizeof(CartBlock));
+			if (*node == NULL)
+				return (NULL);
+		}
+		i = (logical >> (RADIX_BITS * (level - 1))) & RADIX_MASK;
+		if (level == 1)
+			return (&((CartBlock *)*node)[i]);
+		node = &((void **)*node)[i];
+	}
+	return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : radix_free
+// Description  : Free a radix subtree
+//
+// Inputs       : node - the subtree
+//                level - its level (1 for a leaf)
+// Outputs      : none
+
+static void radix_free(void *node, uint32_t level) {
+	uint32_t i;
+
+	if (node == NULL)
+		return;
+	for (i = 0; level > 1 && i < RADIX_FANOUT; i++)
+		radix_free(((void **)node)[i], level - 1);
+	free(node);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : extent_to_radix
+// Description  : Move a block map that has too many extents to a radix index
+//
+// Inputs       : map - the block map (extent form)
+// Outputs      : 0 if successful, -1 if failure
+
+static int extent_to_radix(CartBlockMap *map) {
+	CartBlockMap radix;
+	CartBlock *slot;
+	uint32_t i, j;
+
+	CartExtent *ext = extent_array(map);
+
+	memset(&radix, 0, sizeof(radix));
+	radix.frames = map->frames;
+	radix.height = 1;
+	for (i = 0; i < map->nextents; i++) {
+		for (j = 0; j < ext[i].length; j++) {
+			if ((slot = radix_slot(&radix, ext[i].logical + j, 1)) == NULL) {
+				radix_free(radix.root, radix.height);
+				return (-1);
+			}
+			*slot = ext[i].start + j;
+		}
+	}
+	if (map->capacity > 1)
+		free(map->extents);
+	*map = radix;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_blockmap_init
+// Description  : Initialize an empty block map
+//
+// Inputs       : map - the block map
+// Outputs      : none
+
+void cart_blockmap_init(CartBlockMap *map) {
+	memset(map, 0, sizeof(CartBlockMap));
+	map->capacity = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_blockmap_free
+// Description  : Release the memory of a block map, leaving it empty
+//
+// Inputs       : map - the block map
+// Outputs      : none
+
+void cart_blockmap_free(CartBlockMap *map) {
+	if (map->height > 0)
+		radix_free(map->root, map->height);
+	else if (map->capacity > 1)
+		free(map->extents);
+	cart_blockmap_init(map);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_blockmap_set
+// Description  : Map a file frame to a cartridge frame, splitting and
+//                merging extents as needed.  Mapping past the end extends
+//                the file (any frames skipped are holes).
+//
+// Inputs       : map - the block map
+//                logical - the file frame
+//                block - the cartridge frame, CART_BLOCK_NONE for a hole
+// Outputs      : 0 if successful, -1 if failure
+
+int cart_blockmap_set(CartBlockMap *map, uint32_t logical, CartBlock block) {
+	CartExtent *ext = extent_array(map), *e, piece[3];
+	uint32_t n = 0, pos, end;
+	CartBlock *slot;
+	int i;
+
+	if (logical == UINT32_MAX)
+		return (-1);
+	if (map->height > 0) {
+		if ((slot = radix_slot(map, logical, block != CART_BLOCK_NONE)) != NULL)
+			*slot = block;
+		else if (block != CART_BLOCK_NONE)
+			return (-1);
+	}
+	else {
+		// Cut the frame out of the extent covering it, keeping both ends
+		i = extent_find(map, logical);
+		e = (i >= 0) ? &ext[i] : NULL;
+		if (e != NULL && logical < e->logical + e->length) {
+			if (e->start + (logical - e->logical) == block)
+				return (0);
+			end = e->logical + e->length;
+			if (logical > e->logical)
+				piece[n++] = (CartExtent){ e->logical, logical - e->logical, e->start };
+			pos = i;
+			if (block != CART_BLOCK_NONE)
+				piece[n++] = (CartExtent){ logical, 1, block };
+			if (logical + 1 < end)
+				piece[n++] = (CartExtent){ logical + 1, end - logical - 1, e->start + (logical + 1 - e->logical) };
+			if (extent_reserve(map, map->nextents + n - 1) != 0)
+				return (-1);
+			ext = extent_array(map);
+			memmove(&ext[pos + n], &ext[pos + 1], (map->nextents - pos - 1) * sizeof(CartExtent));
+			map->nextents = map->nextents + n - 1;
+		}
+		else {
+			if (block == CART_BLOCK_NONE) {
+				if (logical >= map->frames)
+					map->frames = logical + 1;
+				return (0);
+			}
+			pos = i + 1;
+			piece[n++] = (CartExtent){ logical, 1, block };
+			if (extent_reserve(map, map->nextents + 1) != 0)
+				return (-1);
+			ext = extent_array(map);
+			memmove(&ext[pos + 1], &ext[pos], (map->nextents - pos) * sizeof(CartExtent));
+			map->nextents++;
+		}
+		memcpy(&ext[pos], piece, n * sizeof(CartExtent));
+
+		// Join the new frame to its neighbours when they are contiguous
+		for (i = (int)pos + (int)n - 1; i >= (int)pos - 1; i--) {
+			if (i >= 0 && i + 1 < (int)map->nextents && extent_follows(&ext[i], &ext[i + 1])) {
+				ext[i].length += ext[i + 1].length;
+				memmove(&ext[i + 1], &ext[i + 2], (map->nextents - i - 2) * sizeof(CartExtent));
+				map->nextents--;
+			}
+		}
+		map->hint = 0;
+		if (map->nextents > CART_BLOCKMAP_MAX_EXTENTS && extent_to_radix(map) != 0)
+			return (-1);
+	}
+	if (logical >= map->frames)
+		map->frames = logical + 1;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_blockmap_append
+// Description  : Map the next frame past the end of the file
+//
+// Inputs       : map - the block map
+//                block - the cartridge frame
+// Outputs      : 0 if successful, -1 if failure
+
+int cart_blockmap_append(CartBlockMap *map, CartBlock block) {
+	CartExtent *last;
+
+	// The common case, growing the last extent, needs no search
+	if (map->height == 0 && map->nextents > 0) {
+		last = &extent_array(map)[map->nextents - 1];
+		if (last->logical + last->length == map->frames && last->start + last->length == block) {
+			last->length++;
+			map->frames++;
+			return (0);
+		}
+	}
+	return (cart_blockmap_set(map, map->frames, block));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_blockmap_truncate
+// Description  : Cut a block map down to its first frames, those after
+//                are dropped (the map never grows here)
+//
+// Inputs       : map - the block map
+//                frames - the file frames kept
+// Outputs      : none
+
+void cart_blockmap_truncate(CartBlockMap *map, uint32_t frames) {
+	CartExtent *ext;
+	CartBlock *slot;
+	uint32_t i;
+
+	if (frames >= map->frames)
+		return;
+	if (map->height > 0) {
+		// Radix form, the leaves keep their nodes but not the frames
+		for (i = frames; i < map->frames; i++) {
+			if ((slot = radix_slot(map, i, 0)) != NULL)
+				*slot = CART_BLOCK_NONE;
+		}
+	}
+	else {
+		ext = extent_array(map);
+		while (map->nextents > 0 && ext[map->nextents - 1].logical >= frames)
+			map->nextents--;
+		if (map->nextents > 0 && ext[map->nextents - 1].logical + ext[map->nextents - 1].length > frames)
+			ext[map->nextents - 1].length = frames - ext[map->nextents - 1].logical;
+		map->hint = 0;
+	}
+	map->frames = frames;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_blockmap_lookup
+// Description  : Find the cartridge frame of a file frame.  Sequential
+//                lookups are O(1) (the last extent is remembered), others
+//                a binary search or a radix walk.
+//
+// Inputs       : map - the block map
+//                logical - the file frame
+//                run - set to the number of frames from logical on that
+//                      follow on the same cartridge (or stay a hole), at
+//                      least 1; may be NULL
+// Outputs      : the cartridge frame, CART_BLOCK_NONE for a hole or past
+//                the end
+
+CartBlock cart_blockmap_lookup(CartBlockMap *map, uint32_t logical, uint32_t *run) {
+	CartBlock *slot, block;
+	uint32_t n = 1, limit;
+	CartExtent *ext, *e;
+	int i;
+
+	if (map->height > 0) {
+		// Radix form, the run ends with the leaf
+		slot = radix_slot(map, logical, 0);
+		block = (slot == NULL || logical >= map->frames) ? CART_BLOCK_NONE : *slot;
+		limit = RADIX_FANOUT - (logical & RADIX_MASK);
+		if (logical >= map->frames)
+			limit = 1;
+		else if (limit > map->frames - logical)
+			limit = map->frames - logical;
+		while (slot != NULL && n < limit && slot[n] == ((block == CART_BLOCK_NONE) ? block : block + n))
+			n++;
+	}
+	else {
+		ext = extent_array(map);
+		i = map->hint;
+		if (i < (int)map->nextents && ext[i].logical + ext[i].length == logical)
+			i++;
+		if (i >= (int)map->nextents || logical < ext[i].logical || logical >= ext[i].logical + ext[i].length)
+			i = extent_find(map, logical);
+		e = (i >= 0) ? &ext[i] : NULL;
+		if (e != NULL && logical < e->logical + e->length) {
+			map->hint = i;
+			block = e->start + (logical - e->logical);
+			n = e->logical + e->length - logical;
+		}
+		else {
+			block = CART_BLOCK_NONE;
+			if (i + 1 < (int)map->nextents)
+				n = ext[i + 1].logical - logical;
+			else if (logical < map->frames)
+				n = map->frames - logical;
+		}
+	}
+	if (run != NULL)
+		*run = n;
+	return (block);
+}
+
+//
+// Unit test
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : blockmap_test_check
+// Description  : Compare a block map against a flat copy of its contents,
+//                frame by frame and run by run
+//
+// Inputs       : map - the block map
+//                flat - the expected block of every frame
+//                frames - the number of frames
+// Outputs      : 0 if they match, -1 if not
+
+static int blockmap_test_check(CartBlockMap *map, CartBlock *flat, uint32_t frames) {
+	uint32_t i, j, run;
+	CartBlock block;
+
+	if (map->frames != frames)
+		return (-1);
+	for (i = 0; i < frames; i += run) {
+		block = cart_blockmap_lookup(map, i, &run);
+		if (run == 0 || i + run > frames)
+			return (-1);
+		for (j = 0; j < run; j++) {
+			if (flat[i + j] != ((block == CART_BLOCK_NONE) ? block : block + j))
+				return (-1);
+		}
+	}
+	for (i = 0; i < 200; i++) {
+		j = getRandomValue(0, frames - 1);
+		if (cart_blockmap_lookup(map, j, NULL) != flat[j])
+			return (-1);
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cartBlockMapUnitTest
+// Description  : Check appends, overwrites and holes against a flat array,
+//                before and after the switch to the radix index
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int cartBlockMapUnitTest(void) {
+	uint32_t i, frames = 3 * CART_CARTRIDGE_SIZE + 17;
+	CartBlock *flat;
+	CartBlockMap map;
+	int ret = -1;
+
+	if ((flat = malloc(frames * sizeof(CartBlock))) == NULL)
+		return (-1);
+	cart_blockmap_init(&map);
+
+	// A file written front to back is one extent per cartridge
+	for (i = 0; i < frames; i++) {
+		flat[i] = CART_BLOCK(i / CART_CARTRIDGE_SIZE, i % CART_CARTRIDGE_SIZE);
+		if (cart_blockmap_append(&map, flat[i]) != 0)
+			goto done;
+	}
+	if (map.nextents != 4 || blockmap_test_check(&map, flat, frames) != 0)
+		goto done;
+
+	// Overwrites and holes split extents, putting a frame back joins them
+	cart_blockmap_set(&map, 100, CART_BLOCK(9, 9));
+	cart_blockmap_set(&map, 101, CART_BLOCK_NONE);
+	flat[100] = CART_BLOCK(9, 9);
+	flat[101] = CART_BLOCK_NONE;
+	if (map.nextents != 6 || blockmap_test_check(&map, flat, frames) != 0)
+		goto done;
+	cart_blockmap_set(&map, 100, CART_BLOCK(0, 100));
+	cart_blockmap_set(&map, 101, CART_BLOCK(0, 101));
+	flat[100] = CART_BLOCK(0, 100);
+	flat[101] = CART_BLOCK(0, 101);
+	if (map.nextents != 4 || blockmap_test_check(&map, flat, frames) != 0)
+		goto done;
+
+	// Scattered overwrites push it over to the radix index
+	for (i = 0; i < 500; i++) {
+		uint32_t at = getRandomValue(0, frames - 1);
+		flat[at] = (getRandomValue(0, 9) == 0) ? CART_BLOCK_NONE : CART_BLOCK(getRandomValue(0, 63), getRandomValue(0, 1023));
+		if (cart_blockmap_set(&map, at, flat[at]) != 0)
+			goto done;
+	}
+	if (map.height == 0 || blockmap_test_check(&map, flat, frames) != 0)
+		goto done;
+
+	// Truncating drops the frames after, growing again finds holes there
+	cart_blockmap_truncate(&map, frames - 700);
+	if (blockmap_test_check(&map, flat, frames - 700) != 0 || cart_blockmap_set(&map, frames - 1, flat[frames - 1]) != 0)
+		goto done;
+	for (i = frames - 700; i < frames - 1; i++)
+		flat[i] = CART_BLOCK_NONE;
+	if (blockmap_test_check(&map, flat, frames) != 0)
+		goto done;
+	for (i = 0; i < frames; i++) {
+		if (cart_blockmap_set(&map, i, flat[i] = CART_BLOCK(5, i % CART_CARTRIDGE_SIZE)) != 0)
+			goto done;
+	}
+	if (blockmap_test_check(&map, flat, frames) != 0)
+		goto done;
+
+	// An extent cut part way keeps its head
+	cart_blockmap_free(&map);
+	for (i = 0; i < 3000; i++) {
+		if (cart_blockmap_append(&map, flat[i] = CART_BLOCK(i / 1000, i % 1000)) != 0)
+			goto done;
+	}
+	cart_blockmap_truncate(&map, 1234);
+	if (map.nextents != 2 || blockmap_test_check(&map, flat, 1234) != 0 || cart_blockmap_lookup(&map, 1234, NULL) != CART_BLOCK_NONE)
+		goto done;
+	ret = 0;
+
+done:
+	cart_blockmap_free(&map);
+	free(flat);
+	if (ret != 0) {
+		logMessage(LOG_ERROR_LEVEL, "Block map unit test failed.");
+		return (-1);
+	}
+	logMessage(LOG_INFO_LEVEL, "Block map unit test completed successfully.");
+	return (0);
+}
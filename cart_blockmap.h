@@ -0,0 +1,78 @@
+#ifndef CART_BLOCKMAP_INCLUDED
+#define CART_BLOCKMAP_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_blockmap.h
+//  Description    : This is the header file for the file block maps, which
+//                   translate the frames of a file to cartridge frames.
+//
+//  Author         : [Jacob Hohenstein]
+//  Last Modified  : [10/16/2016]
+//
+
+// Includes
+#include <stdint.h>
+#include <cart_controller.h>
+
+// Defines
+#define CART_BLOCKMAP_MAX_EXTENTS 64  // extents kept before switching to a radix index
+
+// A cartridge frame packed into one value, CART_BLOCK_NONE for a hole
+typedef uint32_t CartBlock;
+#define CART_BLOCK(cart, frm) (((CartBlock)(cart) << 16) | (frm))
+#define CART_BLOCK_CART(blk) ((CartridgeIndex)((blk) >> 16))
+#define CART_BLOCK_FRAME(blk) ((CartFrameIndex)((blk) & 0xffff))
+#define CART_BLOCK_NONE UINT32_MAX
+
+// A run of file frames stored in consecutive frames of one cartridge
+typedef struct {
+
+	uint32_t  logical;  // first frame of the file in the run
+	uint32_t  length;   // frames in the run
+	CartBlock start;    // cartridge frame holding the first of them
+
+} CartExtent;
+
+// The block map of a file.  Small files keep a sorted extent list (the
+// first extent lives inline, so a contiguous file needs no allocation);
+// files too fragmented for that switch to a radix index, 256 entries per
+// level, grown upwards as the file does.
+typedef struct {
+
+	uint32_t    frames;         // file frames covered, [0, frames)
+	uint32_t    nextents;       // extents in use (extent form)
+	uint32_t    capacity;       // size of the extent array
+	uint32_t    hint;           // extent of the last lookup, for sequential access
+	CartExtent *extents;        // sorted by logical frame, once capacity > 1
+	CartExtent  inline_extent;  // the only extent while capacity is 1
+	void       *root;           // radix index (radix form)
+	uint32_t    height;         // levels in the radix index, 0 in extent form
+
+} CartBlockMap;
+
+///
+// Block Map Interfaces
+
+void cart_blockmap_init(CartBlockMap *map);
+	// Initialize an empty block map
+
+void cart_blockmap_free(CartBlockMap *map);
+	// Release the memory of a block map, leaving it empty
+
+int cart_blockmap_set(CartBlockMap *map, uint32_t logical, CartBlock block);
+	// Map a file frame to a cartridge frame (CART_BLOCK_NONE punches a hole)
+
+int cart_blockmap_append(CartBlockMap *map, CartBlock block);
+	// Map the next frame past the end of the file
+
+void cart_blockmap_truncate(CartBlockMap *map, uint32_t frames);
+	// Drop the frames from "frames" on, a shorter file
+
+CartBlock cart_blockmap_lookup(CartBlockMap *map, uint32_t logical, uint32_t *run);
+	// Find the cartridge frame of a file frame, run is set to the frames from there on that follow it
+
+int cartBlockMapUnitTest(void);
+	// Run a UNIT test checking the block map implementation
+
+#endif
@@ -9,51 +9,1436 @@
 //
 
 // Includes
-#include <string.h> 
+#include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 // Project includes
 #include <cart_cache.h>
 #include <cart_driver.h>
+#include <cart_lz.h>
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 
 // Defines
+#define CACHE_NIL UINT32_MAX          // "null" slot index for links and chains
+#define CACHE_HASH_MULT 0x9E3779B1u   // Fibonacci hashing multiplier
+#define CACHE_SHARD_MULT 0x85EBCA6Bu  // mixes frame groups across the shards
+#define CACHE_SHARD_GROUP_BITS 6      // 64 consecutive frames share a shard
+#define CACHE_MIN_SHARD_FRAMES 128    // never split the cache finer than this
+#define CACHE_FLUSH_CLUSTER 64        // max neighbouring dirty frames written with a victim
+#define CACHE_HUGE_PAGE (2u << 20)    // huge page size the frame arena is aligned to
+#define CACHE_MAX_ARENAS 64           // frame arenas (initial plus one per grow)
+#define CACHE_RESIZE_TRIES 100        // attempts to move frames pinned by other threads
+#define CACHE_VICTIM_MAX_BYTES (CART_FRAME_SIZE * 3 / 4) // frames compressing worse are dropped
+#define CACHE_VICTIM_RATIO 8          // victim entries per frame of victim memory
+
+#define CACHE_KEY(cart, frm) (((uint32_t)(cart) << 16) | (frm))
+#define CACHE_KEY_CART(key) ((CartridgeIndex)((key) >> 16))
+#define CACHE_KEY_FRAME(key) ((CartFrameIndex)((key) & 0xffff))
+
+// Queues an entry can sit on; their meaning depends on the policy
+//
+//   list                  LRU      CLOCK    2Q       ARC
+//   CACHE_RECENT          LRU      ring     A1in     T1
+//   CACHE_FREQUENT        -        -        Am       T2
+//   CACHE_GHOST_RECENT    -        -        A1out    B1
+//   CACHE_GHOST_FREQUENT  -        -        -        B2
+#define CACHE_RECENT 0
+#define CACHE_FREQUENT 1
+#define CACHE_GHOST_RECENT 2
+#define CACHE_GHOST_FREQUENT 3
+#define CACHE_NLISTS 4
+#define CACHE_LIST_NONE 0xff
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // LRU Cache Structure
 //
+// Entries are addressed by index.  An entry is linked into exactly one hash
+// chain while it holds a key, and into one of the policy queues (prev/next,
+// most recently used at the head).  Resident entries own a payload slot in
+// the frame arena; ghost entries (ARC/2Q history) only remember the key.
+// Free entries are kept on a stack threaded through next, so lookup, insert,
+// promote and evict are all O(1).
+//
+// The key and hash chain of each entry live in their own arrays (keys and
+// chain in the shard) so a lookup walks 8 bytes per candidate and never
+// touches the queue links or the 1 KB payloads.
+//
 struct LRUCache_Frame
 {
-	CartridgeIndex cart_index;
-	CartFrameIndex frame_index;
-	char FrameData[CART_FRAME_SIZE];
-	int access_time;
-	int free;
+	uint32_t prev;
+	uint32_t next;
+	uint32_t data;      // payload slot, CACHE_NIL for ghosts
+	uint8_t list;       // queue the entry is on
+	uint8_t ref;        // CLOCK reference bit
+	uint8_t dirty;      // payload differs from the cartridge (write-back)
+	uint16_t pins;      // outstanding pin_cart_cache references
+};
+
+struct cache_list {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t count;
 };
 
-struct LRUCache_Frame *LRUCache; 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Victim Tier Structure
+//
+// Clean frames evicted from a shard are compressed into the shard's victim
+// tier before they are forgotten, so a later miss can expand them in memory
+// instead of going back to the bus.  The tier has its own byte budget and LRU
+// order (prev/next, most recent at the head), and the same index addressed
+// entries, hash chains and free stack as the primary cache.  A key is never
+// both resident and in the victim tier.
+//
+struct cache_victim {
+	uint32_t key;       // packed (cartridge, frame) key
+	uint32_t chain;     // next victim on the same hash chain
+	uint32_t prev;
+	uint32_t next;      // LRU links, next also threads the free stack
+	uint32_t len;       // compressed bytes
+	char *data;         // compressed frame (malloc'd)
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Cache Shard Structure
+//
+// The cache is split into independent shards, each with its own share of the
+// capacity, its own policy queues and its own locks.  Runs of 64 consecutive
+// frames of a cartridge map to the same shard, so a write back cluster never
+// spans shards.
+//
+// lock covers the hash chains, payload slots and anything an insert or an
+// eviction changes; lookups hold it shared, inserts, dirtying and deletes
+// hold it exclusive.  lru_lock serialises the queue updates made by hits
+// under the shared lock; a hit that finds it busy skips the promotion instead
+// of waiting, which only costs a little recency accuracy.
+//
+struct cache_shard {
+	pthread_rwlock_t lock;
+	pthread_mutex_t lru_lock;
+	struct LRUCache_Frame *entries;
+	uint32_t *keys;             //packed (cartridge, frame) key of each entry
+	uint32_t *chain;            //next entry on the same hash chain
+	char **slots;               //payload slot addresses in the arenas
+	uint32_t slot_cap;          //slots with memory behind them (>= max_frames)
+	uint32_t max_frames;        //capacity of this shard, slots [0, max_frames) in use
+	uint32_t nentries;          //resident plus ghost entries (>= 2x frames)
+	uint32_t *hash;             //hash bucket heads, hash_size entries
+	uint32_t hash_size;         //number of buckets (power of two)
+	uint32_t hash_shift;        //32 - log2(hash_size)
+	uint32_t free;              //top of the free entry stack
+	uint32_t *data_free;        //stack of unused payload slots
+	uint32_t data_avail;        //number of unused payload slots
+	struct cache_list lists[CACHE_NLISTS];
+	uint32_t arc_p;             //ARC target size of T1
+	uint64_t hits;              //updated atomically, under the shared lock
+	uint64_t misses;
+	uint64_t inserts;           //updated under the exclusive lock
+	uint64_t evictions;
+	uint64_t writebacks;
+	int flush_failed;           //a write back failed during the current call
+	struct cache_victim *victims; //compressed victim tier, NULL if disabled
+	uint32_t *victim_hash;      //victim hash bucket heads, victim_cap entries
+	uint32_t victim_cap;        //victim entries (power of two)
+	uint32_t victim_shift;      //32 - log2(victim_cap)
+	uint32_t victim_free;       //top of the free victim stack
+	uint32_t victim_head;       //most recently evicted victim
+	uint32_t victim_tail;       //next victim to be dropped
+	uint32_t victim_count;      //frames held compressed
+	size_t victim_bytes;        //compressed bytes held
+	size_t victim_budget;       //compressed bytes allowed
+	uint64_t victim_hits;       //misses served from the victim tier
+	uint64_t victim_stores;     //evicted frames compressed into the tier
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Frame Arena Structure
+//
+// All payload slots come from one aligned anonymous mapping, backed by huge
+// pages when the system has them, so a large cache needs only a handful of
+// TLB entries.  Each shard takes a contiguous run of slots.  Growing the cache
+// online maps one more arena for the new slots; shrinking compacts each
+// shard's frames into its lowest slots and hands the pages of the rest back
+// to the system, keeping them mapped for a later grow.
+//
+struct cache_arena {
+	char *base;                 //start of the mapping
+	size_t size;                //bytes mapped
+	int huge;                   //0 normal pages, 1 hugetlb, 2 transparent hint
+};
+
+struct cache_shard *Cache_Shards;
+uint32_t Cache_Nshards;     //shards in use, set by init
+struct cache_arena Cache_Arenas[CACHE_MAX_ARENAS];
+uint32_t Cache_Narenas;
+pthread_mutex_t Cache_Resize_Lock = PTHREAD_MUTEX_INITIALIZER; //one resize at a time
+
+uint32_t Cache_Max_Frames; //holds the maxium amount of frames in Cache
+uint32_t Cache_Shards_Wanted = DEFAULT_CART_CACHE_SHARDS;
+uint32_t Cache_Victim_Frames = DEFAULT_CART_CACHE_VICTIM_SIZE; //victim tier memory, in frames
+CartCachePolicy Cache_Policy = CART_CACHE_LRU;
+CartCacheWriteMode Cache_Write_Mode = CART_CACHE_WRITETHROUGH;
+CartCacheFlush Cache_Flush;  //writes dirty frames back to the cartridges
+CartCacheStats Cache_Last_Stats; //counters of the last cache, kept after close
+
+static const char *Cache_Policy_Names[CART_CACHE_MAXPOLICY] = { "lru", "clock", "2q", "arc" };
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_shard_of
+// Description  : Find the shard responsible for a (cartridge, frame) key
+//
+// Inputs       : cart - the cartridge number
+//                frm - the frame number
+// Outputs      : the shard
+
+static struct cache_shard * cache_shard_of(CartridgeIndex cart, CartFrameIndex frm) {
+	uint32_t group = CACHE_KEY(cart, frm) >> CACHE_SHARD_GROUP_BITS;
+	return (&Cache_Shards[((group * CACHE_SHARD_MULT) >> 8) % Cache_Nshards]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_hash
+// Description  : Hash a (cartridge, frame) key into a bucket number
+//
+// Inputs       : sh - the shard
+//                cart - the cartridge number
+//                frm - the frame number
+// Outputs      : bucket index
+
+static uint32_t cache_hash(struct cache_shard *sh, CartridgeIndex cart, CartFrameIndex frm) {
+	return ((CACHE_KEY(cart, frm) * CACHE_HASH_MULT) >> sh->hash_shift);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_find
+// Description  : Find the entry holding a key (resident or ghost)
+//
+// Inputs       : sh - the shard
+//                cart - the cartridge number
+//                frm - the frame number
+// Outputs      : entry index or CACHE_NIL if not present
+
+static uint32_t cache_find(struct cache_shard *sh, CartridgeIndex cart, CartFrameIndex frm) {
+	uint32_t i = sh->hash[cache_hash(sh, cart, frm)], key = CACHE_KEY(cart, frm);
+	while (i != CACHE_NIL) {
+		if (sh->keys[i] == key) {
+			return (i);
+		}
+		i = sh->chain[i];
+	}
+	return (CACHE_NIL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_find_resident
+// Description  : Find the entry holding a key whose frame is cached
+//
+// Inputs       : sh - the shard
+//                cart - the cartridge number
+//                frm - the frame number
+// Outputs      : entry index or CACHE_NIL if not resident
+
+static uint32_t cache_find_resident(struct cache_shard *sh, CartridgeIndex cart, CartFrameIndex frm) {
+	uint32_t i = cache_find(sh, cart, frm);
+	return ((i != CACHE_NIL && sh->entries[i].data != CACHE_NIL) ? i : CACHE_NIL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_hash_remove
+// Description  : Unlink an entry from its hash chain
+//
+// Inputs       : sh - the shard
+//                slot - the entry to unlink
+// Outputs      : none
+
+static void cache_hash_remove(struct cache_shard *sh, uint32_t slot) {
+	uint32_t *link = &sh->hash[cache_hash(sh, CACHE_KEY_CART(sh->keys[slot]), CACHE_KEY_FRAME(sh->keys[slot]))];
+	while (*link != slot) {
+		link = &sh->chain[*link];
+	}
+	*link = sh->chain[slot];
+	sh->chain[slot] = CACHE_NIL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_list_unlink
+// Description  : Remove an entry from the queue it is on
+//
+// Inputs       : sh - the shard
+//                slot - the entry to unlink
+// Outputs      : none
+
+static void cache_list_unlink(struct cache_shard *sh, uint32_t slot) {
+	struct LRUCache_Frame *f = &sh->entries[slot];
+	struct cache_list *l;
+	if (f->list == CACHE_LIST_NONE)
+		return;
+	l = &sh->lists[f->list];
+	if (f->prev != CACHE_NIL)
+		sh->entries[f->prev].next = f->next;
+	else
+		l->head = f->next;
+	if (f->next != CACHE_NIL)
+		sh->entries[f->next].prev = f->prev;
+	else
+		l->tail = f->prev;
+	l->count--;
+	f->prev = f->next = CACHE_NIL;
+	f->list = CACHE_LIST_NONE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_list_push
+// Description  : Insert an entry at the most recently used end of a queue
+//
+// Inputs       : sh - the shard
+//                slot - the entry to insert
+//                list - the queue to insert into
+// Outputs      : none
+
+static void cache_list_push(struct cache_shard *sh, uint32_t slot, int list) {
+	struct cache_list *l = &sh->lists[list];
+	sh->entries[slot].prev = CACHE_NIL;
+	sh->entries[slot].next = l->head;
+	if (l->head != CACHE_NIL)
+		sh->entries[l->head].prev = slot;
+	else
+		l->tail = slot;
+	l->head = slot;
+	l->count++;
+	sh->entries[slot].list = list;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_list_move
+// Description  : Move an entry to the head of a queue
+//
+// Inputs       : sh - the shard
+//                slot - the entry to move
+//                list - the destination queue
+// Outputs      : none
+
+static void cache_list_move(struct cache_shard *sh, uint32_t slot, int list) {
+	if (sh->entries[slot].list == list && sh->lists[list].head == slot)
+		return;
+	cache_list_unlink(sh, slot);
+	cache_list_push(sh, slot, list);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_victim_find
+// Description  : Find a key in the victim tier
+//
+// Inputs       : sh - the shard
+//                key - the packed (cartridge, frame) key
+// Outputs      : victim index or CACHE_NIL if not there
+
+static uint32_t cache_victim_find(struct cache_shard *sh, uint32_t key) {
+	uint32_t v;
+
+	if (sh->victims == NULL)
+		return (CACHE_NIL);
+	v = sh->victim_hash[(key * CACHE_HASH_MULT) >> sh->victim_shift];
+	while (v != CACHE_NIL && sh->victims[v].key != key)
+		v = sh->victims[v].chain;
+	return (v);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_victim_drop
+// Description  : Forget a victim, freeing its compressed copy
+//
+// Inputs       : sh - the shard
+//                v - the victim to drop
+// Outputs      : none
+
+static void cache_victim_drop(struct cache_shard *sh, uint32_t v) {
+	struct cache_victim *vf = &sh->victims[v];
+	uint32_t *p = &sh->victim_hash[(vf->key * CACHE_HASH_MULT) >> sh->victim_shift];
+
+	while (*p != v)
+		p = &sh->victims[*p].chain;
+	*p = vf->chain;
+	if (vf->prev == CACHE_NIL)
+		sh->victim_head = vf->next;
+	else
+		sh->victims[vf->prev].next = vf->next;
+	if (vf->next == CACHE_NIL)
+		sh->victim_tail = vf->prev;
+	else
+		sh->victims[vf->next].prev = vf->prev;
+	sh->victim_bytes -= vf->len;
+	sh->victim_count--;
+	free(vf->data);
+	vf->data = NULL;
+	vf->next = sh->victim_free;
+	sh->victim_free = v;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_victim_store
+// Description  : Compress a clean frame being evicted into the victim tier,
+//                dropping the oldest victims to stay within the budget
+//
+// Inputs       : sh - the shard
+//                slot - the resident entry being evicted
+// Outputs      : none (frames that do not compress well are not kept)
+
+static void cache_victim_store(struct cache_shard *sh, uint32_t slot) {
+	char packed[CACHE_VICTIM_MAX_BYTES], *data;
+	struct cache_victim *vf;
+	uint32_t v, bucket;
+	int len;
+
+	if (sh->victims == NULL
+			|| (len = cart_lz_compress(sh->slots[sh->entries[slot].data], CART_FRAME_SIZE, packed, sizeof(packed))) == -1
+			|| (size_t)len > sh->victim_budget)
+		return;
+	while (sh->victim_free == CACHE_NIL || sh->victim_bytes + len > sh->victim_budget)
+		cache_victim_drop(sh, sh->victim_tail);
+	if ((data = malloc(len)) == NULL)
+		return;
+	memcpy(data, packed, len);
+
+	v = sh->victim_free;
+	vf = &sh->victims[v];
+	sh->victim_free = vf->next;
+	vf->key = sh->keys[slot];
+	vf->len = len;
+	vf->data = data;
+	bucket = (vf->key * CACHE_HASH_MULT) >> sh->victim_shift;
+	vf->chain = sh->victim_hash[bucket];
+	sh->victim_hash[bucket] = v;
+	vf->prev = CACHE_NIL;
+	vf->next = sh->victim_head;
+	if (sh->victim_head != CACHE_NIL)
+		sh->victims[sh->victim_head].prev = v;
+	else
+		sh->victim_tail = v;
+	sh->victim_head = v;
+	sh->victim_bytes += len;
+	sh->victim_count++;
+	sh->victim_stores++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_victim_take
+// Description  : Remove a key from the victim tier, expanding it first if a
+//                destination is given (shard held exclusive)
+//
+// Inputs       : sh - the shard
+//                key - the packed (cartridge, frame) key
+//                frame - where to expand the frame, NULL to just forget it
+// Outputs      : 0 if the frame was there (and expanded), -1 if not
+
+static int cache_victim_take(struct cache_shard *sh, uint32_t key, char *frame) {
+	uint32_t v = cache_victim_find(sh, key);
+	int ret = 0;
+
+	if (v == CACHE_NIL)
+		return (-1);
+	if (frame != NULL && cart_lz_decompress(sh->victims[v].data, sh->victims[v].len, frame, CART_FRAME_SIZE) != CART_FRAME_SIZE) {
+		logMessage(LOG_ERROR_LEVEL, "CART cache failed: bad victim copy of frame %u/%u", CACHE_KEY_CART(key), CACHE_KEY_FRAME(key));
+		ret = -1;
+	}
+	cache_victim_drop(sh, v);
+	if (ret == 0 && frame != NULL)
+		sh->victim_hits++;
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_writeback
+// Description  : Write a single dirty frame back through the flush function
+//
+// Inputs       : sh - the shard
+//                slot - the resident, dirty entry to write back
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_writeback(struct cache_shard *sh, uint32_t slot) {
+	struct LRUCache_Frame *f = &sh->entries[slot];
+	CartridgeIndex cart = CACHE_KEY_CART(sh->keys[slot]);
+	CartFrameIndex frm = CACHE_KEY_FRAME(sh->keys[slot]);
+	if (Cache_Flush == NULL || Cache_Flush(cart, frm, sh->slots[f->data]) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "CART cache failed: unable to write back frame %u/%u", cart, frm);
+		sh->flush_failed = 1;
+		return (-1);
+	}
+	f->dirty = 0;
+	sh->writebacks++;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_writeback_cluster
+// Description  : Write back a dirty frame together with the run of dirty
+//                frames around it on the same cartridge, in frame order, so
+//                the cartridge is loaded once for the whole run
+//
+// Inputs       : sh - the shard
+//                slot - the resident, dirty entry to write back
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_writeback_cluster(struct cache_shard *sh, uint32_t slot) {
+	CartridgeIndex cart = CACHE_KEY_CART(sh->keys[slot]);
+	CartFrameIndex first = CACHE_KEY_FRAME(sh->keys[slot]), frm;
+	CartFrameIndex lo = first & ~((1u << CACHE_SHARD_GROUP_BITS) - 1);
+	uint32_t i, n, hi = (uint32_t)lo + (1u << CACHE_SHARD_GROUP_BITS) - 1;
+	int ret = 0;
+
+	// Walk back to the start of the dirty run, then write it in order; runs
+	// stop at the shard's 64 frame group since neighbours live elsewhere
+	for (n = 0; first > lo && n < CACHE_FLUSH_CLUSTER / 2; n++) {
+		i = cache_find_resident(sh, cart, first - 1);
+		if (i == CACHE_NIL || !sh->entries[i].dirty)
+			break;
+		first--;
+	}
+	for (frm = first, n = 0; n < CACHE_FLUSH_CLUSTER && frm <= hi; frm++, n++) {
+		i = cache_find_resident(sh, cart, frm);
+		if (i == CACHE_NIL || !sh->entries[i].dirty)
+			break;
+		if (cache_writeback(sh, i) != 0)
+			ret = -1;
+		if (frm == UINT16_MAX)
+			break;
+	}
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_entry_release
+// Description  : Forget an entry entirely, returning its payload slot (if
+//                any) and the entry itself to the free stacks
+//
+// Inputs       : sh - the shard
+//                slot - the entry to release
+// Outputs      : none
+
+static void cache_entry_release(struct cache_shard *sh, uint32_t slot) {
+	struct LRUCache_Frame *f = &sh->entries[slot];
+	cache_hash_remove(sh, slot);
+	cache_list_unlink(sh, slot);
+	if (f->data != CACHE_NIL) {
+		sh->data_free[sh->data_avail++] = f->data;
+		f->data = CACHE_NIL;
+	}
+	f->next = sh->free;
+	sh->free = slot;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_evict
+// Description  : Drop the payload of a resident entry, either forgetting it
+//                or keeping its key on a ghost queue.  A clean payload is
+//                kept compressed in the victim tier.  A dirty frame that
+//                cannot be written back stays resident and dirty, it holds
+//                the only copy.
+//
+// Inputs       : sh - the shard
+//                slot - the resident entry to evict
+//                ghost - ghost queue to keep the key on, or CACHE_LIST_NONE
+// Outputs      : 0 if evicted, -1 if the write back failed
+
+static int cache_evict(struct cache_shard *sh, uint32_t slot, int ghost) {
+	if (sh->entries[slot].dirty)
+		cache_writeback_cluster(sh, slot);
+	if (sh->entries[slot].dirty)
+		return (-1);
+	sh->evictions++;
+	cache_victim_store(sh, slot);   // only copies that match the cartridge
+	if (ghost == CACHE_LIST_NONE) {
+		cache_entry_release(sh, slot);
+		return (0);
+	}
+	sh->data_free[sh->data_avail++] = sh->entries[slot].data;
+	sh->entries[slot].data = CACHE_NIL;
+	cache_list_move(sh, slot, ghost);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_list_victim
+// Description  : Find the least recently used unpinned entry of a queue
+//
+// Inputs       : sh - the shard
+//                list - the queue to search
+// Outputs      : entry index or CACHE_NIL if every entry is pinned
+
+static uint32_t cache_list_victim(struct cache_shard *sh, int list) {
+	uint32_t i = sh->lists[list].tail;
+	while (i != CACHE_NIL && sh->entries[i].pins > 0)
+		i = sh->entries[i].prev;
+	return (i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_evict_from
+// Description  : Evict the oldest unpinned frame of a queue, falling back to
+//                a second queue when the first has nothing evictable
+//
+// Inputs       : sh - the shard
+//                list, ghost - preferred queue and where its victim's key goes
+//                alt, alt_ghost - fallback queue and its ghost queue
+// Outputs      : 0 if a frame was evicted, -1 if everything is pinned or a
+//                write back failed
+
+static int cache_evict_from(struct cache_shard *sh, int list, int ghost, int alt, int alt_ghost) {
+	uint32_t victim = cache_list_victim(sh, list);
+	if (victim == CACHE_NIL) {
+		victim = cache_list_victim(sh, alt);
+		ghost = alt_ghost;
+	}
+	if (victim == CACHE_NIL)
+		return (-1);
+	return (cache_evict(sh, victim, ghost));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_arc_replace
+// Description  : ARC REPLACE step, evict from T1 or T2 depending on the
+//                adaptive target p
+//
+// Inputs       : sh - the shard
+//                in_b2 - non-zero if the miss being serviced hit in B2
+// Outputs      : 0 if successful, -1 if everything is pinned or a write back
+//                failed
+
+static int cache_arc_replace(struct cache_shard *sh, int in_b2) {
+	struct cache_list *t1 = &sh->lists[CACHE_RECENT];
+	if (t1->count > 0 && (t1->count > sh->arc_p || (in_b2 && t1->count == sh->arc_p)
+			|| sh->lists[CACHE_FREQUENT].count == 0))
+		return (cache_evict_from(sh, CACHE_RECENT, CACHE_GHOST_RECENT, CACHE_FREQUENT, CACHE_GHOST_FREQUENT));
+	return (cache_evict_from(sh, CACHE_FREQUENT, CACHE_GHOST_FREQUENT, CACHE_RECENT, CACHE_GHOST_RECENT));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_evict_one
+// Description  : Evict one resident frame in replacement policy order
+//
+// Inputs       : sh - the shard
+//                ghost - queue of the ghost entry being re-referenced, or
+//                        CACHE_LIST_NONE
+// Outputs      : 0 if a frame was evicted, -1 if everything is pinned or a
+//                write back failed
+
+static int cache_evict_one(struct cache_shard *sh, int ghost) {
+	struct cache_list *recent = &sh->lists[CACHE_RECENT];
+	uint32_t victim, kin, kout, n, c = sh->max_frames;
+
+	switch (Cache_Policy) {
+	case CART_CACHE_CLOCK:
+		// Sweep the hand (list tail), giving referenced frames a second chance
+		for (n = 0; n <= 2 * recent->count; n++) {
+			victim = recent->tail;
+			if (!sh->entries[victim].ref && sh->entries[victim].pins == 0)
+				return (cache_evict(sh, victim, CACHE_LIST_NONE));
+			sh->entries[victim].ref = 0;
+			cache_list_move(sh, victim, CACHE_RECENT);
+		}
+		return (-1);
+
+	case CART_CACHE_2Q:
+		kin = c / 4 ? c / 4 : 1;
+		kout = c / 2 ? c / 2 : 1;
+		if (recent->count > kin || sh->lists[CACHE_FREQUENT].count == 0) {
+			if (cache_evict_from(sh, CACHE_RECENT, CACHE_GHOST_RECENT, CACHE_FREQUENT, CACHE_LIST_NONE) == -1)
+				return (-1);
+			while (sh->lists[CACHE_GHOST_RECENT].count > kout)
+				cache_entry_release(sh, sh->lists[CACHE_GHOST_RECENT].tail);
+			return (0);
+		}
+		return (cache_evict_from(sh, CACHE_FREQUENT, CACHE_LIST_NONE, CACHE_RECENT, CACHE_GHOST_RECENT));
+
+	case CART_CACHE_ARC:
+		return (cache_arc_replace(sh, ghost == CACHE_GHOST_FREQUENT));
+
+	default:
+		return (cache_evict_from(sh, CACHE_RECENT, CACHE_LIST_NONE, CACHE_RECENT, CACHE_LIST_NONE));
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_make_room
+// Description  : Free a payload slot according to the replacement policy
+//
+// Inputs       : sh - the shard
+//                ghost - queue of the ghost entry being re-referenced (already
+//                        unlinked), or CACHE_LIST_NONE on a plain miss
+// Outputs      : 0 if a payload slot is available, -1 if everything is pinned
+//                or a write back failed
+
+static int cache_make_room(struct cache_shard *sh, int ghost) {
+	uint32_t t1, b1, total, c = sh->max_frames;
+
+	if (Cache_Policy == CART_CACHE_ARC) {
+		// Keep the ARC directory (T1+B1 <= c, T1+T2+B1+B2 <= 2c) in bounds
+		t1 = sh->lists[CACHE_RECENT].count;
+		b1 = sh->lists[CACHE_GHOST_RECENT].count;
+		total = t1 + b1 + sh->lists[CACHE_FREQUENT].count + sh->lists[CACHE_GHOST_FREQUENT].count;
+		if (ghost == CACHE_LIST_NONE && t1 + b1 >= c) {
+			if (t1 >= c)
+				return (cache_evict_from(sh, CACHE_RECENT, CACHE_LIST_NONE, CACHE_FREQUENT, CACHE_LIST_NONE));
+			cache_entry_release(sh, sh->lists[CACHE_GHOST_RECENT].tail);
+		}
+		else if (ghost == CACHE_LIST_NONE && total >= 2 * c) {
+			cache_entry_release(sh, sh->lists[CACHE_GHOST_FREQUENT].tail);
+		}
+	}
+	if (sh->data_avail > 0)
+		return (0);
+	return (cache_evict_one(sh, ghost));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_arc_adapt
+// Description  : Move the ARC target p on a ghost hit
+//
+// Inputs       : sh - the shard
+//                ghost - the ghost entry that was re-referenced
+// Outputs      : none
+
+static void cache_arc_adapt(struct cache_shard *sh, uint32_t ghost) {
+	uint32_t b1 = sh->lists[CACHE_GHOST_RECENT].count, b2 = sh->lists[CACHE_GHOST_FREQUENT].count, delta;
+
+	if (sh->entries[ghost].list == CACHE_GHOST_RECENT) {
+		delta = (b2 > b1) ? b2 / b1 : 1;
+		sh->arc_p = (sh->arc_p + delta > sh->max_frames) ? sh->max_frames : sh->arc_p + delta;
+	}
+	else {
+		delta = (b1 > b2) ? b1 / b2 : 1;
+		sh->arc_p = (sh->arc_p > delta) ? sh->arc_p - delta : 0;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_touch
+// Description  : Record a hit on a resident entry (shard held exclusive, or
+//                shared together with lru_lock)
+//
+// Inputs       : sh - the shard
+//                slot - the entry that was referenced
+// Outputs      : none
+
+static void cache_touch(struct cache_shard *sh, uint32_t slot) {
+	switch (Cache_Policy) {
+	case CART_CACHE_CLOCK:
+		sh->entries[slot].ref = 1;
+		break;
+	case CART_CACHE_2Q:
+		// A1in is a FIFO, only Am frames are promoted
+		if (sh->entries[slot].list == CACHE_FREQUENT)
+			cache_list_move(sh, slot, CACHE_FREQUENT);
+		break;
+	case CART_CACHE_ARC:
+		cache_list_move(sh, slot, CACHE_FREQUENT);
+		break;
+	default:
+		cache_list_move(sh, slot, CACHE_RECENT);
+		break;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_touch_shared
+// Description  : Record a hit while holding the shard shared.  CLOCK only
+//                sets the reference bit; the list policies promote when
+//                lru_lock is free and otherwise leave the frame in place.
+//
+// Inputs       : sh - the shard
+//                slot - the entry that was referenced
+// Outputs      : none
+
+static void cache_touch_shared(struct cache_shard *sh, uint32_t slot) {
+	if (Cache_Policy == CART_CACHE_CLOCK) {
+		__atomic_store_n(&sh->entries[slot].ref, 1, __ATOMIC_RELAXED);
+	}
+	else if (pthread_mutex_trylock(&sh->lru_lock) == 0) {
+		cache_touch(sh, slot);
+		pthread_mutex_unlock(&sh->lru_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_insert
+// Description  : Make a key resident after a miss, evicting as the policy
+//                dictates (shard held exclusive)
+//
+// Inputs       : sh - the shard
+//                cart - the cartridge number
+//                frm - the frame number
+// Outputs      : the now resident entry, CACHE_NIL if no frame can be evicted
+
+static uint32_t cache_insert(struct cache_shard *sh, CartridgeIndex cart, CartFrameIndex frm) {
+	uint32_t slot = cache_find(sh, cart, frm), bucket;
+	int list = CACHE_RECENT, ghost;
+
+	if (slot != CACHE_NIL) {
+		// Ghost hit, re-referenced history goes to the frequent queue
+		if (Cache_Policy == CART_CACHE_ARC)
+			cache_arc_adapt(sh, slot);
+		ghost = sh->entries[slot].list;
+		cache_list_unlink(sh, slot);
+		if (cache_make_room(sh, ghost) == -1) {
+			cache_entry_release(sh, slot);
+			return (CACHE_NIL);
+		}
+		list = CACHE_FREQUENT;
+	}
+	else {
+		if (cache_make_room(sh, CACHE_LIST_NONE) == -1)
+			return (CACHE_NIL);
+		if (sh->free == CACHE_NIL) {
+			// Out of entries, give up the oldest history
+			if (sh->lists[CACHE_GHOST_RECENT].count > 0)
+				cache_entry_release(sh, sh->lists[CACHE_GHOST_RECENT].tail);
+			else
+				cache_entry_release(sh, sh->lists[CACHE_GHOST_FREQUENT].tail);
+		}
+		slot = sh->free;
+		sh->free = sh->entries[slot].next;
+		sh->keys[slot] = CACHE_KEY(cart, frm);
+		bucket = cache_hash(sh, cart, frm);
+		sh->chain[slot] = sh->hash[bucket];
+		sh->hash[bucket] = slot;
+	}
+
+	sh->entries[slot].data = sh->data_free[--sh->data_avail];
+	sh->entries[slot].ref = 0;
+	sh->entries[slot].dirty = 0;
+	sh->entries[slot].pins = 0;
+	sh->inserts++;
+	cache_list_push(sh, slot, list);
+	return (slot);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_put
+// Description  : Store a frame's contents in its shard (shard held
+//                exclusive)
+//
+// Inputs       : sh - the shard
+//                cart - the cartridge number of the frame to cache
+//                frm - the frame number of the frame to cache
+//                buf - the buffer to insert into the cache
+// Outputs      : the entry holding the frame, CACHE_NIL if failure
+
+static uint32_t cache_put(struct cache_shard *sh, CartridgeIndex cart, CartFrameIndex frm, void *buf) {
+	uint32_t index;
+
+	//Is object already in the cache?
+	sh->flush_failed = 0;
+	if ((index = cache_find_resident(sh, cart, frm)) != CACHE_NIL) {
+		cache_touch(sh, index);
+	}
+	else if ((index = cache_insert(sh, cart, frm)) == CACHE_NIL) {
+		logMessage(LOG_ERROR_LEVEL, "CART cache failed: no frame can be evicted");
+		return (CACHE_NIL);
+	}
+	else {
+		cache_victim_take(sh, CACHE_KEY(cart, frm), NULL);  // superseded
+	}
+	memcpy(sh->slots[sh->entries[index].data], buf, CART_FRAME_SIZE);
+	sh->entries[index].dirty = 0;
+	return (index);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_arena_map
+// Description  : Map the frame arena.  Explicit huge pages are tried first,
+//                then a 2 MB aligned mapping hinted for transparent huge
+//                pages; arenas smaller than a huge page use normal pages.
+//
+// Inputs       : arena - the arena to map
+//                bytes - the number of payload bytes needed
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_arena_map(struct cache_arena *arena, size_t bytes) {
+	size_t page = (size_t)sysconf(_SC_PAGESIZE), lead;
+	char *base;
+
+	arena->huge = 0;
+	if (bytes < CACHE_HUGE_PAGE) {
+		arena->size = (bytes + page - 1) & ~(page - 1);
+		base = mmap(NULL, arena->size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		arena->base = (base == MAP_FAILED) ? NULL : base;
+		return ((arena->base == NULL) ? -1 : 0);
+	}
+
+	arena->size = (bytes + CACHE_HUGE_PAGE - 1) & ~((size_t)CACHE_HUGE_PAGE - 1);
+#ifdef MAP_HUGETLB
+	base = mmap(NULL, arena->size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	if (base != MAP_FAILED) {
+		arena->base = base;
+		arena->huge = 1;
+		return (0);
+	}
+#endif
+
+	// Over-map by a huge page and trim so the arena starts 2 MB aligned
+	base = mmap(NULL, arena->size + CACHE_HUGE_PAGE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		arena->base = NULL;
+		return (-1);
+	}
+	lead = (CACHE_HUGE_PAGE - ((uintptr_t)base & (CACHE_HUGE_PAGE - 1))) & (CACHE_HUGE_PAGE - 1);
+	if (lead > 0)
+		munmap(base, lead);
+	munmap(base + lead + arena->size, CACHE_HUGE_PAGE - lead);
+	arena->base = base + lead;
+#ifdef MADV_HUGEPAGE
+	arena->huge = (madvise(arena->base, arena->size, MADV_HUGEPAGE) == 0) ? 2 : 0;
+#endif
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_arena_unmap
+// Description  : Release the frame arena
+//
+// Inputs       : arena - the arena to release
+// Outputs      : none
+
+static void cache_arena_unmap(struct cache_arena *arena) {
+	if (arena->base != NULL)
+		munmap(arena->base, arena->size);
+	arena->base = NULL;
+	arena->size = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_shard_init
+// Description  : Initialize an empty shard (no capacity until grown)
+//
+// Inputs       : sh - the shard
+// Outputs      : none
+
+static void cache_shard_init(struct cache_shard *sh) {
+	uint32_t i;
+
+	memset(sh, 0, sizeof(struct cache_shard));
+	sh->free = CACHE_NIL;
+	for (i = 0; i < CACHE_NLISTS; i++) {
+		sh->lists[i].head = sh->lists[i].tail = CACHE_NIL;
+	}
+	pthread_rwlock_init(&sh->lock, NULL);
+	pthread_mutex_init(&sh->lru_lock, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_victim_init
+// Description  : Set up a shard's victim tier
+//
+// Inputs       : sh - the shard
+//                frames - the tier's memory budget, in uncompressed frames
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_victim_init(struct cache_shard *sh, uint32_t frames) {
+	uint32_t size = 16, shift = 28, i;
+
+	sh->victim_free = sh->victim_head = sh->victim_tail = CACHE_NIL;
+	if (frames == 0)
+		return (0);
+	while (size < frames * CACHE_VICTIM_RATIO && shift > 1) {
+		size <<= 1;
+		shift--;
+	}
+	if ((sh->victims = calloc(size, sizeof(struct cache_victim))) == NULL
+			|| (sh->victim_hash = malloc(size * sizeof(uint32_t))) == NULL)
+		return (-1);
+	for (i = size; i-- > 0; ) {
+		sh->victim_hash[i] = CACHE_NIL;
+		sh->victims[i].next = sh->victim_free;
+		sh->victim_free = i;
+	}
+	sh->victim_cap = size;
+	sh->victim_shift = shift;
+	sh->victim_budget = (size_t)frames * CART_FRAME_SIZE;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_shard_rehash
+// Description  : Resize the bucket array to the next power of two >= 2x the
+//                entry count and rechain every entry holding a key
+//
+// Inputs       : sh - the shard
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_shard_rehash(struct cache_shard *sh) {
+	uint32_t size = 2, shift = 31, i, bucket, *hash;
+
+	while (size < sh->nentries * 2 && shift > 1) {
+		size <<= 1;
+		shift--;
+	}
+	if (size == sh->hash_size)
+		return (0);
+	if ((hash = malloc(size * sizeof(uint32_t))) == NULL)
+		return (-1);
+	for (i = 0; i < size; i++) {
+		hash[i] = CACHE_NIL;
+	}
+	free(sh->hash);
+	sh->hash = hash;
+	sh->hash_size = size;
+	sh->hash_shift = shift;
+	for (i = 0; i < sh->nentries; i++) {
+		if (sh->entries[i].list != CACHE_LIST_NONE) {
+			bucket = cache_hash(sh, CACHE_KEY_CART(sh->keys[i]), CACHE_KEY_FRAME(sh->keys[i]));
+			sh->chain[i] = sh->hash[bucket];
+			sh->hash[bucket] = i;
+		}
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_shard_grow
+// Description  : Raise the capacity of a shard, keeping every resident frame
+//                (shard held exclusive, or not yet shared)
+//
+// Inputs       : sh - the shard
+//                max_frames - the new capacity
+//                fresh - payload memory for the slots beyond slot_cap
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_shard_grow(struct cache_shard *sh, uint32_t max_frames, CartFrame *fresh) {
+	uint32_t i, nentries = max_frames * 2, slot_cap = sh->slot_cap, *data_free;
+	struct LRUCache_Frame *entries;
+	char **slots;
+
+	// Payload slots, reusing ones given up by an earlier shrink first
+	if (max_frames > sh->slot_cap) {
+		if ((slots = realloc(sh->slots, max_frames * sizeof(char *))) == NULL)
+			return (-1);
+		sh->slots = slots;
+		if ((data_free = realloc(sh->data_free, max_frames * sizeof(uint32_t))) == NULL)
+			return (-1);
+		sh->data_free = data_free;
+		for (i = slot_cap; i < max_frames; i++) {
+			sh->slots[i] = fresh[i - slot_cap];
+		}
+		sh->slot_cap = max_frames;
+	}
+
+	// Entries for the resident frames and their ghosts
+	if (nentries > sh->nentries) {
+		if ((entries = realloc(sh->entries, nentries * sizeof(struct LRUCache_Frame))) == NULL)
+			return (-1);
+		sh->entries = entries;
+		if ((data_free = realloc(sh->keys, nentries * sizeof(uint32_t))) == NULL)
+			return (-1);
+		sh->keys = data_free;
+		if ((data_free = realloc(sh->chain, nentries * sizeof(uint32_t))) == NULL)
+			return (-1);
+		sh->chain = data_free;
+		for (i = nentries; i-- > sh->nentries; ) {
+			memset(&sh->entries[i], 0, sizeof(struct LRUCache_Frame));
+			sh->chain[i] = CACHE_NIL;
+			sh->entries[i].prev = CACHE_NIL;
+			sh->entries[i].next = sh->free;
+			sh->entries[i].data = CACHE_NIL;
+			sh->entries[i].list = CACHE_LIST_NONE;
+			sh->free = i;
+		}
+		sh->nentries = nentries;
+		if (cache_shard_rehash(sh) != 0)
+			return (-1);
+	}
+
+	// The new slots go on the free stack, lowest on top
+	for (i = max_frames; i-- > sh->max_frames; ) {
+		sh->data_free[sh->data_avail++] = i;
+	}
+	sh->max_frames = max_frames;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_shard_shrink
+// Description  : Lower the capacity of a shard (shard held exclusive).
+//                Frames are evicted in policy order until they fit, then the
+//                ones in slots past the new capacity are moved down so the
+//                pages of those slots can be returned to the system.
+//
+// Inputs       : sh - the shard
+//                want - the new capacity
+// Outputs      : 0 if successful, -1 if pinned frames are in the way (the
+//                shard may still have shrunk part of the way)
+
+static int cache_shard_shrink(struct cache_shard *sh, uint32_t want) {
+	uint32_t i, j, resident, *used, count, max_frames = want;
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	uintptr_t lo, hi;
+
+	// A pinned frame past the new end cannot move, stop just above it for now
+	for (i = 0; i < sh->nentries; i++) {
+		if (sh->entries[i].data != CACHE_NIL && sh->entries[i].data >= max_frames && sh->entries[i].pins > 0)
+			max_frames = sh->entries[i].data + 1;
+	}
+	if (max_frames >= sh->max_frames)
+		return (-1);
+	if ((used = calloc(sh->slot_cap, sizeof(uint32_t))) == NULL)
+		return (-1);
+
+	// Evict in policy order against the new capacity, stopping short if
+	// only pinned frames are left
+	resident = sh->max_frames - sh->data_avail;
+	sh->max_frames = max_frames;
+	if (sh->arc_p > max_frames)
+		sh->arc_p = max_frames;
+	while (resident > max_frames) {
+		sh->data_avail = 0;   // evicted slots are recounted below
+		if (cache_evict_one(sh, CACHE_LIST_NONE) != 0)
+			max_frames = sh->max_frames = resident;
+		else
+			resident--;
+	}
+	while (Cache_Policy == CART_CACHE_ARC && sh->lists[CACHE_RECENT].count + sh->lists[CACHE_GHOST_RECENT].count > max_frames)
+		cache_entry_release(sh, sh->lists[CACHE_GHOST_RECENT].tail);
+	while (Cache_Policy == CART_CACHE_ARC && sh->lists[CACHE_RECENT].count + sh->lists[CACHE_FREQUENT].count
+			+ sh->lists[CACHE_GHOST_RECENT].count + sh->lists[CACHE_GHOST_FREQUENT].count > 2 * max_frames)
+		cache_entry_release(sh, sh->lists[CACHE_GHOST_FREQUENT].tail);
+	while (Cache_Policy == CART_CACHE_2Q && sh->lists[CACHE_GHOST_RECENT].count > (max_frames / 2 ? max_frames / 2 : 1))
+		cache_entry_release(sh, sh->lists[CACHE_GHOST_RECENT].tail);
+
+	// Move frames out of the retired slots into free ones below the new end
+	for (i = 0; i < sh->nentries; i++) {
+		if (sh->entries[i].data != CACHE_NIL)
+			used[sh->entries[i].data] = i + 1;
+	}
+	for (i = max_frames, j = 0; i < sh->slot_cap; i++) {
+		if (used[i] == 0)
+			continue;
+		while (used[j] != 0)
+			j++;
+		memcpy(sh->slots[j], sh->slots[i], CART_FRAME_SIZE);
+		sh->entries[used[i] - 1].data = j;
+		used[j] = used[i];
+		used[i] = 0;
+	}
+	for (i = max_frames, count = 0; i-- > 0; ) {
+		if (used[i] == 0)
+			sh->data_free[count++] = i;
+	}
+	sh->data_avail = count;
+	free(used);
+
+	// Give the whole pages of the retired slots back, they stay mapped
+	for (i = max_frames; i < sh->slot_cap; i = j) {
+		for (j = i + 1; j < sh->slot_cap && sh->slots[j] == sh->slots[j - 1] + CART_FRAME_SIZE; j++);
+		lo = ((uintptr_t)sh->slots[i] + page - 1) & ~(uintptr_t)(page - 1);
+		hi = ((uintptr_t)sh->slots[j - 1] + CART_FRAME_SIZE) & ~(uintptr_t)(page - 1);
+		if (hi > lo)
+			madvise((void *)lo, hi - lo, MADV_DONTNEED);
+	}
+	return ((max_frames == want) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_shard_share
+// Description  : Get a shard's share of a cache capacity
+//
+// Inputs       : shard - the shard number
+//                max_frames - the capacity of the whole cache
+// Outputs      : the shard's capacity
+
+static uint32_t cache_shard_share(uint32_t shard, uint32_t max_frames) {
+	return (max_frames / Cache_Nshards + (shard < max_frames % Cache_Nshards));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_resize
+// Description  : Grow or shrink a running cache, shard by shard
+//
+// Inputs       : max_frames - the new capacity
+// Outputs      : 0 if successful, -1 if failure (the cache is left at a
+//                valid size, which Cache_Max_Frames reports)
+
+static int cache_resize(uint32_t max_frames) {
+	uint32_t i, want, need = 0, tries, total = 0, fresh_used;
+	struct cache_shard *sh;
+	CartFrame *fresh = NULL;
+	int ret = 0;
+
+	// Slots that have no memory behind them yet come from a new arena
+	for (i = 0; i < Cache_Nshards; i++) {
+		want = cache_shard_share(i, max_frames);
+		if (want > Cache_Shards[i].slot_cap)
+			need += want - Cache_Shards[i].slot_cap;
+	}
+	if (need > 0) {
+		if (Cache_Narenas == CACHE_MAX_ARENAS
+				|| cache_arena_map(&Cache_Arenas[Cache_Narenas], (size_t)need * sizeof(CartFrame)) != 0) {
+			logMessage(LOG_ERROR_LEVEL, "CART cache failed: unable to grow to %u frames", max_frames);
+			return (-1);
+		}
+		fresh = (CartFrame *)Cache_Arenas[Cache_Narenas++].base;
+	}
+
+	for (i = 0; i < Cache_Nshards; i++) {
+		sh = &Cache_Shards[i];
+		want = cache_shard_share(i, max_frames);
+		for (tries = 0; tries < CACHE_RESIZE_TRIES && sh->max_frames != want; tries++) {
+			if (tries > 0)
+				sched_yield();  // let other threads drop their pins
+			pthread_rwlock_wrlock(&sh->lock);
+			if (want > sh->max_frames) {
+				fresh_used = (want > sh->slot_cap) ? want - sh->slot_cap : 0;
+				if (cache_shard_grow(sh, want, fresh) == 0)
+					fresh += fresh_used;
+				else
+					tries = CACHE_RESIZE_TRIES;
+			}
+			else {
+				cache_shard_shrink(sh, want);
+			}
+			pthread_rwlock_unlock(&sh->lock);
+		}
+		if (sh->max_frames != want) {
+			logMessage(LOG_ERROR_LEVEL, "CART cache failed: shard %u held at %u frames", i, sh->max_frames);
+			ret = -1;
+		}
+		total += sh->max_frames;
+	}
+	Cache_Max_Frames = total;
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_cache_size
+// Description  : Set the size of the cache (must be called before init, a
+//                running cache is resized with resize_cart_cache)
+//
+// Inputs       : max_frames - the maximum number of items your cache can hold
+// Outputs      : 0 if successful, -1 if failure
+
+int set_cart_cache_size(uint32_t max_frames) {
+	if (Cache_Shards != NULL || max_frames == 0 || max_frames >= CACHE_NIL / 2)
+		return (-1);
+	Cache_Max_Frames = max_frames;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : resize_cart_cache
+// Description  : Resize a running cache in place: a grow keeps every
+//                resident frame, a shrink evicts in replacement policy
+//                order.  A shrink writes dirty frames back through the flush
+//                function, so the caller holds whatever lock that needs (the
+//                driver's cart_set_cache_size does).
+//
+// Inputs       : max_frames - the maximum number of items your cache can hold
+// Outputs      : 0 if successful, -1 if failure
+
+int resize_cart_cache(uint32_t max_frames) {
+	int ret = 0;
+
+	if (max_frames == 0 || max_frames >= CACHE_NIL / 2)
+		return (-1);
+	pthread_mutex_lock(&Cache_Resize_Lock);
+	if (Cache_Shards == NULL)
+		Cache_Max_Frames = max_frames;
+	else if (max_frames < Cache_Nshards)
+		ret = -1;
+	else if (max_frames != Cache_Max_Frames)
+		ret = cache_resize(max_frames);
+	pthread_mutex_unlock(&Cache_Resize_Lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_cache_size
+// Description  : Get the size of the cache
+//
+// Inputs       : none
+// Outputs      : the maximum number of frames the cache holds
+
+uint32_t cart_cache_size(void) {
+	return ((Cache_Max_Frames == 0) ? DEFAULT_CART_FRAME_CACHE_SIZE : Cache_Max_Frames);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_cache_shards
+// Description  : Set the number of independently locked shards (must be
+//                called before init); small caches use fewer so each shard
+//                keeps at least 128 frames
+//
+// Inputs       : shards - the number of shards wanted
+// Outputs      : 0 if successful, -1 if failure
+
+int set_cart_cache_shards(uint32_t shards) {
+	if (Cache_Shards != NULL || shards == 0)
+		return (-1);
+	Cache_Shards_Wanted = shards;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_cache_victim_size
+// Description  : Set the memory of the compressed victim tier (must be
+//                called before init), split evenly over the shards
+//
+// Inputs       : frames - the budget in uncompressed frames, 0 disables
+// Outputs      : 0 if successful, -1 if failure
+
+int set_cart_cache_victim_size(uint32_t frames) {
+	if (Cache_Shards != NULL || frames >= CACHE_NIL / CACHE_VICTIM_RATIO)
+		return (-1);
+	Cache_Victim_Frames = frames;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_cache_policy
+// Description  : Set the replacement policy of the cache (must be called
+//                before init)
+//
+// Inputs       : policy - the replacement policy to use
+// Outputs      : 0 if successful, -1 if failure
+
+int set_cart_cache_policy(CartCachePolicy policy) {
+	if (Cache_Shards != NULL || policy < 0 || policy >= CART_CACHE_MAXPOLICY)
+		return (-1);
+	Cache_Policy = policy;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_cache_policy
+// Description  : Get the replacement policy of the cache
+//
+// Inputs       : none
+// Outputs      : the replacement policy
+
+CartCachePolicy cart_cache_policy(void) {
+	return (Cache_Policy);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_cache_policy_from_name
+// Description  : Translate a policy name ("lru", "clock", "2q", "arc")
+//
+// Inputs       : name - the policy name (case insensitive)
+// Outputs      : the policy or -1 if the name is unknown
+
+int cart_cache_policy_from_name(const char *name) {
+	int i;
+	for (i = 0; i < CART_CACHE_MAXPOLICY; i++) {
+		if (strcasecmp(name, Cache_Policy_Names[i]) == 0)
+			return (i);
+	}
+	return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_cache_policy_name
+// Description  : Get the name of a replacement policy
+//
+// Inputs       : policy - the replacement policy
+// Outputs      : the policy name
+
+const char * cart_cache_policy_name(CartCachePolicy policy) {
+	if (policy < 0 || policy >= CART_CACHE_MAXPOLICY)
+		return ("unknown");
+	return (Cache_Policy_Names[policy]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_cache_write_mode
+// Description  : Choose write-through or write-back caching (must be called
+//                before init)
+//
+// Inputs       : mode - the write mode
+// Outputs      : 0 if successful, -1 if failure
 
-uint32_t Cache_Max_Frames; //holds the maxium amount of frames in Cache
-uint32_t Cache_Current_Time;
-int Cache_Size = sizeof(struct LRUCache_Frame);
+int set_cart_cache_write_mode(CartCacheWriteMode mode) {
+	if (Cache_Shards != NULL || (mode != CART_CACHE_WRITETHROUGH && mode != CART_CACHE_WRITEBACK))
+		return (-1);
+	Cache_Write_Mode = mode;
+	return 0;
+}
 
+////////////////////////////////////////////////////////////////////////////////
 //
-// Functions
+// Function     : cart_cache_write_mode
+// Description  : Get the write mode of the cache
+//
+// Inputs       : none
+// Outputs      : the write mode
+
+CartCacheWriteMode cart_cache_write_mode(void) {
+	return (Cache_Write_Mode);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : set_cart_cache_size
-// Description  : Set the size of the cache (must be called before init)
+// Function     : set_cart_cache_flush
+// Description  : Set the function used to write dirty frames back
 //
-// Inputs       : max_frames - the maximum number of items your cache can hold
+// Inputs       : flush - the write back function
 // Outputs      : 0 if successful, -1 if failure
 
-int set_cart_cache_size(uint32_t max_frames) {
-	Cache_Max_Frames = max_frames;
-	if(max_frames != Cache_Max_Frames)
-		return (-1);
+int set_cart_cache_flush(CartCacheFlush flush) {
+	Cache_Flush = flush;
 	return 0;
 }
 
@@ -66,27 +1451,131 @@ int set_cart_cache_size(uint32_t max_frames) {
 // Outputs      : 0 if successful, -1 if failure
 
 int init_cart_cache(void) {
+	uint32_t i, first, frames;
+	struct cache_arena *arena = &Cache_Arenas[0];
+
 	if(Cache_Max_Frames == 0) {
-		Cache_Max_Frames= 15;
+		Cache_Max_Frames= DEFAULT_CART_FRAME_CACHE_SIZE;
 	}
-	LRUCache = calloc(Cache_Max_Frames, Cache_Size;
+
+	// Split the frames evenly, without making any shard too small to be useful
+	Cache_Nshards = Cache_Max_Frames / CACHE_MIN_SHARD_FRAMES;
+	if (Cache_Nshards > Cache_Shards_Wanted)
+		Cache_Nshards = Cache_Shards_Wanted;
+	if (Cache_Nshards == 0)
+		Cache_Nshards = 1;
+
+	// Payloads come from one arena, carved into a contiguous run per shard
+	if ((Cache_Shards = calloc(Cache_Nshards, sizeof(struct cache_shard))) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "CART cache failed: unable to allocate %u frames", Cache_Max_Frames);
+		return (-1);
+	}
+	for (i = 0; i < Cache_Nshards; i++) {
+		cache_shard_init(&Cache_Shards[i]);
+	}
+	if (cache_arena_map(arena, (size_t)Cache_Max_Frames * sizeof(CartFrame)) != 0)
+		i = 0;
+	else {
+		Cache_Narenas = 1;
+		for (i = 0, first = 0; i < Cache_Nshards; i++, first += frames) {
+			frames = cache_shard_share(i, Cache_Max_Frames);
+			if (cache_shard_grow(&Cache_Shards[i], frames, (CartFrame *)arena->base + first) != 0
+					|| cache_victim_init(&Cache_Shards[i], cache_shard_share(i, Cache_Victim_Frames)) != 0)
+				break;
+		}
+	}
+	if (i < Cache_Nshards) {
+		logMessage(LOG_ERROR_LEVEL, "CART cache failed: unable to allocate %u frames", Cache_Max_Frames);
+		close_cart_cache();
+		return (-1);
+	}
+	logMessage(LOG_INFO_LEVEL, "CART cache arena: %lu KB%s", (unsigned long)(arena->size >> 10),
+		(arena->huge == 1) ? " in huge pages" : (arena->huge == 2) ? " hinted for huge pages" : "");
 	return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : close_cart_cache
-// Description  : Clear all of the contents of LRUCache_Frame,0,Cache_Max_Frames*DEFAULT_CART_FRAME_CACHE_SIZE);
-	
-	free(LRUCache);
-	LRUCache = {0};
+// Description  : Clear all of the contents of the cache, cleanup
+//
+// Inputs       : none
+// Outputs      : o if successful, -1 if failure
+
+int close_cart_cache(void) {
+	uint32_t i;
+
+	if (Cache_Shards == NULL)
+		return 0;
+	cart_cache_stats(&Cache_Last_Stats);
+	for (i = 0; i < Cache_Nshards; i++) {
+		struct cache_shard *sh = &Cache_Shards[i];
+		pthread_rwlock_destroy(&sh->lock);
+		pthread_mutex_destroy(&sh->lru_lock);
+		free(sh->entries);
+		free(sh->keys);
+		free(sh->chain);
+		free(sh->slots);
+		free(sh->data_free);
+		free(sh->hash);
+		while (sh->victim_head != CACHE_NIL)
+			cache_victim_drop(sh, sh->victim_head);
+		free(sh->victims);
+		free(sh->victim_hash);
+	}
+	logMessage(LOG_INFO_LEVEL, "CART cache (%s, %u frames, %u shards): %llu hits, %llu misses, %llu evictions, %llu victim hits",
+		cart_cache_policy_name(Cache_Policy), Cache_Max_Frames, Cache_Nshards,
+		(unsigned long long)Cache_Last_Stats.hits, (unsigned long long)Cache_Last_Stats.misses,
+		(unsigned long long)Cache_Last_Stats.evictions, (unsigned long long)Cache_Last_Stats.victim_hits);
+	free(Cache_Shards);
+	for (i = 0; i < Cache_Narenas; i++) {
+		cache_arena_unmap(&Cache_Arenas[i]);
+	}
+	Cache_Narenas = 0;
+	Cache_Shards = NULL;
+	Cache_Nshards = 0;
 	return 0;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_cache_stats
+// Description  : Get the cache counters, summed over the shards.  Once the
+//                cache is closed the counters of its last run are returned.
+//
+// Inputs       : stats - the structure to fill in
+// Outputs      : 0 if successful, -1 if failure
+
+int cart_cache_stats(CartCacheStats *stats) {
+	struct cache_shard *sh;
+	uint32_t i;
+
+	if (Cache_Shards == NULL) {
+		*stats = Cache_Last_Stats;
+		return (0);
+	}
+	memset(stats, 0, sizeof(CartCacheStats));
+	for (i = 0; i < Cache_Nshards; i++) {
+		sh = &Cache_Shards[i];
+		stats->hits += __atomic_load_n(&sh->hits, __ATOMIC_RELAXED);
+		stats->misses += __atomic_load_n(&sh->misses, __ATOMIC_RELAXED);
+		pthread_rwlock_rdlock(&sh->lock);
+		stats->inserts += sh->inserts;
+		stats->evictions += sh->evictions;
+		stats->writebacks += sh->writebacks;
+		stats->victim_hits += sh->victim_hits;
+		stats->victim_stores += sh->victim_stores;
+		stats->victim_frames += sh->victim_count;
+		stats->victim_bytes += sh->victim_bytes;
+		pthread_rwlock_unlock(&sh->lock);
+	}
+	return (0);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : put_cart_cache
-// Description  : Put an object into the frame 
+// Description  : Put an object into the frame
 //
 // Inputs       : cart - the cartridge number of the frame to cache
 //                frm - the frame number of the frame to cache
@@ -94,65 +1583,260 @@ int init_cart_cache(void) {
 // Outputs      : 0 if successful, -1 if failure
 
 int put_cart_cache(CartridgeIndex cart, CartFrameIndex frm, void *buf)  {
-	//Is object already in the cache?
-	for(int i=0; i <Cache_Max_Frames;i++) {
-		if(LRUCache[i].frame_index == frm && LRUCache[i].cart_index == cart && LRUCache[i].free ==1){
-			//update access time
-			LRUCache[i].access_time = Cache_Current_Time;
-			//copy to cache
-			memcpy(LRUCache[i].FrameData, buf, CART_FRAME_SIZE);
-			Cache_Current_Time++;
-			return 0;
-		}
-	}
-	int index = -1;
-	int Time_Min = 0; //keeps track of the index with the smallest lifespan
-
-	//search cache for available slots
-	for(int i=0; i< Cache_Max_Frames;i++){
-		if(LRUCache[i].free ==0){
-			index =i;
-			break;
-		}
-		else if(LRUCache[i].access_time < LRUCache[Time_Min].access_time){
-			Time_Min = i;
+	struct cache_shard *sh;
+	int ret;
+
+	if (Cache_Shards == NULL)
+		return (-1);
+	sh = cache_shard_of(cart, frm);
+	pthread_rwlock_wrlock(&sh->lock);
+	ret = (cache_put(sh, cart, frm, buf) == CACHE_NIL || sh->flush_failed) ? -1 : 0;
+	pthread_rwlock_unlock(&sh->lock);
+	return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_cart_cache_dirty
+// Description  : Put a modified frame into the cache, it is written back
+//                when evicted or flushed
+//
+// Inputs       : cart - the cartridge number of the frame to cache
+//                frm - the frame number of the frame to cache
+//                buf - the buffer to insert into the cache
+// Outputs      : 0 if successful, -1 if failure (including failure to write
+//                back a frame evicted to make room)
+
+int put_cart_cache_dirty(CartridgeIndex cart, CartFrameIndex frm, void *buf) {
+	struct cache_shard *sh;
+	uint32_t index;
+	int ret = -1;
+
+	if (Cache_Shards == NULL)
+		return (-1);
+	sh = cache_shard_of(cart, frm);
+	pthread_rwlock_wrlock(&sh->lock);
+	if ((index = cache_put(sh, cart, frm, buf)) != CACHE_NIL) {
+		sh->entries[index].dirty = 1;
+		ret = sh->flush_failed ? -1 : 0;
+	}
+	pthread_rwlock_unlock(&sh->lock);
+	return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_cart_cache_frame
+// Description  : Write back a single frame if it is resident and dirty
+//
+// Inputs       : cart - the cartridge number of the frame
+//                frm - the frame number of the frame
+// Outputs      : 0 if successful, -1 if failure
+
+int flush_cart_cache_frame(CartridgeIndex cart, CartFrameIndex frm) {
+	struct cache_shard *sh;
+	uint32_t i;
+	int ret = 0;
+
+	if (Cache_Shards == NULL)
+		return (0);
+	sh = cache_shard_of(cart, frm);
+	pthread_rwlock_wrlock(&sh->lock);
+	if ((i = cache_find_resident(sh, cart, frm)) != CACHE_NIL && sh->entries[i].dirty)
+		ret = cache_writeback(sh, i);
+	pthread_rwlock_unlock(&sh->lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_key_compare
+// Description  : qsort comparator ordering (cartridge << 16 | frame) keys
+//
+// Inputs       : a, b - pointers to keys
+// Outputs      : <0, 0, >0 as for qsort
+
+static int cache_key_compare(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return ((x > y) - (x < y));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_cart_cache
+// Description  : Write back every dirty frame, in cartridge/frame order
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int flush_cart_cache(void) {
+	struct cache_shard *sh;
+	uint32_t *dirty, count = 0, i, s;
+	int ret = 0;
+
+	if (Cache_Shards == NULL)
+		return (0);
+	pthread_mutex_lock(&Cache_Resize_Lock);
+	if ((dirty = malloc(Cache_Max_Frames * sizeof(uint32_t))) == NULL) {
+		pthread_mutex_unlock(&Cache_Resize_Lock);
+		return (-1);
+	}
+
+	// Gather the dirty keys of every shard (sizes held still), then write
+	// them back sorted
+	for (s = 0; s < Cache_Nshards; s++) {
+		sh = &Cache_Shards[s];
+		pthread_rwlock_rdlock(&sh->lock);
+		for (i = 0; i < sh->nentries; i++) {
+			if (sh->entries[i].data != CACHE_NIL && sh->entries[i].dirty)
+				dirty[count++] = sh->keys[i];
 		}
+		pthread_rwlock_unlock(&sh->lock);
 	}
-	//no avaliable slot found, begin LRU algorithm
-	if(index == -1){
-		index= Time_MIn;
+	pthread_mutex_unlock(&Cache_Resize_Lock);
+	qsort(dirty, count, sizeof(uint32_t), cache_key_compare);
+	for (i = 0; i < count; i++) {
+		if (flush_cart_cache_frame(CACHE_KEY_CART(dirty[i]), CACHE_KEY_FRAME(dirty[i])) != 0)
+			ret = -1;
 	}
-	//put object into the cache
-	memcpy(LRUCache[index].FrameData, buf, CART_FRAME_SIZE);
-	LRCache[index].cart_index= cart;
-	LRUCache[index].free= 1;
-	LRUCache[index].frame_index = frm;
-	LRUCache[index].access_time = Cache_Current_Time;
+	free(dirty);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_lookup
+// Description  : Look a frame up under the shard's shared lock, counting the
+//                hit or miss and recording the reference
+//
+// Inputs       : cart - the cartridge number of the frame
+//                frm - the frame number of the frame
+//                pin - non-zero to pin the frame if it is found
+// Outputs      : pointer to cached frame or NULL if not found
 
-	Cache_Current_Time++;
-	return(0);
-	
+static void * cache_lookup(CartridgeIndex cart, CartFrameIndex frm, int pin) {
+	struct cache_shard *sh;
+	char *frame = NULL;
+	uint32_t i;
+
+	if (Cache_Shards == NULL)
+		return NULL;
+	sh = cache_shard_of(cart, frm);
+	pthread_rwlock_rdlock(&sh->lock);
+	if ((i = cache_find_resident(sh, cart, frm)) == CACHE_NIL) {
+		__atomic_fetch_add(&sh->misses, 1, __ATOMIC_RELAXED);
+	}
+	else {
+		__atomic_fetch_add(&sh->hits, 1, __ATOMIC_RELAXED);
+		if (pin)
+			__atomic_fetch_add(&sh->entries[i].pins, 1, __ATOMIC_RELAXED);
+		cache_touch_shared(sh, i);
+		frame = sh->slots[sh->entries[i].data];
+	}
+	pthread_rwlock_unlock(&sh->lock);
+	return (frame);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : get_cart_cache
-// Description  : Get an frame from the cache (and return it)
+// Description  : Get an frame from the cache (and return it).  The frame can
+//                be evicted by the next insert, callers that share the cache
+//                between threads must use pin_cart_cache.
 //
 // Inputs       : cart_index - the cartridge number of the cartridge to find
 //                frame_index - the  number of the frame to find
 // Outputs      : pointer to cached frame or NULL if not found
 
 void * get_cart_cache(CartridgeIndex cart_index, CartFrameIndex frame_index) {
-	for(i=0;i<Cache_Max_Frames;i++)
-	{
-		if(LRUCache[i].cart_index==cart_index&&LRUCache[i].frame_index==frame_index &&LRUCache[i].free==1){
-			LRUCache[i].access_time = Cache_Current_Time;
-			Cache_Current_Time++;
-			return LRUCache[i].FrameData;
-		}
+	return (cache_lookup(cart_index, frame_index, 0));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pin_cart_cache
+// Description  : Get a resident frame and pin it, the returned pointer stays
+//                valid (the frame is never evicted) until it is unpinned
+//
+// Inputs       : cart - the cartridge number of the frame
+//                frm - the frame number of the frame
+// Outputs      : pointer to the cached frame or NULL if not found
+
+void * pin_cart_cache(CartridgeIndex cart, CartFrameIndex frm) {
+	return (cache_lookup(cart, frm, 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : alloc_pin_cart_cache
+// Description  : Make a frame resident and pinned without supplying its
+//                contents, so the caller can fill it in place (e.g. straight
+//                from the bus).  An existing copy is returned as is, one in
+//                the victim tier is expanded into the new slot.
+//
+// Inputs       : cart - the cartridge number of the frame
+//                frm - the frame number of the frame
+//                hit - set to 1 if the frame was already cached, else 0
+// Outputs      : pointer to the cached frame or NULL if failure
+
+void * alloc_pin_cart_cache(CartridgeIndex cart, CartFrameIndex frm, int *hit) {
+	struct cache_shard *sh;
+	char *frame;
+	uint32_t i;
+
+	if (Cache_Shards == NULL)
+		return (NULL);
+	if ((frame = pin_cart_cache(cart, frm)) != NULL) {
+		*hit = 1;
+		return (frame);
+	}
+
+	// Re-check under the exclusive lock, another thread may have inserted it
+	sh = cache_shard_of(cart, frm);
+	pthread_rwlock_wrlock(&sh->lock);
+	sh->flush_failed = 0;
+	if ((i = cache_find_resident(sh, cart, frm)) != CACHE_NIL) {
+		*hit = 1;
+		sh->entries[i].pins++;
+	}
+	else if ((i = cache_insert(sh, cart, frm)) != CACHE_NIL) {
+		// An evicted copy may still be in the victim tier
+		*hit = (cache_victim_take(sh, CACHE_KEY(cart, frm), sh->slots[sh->entries[i].data]) == 0);
+		sh->entries[i].pins = 1;
+	}
+	else {
+		logMessage(LOG_ERROR_LEVEL, "CART cache failed: no frame can be evicted");
+	}
+	frame = (i == CACHE_NIL) ? NULL : sh->slots[sh->entries[i].data];
+	pthread_rwlock_unlock(&sh->lock);
+	return (frame);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unpin_cart_cache
+// Description  : Release a pin taken by pin_cart_cache/alloc_pin_cart_cache
+//
+// Inputs       : cart - the cartridge number of the frame
+//                frm - the frame number of the frame
+// Outputs      : 0 if successful, -1 if the frame was not pinned
+
+int unpin_cart_cache(CartridgeIndex cart, CartFrameIndex frm) {
+	struct cache_shard *sh;
+	uint32_t i;
+	int ret = -1;
+
+	if (Cache_Shards == NULL)
+		return (-1);
+	sh = cache_shard_of(cart, frm);
+	pthread_rwlock_rdlock(&sh->lock);
+	if ((i = cache_find_resident(sh, cart, frm)) != CACHE_NIL
+			&& __atomic_load_n(&sh->entries[i].pins, __ATOMIC_RELAXED) > 0) {
+		__atomic_fetch_sub(&sh->entries[i].pins, 1, __ATOMIC_RELAXED);
+		ret = 0;
 	}
-	return NULL;	
+	pthread_rwlock_unlock(&sh->lock);
+	return (ret);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -162,22 +1846,544 @@ void * get_cart_cache(CartridgeIndex cart_index, CartFrameIndex frame_index) {
 //
 // Inputs       : cart - the cart number of the frame to remove from cache
 //                blk - the frame number of the frame to remove from cache
-// Outputs      : pointe buffer inserted into the object
+// Outputs      : pointer to the removed frame data (valid until the next
+//                put) or NULL if not found
 
 void * delete_cart_cache(CartridgeIndex cart, CartFrameIndex blk) {
-	for(i=0;i<Cache_Max_Frames;i++)
-	{
-		if(LRUCache[i].cart_index==cart &&LRUCache[i].frame_index== blk &&LRUCache[i].free==1){
-			LRUCache[i].free= 0;
-			return LRUCache[i].FrameData;
+	struct cache_shard *sh;
+	char *frame = NULL;
+	uint32_t i, data;
+
+	if (Cache_Shards == NULL)
+		return NULL;
+	sh = cache_shard_of(cart, blk);
+	pthread_rwlock_wrlock(&sh->lock);
+	cache_victim_take(sh, CACHE_KEY(cart, blk), NULL);
+	if ((i = cache_find(sh, cart, blk)) != CACHE_NIL) {
+		if (sh->entries[i].pins > 0) {
+			logMessage(LOG_ERROR_LEVEL, "CART cache failed: deleting pinned frame %u/%u", cart, blk);
+		}
+		else {
+			data = sh->entries[i].data;
+			cache_entry_release(sh, i);
+			frame = (data == CACHE_NIL) ? NULL : sh->slots[data];
 		}
 	}
-	return NULL;
+	pthread_rwlock_unlock(&sh->lock);
+	return (frame);
 }
 
 //
 // Unit test
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_test_access
+// Description  : Reference a frame the way the driver does (get, and put on
+//                a miss), checking the contents of any hit
+//
+// Inputs       : cart - the cartridge number
+//                frm - the frame number
+// Outputs      : 1 on a hit, 0 on a miss, -1 if a hit returned bad data
+
+static int cache_test_access(CartridgeIndex cart, CartFrameIndex frm) {
+	char frame[CART_FRAME_SIZE], *cached;
+	char fill = (char)(cart * 31 + frm);
+
+	if ((cached = get_cart_cache(cart, frm)) != NULL)
+		return ((cached[0] == fill && cached[CART_FRAME_SIZE-1] == fill) ? 1 : -1);
+	memset(frame, fill, CART_FRAME_SIZE);
+	put_cart_cache(cart, frm, frame);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_test_policy
+// Description  : Check one replacement policy against a small (single
+//                shard) cache
+//
+// Inputs       : policy - the policy to check
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_test_policy(CartCachePolicy policy) {
+	struct cache_shard *sh;
+	uint32_t i, resident;
+	uint64_t evictions;
+	int ret = -1, hit;
+	char *pinned;
+
+	Cache_Policy = policy;
+	Cache_Max_Frames = 16;
+	if (init_cart_cache() != 0)
+		return (-1);
+	sh = &Cache_Shards[0];
+
+	// Random traffic: hits must return the right frame, never over capacity
+	for (i = 0; i < 4096; i++) {
+		if (cache_test_access(getRandomValue(0, 3), getRandomValue(0, 40)) == -1) {
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test failed (%s): corrupt frame returned",
+				cart_cache_policy_name(policy));
+			goto done;
+		}
+		if (sh->data_avail + sh->lists[CACHE_RECENT].count + sh->lists[CACHE_FREQUENT].count != Cache_Max_Frames) {
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test failed (%s): payload slots leaked",
+				cart_cache_policy_name(policy));
+			goto done;
+		}
+	}
+	close_cart_cache();
+	init_cart_cache();
+	sh = &Cache_Shards[0];
+
+	if (policy == CART_CACHE_LRU) {
+		// Frame 0 is least recently used; touch it so 1 is evicted instead
+		for (i = 0; i < 16; i++)
+			cache_test_access(9, i);
+		cache_test_access(9, 0);
+		cache_test_access(9, 16);
+		if (get_cart_cache(9, 0) == NULL || get_cart_cache(9, 1) != NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: LRU order not respected");
+			goto done;
+		}
+	}
+
+	if (policy == CART_CACHE_2Q || policy == CART_CACHE_ARC) {
+		// Establish a hot set of 4 frames with repeated references, both
+		// while resident (ARC) and after aging out of A1in (2Q)
+		for (i = 0; i < 8; i++)
+			cache_test_access(7, i % 4);
+		for (i = 0; i < 16; i++)
+			cache_test_access(8, i);
+		for (i = 0; i < 4; i++)
+			cache_test_access(7, i);
+
+		// A long one-pass scan must not flush the hot set
+		for (i = 0; i < 256; i++)
+			cache_test_access(9, i);
+		for (i = 0, resident = 0; i < 4; i++) {
+			if ((hit = cache_test_access(7, i)) == -1)
+				goto done;
+			resident += hit;
+		}
+		if (resident != 4) {
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test failed (%s): scan evicted %u hot frames",
+				cart_cache_policy_name(policy), 4 - resident);
+			goto done;
+		}
+	}
+
+	// A pinned frame survives any amount of eviction pressure
+	cache_test_access(6, 6);
+	pinned = pin_cart_cache(6, 6);
+	for (i = 0; i < 64; i++)
+		cache_test_access(5, i);
+	if (pinned == NULL || get_cart_cache(6, 6) != pinned || pinned[0] != (char)(6 * 31 + 6)) {
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test failed (%s): pinned frame evicted",
+			cart_cache_policy_name(policy));
+		goto done;
+	}
+	unpin_cart_cache(6, 6);
+
+	// With every frame pinned nothing can be inserted
+	for (i = 0; i < Cache_Max_Frames; i++)
+		alloc_pin_cart_cache(4, i, &hit);
+	if (alloc_pin_cart_cache(4, 99, &hit) != NULL || cache_test_access(4, 98) != 0 || get_cart_cache(4, 98) != NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test failed (%s): evicted a pinned frame",
+			cart_cache_policy_name(policy));
+		goto done;
+	}
+	for (i = 0; i < Cache_Max_Frames; i++)
+		unpin_cart_cache(4, i);
+
+	// Deleted frames go away and their slot is reused without eviction
+	cache_test_access(9, 999);
+	if (delete_cart_cache(9, 999) == NULL || get_cart_cache(9, 999) != NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: delete did not remove frame");
+		goto done;
+	}
+	evictions = sh->evictions;
+	cache_test_access(9, 1000);
+	if (get_cart_cache(9, 1000) == NULL || sh->evictions != evictions) {
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test failed (%s): insert evicted despite free slot",
+			cart_cache_policy_name(policy));
+		goto done;
+	}
+	ret = 0;
+
+done:
+	close_cart_cache();
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_test_flush
+// Description  : Flush function used by the unit test, records write backs
+//
+// Inputs       : cart - the cartridge number of the frame
+//                frm - the frame number of the frame
+//                frame - the frame contents
+// Outputs      : 0 if successful, -1 for a frame of Cache_Test_Fail
+
+static uint32_t Cache_Test_Flushed[32];
+static uint32_t Cache_Test_Nflushed;
+static int Cache_Test_Fail = -1;  // cartridge whose write backs fail
+
+static int cache_test_flush(CartridgeIndex cart, CartFrameIndex frm, void *frame) {
+	if ((int)cart == Cache_Test_Fail)
+		return (-1);
+	if (((char *)frame)[0] != (char)(cart * 31 + frm))
+		Cache_Test_Flushed[Cache_Test_Nflushed++ % 32] = UINT32_MAX;
+	else
+		Cache_Test_Flushed[Cache_Test_Nflushed++ % 32] = ((uint32_t)cart << 16) | frm;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_test_writeback
+// Description  : Check dirty frame tracking, clustered write back on eviction,
+//                ordered flushing and a write back that fails
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_test_writeback(void) {
+	CartCacheFlush saved_flush = Cache_Flush;
+	char frame[CART_FRAME_SIZE], *cached;
+	CartCacheStats stats;
+	uint32_t i, n, frm, expect[] = { 0x10001, 0x10002, 0x10003, 0x10004, 0x20001, 0x40000, 0x40001, 0x50000 };
+	int ret = -1;
+
+	Cache_Policy = CART_CACHE_LRU;
+	Cache_Max_Frames = 16;
+	Cache_Test_Nflushed = 0;
+	if (init_cart_cache() != 0)
+		return (-1);
+	set_cart_cache_flush(cache_test_flush);
+
+	// Dirty a run of frames on cartridge 1 (out of order) plus a loner
+	for (i = 0; i < 4; i++) {
+		memset(frame, (char)(1 * 31 + 4 - i), CART_FRAME_SIZE);
+		put_cart_cache_dirty(1, 4 - i, frame);
+	}
+	memset(frame, (char)(2 * 31 + 1), CART_FRAME_SIZE);
+	put_cart_cache_dirty(2, 1, frame);
+	cache_test_access(1, 1);
+	flush_cart_cache_frame(1, 1);
+
+	// Evicting 1/4 writes back the dirty run 1/2-1/4 in order, then 2/1
+	for (i = 0; i < 16; i++)
+		cache_test_access(3, i);
+
+	// Explicit flush writes the remaining dirty frames sorted
+	memset(frame, (char)(5 * 31), CART_FRAME_SIZE);
+	put_cart_cache_dirty(5, 0, frame);
+	for (i = 0; i < 2; i++) {
+		memset(frame, (char)(4 * 31 + 1 - i), CART_FRAME_SIZE);
+		put_cart_cache_dirty(4, 1 - i, frame);
+	}
+	flush_cart_cache();
+	flush_cart_cache();
+
+	// Counters agree with what the flush function saw
+	cart_cache_stats(&stats);
+	if (Cache_Test_Nflushed != sizeof(expect) / sizeof(expect[0]) || stats.writebacks != Cache_Test_Nflushed
+			|| stats.inserts != 24 || stats.evictions != 8)
+		goto done;
+	for (i = 0; i < Cache_Test_Nflushed; i++) {
+		if (Cache_Test_Flushed[i] != expect[i])
+			goto done;
+	}
+
+	// A frame that cannot be written back stays resident and dirty, the
+	// insert that needed its slot fails instead
+	Cache_Test_Fail = 6;
+	memset(frame, (char)(6 * 31), CART_FRAME_SIZE);
+	put_cart_cache_dirty(6, 0, frame);
+	for (i = 0; i < 15; i++)
+		cache_test_access(3, 100 + i);
+	memset(frame, (char)(3 * 31 + 115), CART_FRAME_SIZE);
+	if (put_cart_cache(3, 115, frame) != -1 || (cached = get_cart_cache(6, 0)) == NULL || cached[0] != (char)(6 * 31))
+		goto done;
+	Cache_Test_Fail = -1;
+	n = Cache_Test_Nflushed;
+	if (flush_cart_cache() != 0 || Cache_Test_Nflushed != n + 1 || Cache_Test_Flushed[n % 32] != 0x60000
+			|| put_cart_cache(3, 115, frame) != 0)
+		goto done;
+
+	// A run stops at the 64 frame group even where the next group is in
+	// the same shard: evicting 7/64 writes 7/64-7/65 but not 7/62-7/63
+	n = Cache_Test_Nflushed;
+	for (i = 0; i < 4; i++) {
+		frm = (i < 2) ? 64 + i : 60 + i;
+		memset(frame, (char)(7 * 31 + frm), CART_FRAME_SIZE);
+		put_cart_cache_dirty(7, frm, frame);
+	}
+	for (i = 0; i < 16 && Cache_Test_Nflushed == n; i++)
+		cache_test_access(3, 200 + i);
+	if (Cache_Test_Nflushed != n + 2 || Cache_Test_Flushed[n % 32] != 0x70040 || Cache_Test_Flushed[(n + 1) % 32] != 0x70041
+			|| flush_cart_cache() != 0 || Cache_Test_Nflushed != n + 4 || Cache_Test_Flushed[(n + 2) % 32] != 0x7003e)
+		goto done;
+	ret = 0;
+
+done:
+	if (ret != 0)
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: bad write back (%u frames)", Cache_Test_Nflushed);
+	Cache_Test_Fail = -1;
+	close_cart_cache();
+	set_cart_cache_flush(saved_flush);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_test_victim
+// Description  : Check that evicted frames come back from the victim tier
+//                intact, and that stale, deleted and incompressible frames
+//                do not
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_test_victim(void) {
+	uint32_t i, frames = Cache_Victim_Frames;
+	char buf[CART_FRAME_SIZE], *frame;
+	struct cache_shard *sh;
+	CartCacheStats st;
+	int ret = -1, hit;
+
+	Cache_Policy = CART_CACHE_LRU;
+	Cache_Max_Frames = 16;
+	Cache_Victim_Frames = 16;
+	if (init_cart_cache() != 0) {
+		Cache_Victim_Frames = frames;
+		return (-1);
+	}
+	sh = &Cache_Shards[0];
+	for (i = 0; i < 32; i++)
+		cache_test_access(1, i);
+	cart_cache_stats(&st);
+	if (st.victim_stores != 16 || st.victim_frames != 16 || st.victim_bytes > sh->victim_budget)
+		goto done;
+
+	// An evicted frame is a hit, expanded with its contents
+	if ((frame = alloc_pin_cart_cache(1, 0, &hit)) == NULL || !hit || frame[0] != 31 || frame[CART_FRAME_SIZE-1] != 31)
+		goto done;
+	unpin_cart_cache(1, 0);
+	cart_cache_stats(&st);
+	if (st.victim_hits != 1 || cache_victim_find(sh, CACHE_KEY(1, 0)) != CACHE_NIL)
+		goto done;
+
+	// New contents replace the compressed copy, a delete forgets it
+	memset(buf, 'x', CART_FRAME_SIZE);
+	put_cart_cache(1, 1, buf);
+	delete_cart_cache(1, 2);
+	if (cache_victim_find(sh, CACHE_KEY(1, 1)) != CACHE_NIL || cache_victim_find(sh, CACHE_KEY(1, 2)) != CACHE_NIL)
+		goto done;
+	if (alloc_pin_cart_cache(1, 2, &hit) == NULL || hit)
+		goto done;
+	unpin_cart_cache(1, 2);
+	delete_cart_cache(1, 2);
+
+	// Frames that do not compress are not kept
+	for (i = 0; i < CART_FRAME_SIZE; i++)
+		buf[i] = (char)getRandomValue(0, 255);
+	put_cart_cache(9, 0, buf);
+	for (i = 0; i < 64; i++)
+		cache_test_access(2, i);
+	if (cache_victim_find(sh, CACHE_KEY(9, 0)) != CACHE_NIL || sh->victim_bytes > sh->victim_budget)
+		goto done;
+	for (i = 0; i < 64; i++) {
+		if ((frame = alloc_pin_cart_cache(2, i, &hit)) == NULL || frame[0] != (char)(2 * 31 + i))
+			goto done;
+		unpin_cart_cache(2, i);
+	}
+	ret = 0;
+
+done:
+	if (ret != 0)
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: victim tier");
+	close_cart_cache();
+	Cache_Victim_Frames = frames;
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_test_resident
+// Description  : Check the slot accounting of every shard and count the
+//                resident frames
+//
+// Inputs       : none
+// Outputs      : resident frames, or -1 if a shard's slots do not add up
+
+static int cache_test_resident(void) {
+	struct cache_shard *sh;
+	uint32_t i, resident = 0, total = 0;
+
+	for (i = 0; i < Cache_Nshards; i++) {
+		sh = &Cache_Shards[i];
+		if (sh->data_avail + sh->lists[CACHE_RECENT].count + sh->lists[CACHE_FREQUENT].count != sh->max_frames)
+			return (-1);
+		resident += sh->max_frames - sh->data_avail;
+		total += sh->max_frames;
+	}
+	return ((total == Cache_Max_Frames) ? (int)resident : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_test_resize
+// Description  : Grow and shrink a running cache, checking that a grow keeps
+//                every frame and a shrink keeps the most recent and pinned
+//                ones
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_test_resize(void) {
+	CartCacheStats before, after;
+	CartFrameIndex pf;
+	char *pinned = NULL;
+	int ret = -1, resident;
+	uint32_t i;
+
+	Cache_Policy = CART_CACHE_LRU;
+	Cache_Max_Frames = 256;
+	if (init_cart_cache() != 0)
+		return (-1);
+	pf = 0;
+	cache_test_access(2, pf);
+	if ((pinned = pin_cart_cache(2, pf)) == NULL)
+		goto done;
+	for (i = 1; i < 256; i++)
+		cache_test_access(2, i);
+	resident = cache_test_resident();
+	cart_cache_stats(&before);
+
+	// Growing keeps everything, and nothing is evicted to make room
+	if (resize_cart_cache(1024) != 0 || cache_test_resident() != resident)
+		goto done;
+	for (i = 0; i < 256; i++) {
+		if (cache_test_access(2, i) == -1)
+			goto done;
+	}
+	cart_cache_stats(&after);
+	if (after.evictions != before.evictions || after.hits - before.hits != (uint64_t)resident)
+		goto done;
+
+	// Shrinking evicts the least recent, the hot and pinned frames stay put
+	for (i = 0; i < 512; i++)
+		cache_test_access(3, i);
+	for (i = 0; i < 8; i++)
+		cache_test_access(4, i);
+	if (resize_cart_cache(64) != 0 || Cache_Max_Frames != 64)
+		goto done;
+	resident = cache_test_resident();
+	if (resident < 9 || resident > 64 || get_cart_cache(2, pf) != pinned)
+		goto done;
+	for (i = 0; i < 8; i++) {
+		if (cache_test_access(4, i) != 1)
+			goto done;
+	}
+	for (i = 0; i < 512; i++) {
+		if (cache_test_access(3, i) == -1)
+			goto done;
+	}
+
+	// Growing again reuses the returned slots
+	if (resize_cart_cache(300) != 0)
+		goto done;
+	for (i = 0; i < 1024; i++) {
+		if (cache_test_access(5, i) == -1)
+			goto done;
+	}
+	if (cache_test_resident() == 300 && get_cart_cache(2, pf) == pinned
+			&& pinned[0] == (char)(2 * 31 + pf) && pinned[CART_FRAME_SIZE-1] == (char)(2 * 31 + pf))
+		ret = 0;
+	unpin_cart_cache(2, pf);
+
+done:
+	if (ret != 0)
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: online resize (%u frames)", Cache_Max_Frames);
+	close_cart_cache();
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_test_thread
+// Description  : Worker for the threaded test: pins, fills and overwrites
+//                frames of its own cartridge, checking every hit
+//
+// Inputs       : arg - the thread's cartridge number
+// Outputs      : number of bad frames seen
+
+#define CACHE_TEST_THREADS 4
+
+static void * cache_test_thread(void *arg) {
+	CartridgeIndex cart = (CartridgeIndex)(uintptr_t)arg;
+	char frame[CART_FRAME_SIZE], *cached;
+	uint32_t i, seed = cart + 1;
+	uintptr_t errors = 0;
+	CartFrameIndex frm;
+	int hit;
+
+	for (i = 0; i < 20000; i++) {
+		seed = seed * 1103515245 + 12345;
+		frm = (seed >> 16) % 1024;
+		if ((cached = alloc_pin_cart_cache(cart, frm, &hit)) == NULL) {
+			errors++;
+			continue;
+		}
+		if (!hit)
+			memset(cached, (char)(cart * 31 + frm), CART_FRAME_SIZE);
+		else if (cached[0] != (char)(cart * 31 + frm) || cached[CART_FRAME_SIZE-1] != cached[0])
+			errors++;
+		unpin_cart_cache(cart, frm);
+		if ((seed & 0x700) == 0) {
+			memset(frame, (char)(cart * 31 + frm), CART_FRAME_SIZE);
+			put_cart_cache(cart, frm, frame);
+		}
+	}
+	return ((void *)errors);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_test_shards
+// Description  : Check a sharded cache shared by several threads
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_test_shards(void) {
+	pthread_t threads[CACHE_TEST_THREADS];
+	uintptr_t i, errors = 0;
+	void *result;
+
+	Cache_Policy = CART_CACHE_ARC;
+	Cache_Max_Frames = 1024;
+	if (init_cart_cache() != 0)
+		return (-1);
+	for (i = 0; i < CACHE_TEST_THREADS; i++)
+		pthread_create(&threads[i], NULL, cache_test_thread, (void *)i);
+	for (i = 0; i < CACHE_TEST_THREADS; i++) {
+		pthread_join(threads[i], &result);
+		errors += (uintptr_t)result;
+	}
+	if (Cache_Nshards < 2 || errors != 0) {
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: %lu bad frames over %u shards",
+			(unsigned long)errors, Cache_Nshards);
+		close_cart_cache();
+		return (-1);
+	}
+	close_cart_cache();
+	return (0);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : cartCacheUnitTest
@@ -187,8 +2393,27 @@ void * delete_cart_cache(CartridgeIndex cart, CartFrameIndex blk) {
 // Outputs      : 0 if successful, -1 if failure
 
 int cartCacheUnitTest(void) {
+	uint32_t saved_size = Cache_Max_Frames;
+	CartCachePolicy saved_policy = Cache_Policy, policy;
+	int ret = 0;
 
-	// Return successfully
-	logMessage(LOG_OUTPUT_LEVEL, "Cache unit test completed successfully.");
-	return(0);
+	// Run against a small private cache for every policy
+	close_cart_cache();
+	for (policy = 0; policy < CART_CACHE_MAXPOLICY && ret == 0; policy++) {
+		ret = cache_test_policy(policy);
+	}
+	if (ret == 0)
+		ret = cache_test_writeback();
+	if (ret == 0)
+		ret = cache_test_shards();
+	if (ret == 0)
+		ret = cache_test_resize();
+	if (ret == 0)
+		ret = cache_test_victim();
+	Cache_Max_Frames = saved_size;
+	Cache_Policy = saved_policy;
+	if (ret == 0) {
+		logMessage(LOG_OUTPUT_LEVEL, "Cache unit test completed successfully.");
+	}
+	return(ret);
 }
@@ -16,6 +16,45 @@
 
 // Defines
 #define DEFAULT_CART_FRAME_CACHE_SIZE 1024  // Default size for cache
+#define DEFAULT_CART_CACHE_SHARDS 8         // Default number of cache shards
+#define DEFAULT_CART_CACHE_VICTIM_SIZE 256  // Default compressed victim tier memory, in frames
+
+// Replacement policies
+typedef enum {
+
+	CART_CACHE_LRU   = 0,  // Least recently used
+	CART_CACHE_CLOCK = 1,  // Second chance (reference bit) approximation of LRU
+	CART_CACHE_2Q    = 2,  // 2Q, scan resistant FIFO/LRU with ghost history
+	CART_CACHE_ARC   = 3,  // Adaptive replacement cache
+	CART_CACHE_MAXPOLICY = 4 // Maximum policy value
+
+} CartCachePolicy;
+
+// Write modes
+typedef enum {
+
+	CART_CACHE_WRITETHROUGH = 0, // Every write goes to the cartridge immediately
+	CART_CACHE_WRITEBACK    = 1  // Writes dirty the cached frame, written on evict/flush
+
+} CartCacheWriteMode;
+
+// Function called to write a dirty frame back to its cartridge
+typedef int (*CartCacheFlush)(CartridgeIndex cart, CartFrameIndex frm, void *frame);
+
+// Cache counters, summed over the shards
+typedef struct {
+
+	uint64_t hits;        // lookups that found the frame resident
+	uint64_t misses;      // lookups that did not
+	uint64_t inserts;     // frames made resident
+	uint64_t evictions;   // resident frames dropped to make room
+	uint64_t writebacks;  // dirty frames written back (evict or flush)
+	uint64_t victim_hits;   // misses served from the compressed victim tier
+	uint64_t victim_stores; // evicted frames compressed into the victim tier
+	uint64_t victim_frames; // frames held compressed right now
+	uint64_t victim_bytes;  // compressed bytes held right now
+
+} CartCacheStats;
 
 ///
 // Cache Interfaces
@@ -23,6 +62,42 @@
 int set_cart_cache_size(uint32_t max_frames);
 	// Set the size of the cache (must be called before init)
 
+int resize_cart_cache(uint32_t max_frames);
+	// Resize a running cache in place, holding what the flush function needs (a shrink writes back)
+
+uint32_t cart_cache_size(void);
+	// Get the size of the cache in frames
+
+int set_cart_cache_shards(uint32_t shards);
+	// Set the number of independently locked shards (must be called before init)
+
+int set_cart_cache_victim_size(uint32_t frames);
+	// Set the memory of the compressed victim tier in frames, 0 disables (must be called before init)
+
+int set_cart_cache_policy(CartCachePolicy policy);
+	// Set the replacement policy of the cache (must be called before init)
+
+CartCachePolicy cart_cache_policy(void);
+	// Get the replacement policy of the cache
+
+int cart_cache_policy_from_name(const char *name);
+	// Translate a policy name ("lru", "clock", "2q", "arc"), -1 if unknown
+
+const char * cart_cache_policy_name(CartCachePolicy policy);
+	// Get the name of a replacement policy
+
+int set_cart_cache_write_mode(CartCacheWriteMode mode);
+	// Choose write-through or write-back caching (must be called before init)
+
+CartCacheWriteMode cart_cache_write_mode(void);
+	// Get the write mode of the cache
+
+int set_cart_cache_flush(CartCacheFlush flush);
+	// Set the function used to write dirty frames back
+
+int cart_cache_stats(CartCacheStats *stats);
+	// Get the cache counters (those of the last run once the cache is closed)
+
 int init_cart_cache(void);
 	// Initialize the cache 
 
@@ -32,8 +107,29 @@ int close_cart_cache(void);
 int put_cart_cache(CartridgeIndex cart, CartFrameIndex frm, void *frame);
 	// Put an object into the object cache, evicting other items as necessary
 
+int put_cart_cache_dirty(CartridgeIndex cart, CartFrameIndex frm, void *frame);
+	// Put a modified frame into the cache, written back on eviction or flush
+
+int flush_cart_cache_frame(CartridgeIndex cart, CartFrameIndex frm);
+	// Write back a single frame if it is dirty
+
+int flush_cart_cache(void);
+	// Write back every dirty frame, in cartridge/frame order
+
 void * get_cart_cache(CartridgeIndex dsk, CartFrameIndex blk);
-	// Get an object from the cache (and return it)
+	// Get an object from the cache (and return it), use pin if threaded
+
+void * pin_cart_cache(CartridgeIndex cart, CartFrameIndex frm);
+	// Get a cached frame and pin it, the pointer is stable until unpinned
+
+void * alloc_pin_cart_cache(CartridgeIndex cart, CartFrameIndex frm, int *hit);
+	// Make a frame resident and pinned so the caller can fill it in place
+
+int unpin_cart_cache(CartridgeIndex cart, CartFrameIndex frm);
+	// Release a pin taken by pin_cart_cache/alloc_pin_cart_cache
+
+void * delete_cart_cache(CartridgeIndex cart, CartFrameIndex blk);
+	// Remove an object from the cache
 
 //
 // Unit test
@@ -9,11 +9,14 @@
 
 // Include Files
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include <arpa/inet.h>
 
 // Project Include Files
 #include <cart_network.h>
 #include <cart_driver.h>
+#include <cmpsc311_util.h>
 
 //
 //  Global data
@@ -33,28 +36,58 @@ struct             sockaddr_in caddr;
 //
 // Functions
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_xfer
+// Description  : moves all of a buffer over the connection, going round
+//                again on short reads and writes
+//
+// Inputs       : buf - the bytes to send, or where to put those received
+//                len - the number of bytes
+//                sending - 1 to write to the server, 0 to read from it
+// Outputs      : 0 if successful, -1 if failure
+
+static int client_xfer(void *buf, size_t len, int sending) {
+	char *p = buf;
+	ssize_t n;
+	while(len > 0) {
+		n = sending ? write(client_socket, p, len) : read(client_socket, p, len);
+		if(n <= 0) {
+			printf("Error %s network data\n", sending ? "writing" : "reading");
+			return(-1);
+		}
+		p += n;
+		len -= n;
+	}
+	return(0);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : client_cart_bus_request
 // Description  : This the client operation that sends a request to the CART
 //                server process.   It will:
 //
-//                1) if INIT make a connection to the server
+//                1) if there is no connection yet make one to the server
 //                2) send any request to the server, returning results
-//                3) if CLOSE, will close the connection
+//                3) if POWOFF, will close the connection
+//
+//                The driver holds its lock around every call, so requests
+//                reach the server one at a time and in order.
 //
 // Inputs       : reg - the request reqisters for the command
 //                buf - the block to be read/written from (READ/WRITE)
-// Outputs      : the response structure encoded as needed
+// Outputs      : the response structure encoded as needed, -1 if failure
 
-int client_cart_bus_request(CartXferRegister reg, void *buf) {
+CartXferRegister client_cart_bus_request(CartXferRegister reg, void *buf) {
 	uint64_t value; //used to hold values when switching between network byte order and host byte order
+	CartXferRegister ky1 = (reg >> 56) & 0xff; //opcode, see create_cart_regstate
 	//if there is no existing connection, make a connection to the server
 	if(client_socket==-1){
 		//setting up address information
 		caddr.sin_family = AF_INET; //protocol family
-		caddr.sin_port = htons(CART_DEFAULT_PORT);
-		if( inet_aton(CART_DEFAULT_IP, &caddr.sin_addr) == 0){
+		caddr.sin_port = htons((cart_network_port != 0) ? cart_network_port : CART_DEFAULT_PORT);
+		if( inet_aton((cart_network_address != NULL) ? (char *)cart_network_address : CART_DEFAULT_IP, &caddr.sin_addr) == 0){
 			return(-1);
 		}
 		client_socket = socket(AF_INET, SOCK_STREAM, 0); //creates file handle for network and saves it in client_socket
@@ -65,91 +98,29 @@ int client_cart_bus_request(CartXferRegister reg, void *buf) {
 		//connect socket file descriptor to address, returns 0 if successfule, -1 if failed
 		if(connect(client_socket, (const struct sockaddr *)&caddr, sizeof(caddr)) ==-1) {
 			printf("Error on socket connect\n"); 
+			close(client_socket);
+			client_socket = -1;
 			return(-1);
 		}
 	}
-	//use already existing connection
-	else{
-		const struct Opcode oregstate= {0};
-		extract_cart_opcode(reg,oregstate);
-		
-		switch(oregstate.KY1){
-			case CART_OP_RDFRME:
-				value = htonll64(reg);
-				if(write(client_socket, &value, sizeof(value)) != sizeof(value)) {
-					printf("Error writing network data\n");
-					return(-1);
-				} 
-				printf("Sent a value of [%i]\n", ntohll64(value));
-				if( read( client_socket, &value, sizeof(value)) != sizeof(value)) {
-					printf("Error reading network data\n");
-					return(-1);
-				}
-				value = ntohll64(value);
-				printf("Recieved a value of [%lu]\n",value);
-				//char buf = malloc(1024);
-				if( read( client_socket, buf, sizeof(buf)) != sizeof(buf)) {
-					printf("Error reading network data\n");
-					return(-1);
-				}
-				printf("Recieved a buf of [%p]\n",buf);
-				break;
 
-			case CART_OP_WRFRME: 
-				value = htonll64(reg);
-				if(write(client_socket, &value, sizeof(value)) != sizeof(value)) {
-					printf("Error writing network data \n");
-					return(-1);
-				} 
-				printf("Sent a value of [%d]\n", ntohll64(value));
-				////////////////////////////////////////////////////////////////////////////////////////
-				//char buf = malloc(1024);
-				if(write(client_socket,buf, sizeof(buf)) != sizeof(buf)) {
-					printf("Error writing network data\n");
-					return(-1);
-				}
-				/////////////////////////////////////////////////////////////////////////////////////////
-				if( read( client_socket, &value, sizeof(value)) != sizeof(value)) {
-					printf("Error reading network data\n");
-					return(-1);
-				}
-				value = ntohll64(value);
-				printf("Recieved a value of [%lu]\n",value);
-				break;
+	//the request, then a frame for a write
+	value = htonll64(reg);
+	if(client_xfer(&value, sizeof(value), 1) == -1)
+		return(-1);
+	if(ky1 == CART_OP_WRFRME && client_xfer(buf, CART_FRAME_SIZE, 1) == -1)
+		return(-1);
 
-			case CART_OP_POWOFF:
-				value = htonll64(reg);
-				if(write(client_socket, &value, sizeof(value)) != sizeof(value)) {
-					printf("Error writing network data\n");
-					return(-1);
-				} 
-				printf("Sent a value of [%d]\n", ntohll64(value));
-				if( read( client_socket, &value, sizeof(value)) != sizeof(value)) {
-					printf("Error reading network data \n");
-					return(-1);
-				}
-				value = ntohll64(value);
-				printf("Recieved a value of [%lu]\n",value);
-				close(client_socket);
-				client_socket = -1; 
-				break;
-
-			default:
-				value = htonll64(reg);
-				if(write(client_socket, &value, sizeof(value)) != sizeof(value)) {
-					printf("Error writing network data \n");
-					return(-1);
-				} 
-				printf("Sent a value of [%d]\n", ntohll64(value));
-				if( read( client_socket, &value, sizeof(value)) != sizeof(value)) {
-					printf("Error reading network data\n");
-					return(-1);
-				}
-				value = ntohll64(value);
-				printf("Recieved a value of [%lu]\n",value);
-				break;
-		}
+	//the response, then a frame for a read
+	if(client_xfer(&value, sizeof(value), 0) == -1)
+		return(-1);
+	value = ntohll64(value);
+	if(ky1 == CART_OP_RDFRME && client_xfer(buf, CART_FRAME_SIZE, 0) == -1)
+		return(-1);
 
+	if(ky1 == CART_OP_POWOFF) {
+		close(client_socket);
+		client_socket = -1; 
 	}
-	return(0);
+	return(value);
 }
@@ -0,0 +1,233 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_dedup.c
+//  Description    : This is the implementation of the frame fingerprint
+//                   index, a chained hash table with an entry per frame.
+//
+//  Author         : [Jacob Hohenstein]
+//  Last Modified  : [10/16/2016]
+//
+
+// Includes
+#include <string.h>
+#include <stdlib.h>
+
+// Project includes
+#include <cart_dedup.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define DEDUP_FRAMES (CART_MAX_CARTRIDGES * CART_CARTRIDGE_SIZE)
+#define DEDUP_SLOT(blk) (CART_BLOCK_CART(blk) * CART_CARTRIDGE_SIZE + CART_BLOCK_FRAME(blk))
+#define DEDUP_BLOCK(slot) CART_BLOCK((slot) / CART_CARTRIDGE_SIZE, (slot) % CART_CARTRIDGE_SIZE)
+
+// The index entry of a frame, chained from the bucket of its fingerprint
+struct dedup_entry {
+	uint64_t hash;     // fingerprint of the contents
+	uint32_t next;     // next entry of the chain plus one, 0 at the end
+	uint8_t  indexed;  // the frame is in the index
+};
+
+//
+// Global data
+
+uint32_t Dedup_Heads[CART_DEDUP_BUCKETS];      // first entry of each chain plus one, 0 if empty
+struct dedup_entry Dedup_Entries[DEDUP_FRAMES];  // by cartridge, then frame
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dedup_bucket
+// Description  : Get the chain of a fingerprint
+//
+// Inputs       : hash - the fingerprint
+// Outputs      : the bucket
+
+static uint32_t dedup_bucket(uint64_t hash) {
+	return ((uint32_t)(hash >> 32) % CART_DEDUP_BUCKETS);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_dedup_init
+// Description  : Empty the index
+//
+// Inputs       : none
+// Outputs      : none
+
+void cart_dedup_init(void) {
+	memset(Dedup_Heads, 0, sizeof(Dedup_Heads));
+	memset(Dedup_Entries, 0, sizeof(Dedup_Entries));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_dedup_hash
+// Description  : Fingerprint a frame, eight bytes at a time, each word mixed
+//                in with a multiply so reordered words hash apart
+//
+// Inputs       : frame - the contents
+// Outputs      : the fingerprint
+
+uint64_t cart_dedup_hash(const void *frame) {
+	const char *p = frame;
+	uint64_t h = 0x9e3779b97f4a7c15ULL, w;
+	int i;
+
+	for (i = 0; i < CART_FRAME_SIZE; i += sizeof(w)) {
+		memcpy(&w, p + i, sizeof(w));
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 29;
+	}
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	return (h ^ (h >> 32));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_dedup_is_zero
+// Description  : Check a frame holds only zeros
+//
+// Inputs       : frame - the contents
+// Outputs      : 1 if it does, 0 if not
+
+int cart_dedup_is_zero(const void *frame) {
+	const char *p = frame;
+	uint64_t w, any = 0;
+	int i;
+
+	for (i = 0; i < CART_FRAME_SIZE; i += sizeof(w)) {
+		memcpy(&w, p + i, sizeof(w));
+		any |= w;
+	}
+	return (any == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_dedup_find
+// Description  : Find the frame last indexed with a fingerprint
+//
+// Inputs       : hash - the fingerprint
+// Outputs      : the frame, CART_BLOCK_NONE if none
+
+CartBlock cart_dedup_find(uint64_t hash) {
+	uint32_t e;
+
+	for (e = Dedup_Heads[dedup_bucket(hash)]; e != 0; e = Dedup_Entries[e - 1].next) {
+		if (Dedup_Entries[e - 1].hash == hash)
+			return (DEDUP_BLOCK(e - 1));
+	}
+	return (CART_BLOCK_NONE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_dedup_insert
+// Description  : Index a frame, at the head of its chain so it is the one
+//                found for its fingerprint
+//
+// Inputs       : hash - the fingerprint of its contents
+//                block - the frame
+// Outputs      : none
+
+void cart_dedup_insert(uint64_t hash, CartBlock block) {
+	uint32_t slot = DEDUP_SLOT(block), bucket = dedup_bucket(hash);
+
+	cart_dedup_remove(block);
+	Dedup_Entries[slot].hash = hash;
+	Dedup_Entries[slot].next = Dedup_Heads[bucket];
+	Dedup_Entries[slot].indexed = 1;
+	Dedup_Heads[bucket] = slot + 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_dedup_remove
+// Description  : Unlink a frame from its chain, if it is indexed
+//
+// Inputs       : block - the frame
+// Outputs      : none
+
+void cart_dedup_remove(CartBlock block) {
+	uint32_t slot, *link;
+
+	if (block == CART_BLOCK_NONE || !Dedup_Entries[slot = DEDUP_SLOT(block)].indexed)
+		return;
+	for (link = &Dedup_Heads[dedup_bucket(Dedup_Entries[slot].hash)]; *link != slot + 1; link = &Dedup_Entries[*link - 1].next)
+		;
+	*link = Dedup_Entries[slot].next;
+	Dedup_Entries[slot].indexed = 0;
+}
+
+//
+// Unit test
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cartDedupUnitTest
+// Description  : Fingerprint distinct and equal frames, find, replace and
+//                remove frames sharing a chain
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int cartDedupUnitTest(void) {
+	char a[CART_FRAME_SIZE], b[CART_FRAME_SIZE];
+	uint64_t ha, hb;
+	uint32_t i;
+
+	// Zeros are spotted, a single byte or moved word changes the fingerprint
+	memset(a, 0, sizeof(a));
+	memcpy(b, a, sizeof(b));
+	if (!cart_dedup_is_zero(a) || cart_dedup_hash(a) != cart_dedup_hash(b)) {
+		logMessage(LOG_ERROR_LEVEL, "Dedup unit test failed: zero frame.");
+		return (-1);
+	}
+	b[CART_FRAME_SIZE - 1] = 1;
+	for (i = 0; i < sizeof(a); i++)
+		a[i] = (char)getRandomValue(0, 255);
+	ha = cart_dedup_hash(a);
+	if (cart_dedup_is_zero(b) || cart_dedup_hash(b) == cart_dedup_hash(a) || ha == cart_dedup_hash(b)) {
+		logMessage(LOG_ERROR_LEVEL, "Dedup unit test failed: frames not told apart.");
+		return (-1);
+	}
+	memcpy(b, a + 8, 8);
+	memcpy(b + 8, a, 8);
+	memcpy(b + 16, a + 16, sizeof(b) - 16);
+	if (memcmp(a, b, 16) != 0 && cart_dedup_hash(b) == ha) {
+		logMessage(LOG_ERROR_LEVEL, "Dedup unit test failed: reordered words collide.");
+		return (-1);
+	}
+
+	// Frames in one chain are found, replaced and removed independently
+	cart_dedup_init();
+	hb = ha + ((uint64_t)CART_DEDUP_BUCKETS << 32);
+	cart_dedup_insert(ha, CART_BLOCK(3, 7));
+	cart_dedup_insert(hb, CART_BLOCK(9, 1));
+	cart_dedup_insert(ha, CART_BLOCK(60, 1023));
+	if (cart_dedup_find(ha) != CART_BLOCK(60, 1023) || cart_dedup_find(hb) != CART_BLOCK(9, 1)
+			|| cart_dedup_find(ha + 1) != CART_BLOCK_NONE) {
+		logMessage(LOG_ERROR_LEVEL, "Dedup unit test failed: lookup wrong.");
+		return (-1);
+	}
+	cart_dedup_remove(CART_BLOCK(60, 1023));
+	cart_dedup_remove(CART_BLOCK(60, 1023));
+	if (cart_dedup_find(ha) != CART_BLOCK(3, 7) || cart_dedup_find(hb) != CART_BLOCK(9, 1)) {
+		logMessage(LOG_ERROR_LEVEL, "Dedup unit test failed: remove broke the chain.");
+		return (-1);
+	}
+	cart_dedup_insert(hb, CART_BLOCK(3, 7));
+	cart_dedup_remove(CART_BLOCK(9, 1));
+	if (cart_dedup_find(ha) != CART_BLOCK_NONE || cart_dedup_find(hb) != CART_BLOCK(3, 7)) {
+		logMessage(LOG_ERROR_LEVEL, "Dedup unit test failed: reindexed frame kept.");
+		return (-1);
+	}
+	cart_dedup_init();
+
+	logMessage(LOG_INFO_LEVEL, "Dedup unit test completed successfully.");
+	return (0);
+}
@@ -0,0 +1,47 @@
+#ifndef CART_DEDUP_INCLUDED
+#define CART_DEDUP_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_dedup.h
+//  Description    : This is the header file for the frame fingerprint index,
+//                   which finds a cartridge frame already holding the
+//                   contents of a frame about to be written.
+//
+//  Author         : [Jacob Hohenstein]
+//  Last Modified  : [10/16/2016]
+//
+
+// Includes
+#include <stdint.h>
+#include <cart_controller.h>
+#include <cart_blockmap.h>
+
+// Defines
+#define CART_DEDUP_BUCKETS 16384  // index chains, about four frames each on a full device
+
+///
+// Fingerprint Index Interfaces (callers serialize, the driver holds driver_lock)
+
+void cart_dedup_init(void);
+	// Empty the index
+
+uint64_t cart_dedup_hash(const void *frame);
+	// Fingerprint the contents of a frame
+
+int cart_dedup_is_zero(const void *frame);
+	// 1 if every byte of a frame is zero
+
+CartBlock cart_dedup_find(uint64_t hash);
+	// The frame last indexed with a fingerprint, CART_BLOCK_NONE if none (compare before sharing it)
+
+void cart_dedup_insert(uint64_t hash, CartBlock block);
+	// Index a frame by the fingerprint of its contents, replacing any it had
+
+void cart_dedup_remove(CartBlock block);
+	// Drop a frame from the index, its contents are changing or it is free
+
+int cartDedupUnitTest(void);
+	// Run a UNIT test checking the fingerprint index implementation
+
+#endif
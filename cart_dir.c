@@ -0,0 +1,322 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_dir.c
+//  Description    : This is the implementation of the directory blocks.
+//
+//  Author         : [Jacob Hohenstein]
+//  Last Modified  : [10/16/2016]
+//
+
+// Includes
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+// Project includes
+#include <cart_dir.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Block Format
+//
+// A bucket is one frame.  It starts with a header of the bytes in use
+// (header included), the number of entries and the number of buckets the
+// directory had when the block was written, each little endian.  Entries
+// follow back to back: the 4 byte hash of the name, the 2 byte id, a type
+// byte, a length byte and the name itself, without a NUL.  A frame of
+// zeroes reads as an empty bucket.
+//
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dir_get16/dir_get32/dir_put16/dir_put32
+// Description  : Read and write the little endian fields of a block
+//
+// Inputs       : p - the field
+//                v - the value to write
+// Outputs      : the value read
+
+static uint16_t dir_get16(const char *p) {
+	return ((uint16_t)((uint8_t)p[0] | ((uint8_t)p[1] << 8)));
+}
+
+static uint32_t dir_get32(const char *p) {
+	return ((uint32_t)dir_get16(p) | ((uint32_t)dir_get16(p + 2) << 16));
+}
+
+static void dir_put16(char *p, uint16_t v) {
+	p[0] = (char)(v & 0xff);
+	p[1] = (char)(v >> 8);
+}
+
+static void dir_put32(char *p, uint32_t v) {
+	dir_put16(p, (uint16_t)(v & 0xffff));
+	dir_put16(p + 2, (uint16_t)(v >> 16));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dir_used
+// Description  : Get the bytes in use of a block, treating a zeroed or
+//                damaged header as an empty block
+//
+// Inputs       : block - the block
+// Outputs      : bytes in use, header included
+
+static int dir_used(const char *block) {
+	int used = dir_get16(block);
+	return ((used < CART_DIR_HEADER || used > CART_FRAME_SIZE) ? CART_DIR_HEADER : used);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_dir_hash
+// Description  : Hash a name (FNV-1a), the low bits pick its bucket
+//
+// Inputs       : name - the name
+//                len - its length
+// Outputs      : the hash
+
+uint32_t cart_dir_hash(const char *name, size_t len) {
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (uint8_t)name[i];
+		h *= 16777619u;
+	}
+	return (h);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_dir_block_init
+// Description  : Make an empty bucket
+//
+// Inputs       : block - the frame to fill
+//                nbuckets - buckets in the directory
+// Outputs      : none
+
+void cart_dir_block_init(char *block, uint32_t nbuckets) {
+	memset(block, 0, CART_FRAME_SIZE);
+	dir_put16(block, CART_DIR_HEADER);
+	dir_put32(block + 4, nbuckets);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_dir_block_buckets
+// Description  : Get the number of buckets recorded in a block
+//
+// Inputs       : block - the block
+// Outputs      : the number of buckets
+
+uint32_t cart_dir_block_buckets(const char *block) {
+	return (dir_get32(block + 4));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_dir_block_next
+// Description  : Read the entry at or after an offset and move past it
+//
+// Inputs       : block - the block
+//                offset - the offset, 0 for the first entry, advanced
+//                rec - the entry read
+// Outputs      : 1 if an entry was read, 0 at the end of the block
+
+int cart_dir_block_next(const char *block, int *offset, CartDirRecord *rec) {
+	int used = dir_used(block), at = (*offset < CART_DIR_HEADER) ? CART_DIR_HEADER : *offset;
+
+	if (at + CART_DIR_ENTRY_HEADER > used)
+		return (0);
+	rec->hash = dir_get32(block + at);
+	rec->id = (int16_t)dir_get16(block + at + 4);
+	rec->type = (uint8_t)block[at + 6];
+	rec->len = (uint8_t)block[at + 7];
+	rec->name = block + at + CART_DIR_ENTRY_HEADER;
+	if (at + CART_DIR_ENTRY_HEADER + rec->len > used)
+		return (0);
+	*offset = at + CART_DIR_ENTRY_HEADER + rec->len;
+	return (1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_dir_block_find
+// Description  : Find a name in a bucket, comparing hashes before names
+//
+// Inputs       : block - the block
+//                hash - cart_dir_hash of the name
+//                name - the name
+//                len - its length
+//                rec - the entry found (may be NULL)
+// Outputs      : offset of the entry, -1 if it is not there
+
+int cart_dir_block_find(const char *block, uint32_t hash, const char *name, size_t len, CartDirRecord *rec) {
+	CartDirRecord r;
+	int offset = 0, at;
+
+	for (at = CART_DIR_HEADER; cart_dir_block_next(block, &offset, &r); at = offset) {
+		if (r.hash == hash && r.len == len && memcmp(r.name, name, len) == 0) {
+			if (rec != NULL)
+				*rec = r;
+			return (at);
+		}
+	}
+	return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_dir_block_add
+// Description  : Add an entry to the end of a bucket
+//
+// Inputs       : block - the block
+//                hash - cart_dir_hash of the name
+//                name - the name
+//                len - its length
+//                id - what it refers to
+//                type - CART_DIR_FILE or CART_DIR_DIRECTORY
+// Outputs      : 0 if successful, -1 if the bucket is full (or name too long)
+
+int cart_dir_block_add(char *block, uint32_t hash, const char *name, size_t len, int16_t id, uint8_t type) {
+	int used = dir_used(block);
+	char *e = block + used;
+
+	if (len > CART_DIR_MAX_NAME || used + CART_DIR_ENTRY_HEADER + (int)len > CART_FRAME_SIZE)
+		return (-1);
+	dir_put32(e, hash);
+	dir_put16(e + 4, (uint16_t)id);
+	e[6] = (char)type;
+	e[7] = (char)len;
+	memcpy(e + CART_DIR_ENTRY_HEADER, name, len);
+	dir_put16(block, (uint16_t)(used + CART_DIR_ENTRY_HEADER + len));
+	dir_put16(block + 2, dir_get16(block + 2) + 1);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_dir_block_remove
+// Description  : Remove an entry, closing the gap behind it
+//
+// Inputs       : block - the block
+//                offset - the entry, as returned by cart_dir_block_find
+// Outputs      : none
+
+void cart_dir_block_remove(char *block, int offset) {
+	int used = dir_used(block), size = CART_DIR_ENTRY_HEADER + (uint8_t)block[offset + 7];
+
+	memmove(block + offset, block + offset + size, used - offset - size);
+	memset(block + used - size, 0, size);
+	dir_put16(block, (uint16_t)(used - size));
+	dir_put16(block + 2, dir_get16(block + 2) - 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_dir_block_split
+// Description  : Split a bucket as its directory doubles: bucket i becomes
+//                buckets i and i + nbuckets, chosen by the next hash bit
+//
+// Inputs       : block - the bucket
+//                lo - the new bucket i
+//                hi - the new bucket i + nbuckets
+//                nbuckets - buckets before the doubling
+// Outputs      : none
+
+void cart_dir_block_split(const char *block, char *lo, char *hi, uint32_t nbuckets) {
+	CartDirRecord r;
+	int offset = 0;
+
+	cart_dir_block_init(lo, nbuckets * 2);
+	cart_dir_block_init(hi, nbuckets * 2);
+	while (cart_dir_block_next(block, &offset, &r))
+		cart_dir_block_add((r.hash & nbuckets) ? hi : lo, r.hash, r.name, r.len, r.id, r.type);
+}
+
+//
+// Unit test
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cartDirUnitTest
+// Description  : Fill a bucket, find and remove entries, split it and read
+//                damaged blocks
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int cartDirUnitTest(void) {
+	char block[CART_FRAME_SIZE], lo[CART_FRAME_SIZE], hi[CART_FRAME_SIZE], name[32];
+	CartDirRecord rec;
+	int i, n, offset;
+
+	// Fill a bucket until it says it is full, every name is found
+	cart_dir_block_init(block, 1);
+	for (n = 0; ; n++) {
+		snprintf(name, sizeof(name), "entry%d", n);
+		if (cart_dir_block_add(block, cart_dir_hash(name, strlen(name)), name, strlen(name), (int16_t)n, n % 2) != 0)
+			break;
+	}
+	if (n < 50) {
+		logMessage(LOG_ERROR_LEVEL, "Directory unit test failed: bucket held %d entries.", n);
+		return (-1);
+	}
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "entry%d", i);
+		if (cart_dir_block_find(block, cart_dir_hash(name, strlen(name)), name, strlen(name), &rec) == -1
+				|| rec.id != i || rec.type != i % 2) {
+			logMessage(LOG_ERROR_LEVEL, "Directory unit test failed: entry %d lost.", i);
+			return (-1);
+		}
+	}
+
+	// Removing entries keeps the rest, and makes room again
+	for (i = 0; i < n; i += 3) {
+		snprintf(name, sizeof(name), "entry%d", i);
+		cart_dir_block_remove(block, cart_dir_block_find(block, cart_dir_hash(name, strlen(name)), name, strlen(name), NULL));
+	}
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "entry%d", i);
+		if ((cart_dir_block_find(block, cart_dir_hash(name, strlen(name)), name, strlen(name), NULL) == -1) != (i % 3 == 0)) {
+			logMessage(LOG_ERROR_LEVEL, "Directory unit test failed: remove of entry %d.", i);
+			return (-1);
+		}
+	}
+	if (cart_dir_block_add(block, 0, "again", 5, 1, CART_DIR_FILE) != 0)
+		return (-1);
+
+	// A split sends every entry to the bucket its next hash bit picks
+	cart_dir_block_split(block, lo, hi, 1);
+	for (i = 0; i < 2; i++) {
+		for (offset = 0; cart_dir_block_next(i ? hi : lo, &offset, &rec); ) {
+			if ((rec.hash & 1) != (uint32_t)i || cart_dir_block_find(block, rec.hash, rec.name, rec.len, NULL) == -1)
+				return (-1);
+		}
+		if (cart_dir_block_buckets(i ? hi : lo) != 2)
+			return (-1);
+	}
+
+	// Zeroed and damaged blocks read as (at worst short) buckets
+	memset(block, 0, sizeof(block));
+	offset = 0;
+	if (cart_dir_block_next(block, &offset, &rec) != 0 || cart_dir_block_add(block, 7, "x", 1, 1, CART_DIR_FILE) != 0)
+		return (-1);
+	for (i = 0; i < 1000; i++) {
+		block[getRandomValue(0, CART_FRAME_SIZE - 1)] = (char)getRandomValue(0, 255);
+		for (offset = 0, n = 0; cart_dir_block_next(block, &offset, &rec); n++) {
+			if (offset > CART_FRAME_SIZE)
+				return (-1);
+		}
+	}
+
+	logMessage(LOG_INFO_LEVEL, "Directory unit test completed successfully.");
+	return (0);
+}
@@ -0,0 +1,72 @@
+#ifndef CART_DIR_INCLUDED
+#define CART_DIR_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_dir.h
+//  Description    : This is the header file for the directory blocks, the
+//                   on-cartridge format of a directory.  A directory is an
+//                   array of hashed buckets, one frame each, and a name is
+//                   found by reading the single bucket its hash selects.
+//
+//  Author         : [Jacob Hohenstein]
+//  Last Modified  : [10/16/2016]
+//
+
+// Includes
+#include <stdint.h>
+#include <stddef.h>
+#include <cart_controller.h>
+
+// Defines
+#define CART_DIR_HEADER 8            // block header: used bytes, entries, buckets
+#define CART_DIR_ENTRY_HEADER 8      // entry header: hash, id, type, name length
+#define CART_DIR_MAX_NAME 255        // longest name an entry holds
+#define CART_DIR_MAX_BUCKETS 8192    // largest directory, in frames
+
+// Entry types
+#define CART_DIR_FILE 0
+#define CART_DIR_DIRECTORY 1
+
+// An entry decoded from a block, name points into the block
+typedef struct {
+
+	uint32_t    hash;  // cart_dir_hash of the name
+	int16_t     id;    // file handle of what the name refers to
+	uint8_t     type;  // CART_DIR_FILE or CART_DIR_DIRECTORY
+	uint8_t     len;   // length of the name, not NUL terminated
+	const char *name;
+
+} CartDirRecord;
+
+///
+// Directory Block Interfaces
+
+uint32_t cart_dir_hash(const char *name, size_t len);
+	// Hash a name, the low bits pick its bucket
+
+void cart_dir_block_init(char *block, uint32_t nbuckets);
+	// Make an empty bucket of a directory with nbuckets buckets
+
+uint32_t cart_dir_block_buckets(const char *block);
+	// Get the number of buckets recorded in a block
+
+int cart_dir_block_find(const char *block, uint32_t hash, const char *name, size_t len, CartDirRecord *rec);
+	// Find a name in a bucket, the entry offset or -1 if it is not there
+
+int cart_dir_block_add(char *block, uint32_t hash, const char *name, size_t len, int16_t id, uint8_t type);
+	// Add an entry to a bucket, -1 if the bucket is full
+
+void cart_dir_block_remove(char *block, int offset);
+	// Remove the entry at an offset returned by cart_dir_block_find
+
+int cart_dir_block_next(const char *block, int *offset, CartDirRecord *rec);
+	// Read the entry at or after *offset (0 to start) and move past it, 0 at the end
+
+void cart_dir_block_split(const char *block, char *lo, char *hi, uint32_t nbuckets);
+	// Split a bucket of a doubling directory, entries with the hash bit nbuckets go to hi
+
+int cartDirUnitTest(void);
+	// Run a UNIT test checking the directory block implementation
+
+#endif
@@ -9,14 +9,31 @@
 //
 
 // Includes
+#define _GNU_SOURCE //memfd_create, and the error checking driver_lock
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 
 // Project Includes
 #include <cart_driver.h>
 #include <cart_controller.h>
 #include <cart_cache.h>
+#include <cart_blockmap.h>
+#include <cart_alloc.h>
+#include <cart_names.h>
+#include <cart_dir.h>
+#include <cart_meta.h>
+#include <cart_dedup.h>
+#include <cart_lz.h>
+#include <cart_pack.h>
+#include <cart_network.h>
 #include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
 
 //structure for the 5 elements in the opcode register
 typedef struct {
@@ -34,21 +51,164 @@ struct Frame {
 	CartFrameIndex frame_index;
 };
 
+//the part of one frame a read or write touches, see plan_frame_ops
+struct FrameOp {
+	CartBlock blk;     //cartridge frame
+	uint32_t idx;      //frame of the file
+	int seg;           //the caller's buffer its first byte is in
+	uint32_t seg_off;  //and where in that buffer
+	int16_t frame_pos; //first byte of the frame involved
+	int16_t bytes;     //bytes of the frame involved
+	int fresh;         //frame newly allocated by this write, nothing to read
+	int req;           //the request of a ring batch it serves, see async_run_plan
+};
+#define CART_FRAME_OPS_STACK 16 //requests spanning more frames allocate their ops
+
 struct File {
-	char file_path[CART_MAX_TOTAL_FILES];
+	const char *file_name; //name within its directory, interned in file_names
+	int16_t parent;        //directory holding the file
+	int is_dir;            //a directory, its frames are hashed buckets (cart_dir.h)
+	uint32_t dir_buckets;  //buckets of a directory, a power of two
+	uint32_t dir_entries;  //names in a directory
 	int current_pos;
 	int end_pos;
 	int file_open;
-	struct Frame FrameList[CART_CARTRIDGE_SIZE];
-	int frame_list_index;
+	CartBlockMap map; //cartridge frame of each frame of the file
+	CartDriverStats stats;
+	int ra_prev;     //last frame of the file read, -1 if none yet
+	int ra_start;    //first frame of the current readahead window
+	int ra_size;     //frames in the window, 0 while the reads look random
+	int ra_async;    //reading the last ra_async frames of the window queues the next
+	char *wbuf;      //frame a partial write ended in, later partial writes to it gather here
+	int wbuf_idx;    //frame of the file in wbuf, -1 if none
+	int wbuf_dirty;  //wbuf holds bytes the cartridge does not have yet
+	int mapped;      //cart_mmap views of the file, it cannot be closed while any remain
+	uint32_t meta_frames; //frames of the map the journal or checkpoint has, later ones are logged at commit
+	int meta_size;        //end_pos as the journal or checkpoint has it
+	int compressed;       //frames are compressed and packed into the frames of the map (cart_pack.h)
+	CartPackIndex pack;   //where each frame of a compressed file is packed
+	char *pack_buf;       //the open slot of a compressed file, stored when it closes
+	int pack_dirty;       //pack_buf holds bytes the cartridge does not have yet
+};
+
+//a run of file frames for the readahead thread to bring into the cache
+struct Readahead {
+	int16_t fd;
+	int first;
+	int count;
 };
 
 struct File FileArray[CART_MAX_TOTAL_FILES]; //an array of struct file will contain all the file data
 int file_counter;
+CartNames file_names; //(directory, name) to file handle, caches the directory blocks
+int16_t root_dir; //file handle of the root directory
+int16_t free_files[CART_MAX_TOTAL_FILES]; //handles of removed files, reused first
+int free_file_count;
+
+CartDriverStats driver_stats; //counters for the whole driver
+int16_t stats_fd = CART_ALL_FILES; //file being serviced, charged for its bus work
+
+//counts an event for the driver and for the file being serviced
+#define COUNT_STAT(field, n) do { \
+		driver_stats.field += (n); \
+		if (stats_fd != CART_ALL_FILES) \
+			FileArray[stats_fd].stats.field += (n); \
+	} while (0)
+
+CartridgeIndex loaded_cartridge= CART_NO_CARTRIDGE; //keeps track of what cartirdge is currently loaded
+
+//frames written since poweron, a bit per frame; the cartridges are not zeroed
+//at poweron, so a frame never written reads as zeros without touching the bus
+uint64_t written_frames[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE / 64];
+#define FRAME_WRITTEN(cart, frm) ((written_frames[cart][(frm) / 64] >> ((frm) % 64)) & 1)
+#define MARK_WRITTEN(cart, frm) (written_frames[cart][(frm) / 64] |= (uint64_t)1 << ((frm) % 64))
 
-CartridgeIndex loaded_cartridge= -1;           //keeps track of what cartirdge is currently loaded
-CartridgeIndex avail_cart;
-CartFrameIndex avail_frame;
+//the metadata journal (cart_meta.h): each change to the namespace is logged
+//in journal_frame once made, the frames and sizes of files when committed
+//(see meta_commit); the frame is written to its slot of the ring by
+//cart_fsync and when it fills; when the ring fills, and at poweroff, a
+//checkpoint of the whole table is written and the ring restarts
+char journal_frame[CART_FRAME_SIZE];
+uint32_t journal_seq;  //sequence number of journal_frame, in slot journal_seq - superblock.sequence
+int journal_dirty;     //journal_frame holds records not written yet
+int journal_frees;     //and they free frames, which must not be overwritten before it is
+int journal_replaying; //a remount is applying records, they are not logged again
+CartMetaSuper superblock;     //as last written
+CartBlock *checkpoint_frames; //frames of the last checkpoint, freed once the next is written
+uint32_t checkpoint_count;
+int32_t format_on_poweron; //cart_set_format, start with an empty file system
+
+//frames of files are stored once: a file frame of all zeros is a hole, one
+//whose contents a cached frame already holds shares it (cart_dedup.h); a
+//shared frame is copied when one of its files next writes it
+uint32_t dedup_enabled = 1; //cart_set_dedup
+char zero_frame[CART_FRAME_SIZE]; //what a hole reads as
+
+//every interface call and each readahead frame hold driver_lock, so the bus,
+//the file table and the counters have one user at a time; it is taken
+//before any cache shard lock (error checking, so a page fault on a view
+//inside a driver call is caught rather than deadlocking, see map_fault)
+pthread_mutex_t driver_lock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+
+//readahead windows queued by cart_read for the readahead thread
+#define CART_READAHEAD_INIT 4     //frames in the first window of a sequential reader
+#define CART_READAHEAD_QUEUE 64   //queued windows, more are dropped
+uint32_t readahead_max = CART_READAHEAD_MAX;
+struct Readahead readahead_queue[CART_READAHEAD_QUEUE];
+uint32_t readahead_head, readahead_tail; //next slot to fill, next to service
+int readahead_running, readahead_stop;
+pthread_t readahead_thread;
+pthread_mutex_t readahead_lock = PTHREAD_MUTEX_INITIALIZER; //taken after driver_lock, never before
+pthread_cond_t readahead_cond = PTHREAD_COND_INITIALIZER;
+
+//requests queued by cart_submit for the async thread and their completions;
+//a request keeps its slot in both rings until it is reaped, so neither overflows
+CartSqe async_sq[CART_RING_ENTRIES];
+CartCqe async_cq[CART_RING_ENTRIES];
+uint32_t async_sq_head, async_sq_tail; //next submission slot to fill, next to run
+uint32_t async_cq_head, async_cq_tail; //next completion slot to fill, next to reap
+int async_running, async_stop;
+pthread_t async_thread;
+pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER; //never held while taking driver_lock
+pthread_cond_t async_submit_cond = PTHREAD_COND_INITIALIZER; //requests queued, or stopping
+pthread_cond_t async_done_cond = PTHREAD_COND_INITIALIZER;   //requests completed
+
+//the compaction thread moves the frames of a fragmented file into one run
+//of a cartridge, a batch at a time and only while nothing else has used the
+//driver since its last batch (see compact_worker)
+#define CART_COMPACT_INTERVAL 100 //milliseconds between batches
+#define CART_COMPACT_BATCH 64     //most frames moved in a batch
+#define CART_COMPACT_SCAN 32      //files looked at in a batch for one to compact
+uint32_t compact_rate = CART_COMPACT_RATE; //cart_set_compaction, frames moved a second
+int compact_running, compact_stop;
+pthread_t compact_thread;
+pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER; //never held while taking driver_lock
+pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
+uint64_t compact_activity; //driver counters as the last batch left them
+int16_t compact_fd = -1;   //file being compacted, -1 for none
+int16_t compact_scan;      //next file to look at for one
+CartBlock compact_run;     //the frames reserved for it
+uint32_t compact_count;    //frames in the run
+uint32_t compact_placed;   //frames of the run used so far
+uint32_t compact_next;     //next frame of the file to move
+
+//views made by cart_mmap: a page is read from the file the first time it is
+//touched and written back by cart_msync once it has been written to
+#define CART_MAX_MAPPINGS 64
+#define MAP_PAGE_ABSENT 0 //not read yet, any access faults
+#define MAP_PAGE_CLEAN  1 //read in and read only, a write faults
+#define MAP_PAGE_DIRTY  2 //written to since it was read or synced
+struct Mapping {
+	char *addr;      //first byte of the view, NULL for a free slot
+	uint32_t len;    //bytes of the file in the view, from its start
+	size_t span;     //bytes reserved, len rounded up to whole pages
+	int16_t fd;      //the file
+	uint8_t *pages;  //MAP_PAGE_* of each page
+	char *fill;      //the same pages writable, filled while the view's are inaccessible
+};
+struct Mapping mappings[CART_MAX_MAPPINGS];
+size_t map_page_size; //set, with the fault handler, by the first cart_mmap
+struct sigaction map_old_action; //SIGSEGV handling for faults outside the views
 //
 //
 // Implementation
@@ -77,18 +237,18 @@ CartXferRegister create_cart_regstate(CartXferRegister KY1, CartXferRegister KY2
 // Function     : extract_cart_opcode
 // Description  : extracts a register structure
 //
-// Inputs       : opcode, struct for the 5 elements in register
-// Outputs      : return 0 if success, 
-int extract_cart_opcode(CartXferRegister reg, struct OpCode Oregstate)
+// Inputs       : reg - the register value returned by the bus
+// Outputs      : the 5 elements of the register
+Opcode extract_cart_opcode(CartXferRegister reg)
 {
-	const struct Opcode oregstate={0};
+	Opcode oregstate;
 	oregstate.KY1 = (reg&0xff00000000000000) >>56;
 	oregstate.KY2 = (reg&0x00ff000000000000) >>48;
 	oregstate.RT1 = (reg&0x0000800000000000) >>47;
 	oregstate.CT1 = (reg&0x00007FFF80000000) >>31;
 	oregstate.FM1 = (reg&0x000000007FFF8000) >>15;
-	return (0);
-}  
+	return (oregstate);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -102,15 +262,15 @@ int LDCART_opcode(CartridgeIndex cart_index)
 {
 	if(loaded_cartridge != cart_index) {
 		CartXferRegister regstate= 0x0;
-		const Opcode oregstate= {0};
+		Opcode oregstate;
 		regstate = create_cart_regstate(CART_OP_LDCART,0,0,cart_index,0);
-		oregstate= cart_client_bus_request(regstate,NULL);
-		extract_cart_opcode(regstate,oregstate);
-		if(oregstate.RT1 == -1){
+		oregstate= extract_cart_opcode(client_cart_bus_request(regstate,NULL));
+		if(oregstate.RT1 != 0){
 			logMessage(LOG_ERROR_LEVEL, "CART driver failed: failed to load cartridge");
-		return(-1);
+			return(-1);
 		}
-	loaded_cartridge = cart_index;
+		loaded_cartridge = cart_index;
+		COUNT_STAT(cart_loads, 1);
 	}
 	return(0);
 }
@@ -124,11 +284,10 @@ int LDCART_opcode(CartridgeIndex cart_index)
 // Outputs      : return 0 if success, -1 if failed
 int BZERO_opcode(void){
 	CartXferRegister regstate= 0x0;
-	const struct Opcode oregstate= {0};
-	regstate = create_cart_regstate(CART_OP_BZERO,0,0,0,NULL);
-	oregstate= cart_client_bus_request(regstate,NULL);
-	extract_cart_opcode(regstate,oregstate);
-	if(oregstate.RT1 == -1){
+	Opcode oregstate;
+	regstate = create_cart_regstate(CART_OP_BZERO,0,0,0,0);
+	oregstate= extract_cart_opcode(client_cart_bus_request(regstate,NULL));
+	if(oregstate.RT1 != 0){
 		logMessage(LOG_ERROR_LEVEL, "CART driver failed: failed to zero current cartridge");
 		return(-1);
 	}
@@ -144,23 +303,15 @@ int BZERO_opcode(void){
 //		  *buf- char pointer where data from frame is written
 // Outputs      : return 0 if success, -1 if failed
 int RDFRME_opcode(CartFrameIndex frame_index, char *buf) {
-	//cache is checked for frame being read first
-	char *tempbuf;
-	tempbuf = get_cart_cache(loaded_cartridge,frame_index);
-	if(tempbuf==NULL) {
-		CartXferRegister regstate= 0x0;
-		const struct Opcode oregstate = {0};
-		regstate = create_cart_regstate(CART_OP_RDFRME,0,0,0,frame_index);
-		oregstate= cart_client_bus_request(regstate,buf);
-		extract_cart_opcode(regstate,oregstate);
-		if(oregstate.RT1 == -1){
-			logMessage(LOG_ERROR_LEVEL, "CART driver failed: failed to read frame");
-			return(-1);
-		}
-	}
-	else {
-		memcpy(buf,tempbuf,CART_FRAME_SIZE);
+	CartXferRegister regstate= 0x0;
+	Opcode oregstate;
+	regstate = create_cart_regstate(CART_OP_RDFRME,0,0,0,frame_index);
+	oregstate= extract_cart_opcode(client_cart_bus_request(regstate,buf));
+	if(oregstate.RT1 != 0){
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: failed to read frame");
+		return(-1);
 	}
+	COUNT_STAT(frames_read, 1);
 	return(0);
 }
 
@@ -175,301 +326,4867 @@ int RDFRME_opcode(CartFrameIndex frame_index, char *buf) {
 int WRFRME_opcode(CartFrameIndex frame_index, char *buf)
 {
 	CartXferRegister regstate= 0x0;
-	struct Opcode oregstate = {0};
+	Opcode oregstate;
 	regstate = create_cart_regstate(CART_OP_WRFRME,0,0,0,frame_index);
-	oregstate= cart_client_bus_request(regstate,buf);
-	extract_cart_opcode(regstate,oregstate);
-	if(oregstate.RT1 == -1){
+	oregstate= extract_cart_opcode(client_cart_bus_request(regstate,buf));
+	if(oregstate.RT1 != 0){
 		logMessage(LOG_ERROR_LEVEL, "CART driver failed: failed to write to frame");
 		return(-1);
 	}
+	MARK_WRITTEN(loaded_cartridge, frame_index);
+	COUNT_STAT(frames_written, 1);
 	return(0);
 }
+
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_poweron
-// Description  : Startup up the CART interface, initialize filesystem
+// Function     : pin_cart_frame
+// Description  : returns a pinned, cached copy of a frame.  On a miss the
+//                frame is read from the bus straight into its cache slot, so
+//                later reads of it are hits.  Release with unpin_cart_cache.
 //
-// Inputs       : none
-// Outputs      : 0 if successful, -1 if failure
-
-int32_t cart_poweron(void) {
-	loaded_cartidge= NULL;
-	CartXferRegister regstate= 0x0, i;
-	const struct Opcode oregstate = {0};
-	if((regstate = create_cart_regstate(CART_OP_INITMS,0,0,0,NULL)) ==-1) {
-		logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail on init");
-		return(-1);
-	}
-	oregstate = cart_client_bus_request(regstate, NULL);
-	extract_cart_opcode(regstate, oregstate);
-	if(oregstate.RT1 !=0) {
-		logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to power on");
-		return(-1);
+// Inputs:	  cart_index - cartridge holding the frame
+//		  frame_index- index of the frame being read
+// Outputs      : pointer to the frame if success, NULL if failed
+char * pin_cart_frame(CartridgeIndex cart_index, CartFrameIndex frame_index) {
+	int hit;
+	char *frame = alloc_pin_cart_cache(cart_index, frame_index, &hit);
+	if(frame == NULL)
+		return(NULL);
+	if(hit) {
+		COUNT_STAT(cache_hits, 1);
+		return(frame);
 	}
-
-	//load and zero all cartridges
-	for(i = 0x0; i <CART_MAX_CARTRIDGES;i++)
-	{
-		//load cartridge i
-		if(LDCART_opcode(i) == -1)
-			return(-1);
-		//zeroes current cartridge
-		BZERO_opcode();
+	if(!FRAME_WRITTEN(cart_index, frame_index)) {
+		//nothing was ever put there, what the cartridge holds is stale
+		memset(frame, 0, CART_FRAME_SIZE);
+		COUNT_STAT(zero_fills, 1);
+		return(frame);
 	}
-	// Initilize and set up file system
-	file_counter= 0;
-	for(i=0;i <CART_MAX_TOTAL_FILES;i++)
-	{
-		FileArray[i].file_path[0]= '\0';
-		FileArray[i].current_pos= 0;
-		FileArray[i].end_pos= 0;
-		FileArray[i].file_open= 0;
+	COUNT_STAT(cache_misses, 1);
+	if(LDCART_opcode(cart_index) == -1 || RDFRME_opcode(frame_index, frame) == -1) {
+		unpin_cart_cache(cart_index, frame_index);
+		delete_cart_cache(cart_index, frame_index);
+		return(NULL);
 	}
-	avail_cart= 0;
-	avail_frame= 0;
+	return(frame);
+}
 
-	//Initialize Cache
-	init_cart_cache();
-	// Return successfully
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : RDCART_opcode
+// Description  : reads a frame of any cartridge through the cache, loading
+//                the cartridge and reading the bus only on a miss
+//
+// Inputs:	  cart_index - cartridge holding the frame
+//		  frame_index- index of the frame being read
+//		  *buf- char pointer where data from frame is written
+// Outputs      : return 0 if success, -1 if failed
+int RDCART_opcode(CartridgeIndex cart_index, CartFrameIndex frame_index, char *buf) {
+	char *frame = pin_cart_frame(cart_index, frame_index);
+	if(frame == NULL)
+		return(-1);
+	memcpy(buf, frame, CART_FRAME_SIZE);
+	unpin_cart_cache(cart_index, frame_index);
 	return(0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_poweroff
-// Description  : Shut down the CART interface, close all files
+// Function     : prefetch_cart_frame
+// Description  : brings a frame into the cache ahead of a read, without
+//                counting a hit or miss (caller holds driver_lock)
 //
-// Inputs       : none
-// Outputs      : 0 if successful, -1 if failure
-
-int32_t cart_poweroff(void) {
-	CartXferRegister regstate=0x0;
-	const Opcode oregstate={0};
-	regstate = create_cart_regstate(CART_OP_POWOFF,0,0,0,NULL);
-	oregstate = cart_client_bus_request(regstate,NULL);
-	extract_cart_opcode(regstate,oregstate);
-	if(oregstate.RT1 !=0) {
-		logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to power off");
+// Inputs:	  cart_index - cartridge holding the frame
+//		  frame_index- index of the frame to bring in
+// Outputs      : return 0 if success, -1 if failed
+static int prefetch_cart_frame(CartridgeIndex cart_index, CartFrameIndex frame_index) {
+	int hit;
+	char *frame;
+	//a frame never written is zeros, filling it on demand costs no bus time
+	if(!FRAME_WRITTEN(cart_index, frame_index))
+		return(0);
+	frame = alloc_pin_cart_cache(cart_index, frame_index, &hit);
+	if(frame == NULL)
 		return(-1);
+	if(!hit) {
+		if(LDCART_opcode(cart_index) == -1 || RDFRME_opcode(frame_index, frame) == -1) {
+			unpin_cart_cache(cart_index, frame_index);
+			delete_cart_cache(cart_index, frame_index);
+			return(-1);
+		}
+		COUNT_STAT(readahead_frames, 1);
 	}
-	//close cache
-	close_cart_cache();
-	// Return successfully
+	unpin_cart_cache(cart_index, frame_index);
 	return(0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_open
-// Description  : This function opens the file and returns a file handle
+// Function     : readahead_worker
+// Description  : the readahead thread, services the queued windows a frame
+//                at a time so reads and writes are never held up for long
 //
-// Inputs       : path - filename of the file to open
-// Outputs      : file handle if successful, -1 if failure
-
-int16_t cart_open(char *path) {
-	int length = strlen(path) +1; //includes '/0'
-	//search for a file with that path
+// Inputs       : arg - unused
+// Outputs      : NULL
+static void * readahead_worker(void *arg) {
+	struct Readahead ra;
+	int16_t saved_fd;
+	CartBlock blk;
 	int i;
-	for(i=0;i<file_counter;i++)
-	{
-		if(strncmp(FileArray[i].file_open, path, length)==0) {
-			//if file open
-			if(FileArray[i].file_open == 1) {
-				return(-1);
-			} 
-			else {
-				FileArray[i].file_open = 1;
-				FileArray[i].current_pos= 0;
-				return(i); 
+
+	pthread_mutex_lock(&readahead_lock);
+	while(!readahead_stop) {
+		if(readahead_head == readahead_tail) {
+			pthread_cond_wait(&readahead_cond, &readahead_lock);
+			continue;
+		}
+		ra = readahead_queue[readahead_tail++ % CART_READAHEAD_QUEUE];
+		pthread_mutex_unlock(&readahead_lock);
+
+		for(i = ra.first; i < ra.first + ra.count; i++) {
+			pthread_mutex_lock(&driver_lock);
+			if(__atomic_load_n(&readahead_stop, __ATOMIC_RELAXED) || !FileArray[ra.fd].file_open || i >= (int)FileArray[ra.fd].map.frames) {
+				pthread_mutex_unlock(&driver_lock);
+				break;
 			}
+			blk = cart_blockmap_lookup(&FileArray[ra.fd].map, i, NULL);
+			if(i <= FileArray[ra.fd].ra_prev || blk == CART_BLOCK_NONE) {
+				//the reader got there first
+				pthread_mutex_unlock(&driver_lock);
+				continue;
+			}
+			saved_fd = stats_fd;
+			stats_fd = ra.fd;
+			prefetch_cart_frame(CART_BLOCK_CART(blk), CART_BLOCK_FRAME(blk));
+			stats_fd = saved_fd;
+			pthread_mutex_unlock(&driver_lock);
 		}
+		pthread_mutex_lock(&readahead_lock);
 	}
-	file_counter++;
-	strncpy(FileArray[file_counter].file_path,path,length);
-	FileArray[file_counter].file_open =1;
-	FileArray[file_counter].current_pos = 0;
-	FileArray[file_counter].end_pos = 0;
-	FileArray[file_counter].frame_list_index = -1;
+	pthread_mutex_unlock(&readahead_lock);
+	return(NULL);
+}
 
-	// THIS SHOULD RETURN A FILE HANDLE
-	return (file_counter);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : queue_readahead
+// Description  : hands a window of file frames to the readahead thread,
+//                dropping it if the queue is full
+//
+// Inputs       : fd - the file
+//                first - the first frame of the window (file order)
+//                count - the number of frames
+// Outputs      : none
+static void queue_readahead(int16_t fd, int first, int count) {
+	if(first + count > (int)FileArray[fd].map.frames)
+		count = (int)FileArray[fd].map.frames - first;
+	if(count <= 0)
+		return;
+	pthread_mutex_lock(&readahead_lock);
+	if(readahead_head - readahead_tail < CART_READAHEAD_QUEUE) {
+		readahead_queue[readahead_head++ % CART_READAHEAD_QUEUE] = (struct Readahead){ fd, first, count };
+		pthread_cond_signal(&readahead_cond);
+	}
+	pthread_mutex_unlock(&readahead_lock);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_close
-// Description  : This function closes the file
+// Function     : file_readahead
+// Description  : notes a read of a file frame and grows the readahead
+//                window the way Linux does: a sequential reader gets a
+//                small window, and reaching the marked part of a window
+//                queues the next one at twice the size (up to readahead_max,
+//                and an eighth of the cache so windows do not evict each
+//                other); anything else resets it
 //
-// Inputs       : fd - the file descriptor
-// Outputs      : 0 if successful, -1 if failure
+// Inputs       : fd - the file
+//                idx - the frame of the file being read
+// Outputs      : none
+static void file_readahead(int16_t fd, int idx) {
+	struct File *f = &FileArray[fd];
+	int prev = f->ra_prev, limit = cart_cache_size() / 8;
 
-int16_t cart_close(int16_t fd) {
-	if (fd >= CART_MAX_TOTAL_FILES || fd <0) {
-		logMessage(LOG_ERROR_LEVEL, "CART driver failed: bad file handle.");
-		return (-1);
+	if(idx == prev || !readahead_running)
+		return;
+	f->ra_prev = idx;
+	if(limit > (int)readahead_max)
+		limit = readahead_max;
+	if(limit == 0)
+		return;
+	if(f->ra_size > 0 && idx == f->ra_start + f->ra_size - f->ra_async) {
+		//reader reached the mark, the next window is queued in full
+		f->ra_start += f->ra_size;
+		f->ra_size = (f->ra_size * 2 > limit) ? limit : f->ra_size * 2;
+		f->ra_async = f->ra_size;
+	}
+	else if(f->ra_size > 0 && idx >= f->ra_start - 1 && idx < f->ra_start + f->ra_size) {
+		return;
+	}
+	else if(idx == prev + 1) {
+		//newly sequential, start small and mark the middle of the window
+		f->ra_start = idx + 1;
+		f->ra_size = (CART_READAHEAD_INIT > limit) ? limit : CART_READAHEAD_INIT;
+		f->ra_async = (f->ra_size + 1) / 2;
+	}
+	else {
+		f->ra_size = 0;
+		return;
 	}
+	queue_readahead(fd, f->ra_start, f->ra_size);
+}
 
-	if (FileArray[fd].file_open == 0) {
-		//file has already been closed
-		logMessage(LOG_ERROR_LEVEL, "CART driver failed: file is closed.");
-		return (-1);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : start_readahead
+// Description  : starts the readahead thread (unless readahead is off)
+//
+// Inputs       : none
+// Outputs      : return 0 if success, -1 if failed
+static int start_readahead(void) {
+	readahead_head = readahead_tail = 0;
+	readahead_stop = 0;
+	if(readahead_max == 0)
+		return(0);
+	if(pthread_create(&readahead_thread, NULL, readahead_worker, NULL) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to start readahead");
+		return(-1);
 	}
-	FileArray[fd].file_open = 0;
-	// Return successfully
-	return (0);
+	readahead_running = 1;
+	return(0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_read
-// Description  : Reads "count" bytes from the file handle "fh" into the 
-//                buffer "buf"
+// Function     : stop_readahead
+// Description  : stops the readahead thread, dropping any queued windows
+//                (caller must not hold driver_lock)
 //
-// Inputs       : fd - filename of the file to read from
-//                buf - pointer to buffer to read into
-//                count - number of bytes to read
-// Outputs      : bytes read if successful, -1 if failure
+// Inputs       : none
+// Outputs      : none
+static void stop_readahead(void) {
+	if(!readahead_running)
+		return;
+	pthread_mutex_lock(&readahead_lock);
+	__atomic_store_n(&readahead_stop, 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&readahead_cond);
+	pthread_mutex_unlock(&readahead_lock);
+	pthread_join(readahead_thread, NULL);
+	readahead_running = 0;
+}
 
-int32_t cart_read(int16_t fd, void *buf, int32_t count) {
-	int32_t read_length = count, frame_pos, buf_loc= 0, remaining_bytes= count;
-	char tempbuf[CART_FRAME_SIZE];
-	if (fd >= CART_MAX_TOTAL_FILES || fd <0) {
-		logMessage(LOG_ERROR_LEVEL, "CART driver failed: bad file handle.");
-		return (-1);
-	}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : WRCART_opcode
+// Description  : writes a frame of any cartridge, loading it as needed
+//
+// Inputs:	  cart_index - cartridge holding the frame
+//		  frame_index- index of the frame being written
+//		  *buf- the frame contents to be written
+// Outputs      : return 0 if success, -1 if failed
+int WRCART_opcode(CartridgeIndex cart_index, CartFrameIndex frame_index, void *buf) {
+	if(LDCART_opcode(cart_index) == -1)
+		return(-1);
+	return(WRFRME_opcode(frame_index, buf));
+}
 
-	if (FileArray[fd].file_open == 0) {
-		//file has already been closed
-		logMessage(LOG_ERROR_LEVEL, "CART driver failed: file is closed.");
-		return (-1);
-	}
-	if(count > (FileArray[fd].end_pos - FileArray[fd].current_pos)) {
-		read_length = FileArray[fd].end_pos - FileArray[fd].current_pos;
-		remaining_bytes = read_length;		
-	}
-	while (remaining_bytes > 0) {
-		if(RDCART_opcode(FileArray[fd].FrameList[FileArray[fd].current_pos/CART_FRAME_SIZE].cart_index, FileArray[fd].FrameList[FileArray[fd].current_pos%CART_FRAME_SIZE].frame_index, tempbuf) == -1)
-			return(-1);
-		
-		int frame_bytes;
-		if(remaining_bytes == read_length){
-			if(read_length < CART_FRAME_SIZE)
-				frame_bytes= read_length;
-			else
-				frame_bytes= CART_FRAME_SIZE-frame_pos;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : meta_write
+// Description  : writes a metadata frame straight to its cartridge, the
+//                cache never holds one
+//
+// Inputs       : blk - the frame
+//                frame - the contents, sealed (cart_meta.h)
+// Outputs      : return 0 if success, -1 if failed
+static int meta_write(CartBlock blk, char *frame) {
+	if(WRCART_opcode(CART_BLOCK_CART(blk), CART_BLOCK_FRAME(blk), frame) == -1)
+		return(-1);
+	COUNT_STAT(meta_writes, 1);
+	return(0);
+}
 
-			memcpy(buf+buf_loc,&tempbuf[frame_pos], frame_bytes);
-		}
-		else if (remaining_bytes < CART_FRAME_SIZE) {
-			frame_bytes= remaining_bytes;
-			memcpy(buf+buf_loc,tempbuf, frame_bytes); // all of the frame is copied
-		}
-		else {
-			frame_bytes = CART_FRAME_SIZE;
-			memcpy(buf+buf_loc,tempbuf,frame_bytes);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : meta_write_journal
+// Description  : writes the journal frame to its slot, if anything was
+//                logged since it was last written
+//
+// Inputs       : none
+// Outputs      : return 0 if success, -1 if failed
+static int meta_write_journal(void) {
+	if(!journal_dirty)
+		return(0);
+	cart_meta_frame_seal(journal_frame);
+	if(meta_write(CART_META_SUPERBLOCK + 1 + (journal_seq - superblock.sequence), journal_frame) == -1)
+		return(-1);
+	journal_dirty = 0;
+	journal_frees = 0;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_cart_frame
+// Description  : the cache's write back function, writes a dirty frame.
+//                The journal goes first, so a directory block never names
+//                files the journal does not have (see meta_mount).
+//
+// Inputs:	  cart_index - cartridge holding the frame
+//		  frame_index- index of the frame being written
+//		  *buf- the frame contents to be written
+// Outputs      : return 0 if success, -1 if failed
+static int flush_cart_frame(CartridgeIndex cart_index, CartFrameIndex frame_index, void *buf) {
+	if(meta_write_journal() == -1 || WRCART_opcode(cart_index, frame_index, buf) == -1)
+		return(-1);
+	COUNT_STAT(dirty_flushes, 1);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : frame_key_compare
+// Description  : qsort comparator ordering frames by cartridge, then frame
+//
+// Inputs       : a, b - pointers to struct Frame
+// Outputs      : <0, 0, >0 as for qsort
+static int frame_key_compare(const void *a, const void *b) {
+	const struct Frame *x = a, *y = b;
+	if(x->cart_index != y->cart_index)
+		return((int)x->cart_index - (int)y->cart_index);
+	return((int)x->frame_index - (int)y->frame_index);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_file_frames
+// Description  : writes back the dirty cached frames of a file, sorted so
+//                each cartridge is loaded once and its frames go in order
+//
+// Inputs       : fd - the file whose frames are flushed
+// Outputs      : return 0 if success, -1 if failed
+static int flush_file_frames(int16_t fd) {
+	struct Frame *sorted;
+	uint32_t i, j, run, count = 0;
+	CartBlock blk;
+	int ret = 0;
+
+	if((cart_cache_write_mode() != CART_CACHE_WRITEBACK && !FileArray[fd].is_dir) || FileArray[fd].map.frames == 0)
+		return(0);
+	if((sorted = malloc(FileArray[fd].map.frames * sizeof(struct Frame))) == NULL)
+		return(-1);
+	for(i = 0; i < FileArray[fd].map.frames; i += run) {
+		blk = cart_blockmap_lookup(&FileArray[fd].map, i, &run);
+		for(j = 0; blk != CART_BLOCK_NONE && j < run; j++, count++) {
+			sorted[count].cart_index = CART_BLOCK_CART(blk + j);
+			sorted[count].frame_index = CART_BLOCK_FRAME(blk + j);
 		}
-		FileArray[fd].current_pos += frame_bytes;
-		buf_loc += frame_bytes;
-		remaining_bytes -= frame_bytes;
 	}
-	// Return successfully
-	return (read_length);
+	qsort(sorted, count, sizeof(struct Frame), frame_key_compare);
+	for(i = 0; i < count; i++) {
+		if(flush_cart_cache_frame(sorted[i].cart_index, sorted[i].frame_index) == -1)
+			ret = -1;
+	}
+	free(sorted);
+	return(ret);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_write
-// Description  : Writes "count" bytes to the file handle "fh" from the 
-//                buffer  "buf"
+// Function     : frame_op_compare
+// Description  : qsort comparator for the elevator order: cartridges upwards
+//                from the loaded one, wrapping round, then frames upwards,
+//                then holes
 //
-// Inputs       : fd - filename of the file to write to
-//                buf - pointer to buffer to write from
-//                count - number of bytes to write
-// Outputs      : bytes written if successful, -1 if failure
+// Inputs       : a, b - pointers to struct FrameOp
+// Outputs      : <0, 0, >0 as for qsort
+static int frame_op_compare(const void *a, const void *b) {
+	const struct FrameOp *x = a, *y = b;
+	int origin = (loaded_cartridge < CART_MAX_CARTRIDGES) ? loaded_cartridge : 0;
+	int cx = (CART_BLOCK_CART(x->blk) - origin + CART_MAX_CARTRIDGES) % CART_MAX_CARTRIDGES;
+	int cy = (CART_BLOCK_CART(y->blk) - origin + CART_MAX_CARTRIDGES) % CART_MAX_CARTRIDGES;
+	//holes need no bus, and frames written to them are allocated in file order
+	if((x->blk == CART_BLOCK_NONE) != (y->blk == CART_BLOCK_NONE))
+		return((x->blk == CART_BLOCK_NONE) ? 1 : -1);
+	if(x->blk == CART_BLOCK_NONE)
+		return((int)x->idx - (int)y->idx);
+	if(cx != cy)
+		return(cx - cy);
+	return((int)CART_BLOCK_FRAME(x->blk) - (int)CART_BLOCK_FRAME(y->blk));
+}
 
-int32_t cart_write(int16_t fd, void *buf, int32_t count) {
-	char tempbuf[CART_FRAME_SIZE];
-	int remaining_bytes= count, write_bytes, frame_pos, list_loc, buf_loc= 0;
-	if (fd >= CART_MAX_TOTAL_FILES || fd <0) {
-		logMessage(LOG_ERROR_LEVEL, "CART driver failed: bad file handle.");
-		return (-1);
-	}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : meta_checkpoint_add
+// Description  : adds a record to the checkpoint being built, starting a
+//                new frame when the last one is full
+//
+// Inputs       : frames - the frames so far, grown
+//                count - how many, advanced
+//                rec - the record
+// Outputs      : return 0 if success, -1 if failed
+static int meta_checkpoint_add(char **frames, uint32_t *count, const CartMetaRecord *rec) {
+	char *grown;
 
-	if (FileArray[fd].file_open == 0) {
-		//file has already been closed
-		logMessage(LOG_ERROR_LEVEL, "CART driver failed: file is closed.");
-		return (-1);
-	}
+	if(*count > 0 && cart_meta_frame_add(*frames + (*count - 1) * CART_FRAME_SIZE, rec) == 0)
+		return(0);
+	if((grown = realloc(*frames, (*count + 1) * CART_FRAME_SIZE)) == NULL)
+		return(-1);
+	*frames = grown;
+	cart_meta_frame_init(grown + *count * CART_FRAME_SIZE, CART_META_CHECKPOINT_MAGIC, CART_BLOCK_NONE);
+	(*count)++;
+	return(cart_meta_frame_add(grown + (*count - 1) * CART_FRAME_SIZE, rec));
+}
 
-	while(remaining_bytes >0){
-		frame_pos= FileArray[fd].current_pos % CART_FRAME_SIZE;
-		list_loc= FileArray[fd].current_pos /CART_FRAME_SIZE;
-		
-		if(CART_FRAME_SIZE <= remaining_bytes + frame_pos){
-			write_bytes = CART_FRAME_SIZE - frame_pos;
-		}
-		else if((remaining_bytes + frame_pos)% CART_FRAME_SIZE != 0) {
-			write_bytes = remaining_bytes % CART_FRAME_SIZE;
-		}
-		else {
-			write_bytes = CART_FRAME_SIZE;
-		}
-		if(list_loc > FileArray[fd].frame_list_index){
-			FileArray[fd].FrameList[list_loc].cart_index = avail_cart;
-			FileArray[fd].FrameList[list_loc].frame_index = avail_frame;
-			if (avail_frame >= CART_CARTRIDGE_SIZE - 1) {
-				avail_cart += 1;
-				avail_frame = 0;
-			} else {
-				avail_frame++;	
-			}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : meta_checkpoint
+// Description  : writes the whole file table as a chain of new frames, then
+//                a superblock pointing at it, so the journal starts again
+//                empty; the last checkpoint's frames are then freed
+//
+// Inputs       : none
+// Outputs      : return 0 if success, -1 if failed
+static int meta_checkpoint(void) {
+	char *frames = NULL, sb[CART_FRAME_SIZE];
+	CartBlock *blocks = NULL, blk;
+	CartMetaSuper next;
+	CartMetaRecord rec;
+	CartPackEntry e;
+	uint32_t count = 0, taken = 0, i, run;
+	struct File *f;
+	int16_t fd;
+	int ret = -1;
+
+	//the blocks of the directories it names reach the cartridges first
+	if(flush_cart_cache() == -1)
+		return(-1);
+	for(fd = 0; fd < file_counter; fd++) {
+		f = &FileArray[fd];
+		if(f->file_name == NULL)
+			continue;
+		memset(&rec, 0, sizeof(rec));
+		rec.type = CART_META_CREATE;
+		rec.id = fd;
+		rec.parent = f->parent;
+		rec.is_dir = f->is_dir;
+		rec.compressed = f->compressed;
+		rec.name = f->file_name;
+		rec.len = strlen(f->file_name);
+		if(meta_checkpoint_add(&frames, &count, &rec) == -1)
+			goto done;
+		rec.type = CART_META_MAP;
+		for(i = 0; i < f->map.frames; i += run) {
+			if((blk = cart_blockmap_lookup(&f->map, i, &run)) == CART_BLOCK_NONE)
+				continue;
+			rec.frame = i;
+			rec.block = blk;
+			rec.count = run;
+			if(meta_checkpoint_add(&frames, &count, &rec) == -1)
+				goto done;
 		}
-		else{
-			RDCART_opcode(FileArray[fd].FrameList[list_loc].cart_index,FileArray[fd].FrameList[list_loc].frame_index, tempbuf);
+		rec.type = CART_META_PACK;
+		for(i = 0; i < f->pack.frames; i++) {
+			e = cart_pack_lookup(&f->pack, i);
+			if(e.length == 0)
+				continue;
+			rec.frame = i;
+			rec.slot = e.slot;
+			rec.offset = e.offset;
+			rec.length = e.length;
+			if(meta_checkpoint_add(&frames, &count, &rec) == -1)
+				goto done;
 		}
-		//update
-		memcpy(&tempbuf[frame_pos], buf+buf_loc, write_bytes);
-		//write to cache
-		put_cart_cache(FileArray[fd].FrameList[list_loc].cart_index, FileArray[fd].FrameList[list_loc].frame_index, tempbuf);
-		//write to cart
-		WRCART_opcode(FileArray[fd].FrameList[list_loc].cart_index, FileArray[fd].FrameList[list_loc].frame_index, tempbuf);
-		buf_loc += write_bytes;
-		remaining_bytes -= write_bytes;
-		FileArray[fd].current_pos += write_bytes;
-		if (FileArray[fd].end_pos < FileArray[fd].current_pos){
-			FileArray[fd].end_pos = FileArray[fd].current_pos;
+		rec.type = f->is_dir ? CART_META_DIR : CART_META_SIZE;
+		rec.size = f->end_pos;
+		rec.buckets = f->dir_buckets;
+		rec.entries = f->dir_entries;
+		if(meta_checkpoint_add(&frames, &count, &rec) == -1)
+			goto done;
+	}
+
+	//each frame is tagged with the next, the chain is laid out like a file
+	if((blocks = malloc(count * sizeof(CartBlock))) == NULL)
+		goto done;
+	for(taken = 0; taken < count; taken++) {
+		if((blocks[taken] = cart_alloc_frame(taken ? blocks[taken - 1] : CART_BLOCK_NONE, loaded_cartridge)) == CART_BLOCK_NONE) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: out of frames for checkpoint.");
+			goto done;
 		}
 	}
-	// Return successfully
-	return (count);
+	for(i = 0; i < count; i++) {
+		cart_meta_frame_set_tag(frames + i * CART_FRAME_SIZE, (i + 1 < count) ? blocks[i + 1] : CART_BLOCK_NONE);
+		cart_meta_frame_seal(frames + i * CART_FRAME_SIZE);
+		if(meta_write(blocks[i], frames + i * CART_FRAME_SIZE) == -1)
+			goto done;
+	}
+	next.sequence = journal_seq + 1;
+	next.checkpoint = blocks[0];
+	cart_meta_super_encode(sb, &next);
+	if(meta_write(CART_META_SUPERBLOCK, sb) == -1)
+		goto done;
+
+	//the superblock no longer points at the old checkpoint or journal
+	for(i = 0; i < checkpoint_count; i++)
+		cart_alloc_free(checkpoint_frames[i]);
+	free(checkpoint_frames);
+	checkpoint_frames = blocks;
+	checkpoint_count = count;
+	blocks = NULL;
+	superblock = next;
+	for(fd = 0; fd < file_counter; fd++) {
+		FileArray[fd].meta_frames = FileArray[fd].map.frames;
+		FileArray[fd].meta_size = FileArray[fd].end_pos;
+	}
+	journal_seq = next.sequence;
+	cart_meta_frame_init(journal_frame, CART_META_JOURNAL_MAGIC, journal_seq);
+	journal_dirty = 0;
+	ret = 0;
+
+done:
+	for(i = 0; blocks != NULL && i < taken; i++)
+		cart_alloc_free(blocks[i]);
+	free(blocks);
+	free(frames);
+	return(ret);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_read
-// Description  : Seek to specific point in the file
+// Function     : meta_log
+// Description  : logs a change already made to the file table.  A full
+//                journal frame is written and the record starts the next;
+//                once the ring is full a checkpoint holds the change instead.
 //
-// Inputs       : fd - filename of the file to write to
-//                loc - offfset of file in relation to beginning of file
-// Outputs      : 0 if successful, -1 if failure
-
-int32_t cart_seek(int16_t fd, uint32_t loc) {
-	if (fd >= CART_MAX_TOTAL_FILES || fd <0) {
-		logMessage(LOG_ERROR_LEVEL, "CART driver failed: bad file handle.");
-		return (-1);
+// Inputs       : rec - the record
+// Outputs      : return 0 if success, -1 if failed
+static int meta_log(const CartMetaRecord *rec) {
+	if(journal_replaying)
+		return(0);
+	if(cart_meta_frame_add(journal_frame, rec) == -1) {
+		if(meta_write_journal() == -1)
+			return(-1);
+		if(journal_seq + 1 - superblock.sequence >= CART_META_JOURNAL_FRAMES)
+			return(meta_checkpoint());
+		cart_meta_frame_init(journal_frame, CART_META_JOURNAL_MAGIC, ++journal_seq);
+		if(cart_meta_frame_add(journal_frame, rec) == -1)
+			return(-1);
 	}
+	journal_dirty = 1;
+	if(rec->type == CART_META_REMOVE)
+		journal_frees = 1;
+	return(0);
+}
 
-	if (FileArray[fd].file_open == 0) {
-		//file has already been closed
-		logMessage(LOG_ERROR_LEVEL, "CART driver failed: file is closed.");
-		return (-1);
-	}
-	if(loc > FileArray[fd].end_pos){
-		logMessage(LOG_ERROR_LEVEL, "CART driver failed: loc exceeds file length.");
-		return (-1);
-	}
-	FileArray[fd].current_pos= loc;
-	// Return successfully
-	return (0);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : meta_log_file
+// Description  : logs the size of a file or the buckets and entries of a
+//                directory, or its removal
+//
+// Inputs       : fd - the file
+//                type - CART_META_SIZE, CART_META_DIR or CART_META_REMOVE
+// Outputs      : return 0 if success, -1 if failed
+static int meta_log_file(int16_t fd, uint8_t type) {
+	CartMetaRecord rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = type;
+	rec.id = fd;
+	rec.size = FileArray[fd].end_pos;
+	rec.buckets = FileArray[fd].dir_buckets;
+	rec.entries = FileArray[fd].dir_entries;
+	return(meta_log(&rec));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : meta_log_frames
+// Description  : logs the frames a file has gained and the size it has
+//                reached since last logged, a record per extent rather than
+//                per write
+//
+// Inputs       : fd - the file
+// Outputs      : return 0 if success, -1 if failed
+static int meta_log_frames(int16_t fd) {
+	struct File *f = &FileArray[fd];
+	CartMetaRecord rec;
+	uint32_t run;
+
+	//the file is brought up to date before logging, a checkpoint taken by
+	//meta_log has the record already
+	memset(&rec, 0, sizeof(rec));
+	while(f->meta_frames < f->map.frames) {
+		rec.type = CART_META_MAP;
+		rec.id = fd;
+		rec.frame = f->meta_frames;
+		rec.block = cart_blockmap_lookup(&f->map, f->meta_frames, &run);
+		rec.count = (run < f->map.frames - f->meta_frames) ? run : f->map.frames - f->meta_frames;
+		f->meta_frames += rec.count;
+		if(rec.block != CART_BLOCK_NONE && meta_log(&rec) == -1)
+			return(-1);
+	}
+	if(f->meta_size != f->end_pos) {
+		f->meta_size = f->end_pos;
+		return(meta_log_file(fd, CART_META_SIZE));
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : meta_commit
+// Description  : logs what files have gained since last logged, then
+//                writes the journal frame
+//
+// Inputs       : none
+// Outputs      : return 0 if success, -1 if failed
+static int meta_commit(void) {
+	int16_t fd;
+
+	for(fd = 0; fd < file_counter; fd++) {
+		if(FileArray[fd].file_name != NULL && meta_log_frames(fd) == -1)
+			return(-1);
+	}
+	return(meta_write_journal());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : append_file_frame
+// Description  : gives a file a new frame past its end, after the file's
+//                last frame or at least on the same cartridge so reading it
+//                back needs few cartridge loads
+//
+// Inputs       : fd - the file
+// Outputs      : the frame if success, CART_BLOCK_NONE if failed
+static CartBlock append_file_frame(int16_t fd) {
+	CartBlockMap *map = &FileArray[fd].map;
+	CartBlock blk, last = CART_BLOCK_NONE;
+
+	if(map->frames > 0)
+		last = cart_blockmap_lookup(map, map->frames - 1, NULL);
+	if((blk = cart_alloc_frame(last, loaded_cartridge)) == CART_BLOCK_NONE) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: out of frames.");
+		return(CART_BLOCK_NONE);
+	}
+	if(cart_blockmap_append(map, blk) == -1) {
+		cart_alloc_free(blk);
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to grow block map.");
+		return(CART_BLOCK_NONE);
+	}
+	return(blk);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : store_cart_frame
+// Description  : writes a whole frame, through the cache to the cartridge or
+//                (write-back) only dirtying the cached copy
+//
+// Inputs:	  cart_index - cartridge holding the frame
+//		  frame_index- index of the frame being written
+//		  *buf- the frame contents to be written
+// Outputs      : return 0 if success, -1 if failed
+static int store_cart_frame(CartridgeIndex cart_index, CartFrameIndex frame_index, char *buf) {
+	if(cart_cache_write_mode() == CART_CACHE_WRITEBACK) {
+		//only dirty the cached frame, it reaches the cart on evict/flush
+		return(put_cart_cache_dirty(cart_index, frame_index, buf));
+	}
+	//write to cache
+	put_cart_cache(cart_index, frame_index, buf);
+	//write to cart, once the journal has any free of the frame
+	if((journal_frees && meta_write_journal() == -1) || WRCART_opcode(cart_index, frame_index, buf) == -1)
+		return(-1);
+	COUNT_STAT(write_throughs, 1);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_frame
+// Description  : drops a file's reference to a frame; the last frees it,
+//                with its cached copy unwritten
+//
+// Inputs       : blk - the frame
+// Outputs      : none
+static void release_frame(CartBlock blk) {
+	//a frame other files share keeps its contents and its cached copy
+	if(cart_alloc_free(blk) != 0)
+		return;
+	cart_dedup_remove(blk);
+	delete_cart_cache(CART_BLOCK_CART(blk), CART_BLOCK_FRAME(blk));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : remap_file_frame
+// Description  : moves a frame of a file to another cartridge frame (or a
+//                hole), dropping its reference to the one it had.  A frame
+//                the journal or checkpoint already has is logged again, and
+//                the journal must reach the cartridge before the old frame
+//                is reused.
+//
+// Inputs       : fd - the file
+//                idx - the frame of the file
+//                blk - its new cartridge frame, CART_BLOCK_NONE for a hole
+// Outputs      : return 0 if success, -1 if failed
+static int remap_file_frame(int16_t fd, uint32_t idx, CartBlock blk) {
+	struct File *f = &FileArray[fd];
+	CartBlock old = cart_blockmap_lookup(&f->map, idx, NULL);
+	CartMetaRecord rec;
+
+	if(cart_blockmap_set(&f->map, idx, blk) == -1)
+		return(-1);
+	if(old != CART_BLOCK_NONE)
+		release_frame(old);
+	if(idx >= f->meta_frames)
+		return(0);
+	memset(&rec, 0, sizeof(rec));
+	rec.type = CART_META_MAP;
+	rec.id = fd;
+	rec.frame = idx;
+	rec.block = blk;
+	rec.count = 1;
+	if(meta_log(&rec) == -1)
+		return(-1);
+	journal_frees = 1;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : store_file_frame
+// Description  : writes a whole frame of a file.  Zeros become a hole; the
+//                contents of a frame still cached are shared rather than
+//                written again (the fingerprint only finds candidates, the
+//                bytes are compared); otherwise the file's own frame is
+//                written, first copied off a frame other files share.
+//
+// Inputs       : fd - the file
+//                idx - the frame of the file
+//                buf - the frame contents
+// Outputs      : return 0 if success, -1 if failed
+static int store_file_frame(int16_t fd, uint32_t idx, char *buf) {
+	CartBlock blk = cart_blockmap_lookup(&FileArray[fd].map, idx, NULL), dup = CART_BLOCK_NONE;
+	uint64_t hash = 0;
+	char *frame;
+	int same;
+
+	if(dedup_enabled && cart_dedup_is_zero(buf)) {
+		if(blk != CART_BLOCK_NONE && remap_file_frame(fd, idx, CART_BLOCK_NONE) == -1)
+			return(-1);
+		COUNT_STAT(zero_holes, 1);
+		return(0);
+	}
+	if(dedup_enabled) {
+		hash = cart_dedup_hash(buf);
+		dup = cart_dedup_find(hash);
+	}
+	if(dup != CART_BLOCK_NONE && (frame = pin_cart_cache(CART_BLOCK_CART(dup), CART_BLOCK_FRAME(dup))) != NULL) {
+		same = (memcmp(frame, buf, CART_FRAME_SIZE) == 0);
+		unpin_cart_cache(CART_BLOCK_CART(dup), CART_BLOCK_FRAME(dup));
+		//rewriting a frame with what it already holds costs nothing either
+		if(same && dup != blk && cart_alloc_share(dup) == 0 && remap_file_frame(fd, idx, dup) == -1)
+			return(-1);
+		if(same && cart_blockmap_lookup(&FileArray[fd].map, idx, NULL) == dup) {
+			COUNT_STAT(dedup_hits, 1);
+			return(0);
+		}
+	}
+
+	//new contents go in a frame of the file's own
+	if(blk == CART_BLOCK_NONE || cart_alloc_refs(blk) > 1) {
+		dup = (idx > 0) ? cart_blockmap_lookup(&FileArray[fd].map, idx - 1, NULL) : CART_BLOCK_NONE;
+		if((blk = cart_alloc_frame(dup, loaded_cartridge)) == CART_BLOCK_NONE) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: out of frames.");
+			return(-1);
+		}
+		if(remap_file_frame(fd, idx, blk) == -1) {
+			cart_alloc_free(blk);
+			return(-1);
+		}
+	}
+	if(dedup_enabled)
+		cart_dedup_insert(hash, blk);
+	return(store_cart_frame(CART_BLOCK_CART(blk), CART_BLOCK_FRAME(blk), buf));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : store_pack_slot
+// Description  : stores the open slot of a compressed file as the frame of
+//                its map, or makes that a hole once no frame is left in it
+//
+// Inputs       : fd - the file
+//                slot - the slot in pack_buf
+// Outputs      : return 0 if success, -1 if failed
+static int store_pack_slot(int16_t fd, uint32_t slot) {
+	struct File *f = &FileArray[fd];
+
+	if(cart_pack_live(&f->pack, slot) == 0) {
+		f->pack_dirty = 0;
+		if(cart_blockmap_lookup(&f->map, slot, NULL) == CART_BLOCK_NONE)
+			return(0);
+		return(remap_file_frame(fd, slot, CART_BLOCK_NONE));
+	}
+	if(!f->pack_dirty)
+		return(0);
+	if(store_file_frame(fd, slot, f->pack_buf) == -1)
+		return(-1);
+	f->pack_dirty = 0;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pack_set_frame
+// Description  : records where a frame of a compressed file is packed and
+//                journals it, freeing a slot left with no frames
+//
+// Inputs       : fd - the file
+//                idx - the frame of the file
+//                slot, offset, length - its bytes, length 0 for a hole
+// Outputs      : return 0 if success, -1 if failed
+static int pack_set_frame(int16_t fd, uint32_t idx, uint32_t slot, uint16_t offset, int length) {
+	struct File *f = &FileArray[fd];
+	CartMetaRecord rec;
+	uint32_t emptied;
+
+	if(cart_pack_set(&f->pack, idx, slot, offset, length, &emptied) == -1)
+		return(-1);
+
+	//the index is journaled with each frame, remount never reads the slots
+	memset(&rec, 0, sizeof(rec));
+	rec.type = CART_META_PACK;
+	rec.id = fd;
+	rec.frame = idx;
+	rec.slot = slot;
+	rec.offset = offset;
+	rec.length = length;
+	if(meta_log(&rec) == -1)
+		return(-1);
+	if(emptied != CART_PACK_NONE && cart_blockmap_lookup(&f->map, emptied, NULL) != CART_BLOCK_NONE)
+		return(remap_file_frame(fd, emptied, CART_BLOCK_NONE));
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pack_store_frame
+// Description  : writes a whole frame of a compressed file.  Zeros become a
+//                hole; other contents are compressed (kept as they are if
+//                that does not make them smaller) and packed after the
+//                frames already in the open slot, the slot being stored
+//                when the next no longer fits.  The frame's old bytes are
+//                left behind, and a slot left with none is freed.
+//
+// Inputs       : fd - the file
+//                idx - the frame of the file
+//                buf - the frame contents
+// Outputs      : return 0 if success, -1 if failed
+static int pack_store_frame(int16_t fd, uint32_t idx, char *buf) {
+	struct File *f = &FileArray[fd];
+	char packed[CART_FRAME_SIZE];
+	uint32_t slot = CART_PACK_NONE, closed;
+	uint16_t offset = 0;
+	int length = 0;
+
+	if(!cart_dedup_is_zero(buf)) {
+		if((length = cart_lz_compress(buf, CART_FRAME_SIZE, packed, CART_FRAME_SIZE - 1)) == -1) {
+			memcpy(packed, buf, CART_FRAME_SIZE);
+			length = CART_FRAME_SIZE;
+		}
+		if((f->pack_buf == NULL && (f->pack_buf = malloc(CART_FRAME_SIZE)) == NULL)
+				|| cart_pack_place(&f->pack, length, &slot, &offset, &closed) == -1)
+			return(-1);
+		if(closed != CART_PACK_NONE && store_pack_slot(fd, closed) == -1)
+			return(-1);
+		if(offset == 0)
+			memset(f->pack_buf, 0, CART_FRAME_SIZE);
+		memcpy(f->pack_buf + offset, packed, length);
+		f->pack_dirty = 1;
+		COUNT_STAT(frames_packed, 1);
+	}
+	else
+		COUNT_STAT(zero_holes, 1);
+	return(pack_set_frame(fd, idx, slot, offset, length));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_file_frame
+// Description  : writes a whole frame of a file, packed if the file is
+//                compressed
+//
+// Inputs       : fd - the file
+//                idx - the frame of the file
+//                buf - the frame contents
+// Outputs      : return 0 if success, -1 if failed
+static int put_file_frame(int16_t fd, uint32_t idx, char *buf) {
+	if(FileArray[fd].compressed)
+		return(pack_store_frame(fd, idx, buf));
+	return(store_file_frame(fd, idx, buf));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : load_packed_frame
+// Description  : reads a frame of a compressed file, expanding its bytes
+//                from the open slot or from the cached frame of the slot
+//
+// Inputs       : fd - the file
+//                idx - the frame of the file
+//                buf - where to put the frame contents
+// Outputs      : return 0 if success, -1 if failed
+static int load_packed_frame(int16_t fd, uint32_t idx, char *buf) {
+	struct File *f = &FileArray[fd];
+	CartPackEntry e = cart_pack_lookup(&f->pack, idx);
+	CartBlock blk = CART_BLOCK_NONE;
+	const char *slot;
+	int ret = 0;
+
+	if(e.length > 0 && e.slot != f->pack.open)
+		blk = cart_blockmap_lookup(&f->map, e.slot, NULL);
+	//a hole, or a slot never stored, reads as zeros
+	if(e.length == 0 || (e.slot != f->pack.open && blk == CART_BLOCK_NONE)) {
+		memset(buf, 0, CART_FRAME_SIZE);
+		COUNT_STAT(zero_fills, 1);
+		return(0);
+	}
+	if(blk == CART_BLOCK_NONE)
+		slot = f->pack_buf;
+	else if((slot = pin_cart_frame(CART_BLOCK_CART(blk), CART_BLOCK_FRAME(blk))) == NULL)
+		return(-1);
+	if(e.length == CART_FRAME_SIZE)
+		memcpy(buf, slot, CART_FRAME_SIZE);
+	else if(cart_lz_decompress(slot + e.offset, e.length, buf, CART_FRAME_SIZE) != CART_FRAME_SIZE) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: corrupt compressed frame.");
+		ret = -1;
+	}
+	if(blk != CART_BLOCK_NONE)
+		unpin_cart_cache(CART_BLOCK_CART(blk), CART_BLOCK_FRAME(blk));
+	return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_pack_slot
+// Description  : stores the open slot of a compressed file, closing it if
+//                the file is closing (pack_buf is then freed)
+//
+// Inputs       : fd - the file
+//                close - 1 to close the slot
+// Outputs      : 0 if successful, -1 if failure
+
+static int flush_pack_slot(int16_t fd, int close) {
+	struct File *f = &FileArray[fd];
+	uint32_t slot = f->pack.open;
+
+	if(slot != CART_PACK_NONE) {
+		if(close)
+			cart_pack_close(&f->pack);
+		if(store_pack_slot(fd, slot) == -1)
+			return(-1);
+	}
+	if(close) {
+		free(f->pack_buf);
+		f->pack_buf = NULL;
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_write_buffer
+// Description  : stores the frame gathered in a file's write buffer, the
+//                buffer is then empty
+//
+// Inputs       : fd - the file
+// Outputs      : 0 if successful, -1 if failure
+
+static int flush_write_buffer(int16_t fd) {
+	struct File *f = &FileArray[fd];
+
+	if(f->wbuf_idx == -1)
+		return(0);
+	if(f->wbuf_dirty && put_file_frame(fd, f->wbuf_idx, f->wbuf) == -1)
+		return(-1);
+	f->wbuf_idx = -1;
+	f->wbuf_dirty = 0;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iov_total
+// Description  : adds up the lengths of a list of buffers
+//
+// Inputs       : iov - the buffers
+//                iovcnt - the number of buffers
+// Outputs      : total bytes, -1 if the list is bad or over 2GB
+static int32_t iov_total(const struct iovec *iov, int iovcnt) {
+	uint64_t total = 0;
+	int i;
+	if(iovcnt < 0 || (iovcnt > 0 && iov == NULL))
+		return(-1);
+	for(i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+		if(total > INT32_MAX)
+			return(-1);
+	}
+	return((int32_t)total);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : plan_frame_ops
+// Description  : splits a read or write at a file position into one
+//                operation per frame, allocating the frames a write adds
+//                past the end of the file, then orders them by cartridge so
+//                each cartridge is loaded once however the file is laid out
+//                (a frame of a compressed file goes by the slot it is packed
+//                in, nothing is allocated for it)
+//
+// Inputs       : fd - the file
+//                pos - the file position
+//                iov - the caller's buffers
+//                count - bytes from the position
+//                ops - one entry per frame spanned
+//                allocate - 1 to give frames past the end to the file
+// Outputs      : number of operations if success, -1 if failed
+static int plan_frame_ops(int16_t fd, uint32_t pos, const struct iovec *iov, int32_t count, struct FrameOp *ops, int allocate) {
+	struct File *f = &FileArray[fd];
+	uint32_t idx, run = 0, seg_off = 0;
+	int32_t done = 0, bytes, left;
+	CartBlock blk = CART_BLOCK_NONE;
+	CartPackEntry e;
+	int n = 0, seg = 0;
+
+	while(done < count) {
+		idx = pos / CART_FRAME_SIZE;
+		ops[n].frame_pos = pos % CART_FRAME_SIZE;
+		bytes = CART_FRAME_SIZE - ops[n].frame_pos;
+		if(bytes > count - done)
+			bytes = count - done;
+		ops[n].bytes = bytes;
+		ops[n].idx = idx;
+		ops[n].fresh = 0;
+		if(f->compressed) {
+			e = cart_pack_lookup(&f->pack, idx);
+			blk = (e.length > 0 && e.slot != f->pack.open) ? cart_blockmap_lookup(&f->map, e.slot, NULL) : CART_BLOCK_NONE;
+		}
+		else if(idx >= f->map.frames && allocate) {
+			//a remount maps no holes past the file's last frame
+			if(idx > f->map.frames && cart_blockmap_set(&f->map, idx - 1, CART_BLOCK_NONE) == -1)
+				return(-1);
+			if((blk = append_file_frame(fd)) == CART_BLOCK_NONE)
+				return(-1);
+			ops[n].fresh = 1;
+			run = 0;
+		}
+		else {
+			//one lookup per extent (or hole), the frames of a run follow on the cartridge
+			if(run == 0)
+				blk = cart_blockmap_lookup(&f->map, idx, &run);
+			run--;
+		}
+
+		//note the buffer the frame's bytes start in, then step past them
+		while(seg_off == iov[seg].iov_len) {
+			seg++;
+			seg_off = 0;
+		}
+		ops[n].seg = seg;
+		ops[n].seg_off = seg_off;
+		for(left = bytes; left > 0; ) {
+			if(seg_off == iov[seg].iov_len) {
+				seg++;
+				seg_off = 0;
+				continue;
+			}
+			if((uint32_t)left < iov[seg].iov_len - seg_off) {
+				seg_off += left;
+				break;
+			}
+			left -= iov[seg].iov_len - seg_off;
+			seg_off = iov[seg].iov_len;
+		}
+		ops[n++].blk = blk;
+		if(blk != CART_BLOCK_NONE && !f->compressed)
+			blk++;
+		pos += bytes;
+		done += bytes;
+	}
+	if(n > 1)
+		qsort(ops, n, sizeof(struct FrameOp), frame_op_compare);
+	return(n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : frame_op_copy
+// Description  : moves the bytes of one frame operation between the frame
+//                and however many of the caller's buffers they span
+//
+// Inputs       : op - the operation
+//                iov - the caller's buffers
+//                frame - the frame contents
+//                to_frame - 1 to copy into the frame (write), 0 out of it
+// Outputs      : none
+static void frame_op_copy(struct FrameOp *op, const struct iovec *iov, char *frame, int to_frame) {
+	uint32_t seg_off = op->seg_off, chunk;
+	int32_t left = op->bytes;
+	char *at = frame + op->frame_pos;
+	int seg = op->seg;
+
+	while(left > 0) {
+		chunk = iov[seg].iov_len - seg_off;
+		if(chunk > (uint32_t)left)
+			chunk = left;
+		if(to_frame)
+			memcpy(at, (char *)iov[seg].iov_base + seg_off, chunk);
+		else
+			memcpy((char *)iov[seg].iov_base + seg_off, at, chunk);
+		at += chunk;
+		left -= chunk;
+		seg++;
+		seg_off = 0;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : frame_ops_alloc
+// Description  : gets room for the frame operations of a request, the stack
+//                buffer unless the request spans more frames than it holds
+//
+// Inputs       : pos - the file position
+//                count - bytes from the position
+//                stack - the caller's CART_FRAME_OPS_STACK entries
+// Outputs      : the operations array, NULL if failed
+static struct FrameOp * frame_ops_alloc(uint32_t pos, int32_t count, struct FrameOp *stack) {
+	uint32_t frames = (pos + count - 1) / CART_FRAME_SIZE - pos / CART_FRAME_SIZE + 1;
+	if(frames <= CART_FRAME_OPS_STACK)
+		return(stack);
+	return(malloc(frames * sizeof(struct FrameOp)));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : frame_op_read
+// Description  : copies the bytes of one frame operation of a read out of
+//                the newest copy of the frame
+//
+// Inputs       : fd - the file
+//                op - the operation
+//                iov - the caller's buffers
+// Outputs      : return 0 if success, -1 if failed
+static int frame_op_read(int16_t fd, struct FrameOp *op, const struct iovec *iov) {
+	char tempbuf[CART_FRAME_SIZE];
+	char *frame;
+
+	//the frame being gathered is newer than any copy on the cartridge
+	if(op->idx == (uint32_t)FileArray[fd].wbuf_idx) {
+		frame_op_copy(op, iov, FileArray[fd].wbuf, 0);
+		return(0);
+	}
+	if(FileArray[fd].compressed) {
+		if(load_packed_frame(fd, op->idx, tempbuf) == -1)
+			return(-1);
+		frame_op_copy(op, iov, tempbuf, 0);
+		return(0);
+	}
+	//a hole reads as zeros without the bus
+	if(op->blk == CART_BLOCK_NONE) {
+		frame_op_copy(op, iov, zero_frame, 0);
+		COUNT_STAT(zero_fills, 1);
+		return(0);
+	}
+	//copy straight out of the pinned cache frame into the caller's buffers
+	if((frame = pin_cart_frame(CART_BLOCK_CART(op->blk), CART_BLOCK_FRAME(op->blk))) == NULL)
+		return(-1);
+	frame_op_copy(op, iov, frame, 0);
+	unpin_cart_cache(CART_BLOCK_CART(op->blk), CART_BLOCK_FRAME(op->blk));
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dir_load
+// Description  : reads a bucket of a directory through the cache
+//
+// Inputs       : dir - the directory
+//                bucket - the bucket
+//                buf - where to put the frame
+// Outputs      : return 0 if success, -1 if failed
+static int dir_load(int16_t dir, uint32_t bucket, char *buf) {
+	CartBlock blk = cart_blockmap_lookup(&FileArray[dir].map, bucket, NULL);
+	if(blk == CART_BLOCK_NONE)
+		return(-1);
+	return(RDCART_opcode(CART_BLOCK_CART(blk), CART_BLOCK_FRAME(blk), buf));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dir_store
+// Description  : writes a bucket of a directory, giving the directory a new
+//                frame for a bucket past its end
+//
+// Inputs       : dir - the directory
+//                bucket - the bucket
+//                buf - the frame contents
+// Outputs      : return 0 if success, -1 if failed
+static int dir_store(int16_t dir, uint32_t bucket, char *buf) {
+	CartBlock blk;
+	if(bucket >= FileArray[dir].map.frames) {
+		if((blk = append_file_frame(dir)) == CART_BLOCK_NONE || meta_log_frames(dir) == -1)
+			return(-1);
+	} else
+		blk = cart_blockmap_lookup(&FileArray[dir].map, bucket, NULL);
+	if(blk == CART_BLOCK_NONE)
+		return(-1);
+	//written back whatever the cache mode, after the journal (see flush_cart_frame)
+	return(put_cart_cache_dirty(CART_BLOCK_CART(blk), CART_BLOCK_FRAME(blk), buf));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dir_grow
+// Description  : doubles the buckets of a directory, splitting bucket i
+//                between i and i + buckets on the next bit of each hash
+//
+// Inputs       : dir - the directory
+// Outputs      : return 0 if success, -1 if failed
+static int dir_grow(int16_t dir) {
+	char block[CART_FRAME_SIZE], lo[CART_FRAME_SIZE], hi[CART_FRAME_SIZE];
+	uint32_t i, n = FileArray[dir].dir_buckets;
+
+	if(n * 2 > CART_DIR_MAX_BUCKETS || cart_alloc_free_frames(CART_NO_CARTRIDGE) < n) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: directory full.");
+		return(-1);
+	}
+	//the new buckets go at the end, in order, so they are written first
+	for(i = 0; i < n; i++) {
+		if(dir_load(dir, i, block) == -1)
+			return(-1);
+		cart_dir_block_split(block, lo, hi, n);
+		if(dir_store(dir, n + i, hi) == -1 || dir_store(dir, i, lo) == -1)
+			return(-1);
+	}
+	FileArray[dir].dir_buckets = n * 2;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dir_add
+// Description  : adds a name to the bucket its hash picks, doubling the
+//                directory while that bucket is full
+//
+// Inputs       : dir - the directory
+//                name, len - the name
+//                id - the file it refers to
+// Outputs      : return 0 if success, -1 if failed
+static int dir_add(int16_t dir, const char *name, size_t len, int16_t id) {
+	char block[CART_FRAME_SIZE];
+	uint32_t hash = cart_dir_hash(name, len), bucket;
+	uint8_t type = FileArray[id].is_dir ? CART_DIR_DIRECTORY : CART_DIR_FILE;
+
+	for(;;) {
+		bucket = hash & (FileArray[dir].dir_buckets - 1);
+		if(dir_load(dir, bucket, block) == -1)
+			return(-1);
+		if(cart_dir_block_add(block, hash, name, len, id, type) == 0)
+			break;
+		if(dir_grow(dir) == -1)
+			return(-1);
+	}
+	if(dir_store(dir, bucket, block) == -1)
+		return(-1);
+	FileArray[dir].dir_entries++;
+	return(meta_log_file(dir, CART_META_DIR));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dir_remove
+// Description  : removes a name from its bucket
+//
+// Inputs       : dir - the directory
+//                name, len - the name
+// Outputs      : return 0 if success, -1 if failed
+static int dir_remove(int16_t dir, const char *name, size_t len) {
+	char block[CART_FRAME_SIZE];
+	uint32_t hash = cart_dir_hash(name, len), bucket = hash & (FileArray[dir].dir_buckets - 1);
+	int offset;
+
+	if(dir_load(dir, bucket, block) == -1)
+		return(-1);
+	if((offset = cart_dir_block_find(block, hash, name, len, NULL)) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: name missing from its directory block.");
+		return(-1);
+	}
+	cart_dir_block_remove(block, offset);
+	if(dir_store(dir, bucket, block) == -1)
+		return(-1);
+	FileArray[dir].dir_entries--;
+	return(meta_log_file(dir, CART_META_DIR));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : resolve_parent
+// Description  : walks a path down to the directory holding its last
+//                component, a name table lookup per component ("/" and
+//                repeated slashes are ignored, so "a/b" is "/a/b")
+//
+// Inputs       : path - the path
+//                parent - set to the directory
+//                name, len - set to the last component, length 0 for the root
+// Outputs      : return 0 if success, -1 if a directory on the way is missing
+static int resolve_parent(const char *path, int16_t *parent, const char **name, size_t *len) {
+	const char *next;
+	int32_t id;
+
+	*parent = root_dir;
+	*len = 0;
+	for(;;) {
+		while(*path == '/')
+			path++;
+		next = strchr(path, '/');
+		*name = path;
+		*len = (next == NULL) ? strlen(path) : (size_t)(next - path);
+		for(next = path + *len; *next == '/'; next++);
+		if(*next == '\0')
+			return(0);
+		//an inner component, it must be a directory
+		id = cart_names_lookup(&file_names, *parent, path, *len);
+		if(id == -1 || !FileArray[id].is_dir) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: no such directory in path.");
+			return(-1);
+		}
+		*parent = (int16_t)id;
+		path = next;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : resolve_path
+// Description  : finds the file a path names
+//
+// Inputs       : path - the path
+// Outputs      : file handle if success, -1 if there is no such file
+static int16_t resolve_path(const char *path) {
+	const char *name;
+	int16_t parent;
+	size_t len;
+
+	if(resolve_parent(path, &parent, &name, &len) == -1)
+		return(-1);
+	if(len == 0)
+		return(parent);
+	return((int16_t)cart_names_lookup(&file_names, parent, name, len));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_file_frames
+// Description  : gives a file's frames back to the allocator, dropping any
+//                cached copies unwritten (see release_frame)
+//
+// Inputs       : fd - the file
+// Outputs      : none
+static void release_file_frames(int16_t fd) {
+	uint32_t i, j, run;
+	CartBlock blk;
+
+	for(i = 0; i < FileArray[fd].map.frames; i += run) {
+		blk = cart_blockmap_lookup(&FileArray[fd].map, i, &run);
+		for(j = 0; blk != CART_BLOCK_NONE && j < run; j++)
+			release_frame(blk + j);
+	}
+	cart_blockmap_free(&FileArray[fd].map);
+	cart_pack_free(&FileArray[fd].pack);
+	free(FileArray[fd].pack_buf);
+	FileArray[fd].pack_buf = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : new_file
+// Description  : creates an empty file or directory and enters it in its
+//                parent (the root directory has no parent)
+//
+// Inputs       : parent - the directory, -1 for the root
+//                name, len - the name
+//                is_dir - 1 for a directory
+//                compressed - 1 for a compressed file
+// Outputs      : file handle if success, -1 if failed
+static int16_t new_file(int16_t parent, const char *name, size_t len, int is_dir, int compressed) {
+	char block[CART_FRAME_SIZE];
+	CartMetaRecord rec;
+	int16_t fd;
+
+	if(len == 0 || len >= CART_MAX_PATH_LENGTH) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: bad file name.");
+		return(-1);
+	}
+	if(free_file_count > 0)
+		fd = free_files[--free_file_count];
+	else if(file_counter < CART_MAX_TOTAL_FILES)
+		fd = file_counter++;
+	else {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: too many files.");
+		return(-1);
+	}
+	memset(&FileArray[fd], 0, sizeof(struct File));
+	cart_blockmap_init(&FileArray[fd].map);
+	cart_pack_init(&FileArray[fd].pack);
+	FileArray[fd].parent = parent;
+	FileArray[fd].is_dir = is_dir;
+	FileArray[fd].compressed = compressed;
+	FileArray[fd].ra_prev = -1;
+	FileArray[fd].wbuf_idx = -1;
+	FileArray[fd].dir_buckets = is_dir ? 1 : 0;
+	if(parent == -1)
+		FileArray[fd].file_name = "";
+	else if((FileArray[fd].file_name = cart_names_insert(&file_names, parent, name, len, fd)) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to add file name.");
+		goto failed;
+	}
+	//the journal has the file before its frames
+	memset(&rec, 0, sizeof(rec));
+	rec.type = CART_META_CREATE;
+	rec.id = fd;
+	rec.parent = parent;
+	rec.is_dir = is_dir;
+	rec.compressed = compressed;
+	rec.name = FileArray[fd].file_name;
+	rec.len = strlen(rec.name);
+	if(meta_log(&rec) == -1)
+		goto unnamed;
+	if(is_dir) {
+		//a directory starts as one empty bucket
+		cart_dir_block_init(block, 1);
+		if(dir_store(fd, 0, block) == -1)
+			goto removed;
+	}
+	if(parent != -1 && dir_add(parent, name, len, fd) == -1)
+		goto removed;
+	return(fd);
+
+removed:
+	meta_log_file(fd, CART_META_REMOVE);
+unnamed:
+	if(parent != -1)
+		cart_names_remove(&file_names, parent, name, len);
+failed:
+	release_file_frames(fd);
+	FileArray[fd].file_name = NULL;
+	free_files[free_file_count++] = fd;
+	return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : remove_file
+// Description  : removes a file or empty directory from its parent and
+//                frees it, its handle is reused by a later create
+//
+// Inputs       : fd - the file
+// Outputs      : return 0 if success, -1 if failed
+static int remove_file(int16_t fd) {
+	struct File *f = &FileArray[fd];
+	size_t len = strlen(f->file_name);
+
+	if(f->file_open) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: file is open.");
+		return(-1);
+	}
+	if(dir_remove(f->parent, f->file_name, len) == -1)
+		return(-1);
+	cart_names_remove(&file_names, f->parent, f->file_name, len);
+	release_file_frames(fd);
+	f->file_name = NULL;
+	free_files[free_file_count++] = fd;
+	return(meta_log_file(fd, CART_META_REMOVE));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clone_file
+// Description  : makes a new file holding what a file does by sharing its
+//                frames, each copied when either file next writes it (see
+//                store_file_frame); only the file table changes.  A
+//                directory is cloned empty.
+//
+// Inputs       : src - the file
+//                parent - the directory of the clone
+//                name, len - its name
+// Outputs      : file handle of the clone if success, -1 if failed
+static int16_t clone_file(int16_t src, int16_t parent, const char *name, size_t len) {
+	struct File *f = &FileArray[src], *c;
+	uint32_t i, j, run, emptied;
+	CartMetaRecord rec;
+	CartPackEntry e;
+	CartBlock blk;
+	int16_t fd;
+
+	//what the file has gathered in memory reaches its map first
+	if(flush_write_buffer(src) == -1 || flush_pack_slot(src, 0) == -1)
+		return(-1);
+	if((fd = new_file(parent, name, len, f->is_dir, f->compressed)) == -1)
+		return(-1);
+	if(f->is_dir)
+		return(fd);
+	c = &FileArray[fd];
+	for(i = 0; i < f->map.frames; i += run) {
+		blk = cart_blockmap_lookup(&f->map, i, &run);
+		if(run > f->map.frames - i)
+			run = f->map.frames - i;
+		for(j = 0; j < run; j++) {
+			if(blk != CART_BLOCK_NONE && cart_alloc_share(blk + j) == -1)
+				goto failed;
+			if(cart_blockmap_set(&c->map, i + j, (blk == CART_BLOCK_NONE) ? CART_BLOCK_NONE : blk + j) == -1) {
+				if(blk != CART_BLOCK_NONE)
+					release_frame(blk + j);
+				goto failed;
+			}
+		}
+		if(blk != CART_BLOCK_NONE)
+			COUNT_STAT(frames_cloned, run);
+	}
+	c->end_pos = f->end_pos;
+
+	//the journal has the clone's frames and size as extents, then where
+	//its frames are packed
+	if(meta_log_frames(fd) == -1)
+		goto failed;
+	memset(&rec, 0, sizeof(rec));
+	rec.type = CART_META_PACK;
+	rec.id = fd;
+	for(i = 0; i < f->pack.frames; i++) {
+		e = cart_pack_lookup(&f->pack, i);
+		if(e.length == 0)
+			continue;
+		rec.frame = i;
+		rec.slot = e.slot;
+		rec.offset = e.offset;
+		rec.length = e.length;
+		if(cart_pack_set(&c->pack, i, e.slot, e.offset, e.length, &emptied) == -1 || meta_log(&rec) == -1)
+			goto failed;
+	}
+	return(fd);
+
+failed:
+	remove_file(fd);
+	return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_fragmented
+// Description  : checks whether a file is worth compacting: its frames are
+//                not one run, yet would fit on one cartridge, and no other
+//                file shares any of them (moving one would copy it)
+//
+// Inputs       : fd - the file
+//                frames - set to the frames it holds, holes aside
+//                first - set to its first frame
+// Outputs      : 1 if it should be compacted, 0 if not
+static int file_fragmented(int16_t fd, uint32_t *frames, CartBlock *first) {
+	struct File *f = &FileArray[fd];
+	CartBlock blk, last = CART_BLOCK_NONE;
+	uint32_t i, j, run, breaks = 0;
+
+	*frames = 0;
+	*first = CART_BLOCK_NONE;
+	if(f->file_name == NULL || f->is_dir)
+		return(0);
+	for(i = 0; i < f->map.frames; i += run) {
+		blk = cart_blockmap_lookup(&f->map, i, &run);
+		if(run > f->map.frames - i)
+			run = f->map.frames - i;
+		if(blk == CART_BLOCK_NONE)
+			continue;
+		for(j = 0; j < run; j++) {
+			if(cart_alloc_refs(blk + j) > 1)
+				return(0);
+		}
+		if(last == CART_BLOCK_NONE)
+			*first = blk;
+		else if(blk != last + 1)
+			breaks++;
+		last = blk + run - 1;
+		*frames += run;
+	}
+	return(breaks > 0 && *frames <= CART_CARTRIDGE_SIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compact_pick
+// Description  : looks at the next few files in turn for one to compact and
+//                reserves a run of frames for it, on the cartridge of its
+//                first frame if that has room
+//
+// Inputs       : none
+// Outputs      : none
+static void compact_pick(void) {
+	uint32_t frames, i;
+	CartBlock first;
+	int16_t fd;
+
+	for(i = 0; i < CART_COMPACT_SCAN && file_counter > 0; i++) {
+		fd = compact_scan;
+		compact_scan = (compact_scan + 1) % file_counter;
+		if(!file_fragmented(fd, &frames, &first) || (compact_run = cart_alloc_run(first, frames)) == CART_BLOCK_NONE)
+			continue;
+		compact_fd = fd;
+		compact_count = frames;
+		compact_placed = 0;
+		compact_next = 0;
+		return;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compact_end
+// Description  : finishes with the file being compacted, freeing the frames
+//                of its run it did not use
+//
+// Inputs       : none
+// Outputs      : none
+static void compact_end(void) {
+	uint32_t i;
+
+	for(i = compact_placed; i < compact_count; i++)
+		cart_alloc_free(compact_run + i);
+	compact_fd = -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compact_step
+// Description  : moves the next frames of the file being compacted into its
+//                run.  The batch is copied first and then remapped, so the
+//                journal is written once for it rather than once a frame; a
+//                frame another file has come to share ends the compaction.
+//
+// Inputs       : batch - the most frames to move
+// Outputs      : return 0 if success, -1 if failed
+static int compact_step(uint32_t batch) {
+	struct File *f = &FileArray[compact_fd];
+	uint32_t idx[CART_COMPACT_BATCH], i, n = 0;
+	uint64_t hash[CART_COMPACT_BATCH];
+	char buf[CART_FRAME_SIZE], *frame;
+	CartBlock blk, dest;
+	int ret = 0, shared = 0;
+
+	//the file may have been removed since the run was reserved
+	if(f->file_name == NULL || f->is_dir) {
+		compact_end();
+		return(0);
+	}
+	while(n < batch && compact_next < f->map.frames && compact_placed < compact_count) {
+		if((blk = cart_blockmap_lookup(&f->map, compact_next, NULL)) == CART_BLOCK_NONE) {
+			compact_next++;
+			continue;
+		}
+		if((shared = (cart_alloc_refs(blk) > 1)))
+			break;
+		dest = compact_run + compact_placed;
+		if((frame = pin_cart_frame(CART_BLOCK_CART(blk), CART_BLOCK_FRAME(blk))) == NULL) {
+			ret = -1;
+			break;
+		}
+		memcpy(buf, frame, CART_FRAME_SIZE);
+		unpin_cart_cache(CART_BLOCK_CART(blk), CART_BLOCK_FRAME(blk));
+		if(store_cart_frame(CART_BLOCK_CART(dest), CART_BLOCK_FRAME(dest), buf) == -1) {
+			delete_cart_cache(CART_BLOCK_CART(dest), CART_BLOCK_FRAME(dest));
+			ret = -1;
+			break;
+		}
+		hash[n] = dedup_enabled ? cart_dedup_hash(buf) : 0;
+		idx[n++] = compact_next++;
+		compact_placed++;
+	}
+	for(i = 0; i < n; i++) {
+		dest = compact_run + compact_placed - n + i;
+		if(remap_file_frame(compact_fd, idx[i], dest) == -1) {
+			compact_end();
+			return(-1);
+		}
+		if(dedup_enabled)
+			cart_dedup_insert(hash[i], dest);
+	}
+	COUNT_STAT(frames_compacted, n);
+	if(ret == -1 || shared || compact_next >= f->map.frames || compact_placed >= compact_count)
+		compact_end();
+	return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : driver_activity
+// Description  : sums the counters a call into the driver moves, to tell
+//                whether anything has used it between two compaction batches
+//
+// Inputs       : none
+// Outputs      : the sum
+static uint64_t driver_activity(void) {
+	return(driver_stats.cache_hits + driver_stats.cache_misses + driver_stats.zero_fills + driver_stats.bytes_read
+		+ driver_stats.bytes_written + driver_stats.page_faults + driver_stats.meta_writes);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compact_worker
+// Description  : the compaction thread, moves a batch of frames (a tenth
+//                of a second's worth at compact_rate) each tenth of a second
+//                the driver has otherwise been idle
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+static void * compact_worker(void *arg) {
+	uint64_t batch = (uint64_t)compact_rate * CART_COMPACT_INTERVAL / 1000, activity;
+	struct timespec until;
+	int16_t saved_fd;
+
+	if(batch == 0)
+		batch = 1;
+	if(batch > CART_COMPACT_BATCH)
+		batch = CART_COMPACT_BATCH;
+	pthread_mutex_lock(&compact_lock);
+	while(!compact_stop) {
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += CART_COMPACT_INTERVAL * 1000000L;
+		if(until.tv_nsec >= 1000000000L) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&compact_cond, &compact_lock, &until);
+		if(compact_stop)
+			break;
+		pthread_mutex_unlock(&compact_lock);
+
+		pthread_mutex_lock(&driver_lock);
+		if((activity = driver_activity()) == compact_activity) {
+			saved_fd = stats_fd;
+			stats_fd = CART_ALL_FILES;
+			if(compact_fd == -1)
+				compact_pick();
+			if(compact_fd != -1 && compact_step(batch) == -1)
+				logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to compact file.");
+			stats_fd = saved_fd;
+			activity = driver_activity();
+		}
+		compact_activity = activity;
+		pthread_mutex_unlock(&driver_lock);
+		pthread_mutex_lock(&compact_lock);
+	}
+	pthread_mutex_unlock(&compact_lock);
+	return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : start_compaction
+// Description  : starts the compaction thread (unless compaction is off)
+//
+// Inputs       : none
+// Outputs      : return 0 if success, -1 if failed
+static int start_compaction(void) {
+	compact_fd = -1;
+	compact_scan = 0;
+	compact_activity = driver_activity();
+	compact_stop = 0;
+	if(compact_rate == 0)
+		return(0);
+	if(pthread_create(&compact_thread, NULL, compact_worker, NULL) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to start compaction");
+		return(-1);
+	}
+	compact_running = 1;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stop_compaction
+// Description  : stops the compaction thread, giving back the frames
+//                reserved for a file it was part way through (caller must
+//                not hold driver_lock)
+//
+// Inputs       : none
+// Outputs      : none
+static void stop_compaction(void) {
+	if(!compact_running)
+		return;
+	pthread_mutex_lock(&compact_lock);
+	compact_stop = 1;
+	pthread_cond_signal(&compact_cond);
+	pthread_mutex_unlock(&compact_lock);
+	pthread_join(compact_thread, NULL);
+	compact_running = 0;
+	if(compact_fd != -1)
+		compact_end();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : meta_read
+// Description  : reads a metadata frame straight from its cartridge
+//
+// Inputs       : blk - the frame
+//                frame - where to put it
+// Outputs      : return 0 if success, -1 if failed
+static int meta_read(CartBlock blk, char *frame) {
+	if(LDCART_opcode(CART_BLOCK_CART(blk)) == -1 || RDFRME_opcode(CART_BLOCK_FRAME(blk), frame) == -1)
+		return(-1);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : meta_apply
+// Description  : replays a checkpoint or journal record into the file
+//                table; the frames a file maps are taken from the allocator
+//                and read from the cartridge when used, never at remount
+//
+// Inputs       : rec - the record
+// Outputs      : return 0 if success, -1 if the record makes no sense
+static int meta_apply(const CartMetaRecord *rec) {
+	CartBlock blk, old;
+	struct File *f;
+	uint32_t i, emptied;
+
+	if(rec->id < 0 || rec->id >= CART_MAX_TOTAL_FILES)
+		return(-1);
+	f = &FileArray[rec->id];
+	if((rec->type == CART_META_CREATE) != (f->file_name == NULL))
+		return(-1);
+	switch(rec->type) {
+	case CART_META_CREATE:
+		memset(f, 0, sizeof(struct File));
+		cart_blockmap_init(&f->map);
+		cart_pack_init(&f->pack);
+		f->parent = rec->parent;
+		f->is_dir = rec->is_dir;
+		f->compressed = rec->compressed;
+		f->dir_buckets = rec->is_dir ? 1 : 0;
+		f->ra_prev = -1;
+		f->wbuf_idx = -1;
+		if(rec->parent == -1) {
+			f->file_name = "";
+			root_dir = rec->id;
+		} else if((f->file_name = cart_names_insert(&file_names, rec->parent, rec->name, rec->len, rec->id)) == NULL)
+			return(-1);
+		if(rec->id >= file_counter)
+			file_counter = rec->id + 1;
+		break;
+	case CART_META_REMOVE:
+		if(f->parent != -1)
+			cart_names_remove(&file_names, f->parent, f->file_name, strlen(f->file_name));
+		release_file_frames(rec->id);
+		f->file_name = NULL;
+		break;
+	case CART_META_RENAME:
+		cart_names_remove(&file_names, f->parent, f->file_name, strlen(f->file_name));
+		if((f->file_name = cart_names_insert(&file_names, rec->parent, rec->name, rec->len, rec->id)) == NULL)
+			return(-1);
+		f->parent = rec->parent;
+		break;
+	case CART_META_MAP:
+		//a frame the file had is replaced, one another file has is shared
+		for(i = 0; i < rec->count; i++) {
+			blk = (rec->block == CART_BLOCK_NONE) ? CART_BLOCK_NONE : rec->block + i;
+			if((old = cart_blockmap_lookup(&f->map, rec->frame + i, NULL)) != CART_BLOCK_NONE)
+				release_frame(old);
+			if(blk != CART_BLOCK_NONE && ((cart_alloc_refs(blk) > 0) ? cart_alloc_share(blk) : cart_alloc_take(blk)) == -1)
+				return(-1);
+			if(cart_blockmap_set(&f->map, rec->frame + i, blk) == -1)
+				return(-1);
+			if(blk != CART_BLOCK_NONE)
+				MARK_WRITTEN(CART_BLOCK_CART(blk), CART_BLOCK_FRAME(blk));
+		}
+		break;
+	case CART_META_SIZE:
+		f->end_pos = rec->size;
+		break;
+	case CART_META_DIR:
+		f->dir_buckets = rec->buckets;
+		f->dir_entries = rec->entries;
+		break;
+	case CART_META_PACK:
+		//a slot the frame leaves empty is freed by the MAP record after
+		if(!f->compressed || cart_pack_set(&f->pack, rec->frame, rec->slot, rec->offset, rec->length, &emptied) == -1)
+			return(-1);
+		break;
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : meta_rebuild_dir
+// Description  : rewrites the buckets of a directory from the file table,
+//                for a remount whose journal is ahead of the blocks
+//
+// Inputs       : dir - the directory
+// Outputs      : return 0 if success, -1 if failed
+static int meta_rebuild_dir(int16_t dir) {
+	struct File *d = &FileArray[dir], *f;
+	uint32_t i, hash;
+	char *blocks;
+	int16_t fd;
+	int ret = 0;
+
+	if(d->dir_buckets == 0 || (blocks = malloc(d->dir_buckets * CART_FRAME_SIZE)) == NULL)
+		return(-1);
+	for(i = 0; i < d->dir_buckets; i++)
+		cart_dir_block_init(blocks + i * CART_FRAME_SIZE, d->dir_buckets);
+	d->dir_entries = 0;
+	for(fd = 0; ret == 0 && fd < file_counter; fd++) {
+		f = &FileArray[fd];
+		if(f->file_name == NULL || f->parent != dir)
+			continue;
+		hash = cart_dir_hash(f->file_name, strlen(f->file_name));
+		ret = cart_dir_block_add(blocks + (hash & (d->dir_buckets - 1)) * CART_FRAME_SIZE, hash, f->file_name,
+				strlen(f->file_name), fd, f->is_dir ? CART_DIR_DIRECTORY : CART_DIR_FILE);
+		d->dir_entries++;
+	}
+	for(i = 0; ret == 0 && i < d->dir_buckets; i++)
+		ret = dir_store(dir, i, blocks + i * CART_FRAME_SIZE);
+	free(blocks);
+	return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : meta_mount
+// Description  : rebuilds the file table from the checkpoint the superblock
+//                points at and the journal frames written since, reading
+//                only those and the first stale slot after them.  The blocks
+//                of a directory are written after the journal, so those of
+//                directories the journal changed are rewritten.
+//
+// Inputs       : none
+// Outputs      : return 0 if success, 1 if there is no file system, -1 if failed
+static int meta_mount(void) {
+	char frame[CART_FRAME_SIZE];
+	uint8_t touched[CART_MAX_TOTAL_FILES];
+	CartMetaRecord rec;
+	CartBlock blk, *grown;
+	uint32_t tag, slot;
+	int offset;
+
+	if(meta_read(CART_META_SUPERBLOCK, frame) == -1)
+		return(-1);
+	if(cart_meta_super_decode(frame, &superblock) == -1)
+		return(1);
+	journal_replaying = 1;
+	memset(touched, 0, sizeof(touched));
+	for(blk = superblock.checkpoint; blk != CART_BLOCK_NONE; blk = tag) {
+		if(meta_read(blk, frame) == -1 || cart_meta_frame_check(frame, CART_META_CHECKPOINT_MAGIC, &tag) == -1
+				|| cart_alloc_take(blk) == -1)
+			goto failed;
+		if((grown = realloc(checkpoint_frames, (checkpoint_count + 1) * sizeof(CartBlock))) == NULL)
+			goto failed;
+		checkpoint_frames = grown;
+		checkpoint_frames[checkpoint_count++] = blk;
+		for(offset = 0; cart_meta_frame_next(frame, &offset, &rec); ) {
+			if(meta_apply(&rec) == -1)
+				goto failed;
+		}
+	}
+
+	//a slot belongs to this journal while it carries the next sequence number,
+	//logging carries on in the last one
+	journal_seq = superblock.sequence;
+	cart_meta_frame_init(journal_frame, CART_META_JOURNAL_MAGIC, journal_seq);
+	for(slot = 0; slot < CART_META_JOURNAL_FRAMES; slot++) {
+		if(meta_read(CART_META_SUPERBLOCK + 1 + slot, frame) == -1)
+			goto failed;
+		if(cart_meta_frame_check(frame, CART_META_JOURNAL_MAGIC, &tag) == -1 || tag != superblock.sequence + slot)
+			break;
+		for(offset = 0; cart_meta_frame_next(frame, &offset, &rec); ) {
+			if(rec.id >= 0 && rec.id < CART_MAX_TOTAL_FILES && FileArray[rec.id].file_name != NULL
+					&& FileArray[rec.id].parent >= 0 && (rec.type == CART_META_REMOVE || rec.type == CART_META_RENAME))
+				touched[FileArray[rec.id].parent] = 1;
+			if(meta_apply(&rec) == -1)
+				goto failed;
+			if(rec.type == CART_META_CREATE || rec.type == CART_META_RENAME)
+				touched[(rec.parent >= 0) ? rec.parent : rec.id] = 1;
+			else if(rec.type == CART_META_DIR)
+				touched[rec.id] = 1;
+		}
+		memcpy(journal_frame, frame, CART_FRAME_SIZE);
+		journal_seq = tag;
+	}
+	journal_replaying = 0;
+	journal_dirty = 0;
+	if(root_dir == -1 || FileArray[root_dir].file_name == NULL)
+		goto failed;
+	for(free_file_count = 0, offset = file_counter - 1; offset >= 0; offset--) {
+		FileArray[offset].meta_frames = FileArray[offset].map.frames;
+		FileArray[offset].meta_size = FileArray[offset].end_pos;
+		if(FileArray[offset].file_name == NULL)
+			free_files[free_file_count++] = offset;
+		else if(touched[offset] && FileArray[offset].is_dir && meta_rebuild_dir(offset) == -1)
+			goto failed;
+	}
+	return(0);
+
+failed:
+	journal_replaying = 0;
+	logMessage(LOG_ERROR_LEVEL, "CART driver failed: file system metadata damaged.");
+	return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : meta_format
+// Description  : starts an empty file system, the root directory alone
+//
+// Inputs       : none
+// Outputs      : return 0 if success, -1 if failed
+static int meta_format(void) {
+	char frame[CART_FRAME_SIZE];
+	CartMetaSuper old;
+
+	//numbered past any journal frame an earlier file system left in the ring
+	if(meta_read(CART_META_SUPERBLOCK, frame) == -1)
+		return(-1);
+	superblock.sequence = (cart_meta_super_decode(frame, &old) == 0) ? old.sequence + CART_META_JOURNAL_FRAMES : 1;
+	superblock.checkpoint = CART_BLOCK_NONE;
+	journal_seq = superblock.sequence;
+	cart_meta_frame_init(journal_frame, CART_META_JOURNAL_MAGIC, journal_seq);
+	journal_dirty = 0;
+	//the root directory holds every path, its blocks go through the cache
+	if((root_dir = new_file(-1, "/", 1, 1, 0)) == -1)
+		return(-1);
+	return(meta_checkpoint());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_open_locked
+// Description  : This function opens the file and returns a file handle
+//
+// Inputs       : path - filename of the file to open
+//                flags - CART_OPEN_* modes of a file the open creates
+// Outputs      : file handle if successful, -1 if failure
+
+static int16_t cart_open_locked(char *path, int32_t flags) {
+	int length = strlen(path) +1; //includes '/0'
+	const char *name;
+	int16_t parent;
+	size_t len;
+	//look each component up in the name table
+	int i;
+	if(length > CART_MAX_PATH_LENGTH) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: path too long.");
+		return(-1);
+	}
+	if(resolve_parent(path, &parent, &name, &len) == -1)
+		return(-1);
+	if(len == 0 || ((i = cart_names_lookup(&file_names, parent, name, len)) != -1 && FileArray[i].is_dir)) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: path is a directory.");
+		return(-1);
+	}
+	//a new file is created in its directory
+	stats_fd = CART_ALL_FILES;
+	if(i == -1 && (i = new_file(parent, name, len, 0, (flags & CART_OPEN_COMPRESSED) != 0)) == -1)
+		return(-1);
+	//if file open
+	if(FileArray[i].file_open == 1) {
+		return(-1);
+	} 
+	FileArray[i].file_open = 1;
+	FileArray[i].current_pos= 0;
+	FileArray[i].ra_prev = -1;
+	FileArray[i].ra_size = 0;
+
+	// THIS SHOULD RETURN A FILE HANDLE
+	return (i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_close_locked
+// Description  : This function closes the file
+//
+// Inputs       : fd - the file descriptor
+// Outputs      : 0 if successful, -1 if failure
+
+static int16_t cart_close_locked(int16_t fd) {
+	if (fd >= CART_MAX_TOTAL_FILES || fd <0) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: bad file handle.");
+		return (-1);
+	}
+
+	if (FileArray[fd].file_open == 0) {
+		//file has already been closed
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: file is closed.");
+		return (-1);
+	}
+	if (FileArray[fd].mapped > 0) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: file is mapped.");
+		return (-1);
+	}
+	stats_fd = fd;
+	FileArray[fd].file_open = 0;
+	//write back the file's dirty frames, the gathered one and the open slot first
+	if(flush_write_buffer(fd) == -1 || flush_pack_slot(fd, 1) == -1 || flush_file_frames(fd) == -1)
+		return(-1);
+	free(FileArray[fd].wbuf);
+	FileArray[fd].wbuf = NULL;
+	// Return successfully
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_fsync_locked
+// Description  : Write back every dirty cached frame of the file, then the
+//                metadata journal
+//
+// Inputs       : fd - the file descriptor
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t cart_fsync_locked(int16_t fd) {
+	if (fd >= CART_MAX_TOTAL_FILES || fd <0) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: bad file handle.");
+		return (-1);
+	}
+
+	if (FileArray[fd].file_open == 0) {
+		//file has already been closed
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: file is closed.");
+		return (-1);
+	}
+	stats_fd = fd;
+	//the file's frames, then the journal naming them
+	if(flush_write_buffer(fd) == -1 || flush_pack_slot(fd, 0) == -1 || flush_file_frames(fd) == -1)
+		return (-1);
+	return (meta_commit());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_open_file
+// Description  : checks a handle names an open (regular) file, and charges
+//                the bus work that follows to it
+//
+// Inputs       : fd - the file descriptor
+// Outputs      : 0 if successful, -1 if failure
+
+static int check_open_file(int16_t fd) {
+	if (fd >= CART_MAX_TOTAL_FILES || fd <0) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: bad file handle.");
+		return (-1);
+	}
+
+	if (FileArray[fd].file_open == 0) {
+		//file has already been closed
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: file is closed.");
+		return (-1);
+	}
+	if (FileArray[fd].is_dir) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: file is a directory.");
+		return (-1);
+	}
+	stats_fd = fd;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : map_invalidate
+// Description  : drops the clean view pages of a file that a write has made
+//                stale, so they are read again on their next touch (dirty
+//                pages are left alone, cart_msync writes them over it)
+//
+// Inputs       : fd - the file written
+//                pos - the first byte written
+//                count - the number of bytes
+// Outputs      : none
+static void map_invalidate(int16_t fd, uint32_t pos, uint32_t count) {
+	struct Mapping *m;
+	size_t page, last;
+	int i;
+
+	if(FileArray[fd].mapped == 0 || count == 0)
+		return;
+	for(i = 0; i < CART_MAX_MAPPINGS; i++) {
+		m = &mappings[i];
+		if(m->addr == NULL || m->fd != fd || pos >= m->len)
+			continue;
+		last = ((pos + count > m->len) ? m->len : pos + count) - 1;
+		for(page = pos / map_page_size; page <= last / map_page_size; page++) {
+			if(m->pages[page] != MAP_PAGE_CLEAN)
+				continue;
+			mprotect(m->addr + page * map_page_size, map_page_size, PROT_NONE);
+			madvise(m->fill + page * map_page_size, map_page_size, MADV_REMOVE);
+			m->pages[page] = MAP_PAGE_ABSENT;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_readv
+// Description  : reads the file at a position into a list of buffers, one
+//                pass over the frames however the bytes are split up
+//
+// Inputs       : fd - the file
+//                iov - the buffers
+//                iovcnt - the number of buffers
+//                pos - where in the file to read from
+// Outputs      : bytes read if successful, -1 if failure
+
+static int32_t file_readv(int16_t fd, const struct iovec *iov, int iovcnt, uint32_t pos) {
+	struct FrameOp stack_ops[CART_FRAME_OPS_STACK], *ops;
+	int32_t read_length = iov_total(iov, iovcnt);
+	int i, n, ret = -1;
+	uint32_t idx;
+
+	if(read_length < 0)
+		return (-1);
+	if(pos >= (uint32_t)FileArray[fd].end_pos)
+		return (0);
+	if((uint32_t)read_length > FileArray[fd].end_pos - pos) {
+		read_length = FileArray[fd].end_pos - pos;
+	}
+	if(read_length == 0)
+		return (0);
+	if((ops = frame_ops_alloc(pos, read_length, stack_ops)) == NULL)
+		return (-1);
+	if((n = plan_frame_ops(fd, pos, iov, read_length, ops, 0)) == -1)
+		goto done;
+
+	//the readahead window follows the file order, the reads themselves go
+	//a cartridge at a time (the frames of a compressed file are not those
+	//of its map, and each slot read serves several)
+	for(idx = pos/CART_FRAME_SIZE; !FileArray[fd].compressed && idx <= (pos+read_length-1)/CART_FRAME_SIZE; idx++)
+		file_readahead(fd, idx);
+	for(i = 0; i < n; i++) {
+		if(frame_op_read(fd, &ops[i], iov) == -1)
+			goto done;
+	}
+	COUNT_STAT(bytes_read, read_length);
+	ret = read_length;
+
+done:
+	if(ops != stack_ops)
+		free(ops);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_file_frame
+// Description  : reads the frame a write touches only part of, zeros if it
+//                is new or a hole
+//
+// Inputs       : fd - the file
+//                op - the frame operation
+//                buf - where to put the frame contents
+// Outputs      : 0 if successful, -1 if failure
+
+static int read_file_frame(int16_t fd, struct FrameOp *op, char *buf) {
+	if(FileArray[fd].compressed)
+		return(load_packed_frame(fd, op->idx, buf));
+	if(op->fresh || op->blk == CART_BLOCK_NONE) {
+		memset(buf, 0, CART_FRAME_SIZE);
+		return(0);
+	}
+	return(RDCART_opcode(CART_BLOCK_CART(op->blk), CART_BLOCK_FRAME(op->blk), buf));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_writev
+// Description  : writes a list of buffers to the file at a position (at most
+//                its end), each frame read and stored once
+//
+// Inputs       : fd - the file
+//                iov - the buffers
+//                iovcnt - the number of buffers
+//                pos - where in the file to write
+// Outputs      : bytes written if successful, -1 if failure
+
+static int32_t file_writev(int16_t fd, const struct iovec *iov, int iovcnt, uint32_t pos) {
+	struct FrameOp stack_ops[CART_FRAME_OPS_STACK], *ops;
+	int32_t count = iov_total(iov, iovcnt);
+	char tempbuf[CART_FRAME_SIZE];
+	struct File *f = &FileArray[fd];
+	int i, n, tail, moved = -1, ret = -1;
+
+	if(count < 0)
+		return (-1);
+	if(pos > (uint32_t)FileArray[fd].end_pos) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: write past end of file.");
+		return (-1);
+	}
+	if(count == 0)
+		return (0);
+	if((ops = frame_ops_alloc(pos, count, stack_ops)) == NULL)
+		return (-1);
+	if((n = plan_frame_ops(fd, pos, iov, count, ops, 1)) == -1)
+		goto done;
+
+	//a write ending part way into a frame leaves the cursor there, so that
+	//frame is gathered in the write buffer for the writes that follow
+	tail = ((pos + count) % CART_FRAME_SIZE != 0) ? (int)((pos + count) / CART_FRAME_SIZE) : -1;
+	for(i = 0; i < n; i++){
+		//storing the frame gathered before may have moved it (see store_file_frame)
+		if((int)ops[i].idx == moved && !f->compressed)
+			ops[i].blk = cart_blockmap_lookup(&f->map, ops[i].idx, NULL);
+		if((int)ops[i].idx == f->wbuf_idx) {
+			frame_op_copy(&ops[i], iov, f->wbuf, 1);
+			f->wbuf_dirty = 1;
+			COUNT_STAT(frames_coalesced, 1);
+			continue;
+		}
+		if((int)ops[i].idx == tail && (f->wbuf != NULL || (f->wbuf = malloc(CART_FRAME_SIZE)) != NULL)) {
+			moved = f->wbuf_idx;
+			if(flush_write_buffer(fd) == -1 || read_file_frame(fd, &ops[i], f->wbuf) == -1)
+				goto done;
+			frame_op_copy(&ops[i], iov, f->wbuf, 1);
+			f->wbuf_idx = ops[i].idx;
+			f->wbuf_dirty = 1;
+			continue;
+		}
+		//a frame written whole needs nothing read back first, nor does a new one or a hole
+		if(ops[i].bytes < CART_FRAME_SIZE && read_file_frame(fd, &ops[i], tempbuf) == -1)
+			goto done;
+		//update
+		frame_op_copy(&ops[i], iov, tempbuf, 1);
+		if(put_file_frame(fd, ops[i].idx, tempbuf) == -1)
+			goto done;
+	}
+	//the cursor has left a frame gathered earlier
+	if(f->wbuf_idx != tail && flush_write_buffer(fd) == -1)
+		goto done;
+	if ((uint32_t)FileArray[fd].end_pos < pos + count){
+		FileArray[fd].end_pos = pos + count;
+	}
+	map_invalidate(fd, pos, count);
+	COUNT_STAT(bytes_written, count);
+	ret = count;
+
+done:
+	if(ops != stack_ops)
+		free(ops);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : map_find
+// Description  : finds the view holding an address
+//
+// Inputs       : addr - the address
+// Outputs      : the view, NULL if no view holds it
+static struct Mapping * map_find(const void *addr) {
+	const char *p = addr;
+	int i;
+
+	for(i = 0; i < CART_MAX_MAPPINGS; i++) {
+		if(mappings[i].addr != NULL && p >= mappings[i].addr && p < mappings[i].addr + mappings[i].span)
+			return(&mappings[i]);
+	}
+	return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : map_overlaps
+// Description  : checks whether any byte of a range lies in a view
+//
+// Inputs       : addr - the first byte
+//                len - the bytes in the range
+// Outputs      : 1 if a view holds part of it, 0 if not
+static int map_overlaps(const void *addr, size_t len) {
+	const char *p = addr;
+	int i;
+
+	for(i = 0; i < CART_MAX_MAPPINGS; i++) {
+		if(mappings[i].addr != NULL && len > 0 && p < mappings[i].addr + mappings[i].span && p + len > mappings[i].addr)
+			return(1);
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_buffers
+// Description  : checks a call's buffers are not in a view: a page of one
+//                touched while the call holds driver_lock could not be
+//                faulted in (see map_fault)
+//
+// Inputs       : iov - the buffers
+//                iovcnt - the number of buffers
+// Outputs      : 0 if none is in a view, -1 if one is
+static int check_buffers(const struct iovec *iov, int iovcnt) {
+	int i;
+
+	if(iovcnt > 0 && map_overlaps(iov, (size_t)iovcnt * sizeof(struct iovec))) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: buffer is in a mapped view.");
+		return(-1);
+	}
+	for(i = 0; i < iovcnt; i++) {
+		if(map_overlaps(iov[i].iov_base, iov[i].iov_len)) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: buffer is in a mapped view.");
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : map_fill_page
+// Description  : reads a page of a view from its file (the cache, the
+//                write buffer or the bus) through the view's writable
+//                alias, then opens the page read only, so no thread sees it
+//                half filled
+//
+// Inputs       : m - the view
+//                page - the page of the view
+// Outputs      : 0 if successful, -1 if failure
+static int map_fill_page(struct Mapping *m, size_t page) {
+	size_t off = page * map_page_size;
+	struct iovec iov;
+
+	iov.iov_base = m->fill + off;
+	iov.iov_len = (m->len - off < map_page_size) ? m->len - off : map_page_size;
+	if(file_readv(m->fd, &iov, 1, off) == -1)
+		return(-1);
+	memset(m->fill + off + iov.iov_len, 0, map_page_size - iov.iov_len);
+	if(mprotect(m->addr + off, map_page_size, PROT_READ) == -1)
+		return(-1);
+	m->pages[page] = MAP_PAGE_CLEAN;
+	COUNT_STAT(page_faults, 1);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : map_fault
+// Description  : the SIGSEGV handler; the first touch of a view page reads
+//                it in read only, the first write to it then makes it
+//                writable and dirty.  Faults outside the views go to the
+//                handling there was before.  The driver calls never touch a
+//                view (check_buffers), should one fault with driver_lock
+//                held the program is stopped.
+//
+// Inputs       : sig - SIGSEGV
+//                info - the faulting address
+//                context - the interrupted context
+// Outputs      : none
+static void map_fault(int sig, siginfo_t *info, void *context) {
+	struct Mapping *m;
+	int16_t saved_fd;
+	size_t page;
+	int ret = 0;
+
+	if(pthread_mutex_lock(&driver_lock) != 0)
+		abort();
+	if((m = map_find(info->si_addr)) == NULL) {
+		pthread_mutex_unlock(&driver_lock);
+		if(map_old_action.sa_flags & SA_SIGINFO)
+			map_old_action.sa_sigaction(sig, info, context);
+		else if(map_old_action.sa_handler != SIG_DFL && map_old_action.sa_handler != SIG_IGN)
+			map_old_action.sa_handler(sig);
+		else
+			signal(SIGSEGV, SIG_DFL); //the access faults again, and ends the program
+		return;
+	}
+	page = ((char *)info->si_addr - m->addr) / map_page_size;
+	saved_fd = stats_fd;
+	stats_fd = m->fd;
+	//threads faulting on one page queue on driver_lock, a page the others
+	//have made dirty meanwhile needs nothing more and the access is retried
+	if(m->pages[page] == MAP_PAGE_ABSENT)
+		ret = map_fill_page(m, page);
+	else if(m->pages[page] == MAP_PAGE_CLEAN && mprotect(m->addr + page * map_page_size, map_page_size, PROT_READ | PROT_WRITE) == 0)
+		m->pages[page] = MAP_PAGE_DIRTY;
+	else if(m->pages[page] != MAP_PAGE_DIRTY)
+		ret = -1;
+	stats_fd = saved_fd;
+	pthread_mutex_unlock(&driver_lock);
+	if(ret == -1)
+		abort();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : map_sync
+// Description  : writes the dirty pages of part of a view back to its file,
+//                each is made read only first so a write racing the sync
+//                faults and dirties it again
+//
+// Inputs       : m - the view
+//                first - the first page
+//                last - the last page
+// Outputs      : 0 if successful, -1 if failure
+static int map_sync(struct Mapping *m, size_t first, size_t last) {
+	struct iovec iov;
+	size_t page, off;
+
+	for(page = first; page <= last; page++) {
+		if(m->pages[page] != MAP_PAGE_DIRTY)
+			continue;
+		off = page * map_page_size;
+		if(mprotect(m->addr + off, map_page_size, PROT_READ) == -1)
+			return(-1);
+		m->pages[page] = MAP_PAGE_CLEAN;
+		iov.iov_base = m->fill + off;
+		iov.iov_len = (m->len - off < map_page_size) ? m->len - off : map_page_size;
+		if(file_writev(m->fd, &iov, 1, off) != (int32_t)iov.iov_len)
+			return(-1);
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_read_locked
+// Description  : Reads "count" bytes from the file handle "fh" into the 
+//                buffer "buf"
+//
+// Inputs       : fd - filename of the file to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+// Outputs      : bytes read if successful, -1 if failure
+
+static int32_t cart_read_locked(int16_t fd, void *buf, int32_t count) {
+	struct iovec iov = { buf, (size_t)count };
+	int32_t ret;
+	if (check_open_file(fd) == -1 || count < 0 || check_buffers(&iov, 1) == -1)
+		return (-1);
+	if ((ret = file_readv(fd, &iov, 1, FileArray[fd].current_pos)) > 0)
+		FileArray[fd].current_pos += ret;
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_write_locked
+// Description  : Writes "count" bytes to the file handle "fh" from the 
+//                buffer  "buf"
+//
+// Inputs       : fd - filename of the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+// Outputs      : bytes written if successful, -1 if failure
+
+static int32_t cart_write_locked(int16_t fd, void *buf, int32_t count) {
+	struct iovec iov = { buf, (size_t)count };
+	int32_t ret;
+	if (check_open_file(fd) == -1 || count < 0 || check_buffers(&iov, 1) == -1)
+		return (-1);
+	if ((ret = file_writev(fd, &iov, 1, FileArray[fd].current_pos)) > 0)
+		FileArray[fd].current_pos += ret;
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_pread_locked
+// Description  : Reads "count" bytes at a position, leaving the file
+//                position alone
+//
+// Inputs       : fd - the file descriptor
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+//                loc - where in the file to read from
+// Outputs      : bytes read if successful, -1 if failure
+
+static int32_t cart_pread_locked(int16_t fd, void *buf, int32_t count, uint32_t loc) {
+	struct iovec iov = { buf, (size_t)count };
+	if (check_open_file(fd) == -1 || count < 0 || check_buffers(&iov, 1) == -1)
+		return (-1);
+	return (file_readv(fd, &iov, 1, loc));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_pwrite_locked
+// Description  : Writes "count" bytes at a position (at most the end of the
+//                file), leaving the file position alone
+//
+// Inputs       : fd - the file descriptor
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+//                loc - where in the file to write
+// Outputs      : bytes written if successful, -1 if failure
+
+static int32_t cart_pwrite_locked(int16_t fd, void *buf, int32_t count, uint32_t loc) {
+	struct iovec iov = { buf, (size_t)count };
+	if (check_open_file(fd) == -1 || count < 0 || check_buffers(&iov, 1) == -1)
+		return (-1);
+	return (file_writev(fd, &iov, 1, loc));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_readv_locked
+// Description  : Reads from the file position into a list of buffers
+//
+// Inputs       : fd - the file descriptor
+//                iov - the buffers, filled in order
+//                iovcnt - the number of buffers
+// Outputs      : bytes read if successful, -1 if failure
+
+static int32_t cart_readv_locked(int16_t fd, const struct iovec *iov, int iovcnt) {
+	int32_t ret;
+	if (check_open_file(fd) == -1 || check_buffers(iov, iovcnt) == -1)
+		return (-1);
+	if ((ret = file_readv(fd, iov, iovcnt, FileArray[fd].current_pos)) > 0)
+		FileArray[fd].current_pos += ret;
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_writev_locked
+// Description  : Writes a list of buffers at the file position
+//
+// Inputs       : fd - the file descriptor
+//                iov - the buffers, written in order
+//                iovcnt - the number of buffers
+// Outputs      : bytes written if successful, -1 if failure
+
+static int32_t cart_writev_locked(int16_t fd, const struct iovec *iov, int iovcnt) {
+	int32_t ret;
+	if (check_open_file(fd) == -1 || check_buffers(iov, iovcnt) == -1)
+		return (-1);
+	if ((ret = file_writev(fd, iov, iovcnt, FileArray[fd].current_pos)) > 0)
+		FileArray[fd].current_pos += ret;
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_seek_locked
+// Description  : Seek to specific point in the file
+//
+// Inputs       : fd - filename of the file to write to
+//                loc - offfset of file in relation to beginning of file
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t cart_seek_locked(int16_t fd, uint32_t loc) {
+	if (fd >= CART_MAX_TOTAL_FILES || fd <0) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: bad file handle.");
+		return (-1);
+	}
+
+	if (FileArray[fd].file_open == 0) {
+		//file has already been closed
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: file is closed.");
+		return (-1);
+	}
+	if (FileArray[fd].is_dir) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: file is a directory.");
+		return (-1);
+	}
+	if(loc > FileArray[fd].end_pos){
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: loc exceeds file length.");
+		return (-1);
+	}
+	//the cursor leaves any frame being gathered
+	stats_fd = fd;
+	if(flush_write_buffer(fd) == -1)
+		return (-1);
+	FileArray[fd].current_pos= loc;
+	// Return successfully
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_truncate_locked
+// Description  : Set the size of a file.  A longer file reads as zeros past
+//                its old end (holes, nothing is stored); a shorter one gives
+//                the frames past its new end back to the allocator, and the
+//                bytes of its last frame past the end are zeroed so growing
+//                it again finds zeros there.
+//
+// Inputs       : fd - the file descriptor
+//                size - the new size in bytes
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t cart_truncate_locked(int16_t fd, uint32_t size) {
+	struct File *f;
+	char zeros[CART_FRAME_SIZE];
+	struct iovec iov;
+	uint32_t keep, i, j, run;
+	CartMetaRecord rec;
+	CartBlock blk;
+
+	if(check_open_file(fd) == -1)
+		return (-1);
+	f = &FileArray[fd];
+	if(size >= (uint32_t)f->end_pos) {
+		//the size reaches the journal at the next commit
+		f->end_pos = size;
+		return (0);
+	}
+	if(f->mapped > 0) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: file is mapped.");
+		return (-1);
+	}
+	keep = (size + CART_FRAME_SIZE - 1) / CART_FRAME_SIZE;
+	if(size % CART_FRAME_SIZE != 0) {
+		memset(zeros, 0, sizeof(zeros));
+		iov.iov_base = zeros;
+		iov.iov_len = ((keep * CART_FRAME_SIZE < (uint32_t)f->end_pos) ? keep * CART_FRAME_SIZE : (uint32_t)f->end_pos) - size;
+		if(file_writev(fd, &iov, 1, size) == -1)
+			return (-1);
+	}
+	//a frame gathered past the new end is dropped with the rest
+	if(f->wbuf_idx >= (int)keep) {
+		f->wbuf_idx = -1;
+		f->wbuf_dirty = 0;
+	}
+
+	if(f->compressed) {
+		//the slots a compressed file no longer packs anything in are freed
+		for(i = keep; i < f->pack.frames; i++) {
+			if(cart_pack_lookup(&f->pack, i).length > 0 && pack_set_frame(fd, i, CART_PACK_NONE, 0, 0) == -1)
+				return (-1);
+		}
+	}
+	else {
+		for(i = keep; i < f->map.frames; i += run) {
+			blk = cart_blockmap_lookup(&f->map, i, &run);
+			if(run > f->map.frames - i)
+				run = f->map.frames - i;
+			for(j = 0; blk != CART_BLOCK_NONE && j < run; j++)
+				release_frame(blk + j);
+		}
+		cart_blockmap_truncate(&f->map, keep);
+		//the journal has the frames gone before any is used again
+		if(keep < f->meta_frames) {
+			memset(&rec, 0, sizeof(rec));
+			rec.type = CART_META_MAP;
+			rec.id = fd;
+			rec.frame = keep;
+			rec.block = CART_BLOCK_NONE;
+			rec.count = f->meta_frames - keep;
+			f->meta_frames = keep;
+			if(meta_log(&rec) == -1)
+				return (-1);
+			journal_frees = 1;
+		}
+	}
+	f->end_pos = size;
+	if(f->current_pos > f->end_pos)
+		f->current_pos = f->end_pos;
+	f->ra_prev = -1;
+	f->ra_size = 0;
+	f->meta_size = f->end_pos;
+	return (meta_log_file(fd, CART_META_SIZE));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_stats_locked
+// Description  : Get the counters of a file, or of the whole driver
+//
+// Inputs       : fd - the file descriptor, or CART_ALL_FILES
+//                stats - the structure to fill in
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t cart_stats_locked(int16_t fd, CartDriverStats *stats) {
+	if (fd == CART_ALL_FILES) {
+		*stats = driver_stats;
+		return (0);
+	}
+	if (fd >= file_counter || fd <0) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: bad file handle.");
+		return (-1);
+	}
+	*stats = FileArray[fd].stats;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_mkdir_locked
+// Description  : Create a directory
+//
+// Inputs       : path - the path of the new directory
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t cart_mkdir_locked(char *path) {
+	const char *name;
+	int16_t parent;
+	size_t len;
+	if(strlen(path) + 1 > CART_MAX_PATH_LENGTH) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: path too long.");
+		return(-1);
+	}
+	if(resolve_parent(path, &parent, &name, &len) == -1)
+		return(-1);
+	if(len == 0 || cart_names_lookup(&file_names, parent, name, len) != -1) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: path exists.");
+		return(-1);
+	}
+	stats_fd = CART_ALL_FILES;
+	return((new_file(parent, name, len, 1, 0) == -1) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_rmdir_locked
+// Description  : Remove an empty directory
+//
+// Inputs       : path - the path of the directory
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t cart_rmdir_locked(char *path) {
+	int16_t fd = resolve_path(path);
+	if(fd == -1 || !FileArray[fd].is_dir || fd == root_dir) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: no such directory.");
+		return(-1);
+	}
+	if(FileArray[fd].dir_entries > 0) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: directory not empty.");
+		return(-1);
+	}
+	stats_fd = CART_ALL_FILES;
+	return(remove_file(fd));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_opendir_locked
+// Description  : Open a directory for cart_readdir
+//
+// Inputs       : path - the path of the directory
+// Outputs      : file handle if successful, -1 if failure
+
+static int16_t cart_opendir_locked(char *path) {
+	int16_t fd = resolve_path(path);
+	if(fd == -1 || !FileArray[fd].is_dir) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: no such directory.");
+		return(-1);
+	}
+	if(FileArray[fd].file_open == 1)
+		return(-1);
+	FileArray[fd].file_open = 1;
+	FileArray[fd].current_pos = 0;
+	return(fd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_readdir_locked
+// Description  : Read the next entry of an open directory.  The position is
+//                the bucket and offset of the next entry, entries come in
+//                bucket order and a directory that grows meanwhile may
+//                return some twice.
+//
+// Inputs       : fd - the directory
+//                entry - the entry read
+// Outputs      : 1 if an entry was read, 0 at the end, -1 if failure
+
+static int32_t cart_readdir_locked(int16_t fd, CartDirEntry *entry) {
+	char block[CART_FRAME_SIZE];
+	CartDirRecord rec;
+	int offset, bucket;
+	if (fd >= CART_MAX_TOTAL_FILES || fd <0) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: bad file handle.");
+		return (-1);
+	}
+
+	if (FileArray[fd].file_open == 0 || !FileArray[fd].is_dir) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: directory is not open.");
+		return (-1);
+	}
+	stats_fd = fd;
+	for(;;) {
+		bucket = FileArray[fd].current_pos / CART_FRAME_SIZE;
+		offset = FileArray[fd].current_pos % CART_FRAME_SIZE;
+		if(bucket >= (int)FileArray[fd].dir_buckets)
+			return (0);
+		if(dir_load(fd, bucket, block) == -1)
+			return (-1);
+		if(cart_dir_block_next(block, &offset, &rec))
+			break;
+		FileArray[fd].current_pos = (bucket + 1) * CART_FRAME_SIZE;
+	}
+	FileArray[fd].current_pos = bucket * CART_FRAME_SIZE + offset;
+	memcpy(entry->name, rec.name, rec.len);
+	entry->name[rec.len] = '\0';
+	entry->is_dir = (rec.type == CART_DIR_DIRECTORY);
+	entry->size = entry->is_dir ? 0 : FileArray[rec.id].end_pos;
+	return (1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_unlink_locked
+// Description  : Remove a file, its frames are freed for reuse
+//
+// Inputs       : path - the path of the file
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t cart_unlink_locked(char *path) {
+	int16_t fd = resolve_path(path);
+	if(fd == -1 || FileArray[fd].is_dir) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: no such file.");
+		return(-1);
+	}
+	stats_fd = CART_ALL_FILES;
+	return(remove_file(fd));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_rename_locked
+// Description  : Move a file or directory to a new path, replacing a file
+//                already there
+//
+// Inputs       : oldpath - the current path
+//                newpath - the new path
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t cart_rename_locked(char *oldpath, char *newpath) {
+	const char *name, *old_name;
+	int16_t fd, parent, old_parent, target, p;
+	size_t len, old_len;
+	CartMetaRecord rec;
+	if(strlen(oldpath) + 1 > CART_MAX_PATH_LENGTH || strlen(newpath) + 1 > CART_MAX_PATH_LENGTH) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: path too long.");
+		return(-1);
+	}
+	if((fd = resolve_path(oldpath)) == -1 || fd == root_dir) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: no such file.");
+		return(-1);
+	}
+	if(resolve_parent(newpath, &parent, &name, &len) == -1)
+		return(-1);
+	//a directory cannot move inside itself
+	for(p = parent; p != root_dir; p = FileArray[p].parent) {
+		if(p == fd) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: directory moved into itself.");
+			return(-1);
+		}
+	}
+	if(len == 0 || (target = (int16_t)cart_names_lookup(&file_names, parent, name, len)) == fd)
+		return((len == 0) ? -1 : 0);
+	stats_fd = CART_ALL_FILES;
+	if(target != -1) {
+		if(FileArray[target].is_dir || FileArray[fd].is_dir) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: path exists.");
+			return(-1);
+		}
+		//the entry freed has the same name in the same bucket, so the
+		//renamed one is sure to fit
+		if(remove_file(target) == -1)
+			return(-1);
+	}
+
+	//enter the new name before dropping the old one
+	old_parent = FileArray[fd].parent;
+	old_name = FileArray[fd].file_name;
+	old_len = strlen(old_name);
+	if(dir_add(parent, name, len, fd) == -1 || dir_remove(old_parent, old_name, old_len) == -1)
+		return(-1);
+	cart_names_remove(&file_names, old_parent, old_name, old_len);
+	if((FileArray[fd].file_name = cart_names_insert(&file_names, parent, name, len, fd)) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to add file name.");
+		return(-1);
+	}
+	FileArray[fd].parent = parent;
+	memset(&rec, 0, sizeof(rec));
+	rec.type = CART_META_RENAME;
+	rec.id = fd;
+	rec.parent = parent;
+	rec.name = FileArray[fd].file_name;
+	rec.len = len;
+	return(meta_log(&rec));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_clone_locked
+// Description  : Make a new file holding what a file does, sharing its
+//                frames until either is written
+//
+// Inputs       : srcpath - the file
+//                dstpath - the path of the clone, which must not exist
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t cart_clone_locked(char *srcpath, char *dstpath) {
+	const char *name;
+	int16_t fd, parent;
+	size_t len;
+	if(strlen(srcpath) + 1 > CART_MAX_PATH_LENGTH || strlen(dstpath) + 1 > CART_MAX_PATH_LENGTH) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: path too long.");
+		return(-1);
+	}
+	if((fd = resolve_path(srcpath)) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: no such file.");
+		return(-1);
+	}
+	if(FileArray[fd].is_dir) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: path is a directory.");
+		return(-1);
+	}
+	if(resolve_parent(dstpath, &parent, &name, &len) == -1)
+		return(-1);
+	if(len == 0 || cart_names_lookup(&file_names, parent, name, len) != -1) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: path exists.");
+		return(-1);
+	}
+	stats_fd = fd;
+	return((clone_file(fd, parent, name, len) == -1) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_snapshot_locked
+// Description  : Clone a directory and everything under it to a new path,
+//                sharing the frames of every file
+//
+// Inputs       : dirpath - the directory
+//                snappath - the path of the snapshot, which must not exist
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t cart_snapshot_locked(char *dirpath, char *snappath) {
+	int16_t tree[CART_MAX_TOTAL_FILES], up[CART_MAX_TOTAL_FILES], copy[CART_MAX_TOTAL_FILES];
+	const char *name;
+	int16_t dir, parent, fd;
+	int n = 1, i;
+	size_t len;
+	if(strlen(dirpath) + 1 > CART_MAX_PATH_LENGTH || strlen(snappath) + 1 > CART_MAX_PATH_LENGTH) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: path too long.");
+		return(-1);
+	}
+	if((dir = resolve_path(dirpath)) == -1 || !FileArray[dir].is_dir) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: no such directory.");
+		return(-1);
+	}
+	if(resolve_parent(snappath, &parent, &name, &len) == -1)
+		return(-1);
+	if(len == 0 || cart_names_lookup(&file_names, parent, name, len) != -1) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: path exists.");
+		return(-1);
+	}
+
+	//the tree is listed, parents before children, before anything is made,
+	//so a snapshot taken inside it does not copy itself
+	tree[0] = dir;
+	up[0] = -1;
+	for(i = 0; i < n; i++) {
+		for(fd = 0; FileArray[tree[i]].is_dir && fd < file_counter; fd++) {
+			if(FileArray[fd].file_name != NULL && FileArray[fd].parent == tree[i] && fd != root_dir) {
+				tree[n] = fd;
+				up[n++] = i;
+			}
+		}
+	}
+	if(n > free_file_count + CART_MAX_TOTAL_FILES - file_counter) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: too many files.");
+		return(-1);
+	}
+	stats_fd = CART_ALL_FILES;
+	if((copy[0] = clone_file(dir, parent, name, len)) == -1)
+		return(-1);
+	for(i = 1; i < n; i++) {
+		name = FileArray[tree[i]].file_name;
+		if((copy[i] = clone_file(tree[i], copy[up[i]], name, strlen(name))) == -1)
+			return(-1);
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_mmap_locked
+// Description  : Map the start of a file, nothing is read until touched
+//
+// Inputs       : fd - the file
+//                len - the bytes to map, at most the size of the file
+// Outputs      : the view if successful, NULL if failure
+
+static void * cart_mmap_locked(int16_t fd, uint32_t len) {
+	struct sigaction act;
+	struct Mapping *m = NULL;
+	int i, mfd;
+
+	if (check_open_file(fd) == -1)
+		return (NULL);
+	if (len == 0 || len > (uint32_t)FileArray[fd].end_pos) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: mapping past the end of the file.");
+		return (NULL);
+	}
+	for (i = 0; i < CART_MAX_MAPPINGS && m == NULL; i++) {
+		if (mappings[i].addr == NULL)
+			m = &mappings[i];
+	}
+	if (m == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: too many mappings.");
+		return (NULL);
+	}
+
+	//the first view installs the fault handler, it stays for the process
+	if (map_page_size == 0) {
+		memset(&act, 0, sizeof(act));
+		act.sa_sigaction = map_fault;
+		act.sa_flags = SA_SIGINFO;
+		sigemptyset(&act.sa_mask);
+		if (sigaction(SIGSEGV, &act, &map_old_action) == -1)
+			return (NULL);
+		map_page_size = sysconf(_SC_PAGESIZE);
+	}
+	m->span = (len + map_page_size - 1) / map_page_size * map_page_size;
+	if ((m->pages = calloc(m->span / map_page_size, 1)) == NULL)
+		return (NULL);
+	//the view and its alias share one memory file, the view starts inaccessible
+	if ((mfd = memfd_create("cart_view", MFD_CLOEXEC)) == -1) {
+		free(m->pages);
+		return (NULL);
+	}
+	m->addr = m->fill = MAP_FAILED;
+	if (ftruncate(mfd, m->span) == 0) {
+		m->addr = mmap(NULL, m->span, PROT_NONE, MAP_SHARED, mfd, 0);
+		m->fill = mmap(NULL, m->span, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+	}
+	close(mfd);
+	if (m->addr == MAP_FAILED || m->fill == MAP_FAILED) {
+		if (m->addr != MAP_FAILED)
+			munmap(m->addr, m->span);
+		if (m->fill != MAP_FAILED)
+			munmap(m->fill, m->span);
+		free(m->pages);
+		memset(m, 0, sizeof(struct Mapping));
+		return (NULL);
+	}
+	m->len = len;
+	m->fd = fd;
+	FileArray[fd].mapped++;
+	return (m->addr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_msync_locked
+// Description  : Write back the pages of a view written to in a range
+//
+// Inputs       : addr - the start of the range, within a view
+//                len - the bytes in the range
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t cart_msync_locked(void *addr, uint32_t len) {
+	struct Mapping *m = map_find(addr);
+	size_t off;
+
+	if (m == NULL || len > m->span - ((char *)addr - m->addr)) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: range is not mapped.");
+		return (-1);
+	}
+	if (len == 0)
+		return (0);
+	stats_fd = m->fd;
+	off = (char *)addr - m->addr;
+	return (map_sync(m, off / map_page_size, (off + len - 1) / map_page_size));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_munmap_locked
+// Description  : Write back a view and unmap it
+//
+// Inputs       : addr - an address within the view
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t cart_munmap_locked(void *addr) {
+	struct Mapping *m = map_find(addr);
+
+	if (m == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: address is not mapped.");
+		return (-1);
+	}
+	stats_fd = m->fd;
+	if (map_sync(m, 0, m->span / map_page_size - 1) == -1)
+		return (-1);
+	munmap(m->addr, m->span);
+	munmap(m->fill, m->span);
+	free(m->pages);
+	FileArray[m->fd].mapped--;
+	memset(m, 0, sizeof(struct Mapping));
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : async_run_one
+// Description  : runs a submitted request through its synchronous call
+//                (caller holds driver_lock).  A view mapped since the
+//                request was queued may hold its buffer now, the call
+//                checks it again (check_buffers) first.
+//
+// Inputs       : sqe - the request
+// Outputs      : the result for its completion
+static int32_t async_run_one(const CartSqe *sqe) {
+	switch(sqe->op) {
+		case CART_ASYNC_READ:
+			return(cart_pread_locked(sqe->fd, sqe->buf, sqe->count, sqe->loc));
+		case CART_ASYNC_WRITE:
+			return(cart_pwrite_locked(sqe->fd, sqe->buf, sqe->count, sqe->loc));
+		case CART_ASYNC_FSYNC:
+			return(cart_fsync_locked(sqe->fd));
+	}
+	logMessage(LOG_ERROR_LEVEL, "CART driver failed: bad async request %d.", sqe->op);
+	return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : async_plannable
+// Description  : checks, quietly, whether a request can go in a frame plan
+//                shared with others: a read or write of an open file from
+//                inside it, no buffer in a view.  A write must only
+//                overwrite mapped frames of an uncompressed file, so the
+//                plan allocates and gathers nothing.  The rest run through
+//                their calls, which report what is wrong with them.
+//
+// Inputs       : sqe - the request
+// Outputs      : 1 if it can, 0 if not
+static int async_plannable(const CartSqe *sqe) {
+	struct File *f;
+
+	if((sqe->op != CART_ASYNC_READ && sqe->op != CART_ASYNC_WRITE) || sqe->fd < 0 || sqe->fd >= CART_MAX_TOTAL_FILES
+			|| sqe->count <= 0 || sqe->buf == NULL)
+		return(0);
+	f = &FileArray[sqe->fd];
+	if(!f->file_open || f->is_dir || sqe->loc >= (uint32_t)f->end_pos || map_overlaps(sqe->buf, (size_t)sqe->count))
+		return(0);
+	if(sqe->op == CART_ASYNC_READ)
+		return(1);
+	return(!f->compressed && (uint64_t)sqe->loc + sqe->count <= (uint32_t)f->end_pos
+		&& (sqe->loc + sqe->count - 1) / CART_FRAME_SIZE < f->map.frames);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : async_conflicts
+// Description  : checks whether two requests touch a frame of the same
+//                file that either writes, so must run in the order queued
+//
+// Inputs       : x, y - the requests
+// Outputs      : 1 if they do, 0 if not
+static int async_conflicts(const CartSqe *x, const CartSqe *y) {
+	if(x->fd != y->fd || (x->op == CART_ASYNC_READ && y->op == CART_ASYNC_READ))
+		return(0);
+	return(x->loc / CART_FRAME_SIZE <= (y->loc + y->count - 1) / CART_FRAME_SIZE
+		&& y->loc / CART_FRAME_SIZE <= (x->loc + x->count - 1) / CART_FRAME_SIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : async_run_plan
+// Description  : runs requests of a ring batch as one frame plan, every
+//                frame they touch sorted once into the elevator order, so
+//                each cartridge is loaded once for the lot however the
+//                requests and their files are laid out (caller holds
+//                driver_lock)
+//
+// Inputs       : sqe - the requests, plannable and none conflicting
+//                n - the number of requests
+//                result - their results, filled in
+// Outputs      : none
+static void async_run_plan(const CartSqe *sqe, int n, int32_t *result) {
+	struct iovec iov[CART_RING_ENTRIES];
+	char tempbuf[CART_FRAME_SIZE];
+	uint32_t frames = 0, idx;
+	struct FrameOp *ops;
+	int i, k, m, used = 0;
+
+	for(k = 0; k < n; k++) {
+		iov[k].iov_base = sqe[k].buf;
+		iov[k].iov_len = sqe[k].count;
+		if(iov[k].iov_len > FileArray[sqe[k].fd].end_pos - sqe[k].loc)
+			iov[k].iov_len = FileArray[sqe[k].fd].end_pos - sqe[k].loc;
+		frames += (sqe[k].loc + iov[k].iov_len - 1) / CART_FRAME_SIZE - sqe[k].loc / CART_FRAME_SIZE + 1;
+		result[k] = 0;
+	}
+	if((ops = malloc(frames * sizeof(struct FrameOp))) == NULL) {
+		for(k = 0; k < n; k++)
+			result[k] = -1;
+		return;
+	}
+
+	//storing the frame a written file was gathering may move it (see
+	//store_file_frame), so that goes before anything is planned
+	for(k = 0; k < n; k++) {
+		stats_fd = sqe[k].fd;
+		if(sqe[k].op == CART_ASYNC_WRITE && flush_write_buffer(sqe[k].fd) == -1)
+			result[k] = -1;
+	}
+	for(k = 0; k < n; k++) {
+		if(result[k] == -1 || (m = plan_frame_ops(sqe[k].fd, sqe[k].loc, &iov[k], iov[k].iov_len, ops + used, 0)) == -1) {
+			result[k] = -1;
+			continue;
+		}
+		for(i = used; i < used + m; i++)
+			ops[i].req = k;
+		used += m;
+		//the readahead window follows each file's order, as file_readv's does
+		stats_fd = sqe[k].fd;
+		for(idx = sqe[k].loc / CART_FRAME_SIZE; sqe[k].op == CART_ASYNC_READ && !FileArray[sqe[k].fd].compressed
+				&& idx <= (sqe[k].loc + iov[k].iov_len - 1) / CART_FRAME_SIZE; idx++)
+			file_readahead(sqe[k].fd, idx);
+	}
+	if(used > 1)
+		qsort(ops, used, sizeof(struct FrameOp), frame_op_compare);
+
+	for(i = 0; i < used; i++) {
+		k = ops[i].req;
+		if(result[k] == -1)
+			continue;
+		stats_fd = sqe[k].fd;
+		if(sqe[k].op == CART_ASYNC_READ) {
+			if(frame_op_read(sqe[k].fd, &ops[i], &iov[k]) == -1)
+				result[k] = -1;
+			continue;
+		}
+		//no two requests of the plan touch a frame one of them writes
+		if((ops[i].bytes < CART_FRAME_SIZE && read_file_frame(sqe[k].fd, &ops[i], tempbuf) == -1))
+			result[k] = -1;
+		else {
+			frame_op_copy(&ops[i], &iov[k], tempbuf, 1);
+			if(put_file_frame(sqe[k].fd, ops[i].idx, tempbuf) == -1)
+				result[k] = -1;
+		}
+	}
+	for(k = 0; k < n; k++) {
+		if(result[k] == -1)
+			continue;
+		stats_fd = sqe[k].fd;
+		result[k] = (int32_t)iov[k].iov_len;
+		if(sqe[k].op == CART_ASYNC_READ)
+			COUNT_STAT(bytes_read, result[k]);
+		else {
+			map_invalidate(sqe[k].fd, sqe[k].loc, result[k]);
+			COUNT_STAT(bytes_written, result[k]);
+		}
+		if(n > 1)
+			COUNT_STAT(async_batched, 1);
+	}
+	free(ops);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : async_run_batch
+// Description  : runs the requests a drain of the ring took, in the order
+//                queued, under driver_lock so synchronous callers and
+//                readahead interleave with the async thread.  Each run of
+//                plannable requests where none touches a frame another of
+//                the run writes goes as one frame plan, the rest through
+//                their synchronous calls.
+//
+// Inputs       : sqe - the requests
+//                n - the number of requests
+//                result - their results, filled in
+// Outputs      : none
+static void async_run_batch(const CartSqe *sqe, int n, int32_t *result) {
+	int first, k, j;
+
+	pthread_mutex_lock(&driver_lock);
+	for(first = 0; first < n; first = k) {
+		if(!async_plannable(&sqe[first])) {
+			result[first] = async_run_one(&sqe[first]);
+			k = first + 1;
+			continue;
+		}
+		//a request is judged once those before it have run, the plan
+		//writes only frames already there so its requests judge alike
+		for(k = first + 1; k < n && async_plannable(&sqe[k]); k++) {
+			for(j = first; j < k && !async_conflicts(&sqe[j], &sqe[k]); j++)
+				;
+			if(j < k)
+				break;
+		}
+		async_run_plan(&sqe[first], k - first, &result[first]);
+	}
+	pthread_mutex_unlock(&driver_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : async_worker
+// Description  : the async thread, takes every request queued so far as a
+//                batch, runs it and posts the completions in the order
+//                queued; once stopping it drains the ring
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+static void * async_worker(void *arg) {
+	CartSqe sqe[CART_RING_ENTRIES];
+	int32_t result[CART_RING_ENTRIES];
+	uint32_t i, n;
+
+	pthread_mutex_lock(&async_lock);
+	while(async_sq_tail != async_sq_head || !async_stop) {
+		if(async_sq_tail == async_sq_head) {
+			pthread_cond_wait(&async_submit_cond, &async_lock);
+			continue;
+		}
+		n = async_sq_head - async_sq_tail;
+		for(i = 0; i < n; i++)
+			sqe[i] = async_sq[(async_sq_tail + i) % CART_RING_ENTRIES];
+		pthread_mutex_unlock(&async_lock);
+
+		async_run_batch(sqe, (int)n, result);
+
+		pthread_mutex_lock(&async_lock);
+		for(i = 0; i < n; i++) {
+			async_cq[async_cq_head % CART_RING_ENTRIES].user_data = sqe[i].user_data;
+			async_cq[async_cq_head++ % CART_RING_ENTRIES].result = result[i];
+		}
+		async_sq_tail += n;
+		pthread_cond_broadcast(&async_done_cond);
+	}
+	pthread_mutex_unlock(&async_lock);
+	return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : start_async
+// Description  : empties the rings and starts the async thread
+//
+// Inputs       : none
+// Outputs      : return 0 if success, -1 if failed
+static int start_async(void) {
+	pthread_mutex_lock(&async_lock);
+	async_sq_head = async_sq_tail = async_cq_head = async_cq_tail = 0;
+	async_stop = 0;
+	if(pthread_create(&async_thread, NULL, async_worker, NULL) != 0) {
+		pthread_mutex_unlock(&async_lock);
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to start async thread");
+		return(-1);
+	}
+	async_running = 1;
+	pthread_mutex_unlock(&async_lock);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stop_async
+// Description  : stops the async thread once every submitted request has
+//                run, completions not yet reaped are dropped (caller must
+//                not hold driver_lock)
+//
+// Inputs       : none
+// Outputs      : none
+static void stop_async(void) {
+	pthread_mutex_lock(&async_lock);
+	if(!async_running) {
+		pthread_mutex_unlock(&async_lock);
+		return;
+	}
+	async_stop = 1;
+	pthread_cond_signal(&async_submit_cond);
+	pthread_mutex_unlock(&async_lock);
+	pthread_join(async_thread, NULL);
+	pthread_mutex_lock(&async_lock);
+	async_running = 0;
+	pthread_cond_broadcast(&async_done_cond);
+	pthread_mutex_unlock(&async_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : start_file_system
+// Description  : mounts the file system on the powered cartridges (or makes
+//                one) and starts the driver's threads
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int start_file_system(void) {
+	int i, mounted = 0;
+
+	//the cartridges are never zeroed: a frame no file held at poweron and
+	//not written since reads as zeros (see pin_cart_frame)
+	memset(written_frames, 0, sizeof(written_frames));
+	// Initilize and set up file system
+	file_counter= 0;
+	free_file_count= 0;
+	cart_names_free(&file_names);
+	if(cart_names_init(&file_names, CART_MAX_TOTAL_FILES) == -1)
+		return(-1);
+	for(i=0;i <CART_MAX_TOTAL_FILES;i++)
+	{
+		FileArray[i].file_name= NULL;
+		FileArray[i].current_pos= 0;
+		FileArray[i].end_pos= 0;
+		FileArray[i].file_open= 0;
+		cart_blockmap_free(&FileArray[i].map);
+		cart_pack_free(&FileArray[i].pack);
+		memset(&FileArray[i].stats, 0, sizeof(CartDriverStats));
+	}
+	//every frame is free again, but for the superblock and the journal; no
+	//contents are known until written
+	cart_alloc_init();
+	cart_dedup_init();
+	for(i = 0; i < CART_META_RESERVED; i++)
+		cart_alloc_take(CART_META_SUPERBLOCK + i);
+
+	//Initialize Cache, dirty frames are written back through the bus
+	set_cart_cache_flush(flush_cart_frame);
+	if(init_cart_cache() == -1)
+		return(-1);
+	//mount the file system on the cartridges, or make one
+	root_dir = -1;
+	if(format_on_poweron || (mounted = meta_mount()) == 1) {
+		if(meta_format() == -1)
+			return(-1);
+	} else if(mounted == -1)
+		return(-1);
+	//sequential readers are prefetched for in the background
+	if(start_readahead() == -1)
+		return(-1);
+	//cart_submit requests run on their own thread
+	if(start_async() == -1)
+		return(-1);
+	//fragmented files are compacted while the driver is idle
+	if(start_compaction() == -1)
+		return(-1);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_poweron
+// Description  : Startup up the CART interface, initialize filesystem
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_poweron(void) {
+	CartXferRegister regstate= 0x0;
+	Opcode oregstate;
+	loaded_cartridge= CART_NO_CARTRIDGE;
+	stats_fd = CART_ALL_FILES;
+	memset(&driver_stats, 0, sizeof(driver_stats));
+	regstate = create_cart_regstate(CART_OP_INITMS,0,0,0,0);
+	oregstate = extract_cart_opcode(client_cart_bus_request(regstate, NULL));
+	if(oregstate.RT1 !=0) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to power on");
+		return(-1);
+	}
+	return(start_file_system());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stop_file_system
+// Description  : stops the driver's threads, writes everything back and
+//                checkpoints the file system, leaving the cartridges powered
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int stop_file_system(void) {
+	int i;
+	//finish the submitted requests, then write back anything still dirty
+	//before the memory system goes away
+	stop_async();
+	stop_readahead();
+	stop_compaction();
+	for(i = 0; i < CART_MAX_MAPPINGS; i++) {
+		if(mappings[i].addr != NULL && cart_munmap(mappings[i].addr) == -1)
+			return(-1);
+	}
+	for(i = 0; i < file_counter; i++) {
+		stats_fd = i;
+		if(flush_write_buffer(i) == -1 || flush_pack_slot(i, 1) == -1)
+			return(-1);
+		free(FileArray[i].wbuf);
+		FileArray[i].wbuf = NULL;
+	}
+	stats_fd = CART_ALL_FILES;
+	if(flush_cart_cache() == -1) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to flush cache");
+		return(-1);
+	}
+	//the next poweron reads the file table from the checkpoint alone
+	if(meta_checkpoint() == -1)
+		return(-1);
+	//close cache, nothing in it is dirty
+	close_cart_cache();
+	for(i = 0; i < file_counter; i++) {
+		cart_blockmap_free(&FileArray[i].map);
+		cart_pack_free(&FileArray[i].pack);
+	}
+	cart_names_free(&file_names);
+	free(checkpoint_frames);
+	checkpoint_frames = NULL;
+	checkpoint_count = 0;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_poweroff
+// Description  : Shut down the CART interface, close all files
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_poweroff(void) {
+	CartXferRegister regstate=0x0;
+	Opcode oregstate;
+	if(stop_file_system() == -1)
+		return(-1);
+	regstate = create_cart_regstate(CART_OP_POWOFF,0,0,0,0);
+	oregstate = extract_cart_opcode(client_cart_bus_request(regstate,NULL));
+	if(oregstate.RT1 !=0) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to power off");
+		return(-1);
+	}
+	// Return successfully
+	return(0);
+}
+
+//
+// Interface, each call holds driver_lock while it runs
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_open
+// Description  : This function opens the file and returns a file handle
+//
+// Inputs       : path - filename of the file to open
+// Outputs      : file handle if successful, -1 if failure
+
+int16_t cart_open(char *path) {
+	return (cart_open_flags(path, 0));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_open_flags
+// Description  : This function opens the file as cart_open does, a file it
+//                creates taking the modes given
+//
+// Inputs       : path - filename of the file to open
+//                flags - CART_OPEN_* modes
+// Outputs      : file handle if successful, -1 if failure
+
+int16_t cart_open_flags(char *path, int32_t flags) {
+	int16_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_open_locked(path, flags);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_close
+// Description  : This function closes the file
+//
+// Inputs       : fd - the file descriptor
+// Outputs      : 0 if successful, -1 if failure
+
+int16_t cart_close(int16_t fd) {
+	int16_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_close_locked(fd);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_fsync
+// Description  : Write back every dirty cached frame of the file, then the
+//                metadata journal
+//
+// Inputs       : fd - the file descriptor
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_fsync(int16_t fd) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_fsync_locked(fd);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_read
+// Description  : Reads "count" bytes from the file handle "fh" into the 
+//                buffer "buf"
+//
+// Inputs       : fd - filename of the file to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t cart_read(int16_t fd, void *buf, int32_t count) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_read_locked(fd, buf, count);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_write
+// Description  : Writes "count" bytes to the file handle "fh" from the 
+//                buffer  "buf"
+//
+// Inputs       : fd - filename of the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t cart_write(int16_t fd, void *buf, int32_t count) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_write_locked(fd, buf, count);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_pread
+// Description  : Reads "count" bytes at a position, leaving the file
+//                position alone
+//
+// Inputs       : fd - the file descriptor
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+//                loc - where in the file to read from
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t cart_pread(int16_t fd, void *buf, int32_t count, uint32_t loc) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_pread_locked(fd, buf, count, loc);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_pwrite
+// Description  : Writes "count" bytes at a position, leaving the file
+//                position alone
+//
+// Inputs       : fd - the file descriptor
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+//                loc - where in the file to write
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t cart_pwrite(int16_t fd, void *buf, int32_t count, uint32_t loc) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_pwrite_locked(fd, buf, count, loc);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_readv
+// Description  : Reads from the file position into a list of buffers
+//
+// Inputs       : fd - the file descriptor
+//                iov - the buffers, filled in order
+//                iovcnt - the number of buffers
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t cart_readv(int16_t fd, const struct iovec *iov, int iovcnt) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_readv_locked(fd, iov, iovcnt);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_writev
+// Description  : Writes a list of buffers at the file position
+//
+// Inputs       : fd - the file descriptor
+//                iov - the buffers, written in order
+//                iovcnt - the number of buffers
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t cart_writev(int16_t fd, const struct iovec *iov, int iovcnt) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_writev_locked(fd, iov, iovcnt);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_seek
+// Description  : Seek to specific point in the file
+//
+// Inputs       : fd - filename of the file to write to
+//                loc - offfset of file in relation to beginning of file
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_seek(int16_t fd, uint32_t loc) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_seek_locked(fd, loc);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_truncate
+// Description  : Set the size of a file, freeing the frames past a new end
+//
+// Inputs       : fd - the file descriptor
+//                size - the new size in bytes
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_truncate(int16_t fd, uint32_t size) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_truncate_locked(fd, size);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_stats
+// Description  : Get the counters of a file, or of the whole driver
+//
+// Inputs       : fd - the file descriptor, or CART_ALL_FILES
+//                stats - the structure to fill in
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_stats(int16_t fd, CartDriverStats *stats) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_stats_locked(fd, stats);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_mkdir
+// Description  : Create a directory
+//
+// Inputs       : path - the path of the new directory
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_mkdir(char *path) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_mkdir_locked(path);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_rmdir
+// Description  : Remove an empty directory
+//
+// Inputs       : path - the path of the directory
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_rmdir(char *path) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_rmdir_locked(path);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_opendir
+// Description  : Open a directory for cart_readdir, closed with cart_close
+//
+// Inputs       : path - the path of the directory
+// Outputs      : file handle if successful, -1 if failure
+
+int16_t cart_opendir(char *path) {
+	int16_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_opendir_locked(path);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_readdir
+// Description  : Read the next entry of an open directory
+//
+// Inputs       : fd - the directory
+//                entry - the entry read
+// Outputs      : 1 if an entry was read, 0 at the end, -1 if failure
+
+int32_t cart_readdir(int16_t fd, CartDirEntry *entry) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_readdir_locked(fd, entry);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_unlink
+// Description  : Remove a file
+//
+// Inputs       : path - the path of the file
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_unlink(char *path) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_unlink_locked(path);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_rename
+// Description  : Move a file or directory to a new path
+//
+// Inputs       : oldpath - the current path
+//                newpath - the new path
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_rename(char *oldpath, char *newpath) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_rename_locked(oldpath, newpath);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_clone
+// Description  : Make a new file holding what a file does, sharing its
+//                frames until either is written
+//
+// Inputs       : srcpath - the file
+//                dstpath - the path of the clone
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_clone(char *srcpath, char *dstpath) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_clone_locked(srcpath, dstpath);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_snapshot
+// Description  : Clone a directory and everything under it to a new path
+//
+// Inputs       : dirpath - the directory
+//                snappath - the path of the snapshot
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_snapshot(char *dirpath, char *snappath) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_snapshot_locked(dirpath, snappath);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_mmap
+// Description  : Map the first len bytes of a file (at most its size), each
+//                page is read in when first touched; the view can not be
+//                the buffer of another driver call
+//
+// Inputs       : fd - the file
+//                len - the bytes to map
+// Outputs      : the view if successful, NULL if failure
+
+void * cart_mmap(int16_t fd, uint32_t len) {
+	void *ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_mmap_locked(fd, len);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_msync
+// Description  : Write back the pages of a view written to in a range
+//
+// Inputs       : addr - the start of the range, within a view
+//                len - the bytes in the range
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_msync(void *addr, uint32_t len) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_msync_locked(addr, len);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_munmap
+// Description  : Write back the view holding an address and unmap it
+//
+// Inputs       : addr - an address within the view
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_munmap(void *addr) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	ret = cart_munmap_locked(addr);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_set_readahead
+// Description  : Set the largest readahead window (must be called before
+//                poweron)
+//
+// Inputs       : frames - the window limit in frames, 0 turns readahead off
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_set_readahead(uint32_t frames) {
+	if (readahead_running || frames > CART_CARTRIDGE_SIZE) {
+		return (-1);
+	}
+	readahead_max = frames;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_set_format
+// Description  : Choose whether the next poweron mounts the file system on
+//                the cartridges or starts an empty one (must be called
+//                before poweron)
+//
+// Inputs       : format - 1 for an empty file system, 0 to mount
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_set_format(int32_t format) {
+	if (async_running) {
+		return (-1);
+	}
+	format_on_poweron = format;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_set_dedup
+// Description  : Choose whether zero frames are kept as holes and frames
+//                already stored are shared (must be called before poweron)
+//
+// Inputs       : enable - 1 to deduplicate frames, 0 to store every frame
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_set_dedup(uint32_t enable) {
+	if (async_running) {
+		return (-1);
+	}
+	dedup_enabled = (enable != 0);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_set_compaction
+// Description  : Set how fast idle fragmented files are compacted (must be
+//                called before poweron)
+//
+// Inputs       : frames - frames moved a second, 0 turns compaction off
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_set_compaction(uint32_t frames) {
+	if (compact_running) {
+		return (-1);
+	}
+	compact_rate = frames;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_set_cache_size
+// Description  : Set the size of the frame cache, resizing it in place
+//                after poweron.  A shrink writes dirty frames back over the
+//                bus and through the journal, so it runs under driver_lock
+//                like any other call.
+//
+// Inputs       : frames - the frames the cache holds
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_set_cache_size(uint32_t frames) {
+	int32_t ret;
+	pthread_mutex_lock(&driver_lock);
+	stats_fd = CART_ALL_FILES;
+	ret = resize_cart_cache(frames);
+	pthread_mutex_unlock(&driver_lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_submit
+// Description  : Queue requests for the async thread, which takes all
+//                those queued at once and runs them as if in the order
+//                submitted, the frames of many in one elevator pass
+//
+// Inputs       : sqes - the requests
+//                count - the number of requests
+// Outputs      : the number queued (fewer once the ring is full), -1 if failure
+//                (nothing is queued if any buffer is in a mapped view)
+
+int32_t cart_submit(const CartSqe *sqes, uint32_t count) {
+	uint32_t n;
+	int ret = 0;
+
+	//a buffer in a view would fault on the async thread inside its call
+	pthread_mutex_lock(&driver_lock);
+	if (sqes != NULL && map_overlaps(sqes, (size_t)count * sizeof(CartSqe)))
+		ret = -1;
+	for (n = 0; sqes != NULL && ret == 0 && n < count; n++) {
+		if ((sqes[n].op == CART_ASYNC_READ || sqes[n].op == CART_ASYNC_WRITE) && sqes[n].count > 0
+				&& map_overlaps(sqes[n].buf, (size_t)sqes[n].count))
+			ret = -1;
+	}
+	pthread_mutex_unlock(&driver_lock);
+	if (ret == -1) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: buffer is in a mapped view.");
+		return (-1);
+	}
+
+	pthread_mutex_lock(&async_lock);
+	if (!async_running || async_stop || (sqes == NULL && count > 0)) {
+		pthread_mutex_unlock(&async_lock);
+		return (-1);
+	}
+	for (n = 0; n < count && async_sq_head - async_cq_tail < CART_RING_ENTRIES; n++)
+		async_sq[async_sq_head++ % CART_RING_ENTRIES] = sqes[n];
+	if (n > 0)
+		pthread_cond_signal(&async_submit_cond);
+	pthread_mutex_unlock(&async_lock);
+	return (n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_reap
+// Description  : Collect completions, in the order their requests ran
+//
+// Inputs       : cqes - filled with the completions
+//                max - the most to collect
+//                wait - completions to wait for first (capped at max and at
+//                       the requests in flight)
+// Outputs      : the number collected, -1 if failure
+
+int32_t cart_reap(CartCqe *cqes, uint32_t max, uint32_t wait) {
+	uint32_t n = 0;
+
+	pthread_mutex_lock(&async_lock);
+	if (!async_running || (cqes == NULL && max > 0)) {
+		pthread_mutex_unlock(&async_lock);
+		return (-1);
+	}
+	if (wait > max)
+		wait = max;
+	if (wait > async_sq_head - async_cq_tail)
+		wait = async_sq_head - async_cq_tail;
+	while (async_running && async_cq_head - async_cq_tail < wait)
+		pthread_cond_wait(&async_done_cond, &async_lock);
+	while (n < max && async_cq_tail != async_cq_head)
+		cqes[n++] = async_cq[async_cq_tail++ % CART_RING_ENTRIES];
+	pthread_mutex_unlock(&async_lock);
+	return (n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : driver_test_fill
+// Description  : fills a buffer for the unit test, random bytes (no two
+//                frames alike) or, for a compressed file, random words
+//
+// Inputs       : buf - the buffer
+//                len - its bytes
+//                text - 1 for words
+// Outputs      : none
+
+static void driver_test_fill(char *buf, uint32_t len, int text) {
+	static const char *words[] = { "cart ", "frame ", "slot ", "journal " };
+	const char *w;
+	uint32_t i = 0;
+
+	while(i < len) {
+		if(!text) {
+			buf[i++] = (char)getRandomValue(0, 255);
+			continue;
+		}
+		for(w = words[getRandomValue(0, 3)]; *w != '\0' && i < len; )
+			buf[i++] = *w++;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : driver_test_put
+// Description  : writes bytes into a file for the unit test, creating it
+//
+// Inputs       : path - the file
+//                buf, len - the bytes
+//                pos - where in the file (at most its size)
+//                flags - CART_OPEN_* for a file the open creates
+// Outputs      : 0 if successful, -1 if failure
+
+static int driver_test_put(char *path, const char *buf, uint32_t len, uint32_t pos, int32_t flags) {
+	int16_t fd;
+	int ret;
+
+	if((fd = cart_open_flags(path, flags)) == -1)
+		return(-1);
+	ret = (cart_pwrite(fd, (void *)buf, len, pos) == (int32_t)len) ? 0 : -1;
+	if(cart_close(fd) == -1)
+		ret = -1;
+	return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : driver_test_check
+// Description  : checks a file holds the bytes expected, and no more
+//
+// Inputs       : path - the file
+//                expect, len - the bytes
+// Outputs      : 0 if it does, -1 if not
+
+static int driver_test_check(char *path, const char *expect, uint32_t len) {
+	char buf[CART_FRAME_SIZE];
+	uint32_t pos, n;
+	int16_t fd;
+	int ret = 0;
+
+	if((fd = cart_open(path)) == -1)
+		return(-1);
+	for(pos = 0; pos <= len && ret == 0; pos += CART_FRAME_SIZE) {
+		n = (len - pos < CART_FRAME_SIZE) ? len - pos : CART_FRAME_SIZE;
+		if(cart_pread(fd, buf, CART_FRAME_SIZE, pos) != (int32_t)n || memcmp(buf, expect + pos, n) != 0)
+			ret = -1;
+	}
+	if(cart_close(fd) == -1)
+		ret = -1;
+	return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : driver_test_refs
+// Description  : counts the files holding the cartridge frame of a file frame
+//
+// Inputs       : path - the file
+//                idx - the frame of the file
+// Outputs      : the references, 0 for a hole or no such file
+
+static uint32_t driver_test_refs(char *path, uint32_t idx) {
+	CartBlock blk = CART_BLOCK_NONE;
+	int16_t fd;
+
+	pthread_mutex_lock(&driver_lock);
+	if((fd = resolve_path(path)) != -1 && idx < FileArray[fd].map.frames)
+		blk = cart_blockmap_lookup(&FileArray[fd].map, idx, NULL);
+	pthread_mutex_unlock(&driver_lock);
+	return((blk == CART_BLOCK_NONE) ? 0 : cart_alloc_refs(blk));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : driver_test_fragmented
+// Description  : tells whether a file is one the compactor would move
+//
+// Inputs       : path - the file
+// Outputs      : 1 if it is, 0 if not, -1 if no such file
+
+static int driver_test_fragmented(char *path) {
+	uint32_t frames;
+	CartBlock first;
+	int16_t fd;
+	int ret = -1;
+
+	pthread_mutex_lock(&driver_lock);
+	if((fd = resolve_path(path)) != -1)
+		ret = file_fragmented(fd, &frames, &first);
+	pthread_mutex_unlock(&driver_lock);
+	return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : driver_test_clones
+// Description  : clones a file and a compressed file, snapshots their
+//                directory, writes each copy and checks every one, the
+//                frames shared and copied, and all of it again after a
+//                remount
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+#define DRIVER_TEST_BYTES (20 * CART_FRAME_SIZE)
+
+static int driver_test_clones(void) {
+	static char a[DRIVER_TEST_BYTES], b[DRIVER_TEST_BYTES], z[DRIVER_TEST_BYTES], y[DRIVER_TEST_BYTES];
+	CartDriverStats before, after;
+	const char *step = "clone";
+	uint32_t free_frames;
+
+	driver_test_fill(a, DRIVER_TEST_BYTES, 0);
+	driver_test_fill(z, DRIVER_TEST_BYTES, 1);
+	if(cart_mkdir("/ut") == -1 || driver_test_put("/ut/a", a, DRIVER_TEST_BYTES, 0, 0) == -1
+			|| driver_test_put("/ut/z", z, DRIVER_TEST_BYTES, 0, CART_OPEN_COMPRESSED) == -1)
+		goto failed;
+	free_frames = cart_alloc_free_frames(CART_NO_CARTRIDGE);
+	cart_stats(CART_ALL_FILES, &before);
+	if(cart_clone("/ut/a", "/ut/b") == -1 || cart_clone("/ut/z", "/ut/y") == -1 || cart_clone("/ut/a", "/ut/b") != -1)
+		goto failed;
+	cart_stats(CART_ALL_FILES, &after);
+	//only the file table changes, every frame is shared
+	if(cart_alloc_free_frames(CART_NO_CARTRIDGE) != free_frames || after.frames_read != before.frames_read
+			|| after.frames_cloned - before.frames_cloned < DRIVER_TEST_BYTES / CART_FRAME_SIZE
+			|| driver_test_refs("/ut/b", 0) != 2)
+		goto failed;
+
+	//a write to either copy gives it a frame of its own
+	step = "copy on write";
+	memcpy(b, a, DRIVER_TEST_BYTES);
+	memcpy(y, z, DRIVER_TEST_BYTES);
+	memcpy(b + 5, "bbbb", 4);
+	memcpy(a + 10000, "aaaa", 4);
+	memcpy(y + 3000, "yy", 2);
+	if(driver_test_put("/ut/b", "bbbb", 4, 5, 0) == -1 || driver_test_put("/ut/a", "aaaa", 4, 10000, 0) == -1
+			|| driver_test_put("/ut/y", "yy", 2, 3000, 0) == -1)
+		goto failed;
+	if(cart_alloc_free_frames(CART_NO_CARTRIDGE) > free_frames - 2 || driver_test_refs("/ut/b", 0) != 1
+			|| driver_test_refs("/ut/a", 0) != 1 || driver_test_refs("/ut/a", 10000 / CART_FRAME_SIZE) != 1
+			|| driver_test_refs("/ut/a", 1) != 2)
+		goto failed;
+	if(driver_test_check("/ut/a", a, DRIVER_TEST_BYTES) == -1 || driver_test_check("/ut/b", b, DRIVER_TEST_BYTES) == -1
+			|| driver_test_check("/ut/z", z, DRIVER_TEST_BYTES) == -1 || driver_test_check("/ut/y", y, DRIVER_TEST_BYTES) == -1)
+		goto failed;
+
+	//a snapshot keeps what its files held, whatever happens to them after
+	step = "snapshot";
+	if(cart_snapshot("/ut", "/us") == -1 || cart_snapshot("/ut", "/us") != -1 || cart_unlink("/ut/a") == -1)
+		goto failed;
+	if(driver_test_check("/us/a", a, DRIVER_TEST_BYTES) == -1 || driver_test_check("/us/b", b, DRIVER_TEST_BYTES) == -1
+			|| driver_test_check("/us/z", z, DRIVER_TEST_BYTES) == -1 || driver_test_check("/us/y", y, DRIVER_TEST_BYTES) == -1)
+		goto failed;
+
+	//a remount finds the same files sharing the same frames (the memory
+	//system keeps its power, it can be initialized once only)
+	step = "remount";
+	format_on_poweron = 0;
+	if(stop_file_system() == -1 || start_file_system() == -1)
+		goto failed;
+	if(driver_test_check("/ut/b", b, DRIVER_TEST_BYTES) == -1 || driver_test_check("/ut/y", y, DRIVER_TEST_BYTES) == -1
+			|| driver_test_check("/us/a", a, DRIVER_TEST_BYTES) == -1 || driver_test_check("/us/b", b, DRIVER_TEST_BYTES) == -1
+			|| driver_test_refs("/us/b", 1) != 3)
+		goto failed;
+	if(driver_test_put("/us/b", "ss", 2, 0, 0) == -1 || driver_test_check("/ut/b", b, DRIVER_TEST_BYTES) == -1)
+		goto failed;
+	memcpy(b, "ss", 2);
+	if(driver_test_check("/us/b", b, DRIVER_TEST_BYTES) == -1)
+		goto failed;
+
+	step = "clean up";
+	if(cart_unlink("/ut/b") == -1 || cart_unlink("/ut/z") == -1 || cart_unlink("/ut/y") == -1 || cart_rmdir("/ut") == -1
+			|| cart_unlink("/us/a") == -1 || cart_unlink("/us/b") == -1 || cart_unlink("/us/z") == -1
+			|| cart_unlink("/us/y") == -1 || cart_rmdir("/us") == -1)
+		goto failed;
+	return(0);
+
+failed:
+	logMessage(LOG_ERROR_LEVEL, "Driver unit test failed: clones %s.", step);
+	return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : driver_test_truncate
+// Description  : shrinks and grows a file and a compressed file, checking
+//                the frames given back, that the bytes past a new end are
+//                gone and that a grown file reads zeros
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int driver_test_truncate(void) {
+	static char t[DRIVER_TEST_BYTES], z[DRIVER_TEST_BYTES];
+	const char *step = "shrink";
+	uint32_t free_frames;
+	int16_t fd = -1;
+
+	driver_test_fill(t, DRIVER_TEST_BYTES, 0);
+	driver_test_fill(z, DRIVER_TEST_BYTES, 1);
+	if(cart_mkdir("/ut") == -1 || driver_test_put("/ut/t", t, DRIVER_TEST_BYTES, 0, 0) == -1
+			|| driver_test_put("/ut/z", z, DRIVER_TEST_BYTES, 0, CART_OPEN_COMPRESSED) == -1)
+		goto failed;
+	//the frames wholly past the end go, the one it falls in stays
+	free_frames = cart_alloc_free_frames(CART_NO_CARTRIDGE);
+	if((fd = cart_open("/ut/t")) == -1 || cart_truncate(fd, 5000) == -1 || cart_close(fd) == -1
+			|| cart_alloc_free_frames(CART_NO_CARTRIDGE) != free_frames + DRIVER_TEST_BYTES / CART_FRAME_SIZE - 5
+			|| driver_test_check("/ut/t", t, 5000) == -1)
+		goto failed;
+
+	//growing adds holes, the old bytes past 5000 must not come back
+	step = "grow";
+	memset(t + 5000, 0, DRIVER_TEST_BYTES - 5000);
+	if((fd = cart_open("/ut/t")) == -1 || cart_truncate(fd, 12000) == -1 || cart_close(fd) == -1
+			|| cart_alloc_free_frames(CART_NO_CARTRIDGE) != free_frames + DRIVER_TEST_BYTES / CART_FRAME_SIZE - 5
+			|| driver_test_check("/ut/t", t, 12000) == -1)
+		goto failed;
+	memcpy(t + 11990, "tail", 4);
+	if(driver_test_put("/ut/t", "tail", 4, 11990, 0) == -1 || driver_test_check("/ut/t", t, 12000) == -1)
+		goto failed;
+
+	//a compressed file drops the tail of its last slot the same way
+	step = "compressed";
+	memset(z + 3000, 0, DRIVER_TEST_BYTES - 3000);
+	if((fd = cart_open("/ut/z")) == -1 || cart_truncate(fd, 3000) == -1 || cart_truncate(fd, 9000) == -1
+			|| cart_close(fd) == -1 || driver_test_check("/ut/z", z, 9000) == -1)
+		goto failed;
+
+	step = "clean up";
+	if(cart_unlink("/ut/t") == -1 || cart_unlink("/ut/z") == -1 || cart_rmdir("/ut") == -1)
+		goto failed;
+	return(0);
+
+failed:
+	logMessage(LOG_ERROR_LEVEL, "Driver unit test failed: truncate %s.", step);
+	return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : driver_test_compaction
+// Description  : writes files a frame each in turn, so their frames
+//                interleave, compacts them and checks they are whole, in
+//                one run each and hold the same bytes, also after a remount
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+#define DRIVER_TEST_FILES 3
+
+static int driver_test_compaction(void) {
+	static char g[DRIVER_TEST_FILES][DRIVER_TEST_BYTES];
+	static char *paths[DRIVER_TEST_FILES] = { "/uc/0", "/uc/1", "/uc/2" };
+	int16_t fds[DRIVER_TEST_FILES];
+	CartDriverStats before, after;
+	const char *step = "fragment";
+	uint32_t free_frames, frames, pos, i;
+	CartBlock first;
+	int16_t fd;
+	int k, left;
+
+	if(cart_mkdir("/uc") == -1)
+		goto failed;
+	for(k = 0; k < DRIVER_TEST_FILES; k++) {
+		driver_test_fill(g[k], DRIVER_TEST_BYTES, 0);
+		if((fds[k] = cart_open(paths[k])) == -1)
+			goto failed;
+	}
+	for(pos = 0; pos < DRIVER_TEST_BYTES; pos += CART_FRAME_SIZE) {
+		for(k = 0; k < DRIVER_TEST_FILES; k++) {
+			if(cart_write(fds[k], g[k] + pos, CART_FRAME_SIZE) != CART_FRAME_SIZE || cart_fsync(fds[k]) == -1)
+				goto failed;
+		}
+	}
+	for(k = 0; k < DRIVER_TEST_FILES; k++) {
+		if(cart_close(fds[k]) == -1 || driver_test_fragmented(paths[k]) != 1)
+			goto failed;
+	}
+
+	//a pass as the idle thread makes it, until no file is left fragmented
+	step = "compact";
+	free_frames = cart_alloc_free_frames(CART_NO_CARTRIDGE);
+	cart_stats(CART_ALL_FILES, &before);
+	pthread_mutex_lock(&driver_lock);
+	stats_fd = CART_ALL_FILES;
+	for(i = 0, left = 1; left && i < CART_MAX_TOTAL_FILES; i++) {
+		if(compact_fd == -1)
+			compact_pick();
+		if(compact_fd != -1 && compact_step(CART_COMPACT_BATCH) == -1)
+			break;
+		for(k = 0, left = 0; k < DRIVER_TEST_FILES; k++) {
+			if((fd = resolve_path(paths[k])) != -1)
+				left += file_fragmented(fd, &frames, &first);
+		}
+	}
+	pthread_mutex_unlock(&driver_lock);
+	cart_stats(CART_ALL_FILES, &after);
+	if(left || compact_fd != -1 || after.frames_compacted - before.frames_compacted < DRIVER_TEST_FILES * DRIVER_TEST_BYTES / CART_FRAME_SIZE
+			|| cart_alloc_free_frames(CART_NO_CARTRIDGE) != free_frames)
+		goto failed;
+	for(k = 0; k < DRIVER_TEST_FILES; k++) {
+		if(driver_test_check(paths[k], g[k], DRIVER_TEST_BYTES) == -1)
+			goto failed;
+	}
+
+	//the new places are in the journal
+	step = "remount";
+	if(stop_file_system() == -1 || start_file_system() == -1)
+		goto failed;
+	for(k = 0; k < DRIVER_TEST_FILES; k++) {
+		if(driver_test_fragmented(paths[k]) != 0 || driver_test_check(paths[k], g[k], DRIVER_TEST_BYTES) == -1)
+			goto failed;
+	}
+
+	step = "clean up";
+	for(k = 0; k < DRIVER_TEST_FILES; k++) {
+		if(cart_unlink(paths[k]) == -1)
+			goto failed;
+	}
+	if(cart_rmdir("/uc") == -1)
+		goto failed;
+	return(0);
+
+failed:
+	logMessage(LOG_ERROR_LEVEL, "Driver unit test failed: compaction %s.", step);
+	return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : driver_test_views
+// Description  : reads and writes a file through a mapped view, checks a
+//                write to the file shows in the view, and that no call,
+//                queued or run, takes a buffer in a view
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int driver_test_views(void) {
+	static char v[DRIVER_TEST_BYTES], b[DRIVER_TEST_BYTES];
+	CartDriverStats before, after;
+	const char *step = "map";
+	uint32_t len = DRIVER_TEST_BYTES - 100;
+	int32_t result;
+	CartSqe sqe;
+	char *view = NULL;
+	int16_t fd = -1;
+
+	driver_test_fill(v, DRIVER_TEST_BYTES, 0);
+	if(cart_mkdir("/uv") == -1 || driver_test_put("/uv/v", v, DRIVER_TEST_BYTES, 0, 0) == -1
+			|| (fd = cart_open("/uv/v")) == -1 || (view = cart_mmap(fd, len)) == NULL)
+		goto failed;
+	cart_stats(CART_ALL_FILES, &before);
+	if(memcmp(view, v, len) != 0)
+		goto failed;
+	cart_stats(CART_ALL_FILES, &after);
+	if(after.page_faults == before.page_faults)
+		goto failed;
+
+	//a store dirties its page, cart_msync writes it to the file; a write
+	//to the file shows in the view
+	step = "write";
+	view[5] = v[5] = 'x';
+	if(cart_msync(view, len) == -1 || cart_pread(fd, b, DRIVER_TEST_BYTES, 0) != DRIVER_TEST_BYTES
+			|| memcmp(b, v, DRIVER_TEST_BYTES) != 0)
+		goto failed;
+	memcpy(v + 5000, "yy", 2);
+	if(cart_pwrite(fd, "yy", 2, 5000) != 2 || memcmp(view, v, len) != 0)
+		goto failed;
+
+	//the buffers of a call are checked when it is queued and when it runs
+	step = "buffers";
+	sqe.op = CART_ASYNC_READ;
+	sqe.fd = fd;
+	sqe.buf = view + 100;
+	sqe.count = 10;
+	sqe.loc = 0;
+	sqe.user_data = 0;
+	if(cart_pread(fd, view, 10, 0) != -1 || cart_write(fd, view + 10, 10) != -1 || cart_submit(&sqe, 1) != -1)
+		goto failed;
+	async_run_batch(&sqe, 1, &result);
+	if(result != -1)
+		goto failed;
+
+	step = "clean up";
+	if(cart_munmap(view) == -1 || cart_close(fd) == -1 || driver_test_check("/uv/v", v, DRIVER_TEST_BYTES) == -1
+			|| cart_unlink("/uv/v") == -1 || cart_rmdir("/uv") == -1)
+		goto failed;
+	return(0);
+
+failed:
+	logMessage(LOG_ERROR_LEVEL, "Driver unit test failed: views %s.", step);
+	return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : driver_test_async
+// Description  : submits a batch of reads of a file and a compressed file
+//                in scrambled order, writes to a cloned third and reads of
+//                what they wrote, a write extending it and an fsync, then checks
+//                every result, the bytes read and written, and that reads
+//                and writes shared frame plans
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+#define DRIVER_TEST_SQES (2 * DRIVER_TEST_BYTES / CART_FRAME_SIZE + 6)
+
+static int driver_test_async(void) {
+	static char a[DRIVER_TEST_BYTES], z[DRIVER_TEST_BYTES], b[DRIVER_TEST_BYTES + 50], w[DRIVER_TEST_BYTES + 50];
+	static char ra[DRIVER_TEST_BYTES], rz[DRIVER_TEST_BYTES], rb[5 * CART_FRAME_SIZE], re[100];
+	CartSqe sqe[DRIVER_TEST_SQES];
+	CartCqe cqe[DRIVER_TEST_SQES];
+	int32_t expect[DRIVER_TEST_SQES];
+	CartDriverStats before, after;
+	const char *step = "files";
+	int16_t fa = -1, fz = -1, fb = -1;
+	uint32_t i, p, n = 0;
+
+	driver_test_fill(a, DRIVER_TEST_BYTES, 0);
+	driver_test_fill(z, DRIVER_TEST_BYTES, 1);
+	driver_test_fill(b, DRIVER_TEST_BYTES, 0);
+	driver_test_fill(w, DRIVER_TEST_BYTES + 50, 0);
+	if(cart_mkdir("/ua") == -1 || driver_test_put("/ua/a", a, DRIVER_TEST_BYTES, 0, 0) == -1
+			|| driver_test_put("/ua/z", z, DRIVER_TEST_BYTES, 0, CART_OPEN_COMPRESSED) == -1
+			|| driver_test_put("/ua/b", b, DRIVER_TEST_BYTES, 0, 0) == -1 || cart_clone("/ua/b", "/ua/c") == -1
+			|| (fa = cart_open("/ua/a")) == -1 || (fz = cart_open("/ua/z")) == -1 || (fb = cart_open("/ua/b")) == -1)
+		goto failed;
+
+	//the frames of both files a frame a request, out of order and interleaved
+	for(i = 0; i < DRIVER_TEST_BYTES / CART_FRAME_SIZE; i++) {
+		p = (i * 7) % (DRIVER_TEST_BYTES / CART_FRAME_SIZE) * CART_FRAME_SIZE;
+		sqe[n] = (CartSqe){ CART_ASYNC_READ, fa, ra + p, CART_FRAME_SIZE, p, n };
+		expect[n++] = CART_FRAME_SIZE;
+		sqe[n] = (CartSqe){ CART_ASYNC_READ, fz, rz + p, CART_FRAME_SIZE, p, n };
+		expect[n++] = CART_FRAME_SIZE;
+	}
+	//writes over parts of frames and whole ones (shared with a clone, so
+	//they move), a read must see both, a write past the end runs on its
+	//own, and a read sees that too
+	sqe[n] = (CartSqe){ CART_ASYNC_WRITE, fb, w + 100, 1500, 100, n };
+	expect[n++] = 1500;
+	sqe[n] = (CartSqe){ CART_ASYNC_WRITE, fb, w + 3 * CART_FRAME_SIZE, 2 * CART_FRAME_SIZE, 3 * CART_FRAME_SIZE, n };
+	expect[n++] = 2 * CART_FRAME_SIZE;
+	sqe[n] = (CartSqe){ CART_ASYNC_READ, fb, rb, 5 * CART_FRAME_SIZE, 0, n };
+	expect[n++] = 5 * CART_FRAME_SIZE;
+	sqe[n] = (CartSqe){ CART_ASYNC_WRITE, fb, w + DRIVER_TEST_BYTES, 50, DRIVER_TEST_BYTES, n };
+	expect[n++] = 50;
+	sqe[n] = (CartSqe){ CART_ASYNC_FSYNC, fb, NULL, 0, 0, n };
+	expect[n++] = 0;
+	sqe[n] = (CartSqe){ CART_ASYNC_READ, fb, re, 100, DRIVER_TEST_BYTES - 10, n };
+	expect[n++] = 60;
+
+	step = "submit";
+	cart_stats(CART_ALL_FILES, &before);
+	if(cart_submit(sqe, n) != (int32_t)n || cart_reap(cqe, n, n) != (int32_t)n)
+		goto failed;
+	cart_stats(CART_ALL_FILES, &after);
+	for(i = 0; i < n; i++) {
+		if(cqe[i].user_data != i || cqe[i].result != expect[i])
+			goto failed;
+	}
+	if(after.async_batched - before.async_batched < 2 * DRIVER_TEST_BYTES / CART_FRAME_SIZE)
+		goto failed;
+
+	step = "bytes";
+	memcpy(b + 100, w + 100, 1500);
+	memcpy(b + 3 * CART_FRAME_SIZE, w + 3 * CART_FRAME_SIZE, 2 * CART_FRAME_SIZE);
+	memcpy(b + DRIVER_TEST_BYTES, w + DRIVER_TEST_BYTES, 50);
+	if(memcmp(ra, a, DRIVER_TEST_BYTES) != 0 || memcmp(rz, z, DRIVER_TEST_BYTES) != 0
+			|| memcmp(rb, b, 5 * CART_FRAME_SIZE) != 0 || memcmp(re, b + DRIVER_TEST_BYTES - 10, 60) != 0)
+		goto failed;
+
+	step = "clean up";
+	if(cart_close(fa) == -1 || cart_close(fz) == -1 || cart_close(fb) == -1
+			|| driver_test_check("/ua/b", b, DRIVER_TEST_BYTES + 50) == -1 || cart_unlink("/ua/a") == -1
+			|| cart_unlink("/ua/z") == -1 || cart_unlink("/ua/b") == -1 || cart_unlink("/ua/c") == -1
+			|| cart_rmdir("/ua") == -1)
+		goto failed;
+	return(0);
+
+failed:
+	logMessage(LOG_ERROR_LEVEL, "Driver unit test failed: async %s.", step);
+	return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : driver_test_reader
+// Description  : the reader thread of the resize test, reads a file over
+//                and over until told to stop
+//
+// Inputs       : arg - the bytes the file holds
+// Outputs      : the passes that read wrong bytes
+
+static int driver_test_done;    //set under driver_lock to stop the reader
+
+static void * driver_test_reader(void *arg) {
+	uintptr_t errors = 0;
+	int done;
+
+	do {
+		if(driver_test_check("/ur/r", arg, DRIVER_TEST_BYTES) == -1)
+			errors++;
+		pthread_mutex_lock(&driver_lock);
+		done = driver_test_done;
+		pthread_mutex_unlock(&driver_lock);
+	} while(!done);
+	return((void *)errors);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : driver_test_resize
+// Description  : shrinks a write-back cache full of dirty frames while
+//                another thread reads, checking the frames written back on
+//                the way reach the cartridges with the journal intact
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+#define DRIVER_TEST_DIRTY 256   //frames dirtied before each shrink
+
+static int driver_test_resize(void) {
+	static char r[DRIVER_TEST_BYTES], w[DRIVER_TEST_DIRTY * CART_FRAME_SIZE];
+	CartCacheStats before, after;
+	const char *step = "write back";
+	pthread_t reader;
+	void *errors = NULL;
+	int round, started = 0;
+
+	//the cache comes back up in write-back mode, holding every frame dirtied
+	if(stop_file_system() == -1 || set_cart_cache_write_mode(CART_CACHE_WRITEBACK) == -1
+			|| set_cart_cache_size(4 * DRIVER_TEST_DIRTY) == -1 || start_file_system() == -1)
+		goto failed;
+	driver_test_fill(r, DRIVER_TEST_BYTES, 0);
+	if(cart_mkdir("/ur") == -1 || driver_test_put("/ur/r", r, DRIVER_TEST_BYTES, 0, 0) == -1)
+		goto failed;
+	driver_test_done = 0;
+	if(pthread_create(&reader, NULL, driver_test_reader, r) != 0)
+		goto failed;
+	started = 1;
+
+	step = "shrink";
+	for(round = 0; round < 4; round++) {
+		driver_test_fill(w, sizeof(w), 0);
+		cart_cache_stats(&before);
+		if(driver_test_put("/ur/w", w, sizeof(w), 0, 0) == -1 || cart_set_cache_size(DRIVER_TEST_DIRTY / 4) == -1
+				|| cart_cache_size() != DRIVER_TEST_DIRTY / 4)
+			goto failed;
+		cart_cache_stats(&after);
+		if(after.writebacks - before.writebacks < DRIVER_TEST_DIRTY / 2 || cart_set_cache_size(4 * DRIVER_TEST_DIRTY) == -1)
+			goto failed;
+	}
+	pthread_mutex_lock(&driver_lock);
+	driver_test_done = 1;
+	pthread_mutex_unlock(&driver_lock);
+	started = 0;
+	if(pthread_join(reader, &errors) != 0 || errors != NULL)
+		goto failed;
+	if(driver_test_check("/ur/w", w, sizeof(w)) == -1 || driver_test_check("/ur/r", r, DRIVER_TEST_BYTES) == -1)
+		goto failed;
+
+	//the journal written with the frames mounts
+	step = "remount";
+	if(stop_file_system() == -1 || start_file_system() == -1)
+		goto failed;
+	if(driver_test_check("/ur/w", w, sizeof(w)) == -1 || driver_test_check("/ur/r", r, DRIVER_TEST_BYTES) == -1)
+		goto failed;
+
+	step = "clean up";
+	if(cart_unlink("/ur/w") == -1 || cart_unlink("/ur/r") == -1 || cart_rmdir("/ur") == -1)
+		goto failed;
+	return(0);
+
+failed:
+	if(started) {
+		pthread_mutex_lock(&driver_lock);
+		driver_test_done = 1;
+		pthread_mutex_unlock(&driver_lock);
+		pthread_join(reader, NULL);
+	}
+	logMessage(LOG_ERROR_LEVEL, "Driver unit test failed: resize %s.", step);
+	return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cartDriverUnitTest
+// Description  : Run a UNIT test of the driver on an empty file system
+//                (through the bus, like a workload)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int cartDriverUnitTest(void) {
+	CartCacheWriteMode saved_mode = cart_cache_write_mode();
+	uint32_t saved_size = cart_cache_size();
+	int32_t saved_format = format_on_poweron;
+	uint32_t saved_rate = compact_rate;
+	int ret = -1;
+
+	//the test compacts by itself, the thread would move frames under it
+	format_on_poweron = 1;
+	compact_rate = 0;
+	if(cart_poweron() == 0) {
+		ret = (driver_test_clones() == 0 && driver_test_truncate() == 0 && driver_test_compaction() == 0
+			&& driver_test_views() == 0 && driver_test_async() == 0 && driver_test_resize() == 0) ? 0 : -1;
+		if(cart_poweroff() == -1)
+			ret = -1;
+	}
+	set_cart_cache_write_mode(saved_mode);
+	set_cart_cache_size(saved_size);
+	format_on_poweron = saved_format;
+	compact_rate = saved_rate;
+	if(ret == 0)
+		logMessage(LOG_OUTPUT_LEVEL, "Driver unit test completed successfully.");
+	return(ret);
 }
@@ -13,10 +13,81 @@
 
 // Include files
 #include <stdint.h>
+#include <sys/uio.h>
 
 // Defines
 #define CART_MAX_TOTAL_FILES 1024 // Maximum number of files ever
 #define CART_MAX_PATH_LENGTH 128 // Maximum length of filename length
+#define CART_ALL_FILES -1 // Pseudo file handle for driver wide statistics
+#define CART_READAHEAD_MAX 32 // Default largest readahead window, in frames
+#define CART_RING_ENTRIES 128 // Most requests submitted and not yet reaped
+#define CART_COMPACT_RATE 256 // Default frames a second the compaction thread moves, while the driver is idle
+#define CART_OPEN_COMPRESSED 1 // cart_open_flags: compress the file's frames, packing several in each
+
+// Driver counters, kept for the whole driver and for each file (work done
+// while servicing a call on that file, including write backs it forces)
+typedef struct {
+
+	uint64_t cache_hits;      // frames found in the cache
+	uint64_t cache_misses;    // frames read from the bus into the cache
+	uint64_t cart_loads;      // LDCART operations issued
+	uint64_t frames_read;     // RDFRME operations issued
+	uint64_t frames_written;  // WRFRME operations issued
+	uint64_t write_throughs;  // frames written straight through to the cartridge
+	uint64_t dirty_flushes;   // dirty cached frames written back
+	uint64_t bytes_read;      // bytes returned by cart_read
+	uint64_t bytes_written;   // bytes accepted by cart_write
+	uint64_t readahead_frames; // frames read from the bus ahead of a sequential reader
+	uint64_t frames_coalesced; // partial writes gathered into a frame already buffered
+	uint64_t page_faults;     // pages of cart_mmap views read in on first touch
+	uint64_t zero_fills;      // frames never written, read as zeros without the bus
+	uint64_t meta_writes;     // superblock, checkpoint and journal frames written
+	uint64_t dedup_hits;      // frames already stored, shared rather than written
+	uint64_t zero_holes;      // frames of zeros kept as holes rather than written
+	uint64_t frames_packed;   // frames of compressed files packed into a slot
+	uint64_t frames_cloned;   // frames shared by cart_clone and cart_snapshot rather than copied
+	uint64_t frames_compacted; // frames moved by the compaction thread into a file's run
+	uint64_t async_batched;   // cart_submit requests run in one frame plan with others of their batch
+
+} CartDriverStats;
+
+// A directory entry returned by cart_readdir
+typedef struct {
+
+	char     name[CART_MAX_PATH_LENGTH]; // name within the directory
+	int32_t  is_dir;                     // 1 for a directory
+	uint32_t size;                       // bytes in a file
+
+} CartDirEntry;
+
+// Requests of the asynchronous interface, each runs as its synchronous call
+typedef enum {
+
+	CART_ASYNC_READ  = 0, // cart_pread of count bytes at loc into buf
+	CART_ASYNC_WRITE = 1, // cart_pwrite of count bytes at loc from buf
+	CART_ASYNC_FSYNC = 2, // cart_fsync
+
+} CartAsyncOp;
+
+// A submission queue entry, queued by cart_submit
+typedef struct {
+
+	int32_t   op;        // a CartAsyncOp
+	int16_t   fd;        // the file
+	void     *buf;       // bytes to read into or write from, untouched until reaped
+	int32_t   count;     // number of bytes
+	uint32_t  loc;       // position in the file (the file position does not move)
+	uint64_t  user_data; // handed back in the completion
+
+} CartSqe;
+
+// A completion queue entry, returned by cart_reap
+typedef struct {
+
+	uint64_t  user_data; // from the submission
+	int32_t   result;    // what the synchronous call returned
+
+} CartCqe;
 
 //
 // Interface functions
@@ -27,7 +98,10 @@ int32_t cart_poweroff(void);
 	// Shut down the CART interface, close all files
 
 int16_t cart_open(char *path);
-	// This function opens the file and returns a file handle
+	// This function opens the file and returns a file handle (paths are "/" separated)
+
+int16_t cart_open_flags(char *path, int32_t flags);
+	// Opens as cart_open, a file it creates taking the CART_OPEN_* modes in flags
 
 int16_t cart_close(int16_t fd);
 	// This function closes the file
@@ -38,9 +112,87 @@ int32_t cart_read(int16_t fd, void *buf, int32_t count);
 int32_t cart_write(int16_t fd, void *buf, int32_t count);
 	// Writes "count" bytes to the file handle "fh" from the buffer  "buf"
 
+int32_t cart_pread(int16_t fd, void *buf, int32_t count, uint32_t loc);
+	// Reads "count" bytes at "loc", without moving the file position
+
+int32_t cart_pwrite(int16_t fd, void *buf, int32_t count, uint32_t loc);
+	// Writes "count" bytes at "loc" (at most the file size), without moving the file position
+
+int32_t cart_readv(int16_t fd, const struct iovec *iov, int iovcnt);
+	// Reads into each buffer of "iov" in turn, reading each frame once
+
+int32_t cart_writev(int16_t fd, const struct iovec *iov, int iovcnt);
+	// Writes each buffer of "iov" in turn, storing each frame once
+
 int32_t cart_seek(int16_t fd, uint32_t loc);
 	// Seek to specific point in the file
 
+int32_t cart_fsync(int16_t fd);
+	// Write back every dirty cached frame of the file, then the metadata journal
+
+int32_t cart_truncate(int16_t fd, uint32_t size);
+	// Set the size of a file, zeros past its old end, the frames past a new end are freed
+
+int32_t cart_stats(int16_t fd, CartDriverStats *stats);
+	// Get the counters of a file, or of the driver for CART_ALL_FILES
+
+int32_t cart_mkdir(char *path);
+	// Create a directory
+
+int32_t cart_rmdir(char *path);
+	// Remove an empty directory
+
+int16_t cart_opendir(char *path);
+	// Open a directory for cart_readdir, closed with cart_close
+
+int32_t cart_readdir(int16_t fd, CartDirEntry *entry);
+	// Read the next entry of an open directory, 1 if read, 0 at the end
+
+int32_t cart_unlink(char *path);
+	// Remove a file that is not open
+
+int32_t cart_rename(char *oldpath, char *newpath);
+	// Move a file or directory, replacing a file at newpath
+
+int32_t cart_clone(char *srcpath, char *dstpath);
+	// Make a new file at dstpath holding what srcpath does, sharing its frames until either is written
+
+int32_t cart_snapshot(char *dirpath, char *snappath);
+	// Clone a directory and every file and directory under it to snappath (a new path)
+
+void * cart_mmap(int16_t fd, uint32_t len);
+	// Map the first "len" bytes of a file (at most its size), pages are read when first touched
+
+int32_t cart_msync(void *addr, uint32_t len);
+	// Write back the pages of a view written to in [addr, addr+len)
+
+int32_t cart_munmap(void *addr);
+	// Write back and unmap the view holding addr (a file can not be closed while mapped)
+
+int32_t cart_set_readahead(uint32_t frames);
+	// Set the largest readahead window in frames, 0 disables (before poweron)
+
+int32_t cart_set_format(int32_t format);
+	// 1 to start the next poweron with an empty file system, 0 to mount the one on the cartridges
+
+int32_t cart_set_dedup(uint32_t enable);
+	// 1 to keep zero frames as holes and share frames stored twice, 0 to store every frame (before poweron)
+
+int32_t cart_set_compaction(uint32_t frames);
+	// Set the frames a second moved into runs for fragmented files while idle, 0 disables (before poweron)
+
+int32_t cart_set_cache_size(uint32_t frames);
+	// Set the frames the cache holds, a running cache is resized in place
+
+int32_t cart_submit(const CartSqe *sqes, uint32_t count);
+	// Queue requests for the driver thread, run in order; the number queued (fewer if the ring is full)
+
+int32_t cart_reap(CartCqe *cqes, uint32_t max, uint32_t wait);
+	// Collect up to max completions, first waiting for "wait" of them (at most those in flight)
+
+int cartDriverUnitTest(void);
+	// Run a UNIT test of clones, snapshots, truncation, compaction, mapped views and cache resizing on an empty file system (powers the system on and off)
+
 
 #endif
 
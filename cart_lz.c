@@ -0,0 +1,298 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_lz.c
+//  Description    : This is the implementation of a small LZ77 style codec
+//                   (LZ4 like byte format) for compressing frames in memory.
+//
+//  Author         : [Jacob Hohenstein]
+//  Last Modified  : [10/16/2016]
+//
+
+// Includes
+#include <string.h>
+#include <stdlib.h>
+
+// Project includes
+#include <cart_lz.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define LZ_HASH_BITS 12         // match finder table, 4096 positions
+#define LZ_MIN_MATCH 4          // shortest match worth an offset
+#define LZ_RUN_MASK 15          // nibble value meaning "more length bytes follow"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Block Format
+//
+// A block is a series of sequences.  Each starts with a token byte whose high
+// nibble is the literal count and low nibble the match length minus 4; a
+// nibble of 15 is followed by extra length bytes (255 means keep adding).
+// The literals come next, then a 2 byte little endian offset back into the
+// output and any extra match length bytes.  The last sequence stops after its
+// literals, which is how the end of the block is recognised.
+//
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lz_hash
+// Description  : Hash the 4 bytes at a position for the match finder
+//
+// Inputs       : p - the position
+// Outputs      : table index
+
+static uint32_t lz_hash(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return ((v * 2654435761u) >> (32 - LZ_HASH_BITS));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lz_put_length
+// Description  : Write the extra bytes of a length that overflowed its nibble
+//
+// Inputs       : op - the output position, advanced
+//                oend - end of the output
+//                n - the length less LZ_RUN_MASK
+// Outputs      : 0 if successful, -1 if the output is full
+
+static int lz_put_length(uint8_t **op, uint8_t *oend, int n) {
+	for (; n >= 255; n -= 255) {
+		if (*op >= oend)
+			return (-1);
+		*(*op)++ = 255;
+	}
+	if (*op >= oend)
+		return (-1);
+	*(*op)++ = (uint8_t)n;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lz_get_length
+// Description  : Read the extra bytes of a length that overflowed its nibble
+//
+// Inputs       : ip - the input position, advanced
+//                iend - end of the input
+//                n - the nibble value
+// Outputs      : the full length, or -1 if the input ends early
+
+static int lz_get_length(const uint8_t **ip, const uint8_t *iend, int n) {
+	uint8_t b;
+	if (n != LZ_RUN_MASK)
+		return (n);
+	do {
+		if (*ip >= iend || n > CART_LZ_MAX_INPUT)
+			return (-1);
+		b = *(*ip)++;
+		n += b;
+	} while (b == 255);
+	return (n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lz_emit
+// Description  : Write one sequence, literals then (unless last) a match
+//
+// Inputs       : op - the output position, advanced
+//                oend - end of the output
+//                lit - the literals
+//                nlit - the number of literals
+//                offset - distance back to the match
+//                mlen - match length, 0 for the last sequence
+// Outputs      : 0 if successful, -1 if the output is full
+
+static int lz_emit(uint8_t **op, uint8_t *oend, const uint8_t *lit, int nlit, int offset, int mlen) {
+	int ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+	uint8_t *token;
+
+	if (*op >= oend)
+		return (-1);
+	token = (*op)++;
+	*token = (uint8_t)(((nlit < LZ_RUN_MASK ? nlit : LZ_RUN_MASK) << 4) | (ml < LZ_RUN_MASK ? ml : LZ_RUN_MASK));
+	if (nlit >= LZ_RUN_MASK && lz_put_length(op, oend, nlit - LZ_RUN_MASK) == -1)
+		return (-1);
+	if (oend - *op < nlit)
+		return (-1);
+	memcpy(*op, lit, nlit);
+	*op += nlit;
+	if (mlen == 0)
+		return (0);
+	if (oend - *op < 2)
+		return (-1);
+	*(*op)++ = (uint8_t)(offset & 0xff);
+	*(*op)++ = (uint8_t)(offset >> 8);
+	if (ml >= LZ_RUN_MASK && lz_put_length(op, oend, ml - LZ_RUN_MASK) == -1)
+		return (-1);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_lz_compress
+// Description  : Compress a block with a single pass, greedy hash match
+//                finder
+//
+// Inputs       : src - the bytes to compress
+//                len - the number of bytes (at most CART_LZ_MAX_INPUT)
+//                dst - where to put the compressed block
+//                cap - the size of dst
+// Outputs      : compressed length, or -1 if it does not fit in cap
+
+int cart_lz_compress(const void *src, int len, void *dst, int cap) {
+	uint16_t table[1 << LZ_HASH_BITS];
+	const uint8_t *in = src, *ip = in, *anchor = in, *end = in + len, *ref;
+	uint8_t *op = dst, *oend = op + cap;
+	uint32_t h;
+	int mlen;
+
+	if (len < 0 || len > CART_LZ_MAX_INPUT || cap < 0)
+		return (-1);
+	memset(table, 0, sizeof(table));
+	while (end - ip >= LZ_MIN_MATCH) {
+		h = lz_hash(ip);
+		ref = in + table[h];
+		table[h] = (uint16_t)(ip - in);
+		if (ref >= ip || memcmp(ref, ip, LZ_MIN_MATCH) != 0) {
+			ip++;
+			continue;
+		}
+		for (mlen = LZ_MIN_MATCH; ip + mlen < end && ref[mlen] == ip[mlen]; mlen++);
+		if (lz_emit(&op, oend, anchor, (int)(ip - anchor), (int)(ip - ref), mlen) == -1)
+			return (-1);
+		ip += mlen;
+		anchor = ip;
+	}
+	if (lz_emit(&op, oend, anchor, (int)(end - anchor), 0, 0) == -1)
+		return (-1);
+	return ((int)(op - (uint8_t *)dst));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_lz_decompress
+// Description  : Expand a compressed block, checking every length and offset
+//                so a damaged block cannot write outside dst
+//
+// Inputs       : src - the compressed block
+//                len - its length
+//                dst - where to put the expanded bytes
+//                cap - the size of dst
+// Outputs      : expanded length, or -1 if the block is corrupt or too large
+
+int cart_lz_decompress(const void *src, int len, void *dst, int cap) {
+	const uint8_t *ip = src, *iend = ip + len, *ref;
+	uint8_t *out = dst, *op = out, *oend = out + cap;
+	int n, offset;
+	uint8_t token;
+
+	if (len <= 0 || cap < 0)
+		return (-1);
+	while (ip < iend) {
+		token = *ip++;
+		if ((n = lz_get_length(&ip, iend, token >> 4)) == -1 || iend - ip < n || oend - op < n)
+			return (-1);
+		memcpy(op, ip, n);
+		op += n;
+		ip += n;
+		if (ip == iend)
+			break;
+
+		// A match, copied a byte at a time since it may overlap itself
+		if (iend - ip < 2)
+			return (-1);
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > op - out)
+			return (-1);
+		if ((n = lz_get_length(&ip, iend, token & LZ_RUN_MASK)) == -1 || oend - op < n + LZ_MIN_MATCH)
+			return (-1);
+		for (n += LZ_MIN_MATCH, ref = op - offset; n > 0; n--)
+			*op++ = *ref++;
+	}
+	return ((int)(op - out));
+}
+
+//
+// Unit test
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lz_test_roundtrip
+// Description  : Compress and expand a buffer, checking it comes back intact
+//
+// Inputs       : buf - the bytes
+//                len - the number of bytes
+// Outputs      : compressed length, or -1 if failure
+
+static int lz_test_roundtrip(const char *buf, int len) {
+	char packed[2 * 1024 + 64], unpacked[2 * 1024];
+	int clen;
+
+	if ((clen = cart_lz_compress(buf, len, packed, sizeof(packed))) == -1
+			|| cart_lz_decompress(packed, clen, unpacked, len) != len
+			|| memcmp(buf, unpacked, len) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "LZ unit test failed: round trip of %d bytes", len);
+		return (-1);
+	}
+	return (clen);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cartLzUnitTest
+// Description  : Check the codec on text, runs, random bytes, every short
+//                length and damaged blocks
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int cartLzUnitTest(void) {
+	char buf[1024], packed[1200], out[1024];
+	int i, len, clen;
+
+	// Text like the workloads compresses, runs collapse to a few bytes
+	for (i = 0; i < 1024; i++)
+		buf[i] = (i % 61 == 60) ? '^' : "the quick brown fox jumps over "[(i * 7 / 5) % 31];
+	if ((clen = lz_test_roundtrip(buf, 1024)) == -1 || clen > 512)
+		return (-1);
+	memset(buf, 0, sizeof(buf));
+	if ((clen = lz_test_roundtrip(buf, 1024)) == -1 || clen > 16)
+		return (-1);
+
+	// Random bytes round trip but do not fit in less than their own size
+	for (i = 0; i < 1024; i++)
+		buf[i] = (char)getRandomValue(0, 255);
+	if (lz_test_roundtrip(buf, 1024) == -1 || cart_lz_compress(buf, 1024, packed, 1000) != -1)
+		return (-1);
+	for (len = 0; len < 40; len++) {
+		if (lz_test_roundtrip(buf + 100, len) == -1)
+			return (-1);
+	}
+
+	// Truncated or damaged blocks fail cleanly (or at worst expand to junk)
+	clen = cart_lz_compress("abcabcabcabcabcabcabcabcabcabc^abc", 34, packed, sizeof(packed));
+	for (len = 1; len < clen; len++) {
+		if (cart_lz_decompress(packed, len, out, 34) > 34)
+			return (-1);
+	}
+	if (cart_lz_decompress(packed, clen, out, 33) != -1) {
+		logMessage(LOG_ERROR_LEVEL, "LZ unit test failed: overran the output");
+		return (-1);
+	}
+	for (i = 0; i < 1000; i++) {
+		packed[getRandomValue(0, clen - 1)] = (char)getRandomValue(0, 255);
+		if (cart_lz_decompress(packed, clen, out, sizeof(out)) > (int)sizeof(out))
+			return (-1);
+	}
+
+	logMessage(LOG_INFO_LEVEL, "LZ unit test completed successfully.");
+	return (0);
+}
@@ -0,0 +1,32 @@
+#ifndef CART_LZ_INCLUDED
+#define CART_LZ_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_lz.h
+//  Description    : This is the header file for the small LZ77 style codec
+//                   used to keep compressed frames in memory.
+//
+//  Author         : [Jacob Hohenstein]
+//  Last Modified  : [10/16/2016]
+//
+
+// Includes
+#include <stdint.h>
+
+// Defines
+#define CART_LZ_MAX_INPUT 65535  // largest block the codec handles (16 bit offsets)
+
+///
+// Codec Interfaces
+
+int cart_lz_compress(const void *src, int len, void *dst, int cap);
+	// Compress len bytes into dst, the compressed length or -1 if it needs more than cap
+
+int cart_lz_decompress(const void *src, int len, void *dst, int cap);
+	// Expand a compressed block into dst, the expanded length or -1 if corrupt/too large
+
+int cartLzUnitTest(void);
+	// Run a UNIT test checking the codec implementation
+
+#endif
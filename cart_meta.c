@@ -0,0 +1,455 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_meta.c
+//  Description    : This is the implementation of the metadata blocks.
+//
+//  Author         : [Jacob Hohenstein]
+//  Last Modified  : [10/16/2016]
+//
+
+// Includes
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+// Project includes
+#include <cart_meta.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Block Format
+//
+// Every field is little endian.  The superblock holds the magic number,
+// the version, the journal sequence number and the first checkpoint frame,
+// then a checksum of those 16 bytes.  Journal and checkpoint frames start
+// with a header of the magic number, the tag (a journal frame's sequence
+// number, or the checkpoint frame that follows), the bytes in use (header
+// included), the offset of the last record and a checksum of the frame.
+// Records follow back to back: a type byte, the length of what follows,
+// then the fields of the type (see meta_payload).
+//
+
+// Defines
+#define META_SUPER_SUM 16  // superblock bytes the checksum covers, it follows them
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : meta_get16/meta_get32/meta_put16/meta_put32
+// Description  : Read and write the little endian fields of a block
+//
+// Inputs       : p - the field
+//                v - the value to write
+// Outputs      : the value read
+
+static uint16_t meta_get16(const char *p) {
+	return ((uint16_t)((uint8_t)p[0] | ((uint8_t)p[1] << 8)));
+}
+
+static uint32_t meta_get32(const char *p) {
+	return ((uint32_t)meta_get16(p) | ((uint32_t)meta_get16(p + 2) << 16));
+}
+
+static void meta_put16(char *p, uint16_t v) {
+	p[0] = (char)(v & 0xff);
+	p[1] = (char)(v >> 8);
+}
+
+static void meta_put32(char *p, uint32_t v) {
+	meta_put16(p, (uint16_t)(v & 0xffff));
+	meta_put16(p + 2, (uint16_t)(v >> 16));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : meta_checksum
+// Description  : Checksum a run of bytes (FNV-1a), skipping a frame's own
+//                checksum field
+//
+// Inputs       : p - the bytes
+//                len - how many
+//                skip - offset of a 4 byte field left out, -1 for none
+// Outputs      : the checksum
+
+static uint32_t meta_checksum(const char *p, size_t len, int skip) {
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if ((int)i == skip) {
+			i += 3;
+			continue;
+		}
+		h ^= (uint8_t)p[i];
+		h *= 16777619u;
+	}
+	return (h);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : meta_payload
+// Description  : Get the bytes a record's fields take after its type and
+//                length: an id, then for CREATE the parent, type and name,
+//                for RENAME the parent and name, for MAP the first frame,
+//                block and count, for SIZE the size, for DIR the bucket
+//                and entry counts and for PACK the frame, slot, offset and
+//                length
+//
+// Inputs       : rec - the record
+// Outputs      : the bytes, -1 for an unknown type
+static int meta_payload(const CartMetaRecord *rec) {
+	switch (rec->type) {
+	case CART_META_CREATE: return (5 + rec->len);
+	case CART_META_REMOVE: return (2);
+	case CART_META_RENAME: return (4 + rec->len);
+	case CART_META_MAP:    return (14);
+	case CART_META_SIZE:   return (6);
+	case CART_META_DIR:    return (10);
+	case CART_META_PACK:   return (14);
+	}
+	return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_meta_super_encode
+// Description  : Write a superblock into a frame
+//
+// Inputs       : frame - the frame to fill
+//                sb - the superblock
+// Outputs      : none
+
+void cart_meta_super_encode(char *frame, const CartMetaSuper *sb) {
+	memset(frame, 0, CART_FRAME_SIZE);
+	meta_put32(frame, CART_META_SUPER_MAGIC);
+	meta_put32(frame + 4, CART_META_VERSION);
+	meta_put32(frame + 8, sb->sequence);
+	meta_put32(frame + 12, sb->checkpoint);
+	meta_put32(frame + META_SUPER_SUM, meta_checksum(frame, META_SUPER_SUM, -1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_meta_super_decode
+// Description  : Read a superblock
+//
+// Inputs       : frame - the frame read
+//                sb - the superblock decoded
+// Outputs      : 0 if successful, -1 if the frame is not a valid superblock
+
+int cart_meta_super_decode(const char *frame, CartMetaSuper *sb) {
+	if (meta_get32(frame) != CART_META_SUPER_MAGIC || meta_get32(frame + 4) != CART_META_VERSION
+			|| meta_get32(frame + META_SUPER_SUM) != meta_checksum(frame, META_SUPER_SUM, -1))
+		return (-1);
+	sb->sequence = meta_get32(frame + 8);
+	sb->checkpoint = meta_get32(frame + 12);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_meta_frame_init
+// Description  : Make an empty journal or checkpoint frame
+//
+// Inputs       : frame - the frame to fill
+//                magic - CART_META_JOURNAL_MAGIC or CART_META_CHECKPOINT_MAGIC
+//                tag - the sequence number, or the next checkpoint frame
+// Outputs      : none
+
+void cart_meta_frame_init(char *frame, uint32_t magic, uint32_t tag) {
+	memset(frame, 0, CART_FRAME_SIZE);
+	meta_put32(frame, magic);
+	meta_put32(frame + 4, tag);
+	meta_put16(frame + 8, CART_META_HEADER);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_meta_frame_set_tag
+// Description  : Change the tag of a frame
+//
+// Inputs       : frame - the frame
+//                tag - the sequence number, or the next checkpoint frame
+// Outputs      : none
+
+void cart_meta_frame_set_tag(char *frame, uint32_t tag) {
+	meta_put32(frame + 4, tag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_meta_frame_add
+// Description  : Add a record to the end of a frame.  A MAP whose run
+//                carries on from the last record's MAP of the same file
+//                lengthens that one instead, so a file written sequentially
+//                logs a record per extent rather than per frame.
+//
+// Inputs       : frame - the frame
+//                rec - the record
+// Outputs      : 0 if successful, -1 if the frame is full (or bad record)
+
+int cart_meta_frame_add(char *frame, const CartMetaRecord *rec) {
+	int used = meta_get16(frame + 8), last = meta_get16(frame + 10), size = meta_payload(rec);
+	CartMetaRecord prev;
+	char *r = frame + used;
+
+	if (size < 0 || rec->len > CART_META_MAX_NAME)
+		return (-1);
+	if (rec->type == CART_META_MAP && last != 0 && cart_meta_frame_next(frame, &last, &prev)
+			&& prev.type == CART_META_MAP && prev.id == rec->id
+			&& prev.frame + prev.count == rec->frame
+			&& ((prev.block == CART_BLOCK_NONE) ? rec->block == CART_BLOCK_NONE : prev.block + prev.count == rec->block)) {
+		meta_put32(frame + meta_get16(frame + 10) + 12, prev.count + rec->count);
+		return (0);
+	}
+	if (used + 2 + size > CART_FRAME_SIZE)
+		return (-1);
+
+	r[0] = (char)rec->type;
+	r[1] = (char)size;
+	meta_put16(r + 2, (uint16_t)rec->id);
+	switch (rec->type) {
+	case CART_META_CREATE:
+		meta_put16(r + 4, (uint16_t)rec->parent);
+		r[6] = (char)((rec->is_dir ? 1 : 0) | (rec->compressed ? 2 : 0));
+		memcpy(r + 7, rec->name, rec->len);
+		break;
+	case CART_META_RENAME:
+		meta_put16(r + 4, (uint16_t)rec->parent);
+		memcpy(r + 6, rec->name, rec->len);
+		break;
+	case CART_META_MAP:
+		meta_put32(r + 4, rec->frame);
+		meta_put32(r + 8, rec->block);
+		meta_put32(r + 12, rec->count);
+		break;
+	case CART_META_SIZE:
+		meta_put32(r + 4, rec->size);
+		break;
+	case CART_META_DIR:
+		meta_put32(r + 4, rec->buckets);
+		meta_put32(r + 8, rec->entries);
+		break;
+	case CART_META_PACK:
+		meta_put32(r + 4, rec->frame);
+		meta_put32(r + 8, rec->slot);
+		meta_put16(r + 12, rec->offset);
+		meta_put16(r + 14, rec->length);
+		break;
+	}
+	meta_put16(frame + 8, (uint16_t)(used + 2 + size));
+	meta_put16(frame + 10, (uint16_t)used);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_meta_frame_seal
+// Description  : Checksum a frame before it is written
+//
+// Inputs       : frame - the frame
+// Outputs      : none
+
+void cart_meta_frame_seal(char *frame) {
+	meta_put32(frame + 12, meta_checksum(frame, CART_FRAME_SIZE, 12));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_meta_frame_check
+// Description  : Check a frame read back was sealed and is of a kind
+//
+// Inputs       : frame - the frame
+//                magic - the kind expected
+//                tag - set to the frame's tag
+// Outputs      : 0 if it is, -1 if not
+
+int cart_meta_frame_check(const char *frame, uint32_t magic, uint32_t *tag) {
+	int used = meta_get16(frame + 8);
+
+	if (meta_get32(frame) != magic || used < CART_META_HEADER || used > CART_FRAME_SIZE
+			|| meta_get32(frame + 12) != meta_checksum(frame, CART_FRAME_SIZE, 12))
+		return (-1);
+	*tag = meta_get32(frame + 4);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_meta_frame_next
+// Description  : Read the record at or after an offset and move past it
+//
+// Inputs       : frame - the frame
+//                offset - the offset, 0 for the first record, advanced
+//                rec - the record read
+// Outputs      : 1 if a record was read, 0 at the end of the frame
+
+int cart_meta_frame_next(const char *frame, int *offset, CartMetaRecord *rec) {
+	int used = meta_get16(frame + 8), at = (*offset < CART_META_HEADER) ? CART_META_HEADER : *offset;
+	const char *r = frame + at;
+
+	if (used > CART_FRAME_SIZE || at + 4 > used || at + 2 + (uint8_t)r[1] > used)
+		return (0);
+	memset(rec, 0, sizeof(CartMetaRecord));
+	rec->type = (uint8_t)r[0];
+	if (rec->type == CART_META_CREATE || rec->type == CART_META_RENAME) {
+		if ((uint8_t)r[1] < meta_payload(rec))
+			return (0);
+		rec->len = (uint8_t)r[1] - meta_payload(rec);
+	}
+	if (meta_payload(rec) != (uint8_t)r[1])
+		return (0);
+
+	rec->id = (int16_t)meta_get16(r + 2);
+	switch (rec->type) {
+	case CART_META_CREATE:
+		rec->parent = (int16_t)meta_get16(r + 4);
+		rec->is_dir = (uint8_t)r[6] & 1;
+		rec->compressed = ((uint8_t)r[6] >> 1) & 1;
+		rec->name = r + 7;
+		break;
+	case CART_META_RENAME:
+		rec->parent = (int16_t)meta_get16(r + 4);
+		rec->name = r + 6;
+		break;
+	case CART_META_MAP:
+		rec->frame = meta_get32(r + 4);
+		rec->block = meta_get32(r + 8);
+		rec->count = meta_get32(r + 12);
+		break;
+	case CART_META_SIZE:
+		rec->size = meta_get32(r + 4);
+		break;
+	case CART_META_DIR:
+		rec->buckets = meta_get32(r + 4);
+		rec->entries = meta_get32(r + 8);
+		break;
+	case CART_META_PACK:
+		rec->frame = meta_get32(r + 4);
+		rec->slot = meta_get32(r + 8);
+		rec->offset = meta_get16(r + 12);
+		rec->length = meta_get16(r + 14);
+		break;
+	}
+	*offset = at + 2 + (uint8_t)r[1];
+	return (1);
+}
+
+//
+// Unit test
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cartMetaUnitTest
+// Description  : Round trip superblocks and records, merge runs of MAP
+//                records and refuse damaged frames
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int cartMetaUnitTest(void) {
+	char frame[CART_FRAME_SIZE], name[32];
+	CartMetaSuper sb = { 77, CART_BLOCK(5, 9) }, sb2;
+	CartMetaRecord rec, got;
+	uint32_t tag;
+	int i, n, offset;
+
+	// Superblocks round trip, and a damaged one is refused
+	cart_meta_super_encode(frame, &sb);
+	if (cart_meta_super_decode(frame, &sb2) != 0 || sb2.sequence != 77 || sb2.checkpoint != CART_BLOCK(5, 9))
+		return (-1);
+	frame[9] ^= 1;
+	if (cart_meta_super_decode(frame, &sb2) == 0)
+		return (-1);
+
+	// Fill a frame with creates and sizes, each comes back as written
+	cart_meta_frame_init(frame, CART_META_JOURNAL_MAGIC, 12);
+	for (n = 0; ; n++) {
+		memset(&rec, 0, sizeof(rec));
+		rec.type = (n % 2) ? CART_META_SIZE : CART_META_CREATE;
+		rec.id = (int16_t)n;
+		rec.parent = (int16_t)(n - 1);
+		rec.is_dir = n % 3 == 0;
+		rec.compressed = n % 5 == 0;
+		rec.size = n * 1000;
+		snprintf(name, sizeof(name), "file%d", n);
+		rec.name = name;
+		rec.len = (rec.type == CART_META_CREATE) ? strlen(name) : 0;
+		if (cart_meta_frame_add(frame, &rec) != 0)
+			break;
+	}
+	if (n < 50)
+		return (-1);
+	cart_meta_frame_seal(frame);
+	if (cart_meta_frame_check(frame, CART_META_JOURNAL_MAGIC, &tag) != 0 || tag != 12
+			|| cart_meta_frame_check(frame, CART_META_CHECKPOINT_MAGIC, &tag) == 0)
+		return (-1);
+	for (i = 0, offset = 0; cart_meta_frame_next(frame, &offset, &got); i++) {
+		snprintf(name, sizeof(name), "file%d", i);
+		if (got.id != i || got.type != ((i % 2) ? CART_META_SIZE : CART_META_CREATE))
+			return (-1);
+		if (got.type == CART_META_SIZE && got.size != (uint32_t)i * 1000)
+			return (-1);
+		if (got.type == CART_META_CREATE && (got.parent != i - 1 || got.is_dir != (i % 3 == 0) || got.compressed != (i % 5 == 0)
+				|| got.len != strlen(name) || memcmp(got.name, name, got.len) != 0))
+			return (-1);
+	}
+	if (i != n)
+		return (-1);
+	frame[100] ^= 4;
+	if (cart_meta_frame_check(frame, CART_META_JOURNAL_MAGIC, &tag) == 0)
+		return (-1);
+
+	// Consecutive frames (or holes) of a file log one MAP record, a gap starts another
+	cart_meta_frame_init(frame, CART_META_CHECKPOINT_MAGIC, CART_BLOCK_NONE);
+	memset(&rec, 0, sizeof(rec));
+	rec.type = CART_META_MAP;
+	rec.id = 3;
+	rec.count = 1;
+	for (i = 0; i < 200; i++) {
+		rec.frame = i;
+		rec.block = CART_BLOCK(2, (i < 60) ? i + 10 : i + 500);
+		if (i >= 100)
+			rec.block = (i < 170) ? CART_BLOCK_NONE : CART_BLOCK(0, i - 101);
+		if (cart_meta_frame_add(frame, &rec) != 0)
+			return (-1);
+	}
+	offset = 0;
+	if (!cart_meta_frame_next(frame, &offset, &got) || got.frame != 0 || got.count != 60 || got.block != CART_BLOCK(2, 10)
+			|| !cart_meta_frame_next(frame, &offset, &got) || got.frame != 60 || got.count != 40
+			|| !cart_meta_frame_next(frame, &offset, &got) || got.count != 70 || got.block != CART_BLOCK_NONE
+			|| !cart_meta_frame_next(frame, &offset, &got) || got.frame != 170 || got.count != 30
+			|| cart_meta_frame_next(frame, &offset, &got))
+		return (-1);
+
+	// A packed frame comes back as written
+	cart_meta_frame_init(frame, CART_META_JOURNAL_MAGIC, 1);
+	memset(&rec, 0, sizeof(rec));
+	rec.type = CART_META_PACK;
+	rec.id = 9;
+	rec.frame = 70000;
+	rec.slot = 123456;
+	rec.offset = 1000;
+	rec.length = 24;
+	offset = 0;
+	if (cart_meta_frame_add(frame, &rec) != 0 || !cart_meta_frame_next(frame, &offset, &got) || got.type != CART_META_PACK
+			|| got.id != 9 || got.frame != 70000 || got.slot != 123456 || got.offset != 1000 || got.length != 24)
+		return (-1);
+
+	// Garbage never reads past the frame
+	for (i = 0; i < 1000; i++) {
+		frame[getRandomValue(0, CART_FRAME_SIZE - 1)] = (char)getRandomValue(0, 255);
+		for (offset = 0; cart_meta_frame_next(frame, &offset, &got); ) {
+			if (offset > CART_FRAME_SIZE)
+				return (-1);
+		}
+	}
+
+	logMessage(LOG_INFO_LEVEL, "Metadata block unit test completed successfully.");
+	return (0);
+}
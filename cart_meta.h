@@ -0,0 +1,107 @@
+#ifndef CART_META_INCLUDED
+#define CART_META_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_meta.h
+//  Description    : This is the header file for the metadata blocks, the
+//                   on-cartridge format of the superblock, the checkpoint
+//                   of the file table and the metadata journal.
+//
+//                   The superblock is frame 0 of cartridge 0 and the
+//                   journal is a ring in the frames after it.  A checkpoint
+//                   is a chain of frames, wherever the allocator put them,
+//                   holding the records that rebuild every file; the
+//                   journal holds the records logged since.
+//
+//  Author         : [Jacob Hohenstein]
+//  Last Modified  : [10/16/2016]
+//
+
+// Includes
+#include <stdint.h>
+#include <stddef.h>
+#include <cart_controller.h>
+#include <cart_blockmap.h>
+
+// Defines
+#define CART_META_SUPER_MAGIC 0x43415254       // "CART"
+#define CART_META_JOURNAL_MAGIC 0x4a524e4c     // "JRNL"
+#define CART_META_CHECKPOINT_MAGIC 0x434b5054  // "CKPT"
+#define CART_META_VERSION 1
+#define CART_META_SUPERBLOCK CART_BLOCK(0, 0)  // where the superblock lives
+#define CART_META_JOURNAL_FRAMES 63            // journal ring, the frames after the superblock
+#define CART_META_RESERVED (1 + CART_META_JOURNAL_FRAMES)  // frames of cartridge 0 kept from the allocator
+#define CART_META_HEADER 16                    // frame header: magic, tag, used, last record, checksum
+#define CART_META_MAX_NAME 250                 // longest name a record holds
+
+// Record types
+#define CART_META_CREATE 1  // a file or directory, with its parent and name
+#define CART_META_REMOVE 2  // a file goes, freeing its frames
+#define CART_META_RENAME 3  // a file moves to a new parent and name
+#define CART_META_MAP    4  // a run of file frames is stored in consecutive cartridge frames (or are holes)
+#define CART_META_SIZE   5  // a file's size in bytes
+#define CART_META_DIR    6  // a directory's bucket and entry counts
+#define CART_META_PACK   7  // a frame of a compressed file is packed in a slot of its map (cart_pack.h)
+
+// The superblock
+typedef struct {
+
+	uint32_t  sequence;    // sequence number of the first journal frame after the checkpoint
+	CartBlock checkpoint;  // first frame of the checkpoint, CART_BLOCK_NONE for none
+
+} CartMetaSuper;
+
+// A record decoded from a frame, name points into the frame
+typedef struct {
+
+	uint8_t     type;     // CART_META_*
+	int16_t     id;       // the file
+	int16_t     parent;   // CREATE, RENAME: directory holding it, -1 for the root
+	uint8_t     is_dir;   // CREATE: a directory
+	uint8_t     compressed; // CREATE: a compressed file, its frames are found by PACK records
+	uint32_t    frame;    // MAP: first file frame of the run, PACK: the file frame
+	CartBlock   block;    // MAP: cartridge frame holding it, CART_BLOCK_NONE for holes
+	uint32_t    count;    // MAP: frames in the run
+	uint32_t    size;     // SIZE: bytes in the file
+	uint32_t    buckets;  // DIR: buckets of the directory
+	uint32_t    entries;  // DIR: names in the directory
+	uint32_t    slot;     // PACK: frame of the map holding the bytes
+	uint16_t    offset;   // PACK: first byte within the slot
+	uint16_t    length;   // PACK: compressed bytes, 0 for a hole
+	uint8_t     len;      // CREATE, RENAME: length of the name
+	const char *name;
+
+} CartMetaRecord;
+
+///
+// Metadata Block Interfaces
+
+void cart_meta_super_encode(char *frame, const CartMetaSuper *sb);
+	// Write a superblock into a frame
+
+int cart_meta_super_decode(const char *frame, CartMetaSuper *sb);
+	// Read a superblock, -1 if the frame does not hold a valid one
+
+void cart_meta_frame_init(char *frame, uint32_t magic, uint32_t tag);
+	// Make an empty journal (tag is its sequence number) or checkpoint (tag is the next frame) frame
+
+int cart_meta_frame_add(char *frame, const CartMetaRecord *rec);
+	// Add a record (a MAP continuing the last record's run extends it), -1 if the frame is full
+
+void cart_meta_frame_seal(char *frame);
+	// Checksum a frame before it is written
+
+int cart_meta_frame_check(const char *frame, uint32_t magic, uint32_t *tag);
+	// Check a frame read back is sealed and of the kind expected, -1 if not
+
+void cart_meta_frame_set_tag(char *frame, uint32_t tag);
+	// Change the tag of a frame (reseal it after)
+
+int cart_meta_frame_next(const char *frame, int *offset, CartMetaRecord *rec);
+	// Read the record at *offset (0 to start) and move past it, 0 at the end
+
+int cartMetaUnitTest(void);
+	// Run a UNIT test checking the metadata block implementation
+
+#endif
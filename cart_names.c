@@ -0,0 +1,344 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_names.c
+//  Description    : This is the implementation of the name tables, open
+//                   addressing hash tables over interned names.
+//
+//  Author         : [Jacob Hohenstein]
+//  Last Modified  : [10/16/2016]
+//
+
+// Includes
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+// Project includes
+#include <cart_names.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define NAMES_MIN_SLOTS 16
+#define NAMES_POOL_HEADER sizeof(char *)  // each chunk starts with the previous one
+
+// Marks a slot whose name was removed, so probes carry on past it
+static const char names_tombstone[1];
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : names_hash
+// Description  : Hash a name within its directory (FNV-1a)
+//
+// Inputs       : parent - the directory
+//                name - the name
+//                len - its length
+// Outputs      : the hash
+
+static uint32_t names_hash(int32_t parent, const char *name, size_t len) {
+	uint32_t h = 2166136261u ^ (uint32_t)parent;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (uint8_t)name[i];
+		h *= 16777619u;
+	}
+	return (h);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : names_find
+// Description  : Probe for a name, or for the slot it would go in
+//
+// Inputs       : names - the table
+//                hash - the hash of the name
+//                parent, name, len - the name
+//                insert - set to the first free slot on the probe path
+// Outputs      : the slot holding the name, NULL if it is not there
+
+static CartNameEntry * names_find(CartNames *names, uint32_t hash, int32_t parent, const char *name,
+		size_t len, CartNameEntry **insert) {
+	uint32_t mask = names->capacity - 1, i;
+	CartNameEntry *e;
+
+	if (insert != NULL)
+		*insert = NULL;
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		e = &names->slots[i];
+		if (e->name == NULL) {
+			if (insert != NULL && *insert == NULL)
+				*insert = e;
+			return (NULL);
+		}
+		if (e->name == names_tombstone) {
+			if (insert != NULL && *insert == NULL)
+				*insert = e;
+			continue;
+		}
+		if (e->hash == hash && e->parent == parent && e->len == len && memcmp(e->name, name, len) == 0)
+			return (e);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : names_rehash
+// Description  : Move every name into a new slot array, dropping tombstones
+//
+// Inputs       : names - the table
+//                capacity - the new number of slots, a power of two
+// Outputs      : 0 if successful, -1 if failure
+
+static int names_rehash(CartNames *names, uint32_t capacity) {
+	CartNameEntry *old = names->slots, *slot;
+	uint32_t i, oldcap = names->capacity;
+
+	if ((names->slots = calloc(capacity, sizeof(CartNameEntry))) == NULL) {
+		names->slots = old;
+		return (-1);
+	}
+	names->capacity = capacity;
+	names->used = names->count;
+	for (i = 0; i < oldcap; i++) {
+		if (old[i].name == NULL || old[i].name == names_tombstone)
+			continue;
+		for (slot = &names->slots[old[i].hash & (capacity - 1)]; slot->name != NULL; ) {
+			slot = (slot == &names->slots[capacity - 1]) ? names->slots : slot + 1;
+		}
+		*slot = old[i];
+	}
+	free(old);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : names_intern
+// Description  : Copy a name into the string pool
+//
+// Inputs       : names - the table
+//                name - the name
+//                len - its length
+// Outputs      : the NUL terminated copy, NULL if out of memory
+
+static char * names_intern(CartNames *names, const char *name, size_t len) {
+	size_t size = CART_NAMES_POOL_CHUNK;
+	char *chunk, *copy;
+
+	if (names->pool == NULL || names->pool_used + len + 1 > CART_NAMES_POOL_CHUNK) {
+		if (NAMES_POOL_HEADER + len + 1 > size)
+			size = NAMES_POOL_HEADER + len + 1;
+		if ((chunk = malloc(size)) == NULL)
+			return (NULL);
+		memcpy(chunk, &names->pool, NAMES_POOL_HEADER);
+		names->pool = chunk;
+		names->pool_used = NAMES_POOL_HEADER;
+	}
+	copy = names->pool + names->pool_used;
+	memcpy(copy, name, len);
+	copy[len] = '\0';
+	names->pool_used += len + 1;
+	return (copy);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_names_init
+// Description  : Initialize an empty table sized for expected names
+//
+// Inputs       : names - the table
+//                expected - the number of names it will likely hold
+// Outputs      : 0 if successful, -1 if failure
+
+int cart_names_init(CartNames *names, uint32_t expected) {
+	uint32_t capacity = NAMES_MIN_SLOTS;
+
+	// Keep the load under three quarters
+	while (capacity / 4 * 3 < expected)
+		capacity *= 2;
+	memset(names, 0, sizeof(CartNames));
+	if ((names->slots = calloc(capacity, sizeof(CartNameEntry))) == NULL)
+		return (-1);
+	names->capacity = capacity;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_names_free
+// Description  : Release the table and every interned name
+//
+// Inputs       : names - the table
+// Outputs      : none
+
+void cart_names_free(CartNames *names) {
+	char *chunk, *prev;
+
+	for (chunk = names->pool; chunk != NULL; chunk = prev) {
+		memcpy(&prev, chunk, NAMES_POOL_HEADER);
+		free(chunk);
+	}
+	free(names->slots);
+	memset(names, 0, sizeof(CartNames));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_names_lookup
+// Description  : Find the id of a name in a directory
+//
+// Inputs       : names - the table
+//                parent - the directory
+//                name - the name
+//                len - its length
+// Outputs      : the id, -1 if it is not there
+
+int32_t cart_names_lookup(CartNames *names, int32_t parent, const char *name, size_t len) {
+	CartNameEntry *e;
+
+	if (names->slots == NULL)
+		return (-1);
+	e = names_find(names, names_hash(parent, name, len), parent, name, len, NULL);
+	return ((e == NULL) ? -1 : e->id);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_names_insert
+// Description  : Add a name to a directory, interning it
+//
+// Inputs       : names - the table
+//                parent - the directory
+//                name - the name
+//                len - its length
+//                id - what it refers to
+// Outputs      : the interned name, NULL if it exists or out of memory
+
+const char * cart_names_insert(CartNames *names, int32_t parent, const char *name, size_t len, int32_t id) {
+	uint32_t hash = names_hash(parent, name, len);
+	CartNameEntry *slot;
+	char *copy;
+
+	if (names->slots == NULL)
+		return (NULL);
+
+	// Grow (or just sweep out tombstones) before the probes get long
+	if ((names->used + 1) > names->capacity / 4 * 3) {
+		if (names_rehash(names, (names->count + 1 > names->capacity / 2) ? names->capacity * 2 : names->capacity) == -1)
+			return (NULL);
+	}
+	if (names_find(names, hash, parent, name, len, &slot) != NULL)
+		return (NULL);
+	if ((copy = names_intern(names, name, len)) == NULL)
+		return (NULL);
+	if (slot->name == NULL)
+		names->used++;
+	*slot = (CartNameEntry){ hash, parent, id, (uint32_t)len, copy };
+	names->count++;
+	return (copy);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_names_remove
+// Description  : Remove a name from a directory
+//
+// Inputs       : names - the table
+//                parent - the directory
+//                name - the name
+//                len - its length
+// Outputs      : 0 if successful, -1 if it is not there
+
+int cart_names_remove(CartNames *names, int32_t parent, const char *name, size_t len) {
+	CartNameEntry *e;
+
+	if (names->slots == NULL)
+		return (-1);
+	if ((e = names_find(names, names_hash(parent, name, len), parent, name, len, NULL)) == NULL)
+		return (-1);
+	e->name = names_tombstone;
+	names->count--;
+	return (0);
+}
+
+//
+// Unit test
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cartNamesUnitTest
+// Description  : Check inserts, lookups and removes across growth, with
+//                the same name in different directories
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int cartNamesUnitTest(void) {
+	char name[64], *longname;
+	const char *copy;
+	CartNames names;
+	int32_t i, ret = -1;
+
+	if (cart_names_init(&names, 0) != 0)
+		return (-1);
+
+	// Thousands of names, each also under a second directory
+	for (i = 0; i < 5000; i++) {
+		snprintf(name, sizeof(name), "file%d.txt", i);
+		if ((copy = cart_names_insert(&names, CART_NAMES_ROOT, name, strlen(name), i)) == NULL
+				|| strcmp(copy, name) != 0
+				|| cart_names_insert(&names, 7, name, strlen(name), i + 5000) == NULL
+				|| cart_names_insert(&names, CART_NAMES_ROOT, name, strlen(name), 0) != NULL)
+			goto done;
+	}
+	for (i = 0; i < 5000; i++) {
+		snprintf(name, sizeof(name), "file%d.txt", i);
+		if (cart_names_lookup(&names, CART_NAMES_ROOT, name, strlen(name)) != i
+				|| cart_names_lookup(&names, 7, name, strlen(name)) != i + 5000
+				|| cart_names_lookup(&names, 8, name, strlen(name)) != -1)
+			goto done;
+	}
+
+	// Removes leave tombstones that lookups probe past and inserts reuse
+	for (i = 0; i < 5000; i += 2) {
+		snprintf(name, sizeof(name), "file%d.txt", i);
+		if (cart_names_remove(&names, CART_NAMES_ROOT, name, strlen(name)) != 0
+				|| cart_names_remove(&names, CART_NAMES_ROOT, name, strlen(name)) != -1)
+			goto done;
+	}
+	for (i = 0; i < 5000; i++) {
+		snprintf(name, sizeof(name), "file%d.txt", i);
+		if (cart_names_lookup(&names, CART_NAMES_ROOT, name, strlen(name)) != ((i % 2) ? i : -1))
+			goto done;
+	}
+	for (i = 0; i < 20000; i++) {
+		snprintf(name, sizeof(name), "churn%d", i % 100);
+		if (cart_names_insert(&names, 3, name, strlen(name), i) == NULL || cart_names_remove(&names, 3, name, strlen(name)) != 0)
+			goto done;
+	}
+	if (names.count != 7500 || names.capacity > 32768)
+		goto done;
+
+	// Names longer than a pool chunk still intern
+	if ((longname = malloc(2 * CART_NAMES_POOL_CHUNK)) == NULL)
+		goto done;
+	memset(longname, 'x', 2 * CART_NAMES_POOL_CHUNK);
+	if (cart_names_insert(&names, 1, longname, 2 * CART_NAMES_POOL_CHUNK, 1) != NULL
+			&& cart_names_lookup(&names, 1, longname, 2 * CART_NAMES_POOL_CHUNK) == 1
+			&& cart_names_insert(&names, 1, "short", 5, 2) != NULL)
+		ret = 0;
+	free(longname);
+
+done:
+	cart_names_free(&names);
+	if (ret != 0) {
+		logMessage(LOG_ERROR_LEVEL, "Name table unit test failed.");
+		return (-1);
+	}
+	logMessage(LOG_INFO_LEVEL, "Name table unit test completed successfully.");
+	return (0);
+}
@@ -0,0 +1,67 @@
+#ifndef CART_NAMES_INCLUDED
+#define CART_NAMES_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_names.h
+//  Description    : This is the header file for the name tables, hashed maps
+//                   from a (parent, name) pair to an id with the names
+//                   interned in a string pool.
+//
+//  Author         : [Jacob Hohenstein]
+//  Last Modified  : [10/16/2016]
+//
+
+// Includes
+#include <stdint.h>
+#include <stddef.h>
+
+// Defines
+#define CART_NAMES_ROOT -1            // parent of the names at the top of the namespace
+#define CART_NAMES_POOL_CHUNK 16384   // bytes per string pool allocation
+
+// One slot of the table, open addressing with linear probing
+typedef struct {
+
+	uint32_t    hash;    // hash of parent and name
+	int32_t     parent;  // id of the directory holding the name
+	int32_t     id;      // what the name refers to
+	uint32_t    len;     // length of the name
+	const char *name;    // interned name, NULL for an empty slot
+
+} CartNameEntry;
+
+// A name table and the pool its names are interned in
+typedef struct {
+
+	CartNameEntry *slots;      // power of two slots
+	uint32_t       capacity;   // slots allocated
+	uint32_t       count;      // names in the table
+	uint32_t       used;       // slots not empty (names and tombstones)
+	char          *pool;       // current pool chunk, chained through its first bytes
+	size_t         pool_used;  // bytes of it handed out
+
+} CartNames;
+
+///
+// Name Table Interfaces
+
+int cart_names_init(CartNames *names, uint32_t expected);
+	// Initialize an empty table sized for expected names
+
+void cart_names_free(CartNames *names);
+	// Release the table and every interned name
+
+int32_t cart_names_lookup(CartNames *names, int32_t parent, const char *name, size_t len);
+	// Find the id of a name in a directory, -1 if it is not there
+
+const char * cart_names_insert(CartNames *names, int32_t parent, const char *name, size_t len, int32_t id);
+	// Add a name, returning its interned copy (NUL terminated), NULL if it exists or no memory
+
+int cart_names_remove(CartNames *names, int32_t parent, const char *name, size_t len);
+	// Remove a name (its interned copy lives until the table is freed), -1 if not there
+
+int cartNamesUnitTest(void);
+	// Run a UNIT test checking the name table implementation
+
+#endif
@@ -0,0 +1,280 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_pack.c
+//  Description    : This is the implementation of the pack index of a
+//                   compressed file, an entry per frame of the file and a
+//                   count of the frames left in each slot.
+//
+//  Author         : [Jacob Hohenstein]
+//  Last Modified  : [10/16/2016]
+//
+
+// Includes
+#include <string.h>
+#include <stdlib.h>
+
+// Project includes
+#include <cart_pack.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pack_grow
+// Description  : Make room for the entries up to a frame and the slot
+//                counts up to a slot, the new ones holes and empty
+//
+// Inputs       : ix - the pack index
+//                frame - the frame of the file
+//                slot - the slot
+// Outputs      : 0 if successful, -1 if failure
+
+static int pack_grow(CartPackIndex *ix, uint32_t frame, uint32_t slot) {
+	uint32_t capacity = ix->capacity;
+	CartPackEntry *entries;
+	uint16_t *live;
+
+	if (frame >= capacity) {
+		while (capacity <= frame)
+			capacity = (capacity < 16) ? 16 : capacity * 2;
+		if ((entries = realloc(ix->entries, capacity * sizeof(CartPackEntry))) == NULL)
+			return (-1);
+		memset(&entries[ix->capacity], 0, (capacity - ix->capacity) * sizeof(CartPackEntry));
+		ix->entries = entries;
+		ix->capacity = capacity;
+	}
+	if (slot != CART_PACK_NONE && slot >= ix->slots) {
+		if ((live = realloc(ix->live, (slot + 1) * sizeof(uint16_t))) == NULL)
+			return (-1);
+		memset(&live[ix->slots], 0, (slot + 1 - ix->slots) * sizeof(uint16_t));
+		ix->live = live;
+		ix->slots = slot + 1;
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_pack_init
+// Description  : Initialize an empty pack index
+//
+// Inputs       : ix - the pack index
+// Outputs      : none
+
+void cart_pack_init(CartPackIndex *ix) {
+	memset(ix, 0, sizeof(CartPackIndex));
+	ix->open = CART_PACK_NONE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_pack_free
+// Description  : Release the memory of a pack index, leaving it empty
+//
+// Inputs       : ix - the pack index
+// Outputs      : none
+
+void cart_pack_free(CartPackIndex *ix) {
+	free(ix->entries);
+	free(ix->live);
+	cart_pack_init(ix);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_pack_lookup
+// Description  : Find the bytes of a frame of the file
+//
+// Inputs       : ix - the pack index
+//                frame - the frame of the file
+// Outputs      : the entry, a hole (length 0) past the last
+
+CartPackEntry cart_pack_lookup(CartPackIndex *ix, uint32_t frame) {
+	CartPackEntry hole = { CART_PACK_NONE, 0, 0 };
+
+	if (frame >= ix->frames)
+		return (hole);
+	return (ix->entries[frame]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_pack_place
+// Description  : Make room for the bytes of a frame, after those already
+//                in the open slot if they fit, else at the start of the
+//                next slot, which is opened
+//
+// Inputs       : ix - the pack index
+//                length - the bytes, 1 to CART_FRAME_SIZE
+//                slot - set to the slot
+//                offset - set to the first byte within it
+//                closed - set to the slot no longer open, CART_PACK_NONE if none
+// Outputs      : 0 if successful, -1 if failure
+
+int cart_pack_place(CartPackIndex *ix, uint16_t length, uint32_t *slot, uint16_t *offset, uint32_t *closed) {
+	if (length == 0 || length > CART_FRAME_SIZE)
+		return (-1);
+	*closed = CART_PACK_NONE;
+	if (ix->open == CART_PACK_NONE || ix->used + length > CART_FRAME_SIZE) {
+		if (pack_grow(ix, 0, ix->slots) != 0)
+			return (-1);
+		*closed = ix->open;
+		ix->open = ix->slots - 1;
+		ix->used = 0;
+	}
+	*slot = ix->open;
+	*offset = ix->used;
+	ix->used += length;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_pack_set
+// Description  : Point a frame of the file at its bytes, moving its count
+//                from the slot it was in
+//
+// Inputs       : ix - the pack index
+//                frame - the frame of the file
+//                slot - the slot holding its bytes (ignored for a hole)
+//                offset - the first byte within the slot
+//                length - the bytes, 0 for a hole
+//                emptied - set to the slot the frame left if that now holds
+//                          no frames and is not open, CART_PACK_NONE if none
+// Outputs      : 0 if successful, -1 if failure
+
+int cart_pack_set(CartPackIndex *ix, uint32_t frame, uint32_t slot, uint16_t offset, uint16_t length, uint32_t *emptied) {
+	CartPackEntry *e;
+
+	*emptied = CART_PACK_NONE;
+	if (length > CART_FRAME_SIZE || (length > 0 && (slot == CART_PACK_NONE || offset + length > CART_FRAME_SIZE)))
+		return (-1);
+	if (pack_grow(ix, frame, (length > 0) ? slot : CART_PACK_NONE) != 0)
+		return (-1);
+	e = &ix->entries[frame];
+	if (e->length > 0 && --ix->live[e->slot] == 0 && e->slot != ix->open)
+		*emptied = e->slot;
+	if (length > 0) {
+		e->slot = slot;
+		ix->live[slot]++;
+	}
+	else {
+		e->slot = CART_PACK_NONE;
+	}
+	e->offset = offset;
+	e->length = length;
+	if (frame >= ix->frames)
+		ix->frames = frame + 1;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_pack_close
+// Description  : Close the open slot, so the next frame placed opens
+//                another
+//
+// Inputs       : ix - the pack index
+// Outputs      : the slot closed, CART_PACK_NONE if none was open
+
+uint32_t cart_pack_close(CartPackIndex *ix) {
+	uint32_t slot = ix->open;
+
+	ix->open = CART_PACK_NONE;
+	ix->used = 0;
+	return (slot);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_pack_live
+// Description  : Count the frames a slot holds
+//
+// Inputs       : ix - the pack index
+//                slot - the slot
+// Outputs      : the frames, 0 for a slot never used
+
+uint32_t cart_pack_live(CartPackIndex *ix, uint32_t slot) {
+	if (slot >= ix->slots)
+		return (0);
+	return (ix->live[slot]);
+}
+
+//
+// Unit test
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cartPackUnitTest
+// Description  : Pack frames of random sizes, rewrite them at random and
+//                check against a flat copy that slots fill, stay within a
+//                frame and are emptied exactly when their last frame goes
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int cartPackUnitTest(void) {
+	CartPackEntry flat[500], got;
+	uint32_t i, n, frame, slot, closed, emptied, count[4000];
+	uint16_t length, offset;
+	CartPackIndex ix;
+
+	cart_pack_init(&ix);
+	memset(flat, 0, sizeof(flat));
+	memset(count, 0, sizeof(count));
+	for (n = 0; n < 5000; n++) {
+		frame = getRandomValue(0, 499);
+		length = (uint16_t)((n % 7 == 0) ? 0 : (n % 11 == 0) ? CART_FRAME_SIZE : getRandomValue(1, 400));
+		slot = CART_PACK_NONE;
+		offset = 0;
+		if (length > 0 && cart_pack_place(&ix, length, &slot, &offset, &closed) != 0) {
+			logMessage(LOG_ERROR_LEVEL, "Pack unit test failed: no room found.");
+			return (-1);
+		}
+		if (length > 0 && (offset + length > CART_FRAME_SIZE || slot >= 4000 || (closed != CART_PACK_NONE && closed + 1 != slot))) {
+			logMessage(LOG_ERROR_LEVEL, "Pack unit test failed: bad placement.");
+			return (-1);
+		}
+		if (cart_pack_set(&ix, frame, slot, offset, length, &emptied) != 0)
+			return (-1);
+
+		// The slot the frame left is emptied with its last frame, unless open
+		if (flat[frame].length > 0 && --count[flat[frame].slot] == 0 && flat[frame].slot != ix.open) {
+			if (emptied != flat[frame].slot) {
+				logMessage(LOG_ERROR_LEVEL, "Pack unit test failed: empty slot missed.");
+				return (-1);
+			}
+		}
+		else if (emptied != CART_PACK_NONE) {
+			logMessage(LOG_ERROR_LEVEL, "Pack unit test failed: slot emptied early.");
+			return (-1);
+		}
+		if (length > 0)
+			count[slot]++;
+		flat[frame] = (CartPackEntry){ (length > 0) ? slot : CART_PACK_NONE, offset, length };
+	}
+	// Closing the open slot moves the next frame on to a new one
+	slot = ix.open;
+	if (cart_pack_close(&ix) != slot || cart_pack_close(&ix) != CART_PACK_NONE
+			|| cart_pack_place(&ix, 10, &n, &offset, &closed) != 0 || n != ix.slots - 1 || offset != 0 || closed != CART_PACK_NONE) {
+		logMessage(LOG_ERROR_LEVEL, "Pack unit test failed: slot not closed.");
+		return (-1);
+	}
+	for (i = 0; i < 600; i++) {
+		got = cart_pack_lookup(&ix, i);
+		if ((i < 500 && memcmp(&got, &flat[i], sizeof(got)) != 0) || (i >= 500 && got.length != 0)
+				|| (cart_pack_live(&ix, i) != count[i])) {
+			logMessage(LOG_ERROR_LEVEL, "Pack unit test failed: index and copy differ at %u.", i);
+			return (-1);
+		}
+	}
+	cart_pack_free(&ix);
+	if (ix.frames != 0 || cart_pack_lookup(&ix, 3).length != 0)
+		return (-1);
+
+	logMessage(LOG_INFO_LEVEL, "Pack unit test completed successfully.");
+	return (0);
+}
@@ -0,0 +1,74 @@
+#ifndef CART_PACK_INCLUDED
+#define CART_PACK_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_pack.h
+//  Description    : This is the header file for the pack index of a
+//                   compressed file, which finds the compressed bytes of
+//                   each frame of the file among the frames of its block
+//                   map (its slots), several frames sharing a slot.
+//
+//  Author         : [Jacob Hohenstein]
+//  Last Modified  : [10/16/2016]
+//
+
+// Includes
+#include <stdint.h>
+#include <cart_controller.h>
+
+// Defines
+#define CART_PACK_NONE UINT32_MAX  // no slot
+
+// Where the bytes of one frame of the file are
+typedef struct {
+
+	uint32_t slot;    // frame of the block map holding them
+	uint16_t offset;  // first byte within the slot
+	uint16_t length;  // compressed bytes, CART_FRAME_SIZE if kept as is, 0 for a hole
+
+} CartPackEntry;
+
+// The pack index of a compressed file.  Frames are packed into the open
+// slot until it is full, then into the next; a frame written again is
+// packed anew, and a slot is emptied once none of its frames are left.
+typedef struct {
+
+	CartPackEntry *entries;   // by frame of the file
+	uint32_t       frames;    // entries in use, later frames are holes
+	uint32_t       capacity;  // size of the entry array
+	uint16_t      *live;      // frames kept in each slot
+	uint32_t       slots;     // slots ever used, the next one opened
+	uint32_t       open;      // slot being filled, CART_PACK_NONE if none
+	uint16_t       used;      // bytes of it filled
+
+} CartPackIndex;
+
+///
+// Pack Index Interfaces
+
+void cart_pack_init(CartPackIndex *ix);
+	// Initialize an empty pack index
+
+void cart_pack_free(CartPackIndex *ix);
+	// Release the memory of a pack index, leaving it empty
+
+CartPackEntry cart_pack_lookup(CartPackIndex *ix, uint32_t frame);
+	// Find the bytes of a frame of the file (a hole past the last entry)
+
+int cart_pack_place(CartPackIndex *ix, uint16_t length, uint32_t *slot, uint16_t *offset, uint32_t *closed);
+	// Make room for length bytes in the open slot or the next one, closed is the slot left (CART_PACK_NONE if none)
+
+int cart_pack_set(CartPackIndex *ix, uint32_t frame, uint32_t slot, uint16_t offset, uint16_t length, uint32_t *emptied);
+	// Point a frame at its bytes, emptied is a closed slot left with no frames (CART_PACK_NONE if none)
+
+uint32_t cart_pack_close(CartPackIndex *ix);
+	// Close the open slot, the next frame placed opens another; the slot closed (CART_PACK_NONE if none)
+
+uint32_t cart_pack_live(CartPackIndex *ix, uint32_t slot);
+	// Count the frames a slot holds
+
+int cartPackUnitTest(void);
+	// Run a UNIT test checking the pack index implementation
+
+#endif
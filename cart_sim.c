@@ -24,6 +24,14 @@
 // Project Includes
 #include <cart_driver.h>
 #include <cart_cache.h>
+#include <cart_lz.h>
+#include <cart_blockmap.h>
+#include <cart_alloc.h>
+#include <cart_names.h>
+#include <cart_dir.h>
+#include <cart_meta.h>
+#include <cart_dedup.h>
+#include <cart_pack.h>
 #include <cart_network.h>
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
@@ -31,15 +39,25 @@
 // Defines
 #define CART_WORKLOAD_DIR "workload"
 #define CART_SIM_MAX_OPEN_FILES 128
-#define CART_ARGUMENTS "huvl:c:i:p:"
+#define CART_ARGUMENTS "huvwmdkl:c:r:z:a:x:q:s:i:p:"
 #define USAGE \
-	"USAGE: cart_sim [-h] [-v] [-l <logfile>] [-c <sz>] <workload-file>\n" \
+	"USAGE: cart_sim [-h] [-v] [-l <logfile>] [-c <sz>] [-r <policy>] [-z <sz>] [-a <frames>] [-x <frames>] [-q <depth>] [-m] [-w] [-d] [-k] [-s <statsfile>] <workload-file>\n" \
 	"\n" \
 	"where:\n" \
 	"    -h - help mode (display this message)\n" \
 	"    -v - verbose output\n" \
 	"    -l - write log messages to the filename <logfile>\n" \
 	"    -c - set the cart block cache to size <sz> (disabled for assign #2)\n" \
+	"    -r - set the cache replacement policy (lru, clock, 2q or arc)\n" \
+	"    -z - set the compressed victim cache to <sz> frames of memory (0 disables)\n" \
+	"    -a - limit the readahead window to <frames> (0 disables)\n" \
+	"    -x - compact fragmented files by <frames> a second while idle (0 disables)\n" \
+	"    -q - validate files with cart_submit/cart_reap, <depth> frame reads in flight\n" \
+	"    -m - validate files through cart_mmap views\n" \
+	"    -w - write-back caching (frames written on eviction, close or fsync)\n" \
+	"    -d - store every frame, without zero holes or sharing of duplicate frames\n" \
+	"    -k - create the workload's files compressed, several frames packed in each\n" \
+	"    -s - write cache and driver statistics (JSON) to <statsfile> at shutdown, - for stdout\n" \
 	"    -i - IP address of server to connect to.\n" \
 	"    -p - port number of server to connect to.\n" \
 	"\n" \
@@ -55,12 +73,18 @@ typedef struct {
 //
 // Global Data
 int verbose;
+char *stats_filename;  // where to dump the statistics at shutdown (NULL for none)
+uint32_t async_depth;  // reads kept in flight when validating (0 reads with cart_pread)
+int map_views;         // validate through cart_mmap views
+int compress_files;    // create the workload's files compressed
 
 //
 // Functional Prototypes
 
 int simulate_CART( char *wload );             // control loop of the CART simulation
 int validate_file(char *fname, int16_t mfh);  // Validate a file in the filesystem
+int read_file_async(int16_t mfh, char *buf, uint32_t size);  // Read a file through the submission ring
+int dump_stats(CartSimulationTable *ftable);  // Write the statistics at shutdown
 
 //
 // Functions
@@ -77,8 +101,8 @@ int validate_file(char *fname, int16_t mfh);  // Validate a file in the filesyst
 int main( int argc, char *argv[] ) {
 
 	// Local variables
-	int ch, verbose = 0, log_initialized = 0, unit_tests = 0;
-	uint32_t cache_size = 0;
+	int ch, verbose = 0, log_initialized = 0, unit_tests = 0, cache_policy = -1, write_back = 0;
+	uint32_t cache_size = 0, victim_size = DEFAULT_CART_CACHE_VICTIM_SIZE, readahead = CART_READAHEAD_MAX, compaction = CART_COMPACT_RATE;
 
 	// Process the command line parameters
 	while ((ch = getopt(argc, argv, CART_ARGUMENTS)) != -1) {
@@ -96,6 +120,22 @@ int main( int argc, char *argv[] ) {
 			unit_tests = 1;
 			break;
 
+		case 'w': // Write-back cache Flag
+			write_back = 1;
+			break;
+
+		case 'm': // Validate through mapped views
+			map_views = 1;
+			break;
+
+		case 'd': // No frame deduplication
+			cart_set_dedup(0);
+			break;
+
+		case 'k': // Compressed files
+			compress_files = 1;
+			break;
+
 		case 'l': // Set the log filename
 			initializeLogWithFilename( optarg );
 			log_initialized = 1;
@@ -107,6 +147,45 @@ int main( int argc, char *argv[] ) {
 			}
 			break;
 
+		case 'z': // Set compressed victim cache size
+			if ( sscanf( optarg, "%u", &victim_size ) != 1 ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad victim cache size [%s]", optarg );
+			    return( -1 );
+			}
+			break;
+
+		case 'a': // Set readahead window limit
+			if ( sscanf( optarg, "%u", &readahead ) != 1 || cart_set_readahead(readahead) == -1 ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad readahead window [%s]", optarg );
+			    return( -1 );
+			}
+			break;
+
+		case 'x': // Set the compaction rate
+			if ( sscanf( optarg, "%u", &compaction ) != 1 || cart_set_compaction(compaction) == -1 ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad compaction rate [%s]", optarg );
+			    return( -1 );
+			}
+			break;
+
+		case 'q': // Set the async validation depth
+			if ( sscanf( optarg, "%u", &async_depth ) != 1 || async_depth > CART_RING_ENTRIES ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad queue depth [%s]", optarg );
+			    return( -1 );
+			}
+			break;
+
+		case 's': // Set the statistics filename
+			stats_filename = optarg;
+			break;
+
+		case 'r': // Set cache replacement policy
+			if ( (cache_policy = cart_cache_policy_from_name(optarg)) == -1 ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad cache policy [%s]", optarg );
+			    return( -1 );
+			}
+			break;
+
         case 'i': // Get the IP address
             if (inet_addr(optarg) == INADDR_NONE) {
 			    logMessage( LOG_ERROR_LEVEL, "Bad IP address [%s]", argv[optind] );
@@ -140,6 +219,13 @@ int main( int argc, char *argv[] ) {
 	if (cache_size != 0) {
 		set_cart_cache_size(cache_size);
 	}
+	if (cache_policy != -1) {
+		set_cart_cache_policy(cache_policy);
+	}
+	set_cart_cache_victim_size(victim_size);
+	if (write_back) {
+		set_cart_cache_write_mode(CART_CACHE_WRITEBACK);
+	}
 
 	// If exgtracting file from data
 	if (unit_tests) {
@@ -147,7 +233,7 @@ int main( int argc, char *argv[] ) {
 		// Run the unit tests
 		enableLogLevels( LOG_INFO_LEVEL );
 		logMessage(LOG_INFO_LEVEL, "Running unit tests ....\n\n");
-		if ( (cartCacheUnitTest() == 0) && (cartCacheUnitTest() == 0) ) {
+		if ( (cartLzUnitTest() == 0) && (cartBlockMapUnitTest() == 0) && (cartAllocUnitTest() == 0) && (cartNamesUnitTest() == 0) && (cartDirUnitTest() == 0) && (cartMetaUnitTest() == 0) && (cartDedupUnitTest() == 0) && (cartPackUnitTest() == 0) && (cartCacheUnitTest() == 0) && (cartCacheUnitTest() == 0) && (cartDriverUnitTest() == 0) ) {
 			logMessage(LOG_INFO_LEVEL, "Unit tests completed successfully.\n\n");
 		} else {
 			logMessage(LOG_ERROR_LEVEL, "Unit tests failed, aborting.\n\n");
@@ -192,10 +278,15 @@ int simulate_CART( char *wload ) {
 	FILE *fhandle = NULL;
 	int32_t err=0, len, off, fields, linecount;
 	CartSimulationTable ftable[CART_SIM_MAX_OPEN_FILES];
-	int idx, i;
+	CartNames findex;  // filename to ftable index
+	int idx, i, nfiles = 0;
 
 	// Setup the file table
 	memset(ftable, 0x0, sizeof(CartSimulationTable)*CART_SIM_MAX_OPEN_FILES);
+	if (cart_names_init(&findex, CART_SIM_MAX_OPEN_FILES) != 0) {
+		logMessage( LOG_ERROR_LEVEL, "Failure allocating the file table index." );
+		return( -1 );
+	}
 
 	// Open the workload file
 	linecount = 0;
@@ -205,7 +296,8 @@ int simulate_CART( char *wload ) {
 		return( -1 );
 	}
 
-	// Startup the interface
+	// Startup the interface, the workload expects an empty file system
+	cart_set_format(1);
 	if (cart_poweron() == -1) {
 		logMessage( LOG_ERROR_LEVEL, "CART simulator failed initialization.");
 		fclose( fhandle );
@@ -234,30 +326,21 @@ int simulate_CART( char *wload ) {
 			logMessage(CartSimulatorLLevel, "File [%s], command [%s], len=%d, offset=%d",
 					fname, command, len, off);
 
-			// Now walk the the table looking for the file
-			idx = -1;
-			i = 0;
-			while ( (i < CART_SIM_MAX_OPEN_FILES) && (idx == -1) ) {
-				if ( (ftable[i].filename != NULL) && (strcmp(ftable[i].filename,fname) == 0) ) {
-					idx = i;
-				}
-				i++;
-			}
+			// Now look the file up in the table
+			idx = cart_names_lookup(&findex, CART_NAMES_ROOT, fname, strlen(fname));
 
 			// File is not found, open the file
 			if (idx == -1) {
 
 				// Log message, find unused index and save filename for later use
 				logMessage(CartSimulatorLLevel, "CART_SIM : Opening file [%s]", fname);
-				idx = 0;
-				while ((ftable[idx].filename != NULL) && (idx < CART_SIM_MAX_OPEN_FILES)) {
-					idx++;
-				}
+				idx = nfiles++;
 				CMPSC_ASSERT1(idx<CART_SIM_MAX_OPEN_FILES, "Too many open files on CART sim [%d]", idx);
 				ftable[idx].filename = strdup(fname);
+				cart_names_insert(&findex, CART_NAMES_ROOT, fname, strlen(fname), idx);
 
 				// Now perform the open
-				ftable[idx].fhandle = cart_open(ftable[idx].filename);
+				ftable[idx].fhandle = cart_open_flags(ftable[idx].filename, compress_files ? CART_OPEN_COMPRESSED : 0);
 				if (ftable[idx].fhandle == -1) {
 					// Failed, error out
 					logMessage(LOG_ERROR_LEVEL, "Open of new file [%s] failed, aborting simulation.", fname);
@@ -366,6 +449,7 @@ int simulate_CART( char *wload ) {
 	}
 
 	// Now walk the the table of files to validate
+	cart_names_free(&findex);
 	for (i=0; i<CART_SIM_MAX_OPEN_FILES; i++) {
 		if (ftable[i].filename != NULL) {
 			if (validate_file(ftable[i].filename, ftable[i].fhandle) != 0) {
@@ -383,6 +467,10 @@ int simulate_CART( char *wload ) {
 		return( -1 );
 	}
 	logMessage(CartSimulatorLLevel, "CART simulator shutdown complete.");
+	if ((stats_filename != NULL) && (dump_stats(ftable) != 0)) {
+		fclose( fhandle );
+		return( -1 );
+	}
 	logMessage(LOG_OUTPUT_LEVEL, "CART simulation: all tests successful!!!.");
 
 	// Close the workload file, successfully
@@ -402,7 +490,7 @@ int simulate_CART( char *wload ) {
 int validate_file(char *fname, int16_t mfh) {
 
 	// Local variables
-	char filename[256], bkfile[256], *filbuf, *membuf;
+	char filename[256], bkfile[256], *filbuf, *membuf, *view;
 	struct stat stats;
 	int idx, fh;
 
@@ -431,13 +519,18 @@ int validate_file(char *fname, int16_t mfh) {
 	}
 	close(fh);
 
-	// Seek to the beginning of the memory file, read the contents
-	if (cart_seek(mfh, 0) == -1) {
-		// Failed, error out
-		logMessage(LOG_ERROR_LEVEL, "Read cart file [%s] see to zero failed.", fname);
-		return(-1);
-	}
-	if (cart_read(mfh, membuf, stats.st_size) != stats.st_size) {
+	// Read the contents of the memory file from the beginning
+	if (map_views) {
+		if ((view = cart_mmap(mfh, stats.st_size)) == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Mapping cart file [%s] of length %ld failed.", fname, (long)stats.st_size);
+			return(-1);
+		}
+		memcpy(membuf, view, stats.st_size);
+		if (cart_munmap(view) != 0) {
+			return(-1);
+		}
+	} else if ((async_depth > 0) ? (read_file_async(mfh, membuf, stats.st_size) != 0)
+			: (cart_pread(mfh, membuf, stats.st_size, 0) != stats.st_size)) {
 		// Failed, error out
 		logMessage(LOG_ERROR_LEVEL, "Read cart file [%s] of length %d failed.", fname, stats.st_size);
 		return(-1);
@@ -472,3 +565,140 @@ int validate_file(char *fname, int16_t mfh) {
 	logMessage(LOG_OUTPUT_LEVEL, "Validation of [%s], length %d sucessful.", fname, stats.st_size);
 	return( 0 );
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_driver_stats
+// Description  : Write one set of driver counters as JSON members
+//
+// Inputs       : out - the stream to write to
+//                st - the counters
+// Outputs      : none
+
+static void dump_driver_stats(FILE *out, CartDriverStats *st) {
+	fprintf(out, "\"cache_hits\": %llu, \"cache_misses\": %llu, \"cart_loads\": %llu, "
+		"\"frames_read\": %llu, \"frames_written\": %llu, \"write_throughs\": %llu, "
+		"\"dirty_flushes\": %llu, \"bytes_read\": %llu, \"bytes_written\": %llu, \"readahead_frames\": %llu, "
+		"\"frames_coalesced\": %llu, \"page_faults\": %llu, \"zero_fills\": %llu, \"meta_writes\": %llu, "
+		"\"dedup_hits\": %llu, \"zero_holes\": %llu, \"frames_packed\": %llu, \"frames_cloned\": %llu, "
+		"\"frames_compacted\": %llu, \"async_batched\": %llu",
+		(unsigned long long)st->cache_hits, (unsigned long long)st->cache_misses,
+		(unsigned long long)st->cart_loads, (unsigned long long)st->frames_read,
+		(unsigned long long)st->frames_written, (unsigned long long)st->write_throughs,
+		(unsigned long long)st->dirty_flushes, (unsigned long long)st->bytes_read,
+		(unsigned long long)st->bytes_written, (unsigned long long)st->readahead_frames,
+		(unsigned long long)st->frames_coalesced, (unsigned long long)st->page_faults,
+		(unsigned long long)st->zero_fills, (unsigned long long)st->meta_writes,
+		(unsigned long long)st->dedup_hits, (unsigned long long)st->zero_holes,
+		(unsigned long long)st->frames_packed, (unsigned long long)st->frames_cloned,
+		(unsigned long long)st->frames_compacted, (unsigned long long)st->async_batched);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_file_async
+// Description  : Read a file a frame per request through cart_submit,
+//                keeping async_depth requests in flight
+//
+// Inputs       : mfh - the memory file handle
+//                buf - the buffer to read into
+//                size - the number of bytes to read
+// Outputs      : 0 if successful, -1 if failure
+
+int read_file_async(int16_t mfh, char *buf, uint32_t size) {
+
+	// Local variables
+	CartCqe cqes[CART_RING_ENTRIES];
+	CartSqe sqe;
+	uint32_t next = 0, inflight = 0;
+	int i, n;
+
+	while ((next < size) || (inflight > 0)) {
+
+		// Top up the ring, then wait for at least one read to finish
+		while ((next < size) && (inflight < async_depth)) {
+			sqe.op = CART_ASYNC_READ;
+			sqe.fd = mfh;
+			sqe.buf = buf + next;
+			sqe.count = (size - next < CART_FRAME_SIZE) ? size - next : CART_FRAME_SIZE;
+			sqe.loc = next;
+			sqe.user_data = sqe.count;
+			if (cart_submit(&sqe, 1) != 1) {
+				break;
+			}
+			next += sqe.count;
+			inflight++;
+		}
+		if ((n = cart_reap(cqes, CART_RING_ENTRIES, 1)) <= 0) {
+			logMessage(LOG_ERROR_LEVEL, "Reaping reads of file handle %d failed.", mfh);
+			return(-1);
+		}
+		for (i = 0; i < n; i++) {
+			if (cqes[i].result != (int32_t)cqes[i].user_data) {
+				logMessage(LOG_ERROR_LEVEL, "Async read of file handle %d returned %d.", mfh, cqes[i].result);
+				return(-1);
+			}
+		}
+		inflight -= n;
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_stats
+// Description  : Write the cache, driver and per-file statistics as a single
+//                JSON object to the statistics file
+//
+// Inputs       : ftable - the simulation file table
+// Outputs      : 0 if successful, -1 if failure
+
+int dump_stats(CartSimulationTable *ftable) {
+
+	// Local variables
+	CartCacheStats cst;
+	CartDriverStats dst;
+	FILE *out;
+	int i, first = 1;
+
+	// Open the output (- is standard output)
+	if (strcmp(stats_filename, "-") == 0) {
+		out = stdout;
+	} else if ((out = fopen(stats_filename, "w")) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Failure writing statistics [%s] (%s)", stats_filename, strerror(errno));
+		return(-1);
+	}
+
+	// Cache, then driver wide counters, then one entry per file
+	cart_cache_stats(&cst);
+	fprintf(out, "{\"cache\": {\"policy\": \"%s\", \"write_back\": %d, \"hits\": %llu, \"misses\": %llu, "
+		"\"inserts\": %llu, \"evictions\": %llu, \"writebacks\": %llu, \"victim_hits\": %llu, "
+		"\"victim_stores\": %llu, \"victim_frames\": %llu, \"victim_bytes\": %llu},\n",
+		cart_cache_policy_name(cart_cache_policy()), cart_cache_write_mode() == CART_CACHE_WRITEBACK,
+		(unsigned long long)cst.hits, (unsigned long long)cst.misses, (unsigned long long)cst.inserts,
+		(unsigned long long)cst.evictions, (unsigned long long)cst.writebacks,
+		(unsigned long long)cst.victim_hits, (unsigned long long)cst.victim_stores,
+		(unsigned long long)cst.victim_frames, (unsigned long long)cst.victim_bytes);
+	cart_stats(CART_ALL_FILES, &dst);
+	fprintf(out, " \"driver\": {");
+	dump_driver_stats(out, &dst);
+	fprintf(out, "},\n \"files\": [");
+	for (i=0; i<CART_SIM_MAX_OPEN_FILES; i++) {
+		if ((ftable[i].filename != NULL) && (cart_stats(ftable[i].fhandle, &dst) == 0)) {
+			fprintf(out, "%s\n  {\"name\": \"%s\", \"fd\": %d, ", first ? "" : ",",
+				ftable[i].filename, ftable[i].fhandle);
+			dump_driver_stats(out, &dst);
+			fprintf(out, "}");
+			first = 0;
+		}
+	}
+	fprintf(out, "\n ]}\n");
+
+	// Close the output and return
+	if (out != stdout) {
+		fclose(out);
+	} else {
+		fflush(out);
+	}
+	return(0);
+}